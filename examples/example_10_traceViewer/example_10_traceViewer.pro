@@ -0,0 +1,7 @@
+include(../examples.pri)
+
+TARGET = example_10_traceViewer
+
+SOURCES += main.cpp
+
+OTHER_FILES += README
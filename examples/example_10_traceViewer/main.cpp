@@ -0,0 +1,256 @@
+/*
+ * Copyright (C) 2008-2011 The QXmpp developers
+ *
+ * Author:
+ *	Jeremy Lainé
+ *
+ * Source:
+ *	http://code.google.com/p/qxmpp
+ *
+ * This file is a part of QXmpp library.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+#include <cstdio>
+#include <cstdlib>
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QDateTime>
+#include <QtCore/QFile>
+#include <QtCore/QMap>
+#include <QtCore/QStringList>
+#include <QtCore/QXmlStreamReader>
+#include <QtCore/QtEndian>
+#include <QtXml/QDomDocument>
+
+#include "QXmppLogger.h"
+
+static const char traceMagic[] = "QXMPPTR1";
+static const int traceMagicSize = 8;
+static const int traceHeaderSize = 17;
+
+struct TraceRecord
+{
+    qint64 stamp;
+    quint32 streamId;
+    QXmppLogger::MessageType type;
+    QByteArray data;
+};
+
+struct JidStatistics
+{
+    JidStatistics() : received(0), sent(0) {}
+    int received;
+    int sent;
+};
+
+static void usage()
+{
+    fprintf(stderr,
+        "Usage: traceViewer [options] <trace file>\n"
+        "\n"
+        "Options:\n"
+        "  -s <id>     only show the stream with the given identifier\n"
+        "  -t <type>   only show messages of the given type:\n"
+        "              received, sent, debug, info or warning\n"
+        "  -j <jid>    only show stanzas sent to or received from the JID\n"
+        "  -r          print per-JID stanza rates instead of the stanzas\n");
+}
+
+static QXmppLogger::MessageType parseType(const QString &name)
+{
+    if (name == "received")
+        return QXmppLogger::ReceivedMessage;
+    else if (name == "sent")
+        return QXmppLogger::SentMessage;
+    else if (name == "debug")
+        return QXmppLogger::DebugMessage;
+    else if (name == "info")
+        return QXmppLogger::InformationMessage;
+    else if (name == "warning")
+        return QXmppLogger::WarningMessage;
+    return QXmppLogger::NoMessage;
+}
+
+static const char *typeSymbol(QXmppLogger::MessageType type)
+{
+    switch (type)
+    {
+    case QXmppLogger::ReceivedMessage:
+        return "<<";
+    case QXmppLogger::SentMessage:
+        return ">>";
+    case QXmppLogger::DebugMessage:
+        return "DEBUG";
+    case QXmppLogger::InformationMessage:
+        return "INFO";
+    case QXmppLogger::WarningMessage:
+        return "WARNING";
+    default:
+        return "";
+    }
+}
+
+/// Returns the remote JID of a stanza, that is the "from" attribute of
+/// received stanzas and the "to" attribute of sent stanzas.
+
+static QString stanzaJid(const TraceRecord &record)
+{
+    QXmlStreamReader reader(record.data);
+    reader.setNamespaceProcessing(false);
+    while (!reader.atEnd()) {
+        if (reader.readNext() == QXmlStreamReader::StartElement) {
+            const QXmlStreamAttributes attributes = reader.attributes();
+            if (record.type == QXmppLogger::ReceivedMessage)
+                return attributes.value("from").toString();
+            else
+                return attributes.value("to").toString();
+        }
+    }
+    return QString();
+}
+
+/// Indents the stanza if it is well-formed XML, otherwise returns it as-is.
+
+static QString prettyPrint(const QByteArray &data)
+{
+    QDomDocument doc;
+    if (doc.setContent(data, false))
+        return doc.toString(2).trimmed();
+    return QString::fromUtf8(data.constData(), data.size());
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+
+    // parse command line
+    QStringList args = a.arguments();
+    args.removeFirst();
+    bool filterStream = false;
+    quint32 streamFilter = 0;
+    QXmppLogger::MessageType typeFilter = QXmppLogger::NoMessage;
+    QString jidFilter;
+    bool rates = false;
+    QString path;
+    while (!args.isEmpty()) {
+        const QString arg = args.takeFirst();
+        if (arg == "-r") {
+            rates = true;
+        } else if ((arg == "-s" || arg == "-t" || arg == "-j") && !args.isEmpty()) {
+            const QString value = args.takeFirst();
+            if (arg == "-s") {
+                filterStream = true;
+                streamFilter = value.toUInt();
+            } else if (arg == "-t") {
+                typeFilter = parseType(value);
+                if (typeFilter == QXmppLogger::NoMessage) {
+                    usage();
+                    return EXIT_FAILURE;
+                }
+            } else {
+                jidFilter = value;
+            }
+        } else if (path.isEmpty() && !arg.startsWith("-")) {
+            path = arg;
+        } else {
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+    if (path.isEmpty()) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    // map the trace
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        fprintf(stderr, "Could not open %s\n", qPrintable(path));
+        return EXIT_FAILURE;
+    }
+    const qint64 size = file.size();
+    const uchar *ptr = size ? file.map(0, size) : 0;
+    if (!ptr || size < traceMagicSize || memcmp(ptr, traceMagic, traceMagicSize)) {
+        fprintf(stderr, "%s is not a QXmpp trace\n", qPrintable(path));
+        return EXIT_FAILURE;
+    }
+
+    QMap<QString, JidStatistics> statistics;
+    qint64 firstStamp = 0;
+    qint64 lastStamp = 0;
+    qint64 pos = traceMagicSize;
+    while (pos + traceHeaderSize <= size) {
+        TraceRecord record;
+        const quint32 length = qFromLittleEndian<quint32>(ptr + pos);
+        record.stamp = qFromLittleEndian<qint64>(ptr + pos + 4);
+        record.streamId = qFromLittleEndian<quint32>(ptr + pos + 12);
+        record.type = QXmppLogger::MessageType(ptr[pos + 16]);
+
+        // a zero time marks the end of the trace
+        if (!record.stamp || pos + traceHeaderSize + length > size)
+            break;
+        record.data = QByteArray::fromRawData(reinterpret_cast<const char*>(ptr + pos + traceHeaderSize), length);
+        pos += traceHeaderSize + length;
+
+        if (!firstStamp)
+            firstStamp = record.stamp;
+        lastStamp = record.stamp;
+
+        // apply filters
+        if ((filterStream && record.streamId != streamFilter) ||
+            (typeFilter != QXmppLogger::NoMessage && record.type != typeFilter))
+            continue;
+
+        const bool isStanza = record.type == QXmppLogger::ReceivedMessage ||
+                              record.type == QXmppLogger::SentMessage;
+        QString jid;
+        if (isStanza && (rates || !jidFilter.isEmpty()))
+            jid = stanzaJid(record);
+        if (!jidFilter.isEmpty() && jid != jidFilter)
+            continue;
+
+        if (rates) {
+            if (!isStanza || jid.isEmpty())
+                continue;
+            if (record.type == QXmppLogger::ReceivedMessage)
+                statistics[jid].received++;
+            else
+                statistics[jid].sent++;
+        } else {
+            QDateTime stamp;
+            stamp.setTime_t(record.stamp / 1000);
+            stamp = stamp.addMSecs(record.stamp % 1000);
+            printf("%s #%u %s\n%s\n\n",
+                qPrintable(stamp.toString("yyyy-MM-dd hh:mm:ss.zzz")),
+                record.streamId,
+                typeSymbol(record.type),
+                prettyPrint(record.data).toUtf8().constData());
+        }
+    }
+
+    if (rates) {
+        const double duration = qMax(qint64(1), lastStamp - firstStamp) / 1000.0;
+        printf("%-40s %10s %10s %10s %10s\n", "JID", "received", "sent", "recv/s", "sent/s");
+        QMap<QString, JidStatistics>::const_iterator it;
+        for (it = statistics.constBegin(); it != statistics.constEnd(); ++it) {
+            printf("%-40s %10i %10i %10.2f %10.2f\n",
+                qPrintable(it.key()),
+                it.value().received,
+                it.value().sent,
+                it.value().received / duration,
+                it.value().sent / duration);
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -12,6 +12,7 @@ SUBDIRS = example_0_connected\
           example_6_rpcClient\
           example_7_archiveHandling\
           example_8_server\
-          example_9_vCard
+          example_9_vCard\
+          example_10_traceViewer
 #          GuiClient
           
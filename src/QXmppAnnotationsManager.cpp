@@ -56,3 +56,9 @@ bool QXmppAnnotationsManager::handleStanza(const QDomElement &element)
     emit notesReceived(iq.items());
 	return true;
 }
+
+QList<QXmppStanzaKey> QXmppAnnotationsManager::stanzaKeys() const
+{
+    return QList<QXmppStanzaKey>()
+        << QXmppStanzaKey("iq", "query", ns_private);
+}
@@ -24,9 +24,9 @@
 #include <QDomElement>
 
 #include "QXmppArchiveIq.h"
+#include "QXmppConstants.h"
 #include "QXmppUtils.h"
 
-static const char *ns_archive = "urn:xmpp:archive";
 static const char *ns_rsm = "http://jabber.org/protocol/rsm";
 
 QXmppArchiveMessage::QXmppArchiveMessage()
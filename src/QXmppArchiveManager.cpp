@@ -26,6 +26,7 @@
 #include "QXmppArchiveIq.h"
 #include "QXmppArchiveManager.h"
 #include "QXmppClient.h"
+#include "QXmppConstants.h"
 
 void QXmppArchiveManager::archiveChatIqReceived(const QXmppArchiveChatIq &chatIq)
 {
@@ -73,6 +74,14 @@ bool QXmppArchiveManager::handleStanza(const QDomElement &element)
     return false;
 }
 
+QList<QXmppStanzaKey> QXmppArchiveManager::stanzaKeys() const
+{
+    return QList<QXmppStanzaKey>()
+        << QXmppStanzaKey("iq", "chat", ns_archive)
+        << QXmppStanzaKey("iq", "list", ns_archive)
+        << QXmppStanzaKey("iq", "pref", ns_archive);
+}
+
 /// Retrieves the list of available collections. Once the results are
 /// received, the archiveListReceived() signal will be emitted.
 ///
@@ -59,6 +59,7 @@ public:
 
     /// \cond
     bool handleStanza(const QDomElement &element);
+    QList<QXmppStanzaKey> stanzaKeys() const;
     /// \endcond
 
 signals:
@@ -93,6 +93,7 @@ public:
     QXmppCall *findCall(const QString &sid, QXmppCall::Direction direction) const;
 
     QList<QXmppCall*> calls;
+    QXmppIceMultiplexer *iceMultiplexer;
     QHostAddress stunHost;
     quint16 stunPort;
     QHostAddress turnHost;
@@ -328,7 +329,10 @@ QXmppCallPrivate::Stream *QXmppCallPrivate::createStream(const QString &media)
     stream->connection->setTurnPassword(manager->d->turnPassword);
     stream->connection->addComponent(RTP_COMPONENT);
     stream->connection->addComponent(RTCP_COMPONENT);
-    stream->connection->bind(QXmppIceComponent::discoverAddresses());
+    if (manager->d->iceMultiplexer)
+        stream->connection->bind(manager->d->iceMultiplexer);
+    else
+        stream->connection->bind(QXmppIceComponent::discoverAddresses());
 
     // connect signals
     bool check = QObject::connect(stream->connection, SIGNAL(localCandidatesChanged()),
@@ -357,6 +361,16 @@ QXmppCallPrivate::Stream *QXmppCallPrivate::createStream(const QString &media)
         check = QObject::connect(channelObject, SIGNAL(sendDatagram(QByteArray)),
                         rtpComponent, SLOT(sendDatagram(QByteArray)));
         Q_ASSERT(check);
+
+        QXmppIceComponent *rtcpComponent = stream->connection->component(RTCP_COMPONENT);
+
+        check = QObject::connect(rtcpComponent, SIGNAL(datagramReceived(QByteArray)),
+                        channelObject, SLOT(controlDatagramReceived(QByteArray)));
+        Q_ASSERT(check);
+
+        check = QObject::connect(channelObject, SIGNAL(sendControlDatagram(QByteArray)),
+                        rtcpComponent, SLOT(sendDatagram(QByteArray)));
+        Q_ASSERT(check);
     }
     return stream;
 }
@@ -698,7 +712,8 @@ void QXmppCall::startVideo()
 }
 
 QXmppCallManagerPrivate::QXmppCallManagerPrivate(QXmppCallManager *qq)
-    : stunPort(0),
+    : iceMultiplexer(0),
+    stunPort(0),
     turnPort(0),
     q(qq)
 {
@@ -763,6 +778,12 @@ bool QXmppCallManager::handleStanza(const QDomElement &element)
     return false;
 }
 
+QList<QXmppStanzaKey> QXmppCallManager::stanzaKeys() const
+{
+    return QList<QXmppStanzaKey>()
+        << QXmppStanzaKey("iq", "jingle", ns_jingle);
+}
+
 void QXmppCallManager::setClient(QXmppClient *client)
 {
     QXmppClientExtension::setClient(client);
@@ -878,6 +899,17 @@ void QXmppCallManager::jingleIqReceived(const QXmppJingleIq &iq)
     }
 }
 
+/// Makes new calls share the sockets of the given \a multiplexer instead
+/// of binding their own ports. The multiplexer must be bound and must
+/// outlive the calls.
+///
+/// \param multiplexer
+
+void QXmppCallManager::setIceMultiplexer(QXmppIceMultiplexer *multiplexer)
+{
+    d->iceMultiplexer = multiplexer;
+}
+
 /// Sets the STUN server to use to determine server-reflexive addresses
 /// and ports.
 ///
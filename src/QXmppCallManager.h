@@ -35,6 +35,7 @@ class QHostAddress;
 class QXmppCallPrivate;
 class QXmppCallManager;
 class QXmppCallManagerPrivate;
+class QXmppIceMultiplexer;
 class QXmppIq;
 class QXmppJingleCandidate;
 class QXmppJingleIq;
@@ -154,6 +155,7 @@ public:
     QXmppCallManager();
     ~QXmppCallManager();
     QXmppCall *call(const QString &jid);
+    void setIceMultiplexer(QXmppIceMultiplexer *multiplexer);
     void setStunServer(const QHostAddress &host, quint16 port = 3478);
     void setTurnServer(const QHostAddress &host, quint16 port = 3478);
     void setTurnUser(const QString &user);
@@ -162,6 +164,7 @@ public:
     /// \cond
     QStringList discoveryFeatures() const;
     bool handleStanza(const QDomElement &element);
+    QList<QXmppStanzaKey> stanzaKeys() const;
     /// \endcond
 
 signals:
@@ -53,6 +53,12 @@ bool QXmppCaptchaManager::handleStanza(const QDomElement& stanza)
     return true;
 }
 
+QList<QXmppStanzaKey> QXmppCaptchaManager::stanzaKeys() const
+{
+    return QList<QXmppStanzaKey>()
+        << QXmppStanzaKey("message", "captcha", ns_captcha);
+}
+
 QString QXmppCaptchaManager::sendResponse(const QString& to, const QXmppDataForm& form)
 {
     QXmppCaptchaIq request;
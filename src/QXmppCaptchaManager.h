@@ -35,6 +35,7 @@ class QXmppCaptchaManager : public QXmppClientExtension
 
 public:
     virtual bool handleStanza(const QDomElement &stanza);
+    virtual QList<QXmppStanzaKey> stanzaKeys() const;
     QString sendResponse(const QString &to, const QXmppDataForm &form);
 
 signals:
@@ -22,12 +22,15 @@
  */
 
 
+#include <QDomElement>
+
 #include "QXmppClient.h"
 #include "QXmppClientExtension.h"
 #include "QXmppConstants.h"
 #include "QXmppLogger.h"
 #include "QXmppOutgoingClient.h"
 #include "QXmppMessage.h"
+#include "QXmppStanzaKey_p.h"
 #include "QXmppUtils.h"
 
 #include "QXmppReconnectionManager.h"
@@ -44,6 +47,10 @@ public:
     QXmppClientPrivate(QXmppClient *);
 
     QList<QXmppClientExtension*> extensions;
+
+    // stanza dispatch table, rebuilt when the extensions change
+    QXmppStanzaHandlers<QXmppClientExtension> stanzaHandlers;
+
     QXmppLogger *logger;
     QXmppOutgoingClient* stream;  ///< Pointer to QXmppOutgoingClient object a wrapper over
                           ///< TCP socket and XMPP protocol
@@ -217,6 +224,7 @@ bool QXmppClient::addExtension(QXmppClientExtension* extension)
     extension->setParent(this);
     extension->setClient(this);
     d->extensions << extension;
+    d->stanzaHandlers.invalidate();
     return true;
 }
 
@@ -230,6 +238,7 @@ bool QXmppClient::removeExtension(QXmppClientExtension* extension)
     if (d->extensions.contains(extension))
     {
         d->extensions.removeAll(extension);
+        d->stanzaHandlers.invalidate();
         delete extension;
         return true;
     } else {
@@ -588,7 +597,7 @@ QXmppVersionManager& QXmppClient::versionManager()
 
 void QXmppClient::slotElementReceived(const QDomElement &element, bool &handled)
 {
-    foreach (QXmppClientExtension *extension, d->extensions)
+    foreach (QXmppClientExtension *extension, d->stanzaHandlers.find(d->extensions, element))
     {
         if (extension->handleStanza(element))
         {
@@ -609,13 +618,8 @@ QXmppLogger *QXmppClient::logger()
 
 void QXmppClient::setLogger(QXmppLogger *logger)
 {
-    if (d->logger)
-        QObject::disconnect(this, SIGNAL(logMessage(QXmppLogger::MessageType, QString)),
-                   d->logger, SLOT(log(QXmppLogger::MessageType, QString)));
     d->logger = logger;
-    if (d->logger)
-        connect(this, SIGNAL(logMessage(QXmppLogger::MessageType, QString)),
-                d->logger, SLOT(log(QXmppLogger::MessageType, QString)));
+    attachLogger(d->logger);
 }
 
 /// At connection establishment, send initial presence.
@@ -64,6 +64,17 @@ QList<QXmppDiscoveryIq::Identity> QXmppClientExtension::discoveryIdentities() co
     return QList<QXmppDiscoveryIq::Identity>();
 }
 
+/// Returns the keys of the stanzas handled by this extension.
+///
+/// handleStanza() will only be called for stanzas which have a child
+/// element matching one of the keys. The default implementation returns
+/// an empty list, which means handleStanza() is called for every stanza.
+
+QList<QXmppStanzaKey> QXmppClientExtension::stanzaKeys() const
+{
+    return QList<QXmppStanzaKey>();
+}
+
 /// Returns the client which loaded this extension.
 ///
 
@@ -26,6 +26,7 @@
 
 #include "QXmppDiscoveryIq.h"
 #include "QXmppLogger.h"
+#include "QXmppStanzaKey.h"
 
 class QDomElement;
 class QStringList;
@@ -54,6 +55,7 @@ public:
 
     virtual QStringList discoveryFeatures() const;
     virtual QList<QXmppDiscoveryIq::Identity> discoveryIdentities() const;
+    virtual QList<QXmppStanzaKey> stanzaKeys() const;
 
     /// \brief You need to implement this method to process incoming XMPP
     /// stanzas.
@@ -27,10 +27,13 @@
 
 #include <QDataStream>
 #include <QDebug>
+#include <QIODevice>
 #include <QSize>
+#include <QVector>
 
 #include "QXmppCodec.h"
 #include "QXmppRtpChannel.h"
+#include "QXmppVideoConverter_p.h"
 
 #include <cstring>
 
@@ -233,6 +236,180 @@ qint16 ulaw2linear(quint8 u_val)
    return ((u_val & SIGN_BIT) ? (BIAS - t) : (t - BIAS));
 }
 
+/*
+ * Lookup tables for G.711, built once from the reference functions above.
+ *
+ * The encoding tables are indexed by the 16-bit sample taken as unsigned,
+ * the decoding tables by the 8-bit code.
+ */
+class QXmppG711Tables
+{
+public:
+    QXmppG711Tables()
+    {
+        for (int i = 0; i < 65536; ++i) {
+            alawEncode[i] = linear2alaw(qint16(quint16(i)));
+            ulawEncode[i] = linear2ulaw(qint16(quint16(i)));
+        }
+        for (int i = 0; i < 256; ++i) {
+            alawDecode[i] = alaw2linear(quint8(i));
+            ulawDecode[i] = ulaw2linear(quint8(i));
+        }
+    }
+
+    quint8 alawEncode[65536];
+    quint8 ulawEncode[65536];
+    qint16 alawDecode[256];
+    qint16 ulawDecode[256];
+};
+
+Q_GLOBAL_STATIC(QXmppG711Tables, g711Tables)
+
+static void g711Encode(const quint8 *table, const qint16 *input, uchar *output, int samples)
+{
+    const quint16 *in = reinterpret_cast<const quint16*>(input);
+    int i = 0;
+    for (; i + 4 <= samples; i += 4) {
+        output[i] = table[in[i]];
+        output[i + 1] = table[in[i + 1]];
+        output[i + 2] = table[in[i + 2]];
+        output[i + 3] = table[in[i + 3]];
+    }
+    for (; i < samples; ++i)
+        output[i] = table[in[i]];
+}
+
+static void g711Decode(const qint16 *table, const uchar *input, qint16 *output, int samples)
+{
+    int i = 0;
+    for (; i + 4 <= samples; i += 4) {
+        output[i] = table[input[i]];
+        output[i + 1] = table[input[i + 1]];
+        output[i + 2] = table[input[i + 2]];
+        output[i + 3] = table[input[i + 3]];
+    }
+    for (; i < samples; ++i)
+        output[i] = table[input[i]];
+}
+
+static bool needsByteSwap(const QDataStream &stream)
+{
+    return (stream.byteOrder() == QDataStream::LittleEndian) !=
+           (QSysInfo::ByteOrder == QSysInfo::LittleEndian);
+}
+
+static void swapSamples(qint16 *samples, int count)
+{
+    quint16 *ptr = reinterpret_cast<quint16*>(samples);
+    for (int i = 0; i < count; ++i)
+        ptr[i] = (ptr[i] >> 8) | (ptr[i] << 8);
+}
+
+/// Reads all the samples remaining in the input stream.
+
+static QVector<qint16> readSamples(QDataStream &input)
+{
+    const QByteArray data = input.device()->readAll();
+    QVector<qint16> samples(data.size() / 2);
+    memcpy(samples.data(), data.constData(), samples.size() * 2);
+    if (needsByteSwap(input))
+        swapSamples(samples.data(), samples.size());
+    return samples;
+}
+
+/// Writes samples to the output stream.
+
+static void writeSamples(QDataStream &output, QVector<qint16> &samples)
+{
+    if (needsByteSwap(output))
+        swapSamples(samples.data(), samples.size());
+    output.writeRawData(reinterpret_cast<const char*>(samples.constData()), samples.size() * 2);
+}
+
+QXmppCodec::~QXmppCodec()
+{
+}
+
+/// Encodes native-endian samples to a buffer.
+///
+/// The default implementation goes through encode(), codecs should
+/// reimplement it to avoid the QDataStream overhead.
+///
+/// \param input the samples to encode
+/// \param samples the number of samples available in \a input
+/// \param output the buffer for the encoded data
+/// \param size the size of \a output on input, the number of bytes written
+/// on output
+///
+/// Returns the number of samples which were consumed. The encoded data is
+/// never truncated: if it does not fit in \a output, nothing is written,
+/// \a size is set to 0 and 0 is returned.
+
+int QXmppCodec::encodeSamples(const qint16 *input, int samples, uchar *output, int *size)
+{
+    const QByteArray data = QByteArray::fromRawData(reinterpret_cast<const char*>(input), samples * 2);
+    QDataStream inputStream(data);
+    inputStream.setByteOrder(QSysInfo::ByteOrder == QSysInfo::LittleEndian ? QDataStream::LittleEndian : QDataStream::BigEndian);
+
+    QByteArray encoded;
+    QDataStream outputStream(&encoded, QIODevice::WriteOnly);
+    const qint64 consumed = encode(inputStream, outputStream);
+    if (encoded.size() > *size) {
+        *size = 0;
+        return 0;
+    }
+
+    *size = encoded.size();
+    memcpy(output, encoded.constData(), *size);
+    return consumed;
+}
+
+/// Decodes a buffer to native-endian samples.
+///
+/// The default implementation goes through decode(), codecs should
+/// reimplement it to avoid the QDataStream overhead.
+///
+/// \param input the data to decode
+/// \param size the size of \a input in bytes
+/// \param output the buffer for the decoded samples
+/// \param samples the number of samples \a output can hold
+///
+/// Returns the number of samples which were written.
+
+int QXmppCodec::decodeSamples(const uchar *input, int size, qint16 *output, int samples)
+{
+    const QByteArray data = QByteArray::fromRawData(reinterpret_cast<const char*>(input), size);
+    QDataStream inputStream(data);
+
+    QByteArray decoded;
+    QDataStream outputStream(&decoded, QIODevice::WriteOnly);
+    outputStream.setByteOrder(QSysInfo::ByteOrder == QSysInfo::LittleEndian ? QDataStream::LittleEndian : QDataStream::BigEndian);
+    decode(inputStream, outputStream);
+
+    const int count = qMin(samples, decoded.size() / 2);
+    memcpy(output, decoded.constData(), count * 2);
+    return count;
+}
+
+/// Generates samples to stand in for lost packets, which is called packet
+/// loss concealment.
+///
+/// The default implementation does not generate anything, so lost packets
+/// are replaced by silence.
+///
+/// \param output the buffer for the generated samples
+/// \param samples the number of missing samples
+///
+/// Returns the number of samples which were written, which must not be
+/// more than \a samples.
+
+int QXmppCodec::concealSamples(qint16 *output, int samples)
+{
+    Q_UNUSED(output);
+    Q_UNUSED(samples);
+    return 0;
+}
+
 QXmppG711aCodec::QXmppG711aCodec(int clockrate)
 {
     m_frequency = clockrate;
@@ -240,27 +417,35 @@ QXmppG711aCodec::QXmppG711aCodec(int clockrate)
 
 qint64 QXmppG711aCodec::encode(QDataStream &input, QDataStream &output)
 {
-    qint64 samples = 0;
-    qint16 pcm;
-    while (!input.atEnd())
-    {
-        input >> pcm;
-        output << linear2alaw(pcm);
-        ++samples;
-    }
-    return samples;
+    const QVector<qint16> samples = readSamples(input);
+    QByteArray encoded(samples.size(), 0);
+    int size = encoded.size();
+    encodeSamples(samples.constData(), samples.size(), reinterpret_cast<uchar*>(encoded.data()), &size);
+    output.writeRawData(encoded.constData(), size);
+    return samples.size();
 }
 
 qint64 QXmppG711aCodec::decode(QDataStream &input, QDataStream &output)
 {
-    qint64 samples = 0;
-    quint8 g711;
-    while (!input.atEnd())
-    {
-        input >> g711;
-        output << alaw2linear(g711);
-        ++samples;
-    }
+    const QByteArray encoded = input.device()->readAll();
+    QVector<qint16> samples(encoded.size());
+    decodeSamples(reinterpret_cast<const uchar*>(encoded.constData()), encoded.size(), samples.data(), samples.size());
+    writeSamples(output, samples);
+    return samples.size();
+}
+
+int QXmppG711aCodec::encodeSamples(const qint16 *input, int samples, uchar *output, int *size)
+{
+    samples = qMin(samples, *size);
+    g711Encode(g711Tables()->alawEncode, input, output, samples);
+    *size = samples;
+    return samples;
+}
+
+int QXmppG711aCodec::decodeSamples(const uchar *input, int size, qint16 *output, int samples)
+{
+    samples = qMin(samples, size);
+    g711Decode(g711Tables()->alawDecode, input, output, samples);
     return samples;
 }
 
@@ -271,27 +456,35 @@ QXmppG711uCodec::QXmppG711uCodec(int clockrate)
 
 qint64 QXmppG711uCodec::encode(QDataStream &input, QDataStream &output)
 {
-    qint64 samples = 0;
-    qint16 pcm;
-    while (!input.atEnd())
-    {
-        input >> pcm;
-        output << linear2ulaw(pcm);
-        ++samples;
-    }
-    return samples;
+    const QVector<qint16> samples = readSamples(input);
+    QByteArray encoded(samples.size(), 0);
+    int size = encoded.size();
+    encodeSamples(samples.constData(), samples.size(), reinterpret_cast<uchar*>(encoded.data()), &size);
+    output.writeRawData(encoded.constData(), size);
+    return samples.size();
 }
 
 qint64 QXmppG711uCodec::decode(QDataStream &input, QDataStream &output)
 {
-    qint64 samples = 0;
-    quint8 g711;
-    while (!input.atEnd())
-    {
-        input >> g711;
-        output << ulaw2linear(g711);
-        ++samples;
-    }
+    const QByteArray encoded = input.device()->readAll();
+    QVector<qint16> samples(encoded.size());
+    decodeSamples(reinterpret_cast<const uchar*>(encoded.constData()), encoded.size(), samples.data(), samples.size());
+    writeSamples(output, samples);
+    return samples.size();
+}
+
+int QXmppG711uCodec::encodeSamples(const qint16 *input, int samples, uchar *output, int *size)
+{
+    samples = qMin(samples, *size);
+    g711Encode(g711Tables()->ulawEncode, input, output, samples);
+    *size = samples;
+    return samples;
+}
+
+int QXmppG711uCodec::decodeSamples(const uchar *input, int size, qint16 *output, int samples)
+{
+    samples = qMin(samples, size);
+    g711Decode(g711Tables()->ulawDecode, input, output, samples);
     return samples;
 }
 
@@ -330,33 +523,68 @@ QXmppSpeexCodec::~QXmppSpeexCodec()
 
 qint64 QXmppSpeexCodec::encode(QDataStream &input, QDataStream &output)
 {
-    QByteArray pcm_buffer(frame_samples * 2, 0);
-    const int length = input.readRawData(pcm_buffer.data(), pcm_buffer.size());
-    if (length != pcm_buffer.size())
+    QVector<qint16> pcm_buffer(frame_samples);
+    const int length = input.readRawData(reinterpret_cast<char*>(pcm_buffer.data()), frame_samples * 2);
+    if (length != frame_samples * 2)
     {
         qWarning() << "Read only read" << length << "bytes";
         return 0;
     }
-    speex_bits_reset(encoder_bits);
-    speex_encode_int(encoder_state, (short*)pcm_buffer.data(), encoder_bits);
-    QByteArray speex_buffer(speex_bits_nbytes(encoder_bits), 0);
-    speex_bits_write(encoder_bits, speex_buffer.data(), speex_buffer.size());
-    output.writeRawData(speex_buffer.data(), speex_buffer.size());
+    if (needsByteSwap(input))
+        swapSamples(pcm_buffer.data(), pcm_buffer.size());
+
+    QByteArray speex_buffer(frame_samples * 2, 0);
+    int size = speex_buffer.size();
+    encodeSamples(pcm_buffer.constData(), pcm_buffer.size(), reinterpret_cast<uchar*>(speex_buffer.data()), &size);
+    output.writeRawData(speex_buffer.constData(), size);
     return frame_samples;
 }
 
 qint64 QXmppSpeexCodec::decode(QDataStream &input, QDataStream &output)
 {
-    const int length = input.device()->bytesAvailable();
-    QByteArray speex_buffer(length, 0);
-    input.readRawData(speex_buffer.data(), speex_buffer.size());
-    speex_bits_read_from(decoder_bits, speex_buffer.data(), speex_buffer.size());
-    QByteArray pcm_buffer(frame_samples * 2, 0);
-    speex_decode_int(decoder_state, decoder_bits, (short*)pcm_buffer.data());
-    output.writeRawData(pcm_buffer.data(), pcm_buffer.size());
+    const QByteArray speex_buffer = input.device()->readAll();
+    QVector<qint16> pcm_buffer(frame_samples);
+    decodeSamples(reinterpret_cast<const uchar*>(speex_buffer.constData()), speex_buffer.size(), pcm_buffer.data(), pcm_buffer.size());
+    writeSamples(output, pcm_buffer);
     return frame_samples;
 }
 
+int QXmppSpeexCodec::encodeSamples(const qint16 *input, int samples, uchar *output, int *size)
+{
+    if (samples < frame_samples) {
+        *size = 0;
+        return 0;
+    }
+    speex_bits_reset(encoder_bits);
+    speex_encode_int(encoder_state, const_cast<spx_int16_t*>(input), encoder_bits);
+    if (speex_bits_nbytes(encoder_bits) > *size) {
+        *size = 0;
+        return 0;
+    }
+    *size = speex_bits_write(encoder_bits, reinterpret_cast<char*>(output), *size);
+    return frame_samples;
+}
+
+int QXmppSpeexCodec::decodeSamples(const uchar *input, int size, qint16 *output, int samples)
+{
+    if (samples < frame_samples)
+        return 0;
+    speex_bits_read_from(decoder_bits, reinterpret_cast<char*>(const_cast<uchar*>(input)), size);
+    speex_decode_int(decoder_state, decoder_bits, output);
+    return frame_samples;
+}
+
+int QXmppSpeexCodec::concealSamples(qint16 *output, int samples)
+{
+    // let the decoder extrapolate the missing frames
+    int done = 0;
+    while (done + frame_samples <= samples) {
+        speex_decode_int(decoder_state, 0, output + done);
+        done += frame_samples;
+    }
+    return done;
+}
+
 #endif
 
 #ifdef QXMPP_USE_THEORA
@@ -364,7 +592,7 @@ qint64 QXmppSpeexCodec::decode(QDataStream &input, QDataStream &output)
 class QXmppTheoraDecoderPrivate
 {
 public:
-    bool decodeFrame(const QByteArray &buffer, QXmppVideoFrame *frame);
+    bool decodeFrame(const char *data, int size, QXmppVideoFrame *frame);
 
     th_comment comment;
     th_info info;
@@ -372,13 +600,14 @@ public:
     th_dec_ctx *ctx;
 
     QByteArray packetBuffer;
+    QXmppVideoFramePool framePool;
 };
 
-bool QXmppTheoraDecoderPrivate::decodeFrame(const QByteArray &buffer, QXmppVideoFrame *frame)
+bool QXmppTheoraDecoderPrivate::decodeFrame(const char *data, int size, QXmppVideoFrame *frame)
 {
     ogg_packet packet;
-    packet.packet = (unsigned char*) buffer.data();
-    packet.bytes = buffer.size();
+    packet.packet = (unsigned char*) data;
+    packet.bytes = size;
     packet.b_o_s = 1;
     packet.e_o_s = 0;
     packet.granulepos = -1;
@@ -394,17 +623,17 @@ bool QXmppTheoraDecoderPrivate::decodeFrame(const QByteArray &buffer, QXmppVideo
         return false;
     }
 
+    // the planes returned by libtheora point into its reference frames,
+    // which are neither contiguous nor stable, so copy them to a pooled buffer
     if (info.pixel_fmt == TH_PF_420) {
-        if (!frame->isValid()) {
-            const int bytes = ycbcr_buffer[0].stride * ycbcr_buffer[0].height
-                            + ycbcr_buffer[1].stride * ycbcr_buffer[1].height
-                            + ycbcr_buffer[2].stride * ycbcr_buffer[2].height;
-
-            *frame = QXmppVideoFrame(bytes,
-                QSize(ycbcr_buffer[0].width, ycbcr_buffer[0].height),
-                ycbcr_buffer[0].stride,
-                QXmppVideoFrame::Format_YUV420P);
-        }
+        const int bytes = ycbcr_buffer[0].stride * ycbcr_buffer[0].height
+                        + ycbcr_buffer[1].stride * ycbcr_buffer[1].height
+                        + ycbcr_buffer[2].stride * ycbcr_buffer[2].height;
+
+        *frame = framePool.frame(bytes,
+            QSize(ycbcr_buffer[0].width, ycbcr_buffer[0].height),
+            ycbcr_buffer[0].stride,
+            QXmppVideoFrame::Format_YUV420P);
         uchar *output = frame->bits();
         for (int i = 0; i < 3; ++i) {
             const int length = ycbcr_buffer[i].stride * ycbcr_buffer[i].height;
@@ -413,38 +642,19 @@ bool QXmppTheoraDecoderPrivate::decodeFrame(const QByteArray &buffer, QXmppVideo
         }
         return true;
     } else if (info.pixel_fmt == TH_PF_422) {
-        if (!frame->isValid()) {
-            const int bytes = ycbcr_buffer[0].width * ycbcr_buffer[0].height * 2;
+        const int bytes = ycbcr_buffer[0].width * ycbcr_buffer[0].height * 2;
 
-            *frame = QXmppVideoFrame(bytes,
-                QSize(ycbcr_buffer[0].width, ycbcr_buffer[0].height),
-                ycbcr_buffer[0].width * 2,
-                QXmppVideoFrame::Format_YUYV);
-        }
+        *frame = framePool.frame(bytes,
+            QSize(ycbcr_buffer[0].width, ycbcr_buffer[0].height),
+            ycbcr_buffer[0].width * 2,
+            QXmppVideoFrame::Format_YUYV);
 
         // YUV 4:2:2 packing
-        const int width = ycbcr_buffer[0].width;
-        const int height = ycbcr_buffer[0].height;
-        const int y_stride = ycbcr_buffer[0].stride;
-        const int c_stride = ycbcr_buffer[1].stride;
-        const uchar *y_row = ycbcr_buffer[0].data;
-        const uchar *cb_row = ycbcr_buffer[1].data;
-        const uchar *cr_row = ycbcr_buffer[2].data;
-        uchar *output = frame->bits();
-        for (int y = 0; y < height; ++y) {
-            const uchar *y_ptr = y_row;
-            const uchar *cb_ptr = cb_row;
-            const uchar *cr_ptr = cr_row;
-            for (int x = 0; x < width; x += 2) {
-                *(output++) = *(y_ptr++);
-                *(output++) = *(cb_ptr++);
-                *(output++) = *(y_ptr++);
-                *(output++) = *(cr_ptr++);
-            }
-            y_row += y_stride;
-            cb_row += c_stride;
-            cr_row += c_stride;
-        }
+        QXmppVideoConverter::planarToYuyv(
+            ycbcr_buffer[0].width, ycbcr_buffer[0].height,
+            ycbcr_buffer[0].data, ycbcr_buffer[0].stride,
+            ycbcr_buffer[1].data, ycbcr_buffer[2].data, ycbcr_buffer[1].stride, 0,
+            frame->bits(), frame->bytesPerLine());
         return true;
     } else {
         qWarning("Theora decoder received an unsupported frame format");
@@ -520,11 +730,11 @@ QList<QXmppVideoFrame> QXmppTheoraDecoder::handlePacket(const QByteArray &ba)
                 return frames;
             }
 
-            d->packetBuffer.resize(packetLength);
-            stream.readRawData(d->packetBuffer.data(), packetLength);
-            if (d->ctx && d->decodeFrame(d->packetBuffer, &frame))
+            // decode straight from the payload
+            const char *data = ba.constData() + stream.device()->pos();
+            stream.skipRawData(packetLength);
+            if (d->ctx && d->decodeFrame(data, packetLength, &frame))
                 frames << frame;
-            d->packetBuffer.resize(0);
         }
     } else {
         // fragments
@@ -548,7 +758,7 @@ QList<QXmppVideoFrame> QXmppTheoraDecoder::handlePacket(const QByteArray &ba)
 
         if (theora_frag == 3) {
             // end fragment
-            if (d->ctx && d->decodeFrame(d->packetBuffer, &frame))
+            if (d->ctx && d->decodeFrame(d->packetBuffer.constData(), d->packetBuffer.size(), &frame))
                 frames << frame;
             d->packetBuffer.resize(0);
         }
@@ -833,25 +1043,13 @@ QList<QByteArray> QXmppTheoraEncoder::handleFrame(const QXmppVideoFrame &frame)
         d->ycbcr_buffer[1].data = d->ycbcr_buffer[0].data + d->ycbcr_buffer[0].stride * d->ycbcr_buffer[0].height;
         d->ycbcr_buffer[2].stride = d->ycbcr_buffer[1].stride;
         d->ycbcr_buffer[2].data = d->ycbcr_buffer[1].data + d->ycbcr_buffer[1].stride * d->ycbcr_buffer[1].height;
-    } else if (d->info.pixel_fmt = TH_PF_422) {
+    } else if (d->info.pixel_fmt == TH_PF_422) {
         // YUV 4:2:2 unpacking
-        const int width = frame.width();
-        const int height = frame.height();
-        const int stride = frame.bytesPerLine();
-        const uchar *row = frame.bits();
-        uchar *y_out = d->ycbcr_buffer[0].data;
-        uchar *cb_out = d->ycbcr_buffer[1].data;
-        uchar *cr_out = d->ycbcr_buffer[2].data;
-        for (int y = 0; y < height; ++y) {
-            const uchar *ptr = row;
-            for (int x = 0; x < width; x += 2) {
-                *(y_out++) = *(ptr++);
-                *(cb_out++) = *(ptr++);
-                *(y_out++) = *(ptr++);
-                *(cr_out++) = *(ptr++);
-            }
-            row += stride;
-        }
+        QXmppVideoConverter::yuyvToPlanar(
+            frame.width(), frame.height(),
+            frame.bits(), frame.bytesPerLine(),
+            d->ycbcr_buffer[0].data, d->ycbcr_buffer[0].stride,
+            d->ycbcr_buffer[1].data, d->ycbcr_buffer[2].data, d->ycbcr_buffer[1].stride, 0);
     } else {
         qWarning("Theora encoder received an unsupported frame format");
         return packets;
@@ -32,11 +32,14 @@ class QXmppVideoFrame;
 /// \brief The QXmppCodec class is the base class for audio codecs capable of
 /// encoding and decoding audio samples.
 ///
-/// Samples must be 16-bit little endian.
+/// Samples must be 16-bit little endian when using the QDataStream based
+/// methods, and native-endian when using the buffer based methods.
 
 class QXmppCodec
 {
 public:
+    virtual ~QXmppCodec();
+
     /// Reads samples from the input stream, encodes them and writes the
     /// encoded data to the output stream.
     virtual qint64 encode(QDataStream &input, QDataStream &output) = 0;
@@ -44,6 +47,10 @@ public:
     /// Reads encoded data from the input stream, decodes it and writes the
     /// decoded samples to the output stream.
     virtual qint64 decode(QDataStream &input, QDataStream &output) = 0;
+
+    virtual int encodeSamples(const qint16 *input, int samples, uchar *output, int *size);
+    virtual int decodeSamples(const uchar *input, int size, qint16 *output, int samples);
+    virtual int concealSamples(qint16 *output, int samples);
 };
 
 /// \internal
@@ -58,6 +65,9 @@ public:
     qint64 encode(QDataStream &input, QDataStream &output);
     qint64 decode(QDataStream &input, QDataStream &output);
 
+    int encodeSamples(const qint16 *input, int samples, uchar *output, int *size);
+    int decodeSamples(const uchar *input, int size, qint16 *output, int samples);
+
 private:
     int m_frequency;
 };
@@ -74,6 +84,9 @@ public:
     qint64 encode(QDataStream &input, QDataStream &output);
     qint64 decode(QDataStream &input, QDataStream &output);
 
+    int encodeSamples(const qint16 *input, int samples, uchar *output, int *size);
+    int decodeSamples(const uchar *input, int size, qint16 *output, int samples);
+
 private:
     int m_frequency;
 };
@@ -94,6 +107,10 @@ public:
     qint64 encode(QDataStream &input, QDataStream &output);
     qint64 decode(QDataStream &input, QDataStream &output);
 
+    int encodeSamples(const qint16 *input, int samples, uchar *output, int *size);
+    int decodeSamples(const uchar *input, int size, qint16 *output, int samples);
+    int concealSamples(qint16 *output, int samples);
+
 private:
     SpeexBits *encoder_bits;
     void *encoder_state;
@@ -38,6 +38,7 @@ QXmppConfiguration::QXmppConfiguration() : m_port(5222),
                 m_useSASLAuthentication(true),
                 m_ignoreSslErrors(true),
                 m_ignoreAuth(false),
+                m_useCompression(false),
                 m_streamSecurityMode(QXmppConfiguration::TLSEnabled),
                 m_nonSASLAuthMechanism(QXmppConfiguration::NonSASLDigest),
                 m_SASLAuthMechanism(QXmppConfiguration::SASLDigestMD5)
@@ -322,6 +323,26 @@ void QXmppConfiguration::setUseSASLAuthentication(bool useSASL)
     m_useSASLAuthentication = useSASL;
 }
 
+/// Returns true if stream compression (XEP-0138) should be used when the
+/// server offers it. The default value is false.
+
+bool QXmppConfiguration::useCompression() const
+{
+    return m_useCompression;
+}
+
+/// Sets whether stream compression (XEP-0138) should be used when the
+/// server offers it.
+///
+/// Compression is only available if QXmpp was built with zlib support.
+///
+/// \param useCompression
+
+void QXmppConfiguration::setUseCompression(bool useCompression)
+{
+    m_useCompression = useCompression;
+}
+
 /// Returns the specified security mode for the stream. The default value is
 /// QXmppConfiguration::TLSEnabled.
 /// \return StreamSecurityMode
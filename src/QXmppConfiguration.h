@@ -114,6 +114,9 @@ public:
     bool useSASLAuthentication() const;
     void setUseSASLAuthentication(bool);
 
+    bool useCompression() const;
+    void setUseCompression(bool);
+
     bool ignoreSslErrors() const;
     void setIgnoreSslErrors(bool);
 
@@ -194,6 +197,9 @@ private:
     // default is false
     bool m_ignoreAuth;
 
+    // default is false
+    bool m_useCompression;
+
     StreamSecurityMode m_streamSecurityMode;
     NonSASLAuthMechanism m_nonSASLAuthMechanism;
     SASLAuthMechanism m_SASLAuthMechanism;
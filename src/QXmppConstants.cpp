@@ -81,4 +81,8 @@ const char *ns_private = "jabber:iq:private";
 const char *ns_rosternotes = "storage:rosternotes";
 
 const char *ns_bob = "urn:xmpp:bob";
-const char *ns_captcha = "urn:xmpp:captcha";
\ No newline at end of file
+const char *ns_captcha = "urn:xmpp:captcha";
+// XEP-0136: Message Archiving
+const char *ns_archive = "urn:xmpp:archive";
+// XEP-0060: Publish-Subscribe
+const char *ns_pubsub = "http://jabber.org/protocol/pubsub";
\ No newline at end of file
@@ -76,5 +76,7 @@ extern const char *ns_private;
 extern const char *ns_rosternotes;
 extern const char *ns_bob;
 extern const char *ns_captcha;
+extern const char *ns_archive;
+extern const char *ns_pubsub;
 
 #endif // QXMPPCONSTANTS_H
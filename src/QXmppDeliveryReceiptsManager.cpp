@@ -104,3 +104,10 @@ bool QXmppDeliveryReceiptsManager::handleStanza(const QDomElement &stanza)
 
     return false;
 }
+
+QList<QXmppStanzaKey> QXmppDeliveryReceiptsManager::stanzaKeys() const
+{
+    return QList<QXmppStanzaKey>()
+        << QXmppStanzaKey("message", "received", ns_message_receipts)
+        << QXmppStanzaKey("message", "request", ns_message_receipts);
+}
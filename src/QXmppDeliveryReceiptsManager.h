@@ -44,6 +44,7 @@ public:
     /// \cond
     virtual QStringList discoveryFeatures() const;
     virtual bool handleStanza(const QDomElement &stanza);
+    virtual QList<QXmppStanzaKey> stanzaKeys() const;
     /// \endcond
 
 public slots:
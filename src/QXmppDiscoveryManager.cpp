@@ -72,6 +72,13 @@ bool QXmppDiscoveryManager::handleStanza(const QDomElement &element)
     return false;
 }
 
+QList<QXmppStanzaKey> QXmppDiscoveryManager::stanzaKeys() const
+{
+    return QList<QXmppStanzaKey>()
+        << QXmppStanzaKey("iq", "query", ns_disco_info)
+        << QXmppStanzaKey("iq", "query", ns_disco_items);
+}
+
 /// Requests information from the specified XMPP entity.
 ///
 /// \param jid  The target entity's JID.
@@ -59,6 +59,7 @@ public:
     /// \cond
     QStringList discoveryFeatures() const;
     bool handleStanza(const QDomElement &element);
+    QList<QXmppStanzaKey> stanzaKeys() const;
     QXmppDiscoveryIq capabilities();
     /// \endcond
 
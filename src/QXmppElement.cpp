@@ -24,40 +24,121 @@
 #include "QXmppElement.h"
 #include "QXmppUtils.h"
 
-#include <QDomElement>
+#include <QDomDocument>
+#include <QMutex>
+
+/// \internal
+///
+/// The QXmppElementDocument class is shared by an element constructed
+/// from a DOM element and by the children created when it is converted.
+///
+/// It keeps the source document alive, so that the DOM tree is neither
+/// modified nor deleted while unconverted elements read it, and it holds
+/// the lock which guards their conversion. Elements parsed from different
+/// stanzas never contend for the same lock.
+
+class QXmppElementDocument
+{
+public:
+    QXmppElementDocument(const QDomDocument &document)
+        : counter(1), document(document) {}
+
+    QAtomicInt counter;
+    QMutex mutex;
+    QDomDocument document;
+};
 
 class QXmppElementPrivate
 {
 public:
     QXmppElementPrivate();
-    QXmppElementPrivate(const QDomElement &element);
+    QXmppElementPrivate(const QDomElement &element, QXmppElementDocument *shared = 0);
     ~QXmppElementPrivate();
 
+    bool isLoaded();
+    void load();
+
     QAtomicInt counter;
+    QAtomicInt loaded;
 
     QXmppElementPrivate *parent;
+    QXmppElementDocument *document;
     QMap<QString, QString> attributes;
     QList<QXmppElementPrivate*> children;
     QString name;
     QString value;
+
+    // DOM element this element was constructed from, it is only converted
+    // when the element is inspected or modified
+    QDomElement source;
 };
 
 QXmppElementPrivate::QXmppElementPrivate()
-    : counter(1), parent(NULL)
+    : counter(1), loaded(1), parent(NULL), document(NULL)
 {
 }
 
-QXmppElementPrivate::QXmppElementPrivate(const QDomElement &element)
-    : counter(1), parent(NULL)
+QXmppElementPrivate::QXmppElementPrivate(const QDomElement &element, QXmppElementDocument *shared)
+    : counter(1), loaded(1), parent(NULL), document(NULL)
 {
     if (element.isNull())
         return;
 
+    if (shared) {
+        shared->counter.ref();
+        document = shared;
+    } else {
+        document = new QXmppElementDocument(element.ownerDocument());
+    }
+
+    // the namespace is checked against the parent now, as the parent
+    // may no longer be reachable once the stanza's document is released
     name = element.tagName();
     QString xmlns = element.namespaceURI();
     QString parentns = element.parentNode().namespaceURI();
     if (!xmlns.isEmpty() && xmlns != parentns)
         attributes.insert("xmlns", xmlns);
+    source = element;
+    loaded = 0;
+}
+
+QXmppElementPrivate::~QXmppElementPrivate()
+{
+    // no other copy refers to this element any more, and the document
+    // outlives the DOM element, so releasing it only drops a reference
+    source = QDomElement();
+    if (document && !document->counter.deref())
+        delete document;
+    foreach (QXmppElementPrivate *child, children)
+        if (!child->counter.deref())
+            delete child;
+}
+
+/// Returns true if the element no longer refers to its source DOM element.
+
+bool QXmppElementPrivate::isLoaded()
+{
+    return loaded.testAndSetAcquire(1, 1);
+}
+
+/// Converts the source DOM element, child elements are themselves
+/// converted when they are accessed.
+///
+/// This is safe to call from several threads at once, so that const
+/// accessors can be used on copies of an element owned by other threads.
+
+void QXmppElementPrivate::load()
+{
+    if (isLoaded())
+        return;
+
+    QMutexLocker locker(&document->mutex);
+    if (source.isNull())
+        return;
+
+    const QDomElement element = source;
+    source = QDomElement();
+
     QDomNamedNodeMap attrs = element.attributes();
     for (int i = 0; i < attrs.size(); i++)
     {
@@ -70,7 +151,7 @@ QXmppElementPrivate::QXmppElementPrivate(const QDomElement &element)
     {
         if (childNode.isElement())
         {
-            QXmppElementPrivate *child = new QXmppElementPrivate(childNode.toElement());
+            QXmppElementPrivate *child = new QXmppElementPrivate(childNode.toElement(), document);
             child->parent = this;
             children.append(child);
         } else if (childNode.isText()) {
@@ -78,13 +159,51 @@ QXmppElementPrivate::QXmppElementPrivate(const QDomElement &element)
         }
         childNode = childNode.nextSibling();
     }
+    loaded.fetchAndStoreRelease(1);
 }
 
-QXmppElementPrivate::~QXmppElementPrivate()
+/// Serializes a DOM element exactly as QXmppElement::toXml() would
+/// serialize its converted form.
+
+static void domElementToXml(QXmlStreamWriter *writer, const QDomElement &element, const QString &parentns)
 {
-    foreach (QXmppElementPrivate *child, children)
-        if (!child->counter.deref())
-            delete child;
+    writer->writeStartElement(element.tagName());
+
+    const QString xmlns = element.namespaceURI();
+    if (!xmlns.isEmpty() && xmlns != parentns)
+        writer->writeAttribute("xmlns", xmlns);
+
+    // attributes are written in name order
+    QMap<QString, QString> attributes;
+    QDomNamedNodeMap attrs = element.attributes();
+    for (int i = 0; i < attrs.size(); i++)
+    {
+        QDomAttr attr = attrs.item(i).toAttr();
+        attributes.insert(attr.name(), attr.value());
+    }
+    QMap<QString, QString>::const_iterator it;
+    for (it = attributes.constBegin(); it != attributes.constEnd(); ++it)
+        if (it.key() != "xmlns")
+            helperToXmlAddAttribute(writer, it.key(), it.value());
+
+    QString value;
+    QDomNode childNode = element.firstChild();
+    while (!childNode.isNull())
+    {
+        if (childNode.isText())
+            value += childNode.toText().data();
+        childNode = childNode.nextSibling();
+    }
+    if (!value.isEmpty())
+        writer->writeCharacters(value);
+
+    QDomElement childElement = element.firstChildElement();
+    while (!childElement.isNull())
+    {
+        domElementToXml(writer, childElement, xmlns);
+        childElement = childElement.nextSiblingElement();
+    }
+    writer->writeEndElement();
 }
 
 QXmppElement::QXmppElement()
@@ -126,21 +245,25 @@ QXmppElement &QXmppElement::operator=(const QXmppElement &other)
 
 QStringList QXmppElement::attributeNames() const
 {
+    d->load();
     return d->attributes.keys();
 }
 
 QString QXmppElement::attribute(const QString &name) const
 {
+    d->load();
     return d->attributes.value(name);
 }
 
 void QXmppElement::setAttribute(const QString &name, const QString &value)
 {
+    d->load();
     d->attributes.insert(name, value);
 }
 
 void QXmppElement::appendChild(const QXmppElement &child)
 {
+    d->load();
     if (child.d->parent == d)
         return;
 
@@ -154,6 +277,7 @@ void QXmppElement::appendChild(const QXmppElement &child)
 
 QXmppElement QXmppElement::firstChildElement(const QString &name) const
 {
+    d->load();
     foreach (QXmppElementPrivate *child_d, d->children)
         if (name.isEmpty() || child_d->name == name)
             return QXmppElement(child_d);
@@ -178,6 +302,7 @@ bool QXmppElement::isNull() const
 
 void QXmppElement::removeChild(const QXmppElement &child)
 {
+    d->load();
     if (child.d->parent != d)
         return;
 
@@ -193,16 +318,19 @@ QString QXmppElement::tagName() const
 
 void QXmppElement::setTagName(const QString &tagName)
 {
+    d->load();
     d->name = tagName;
 }
 
 QString QXmppElement::value() const
 {
+    d->load();
     return d->value;
 }
 
 void QXmppElement::setValue(const QString &value)
 {
+    d->load();
     d->value = value;
 }
 
@@ -211,6 +339,19 @@ void QXmppElement::toXml(QXmlStreamWriter *writer) const
     if (isNull())
         return;
 
+    // write unconverted elements straight from the DOM
+    if (!d->isLoaded())
+    {
+        QMutexLocker locker(&d->document->mutex);
+        if (!d->source.isNull())
+        {
+            const QString parentns = d->attributes.contains("xmlns") ?
+                QString() : d->source.namespaceURI();
+            domElementToXml(writer, d->source, parentns);
+            return;
+        }
+    }
+
     writer->writeStartElement(d->name);
     if (d->attributes.contains("xmlns"))
         writer->writeAttribute("xmlns", d->attributes.value("xmlns"));
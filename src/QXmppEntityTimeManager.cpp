@@ -83,3 +83,9 @@ bool QXmppEntityTimeManager::handleStanza(const QDomElement &element)
 
     return false;
 }
+
+QList<QXmppStanzaKey> QXmppEntityTimeManager::stanzaKeys() const
+{
+    return QList<QXmppStanzaKey>()
+        << QXmppStanzaKey("iq", "time", ns_entity_time);
+}
@@ -44,6 +44,7 @@ public:
     /// \cond
     QStringList discoveryFeatures() const;
     bool handleStanza(const QDomElement &element);
+    QList<QXmppStanzaKey> stanzaKeys() const;
     /// \endcond
 
 signals:
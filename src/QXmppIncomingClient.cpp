@@ -173,6 +173,12 @@ void QXmppIncomingClient::handleStream(const QDomElement &streamElement)
     {
         features.setBindMode(QXmppStreamFeatures::Required);
         features.setSessionMode(QXmppStreamFeatures::Enabled);
+        if (isCompressionSupported() && !isCompressed())
+        {
+            QList<QXmppConfiguration::CompressionMethod> methods;
+            methods << QXmppConfiguration::ZlibCompression;
+            features.setCompressionMethods(methods);
+        }
     }
     else if (d->passwordChecker)
     {
@@ -195,10 +201,35 @@ void QXmppIncomingClient::handleStanza(const QDomElement &nodeRecv)
     if (ns == ns_tls && nodeRecv.tagName() == "starttls")
     {
         sendData("<proceed xmlns='urn:ietf:params:xml:ns:xmpp-tls'/>");
+        flush();
         socket()->flush();
         socket()->startServerEncryption();
         return;
     }
+    else if (ns == ns_compress && nodeRecv.tagName() == "compress")
+    {
+        const QString method = nodeRecv.firstChildElement("method").text();
+        if (method != "zlib" || !isCompressionSupported())
+        {
+            sendData("<failure xmlns='http://jabber.org/protocol/compress'><unsupported-method/></failure>");
+        }
+        else if (d->username.isEmpty() || isCompressed())
+        {
+            sendData("<failure xmlns='http://jabber.org/protocol/compress'><setup-failed/></failure>");
+        }
+        else
+        {
+            // the response is sent uncompressed, then the client restarts
+            // the stream
+            sendData("<compressed xmlns='http://jabber.org/protocol/compress'/>");
+            if (!startCompression())
+            {
+                warning("Could not start stream compression");
+                disconnectFromHost();
+            }
+        }
+        return;
+    }
     else if (ns == ns_sasl)
     {
         if (nodeRecv.tagName() == "auth")
@@ -107,6 +107,7 @@ void QXmppIncomingServer::handleStanza(const QDomElement &stanza)
     if (ns == ns_tls && stanza.tagName() == "starttls")
     {
         sendData("<proceed xmlns='urn:ietf:params:xml:ns:xmpp-tls'/>");
+        flush();
         socket()->flush();
         socket()->startServerEncryption();
         return;
@@ -24,11 +24,17 @@
 
 #include <iostream>
 
+#include <QAtomicInt>
 #include <QChildEvent>
+#include <QCoreApplication>
 #include <QDateTime>
 #include <QFile>
 #include <QMetaType>
-#include <QTextStream>
+#include <QMutex>
+#include <QSet>
+#include <QThread>
+#include <QWaitCondition>
+#include <QtEndian>
 
 #include "QXmppLogger.h"
 
@@ -53,24 +59,569 @@ static const char *typeName(QXmppLogger::MessageType type)
     }
 }
 
-static QString formatted(QXmppLogger::MessageType type, const QString& text)
+static QString formatted(const QDateTime &time, QXmppLogger::MessageType type, const QString& text)
 {
-    return QDateTime::currentDateTime().toString() + " " +
+    return time.toString() + " " +
         QString::fromLatin1(typeName(type)) + " " +
         text;
 }
 
+// maximum amount of text waiting to be written to the log file
+static const int fileBufferSize = 4 * 1024 * 1024;
+
+// amount of text above which the writer thread is woken up early
+static const int fileFlushThreshold = 64 * 1024;
+
+// maximum delay before messages are written to the log file
+static const int fileFlushInterval = 500;
+
+class QXmppLoggerFileEntry
+{
+public:
+    QDateTime time;
+    QXmppLogger::MessageType type;
+    QString text;
+};
+
+/// The QXmppLoggerFileWriter class writes log messages to a file from a
+/// background thread.
+///
+/// Messages are formatted and written by batches, so that logging does
+/// not cost a file operation for every message. If messages arrive faster
+/// than they can be written, the excess is dropped and counted.
+
+class QXmppLoggerFileWriter : public QThread
+{
+public:
+    QXmppLoggerFileWriter();
+    ~QXmppLoggerFileWriter();
+
+    void append(QXmppLogger::MessageType type, const QString &text);
+    int dropped();
+    void setPath(const QString &path);
+    void setMaxSize(qint64 bytes);
+    void setRotationInterval(int secs);
+    void stop();
+
+protected:
+    void run();
+
+private:
+    QMutex m_mutex;
+    QWaitCondition m_condition;
+    QList<QXmppLoggerFileEntry> m_entries;
+    int m_pendingBytes;
+    int m_dropped;
+    int m_droppedPending;
+    QString m_path;
+    qint64 m_maxSize;
+    int m_rotationInterval;
+    bool m_stopping;
+};
+
+// writers which need to be flushed when the application exits
+static QMutex fileWritersMutex;
+static QSet<QXmppLoggerFileWriter*> fileWriters;
+
+static void stopFileWriters()
+{
+    QMutexLocker locker(&fileWritersMutex);
+    foreach (QXmppLoggerFileWriter *writer, fileWriters)
+        writer->stop();
+}
+
+QXmppLoggerFileWriter::QXmppLoggerFileWriter()
+    : m_pendingBytes(0),
+    m_dropped(0),
+    m_droppedPending(0),
+    m_maxSize(0),
+    m_rotationInterval(0),
+    m_stopping(false)
+{
+    static bool postRoutineAdded = false;
+
+    QMutexLocker locker(&fileWritersMutex);
+    if (!postRoutineAdded) {
+        qAddPostRoutine(stopFileWriters);
+        postRoutineAdded = true;
+    }
+    fileWriters.insert(this);
+}
+
+QXmppLoggerFileWriter::~QXmppLoggerFileWriter()
+{
+    fileWritersMutex.lock();
+    fileWriters.remove(this);
+    fileWritersMutex.unlock();
+
+    stop();
+}
+
+/// Queues a message to be written.
+///
+/// \param type
+/// \param text
+
+void QXmppLoggerFileWriter::append(QXmppLogger::MessageType type, const QString &text)
+{
+    QXmppLoggerFileEntry entry;
+    entry.time = QDateTime::currentDateTime();
+    entry.type = type;
+    entry.text = text;
+
+    QMutexLocker locker(&m_mutex);
+    const int size = text.size() * sizeof(QChar);
+    if (m_pendingBytes + size > fileBufferSize) {
+        m_dropped++;
+        m_droppedPending++;
+        return;
+    }
+    m_entries << entry;
+    m_pendingBytes += size;
+    if (m_pendingBytes >= fileFlushThreshold)
+        m_condition.wakeOne();
+}
+
+/// Returns the number of messages which were dropped because the buffer
+/// was full.
+
+int QXmppLoggerFileWriter::dropped()
+{
+    QMutexLocker locker(&m_mutex);
+    return m_dropped;
+}
+
+void QXmppLoggerFileWriter::setPath(const QString &path)
+{
+    QMutexLocker locker(&m_mutex);
+    m_path = path;
+}
+
+void QXmppLoggerFileWriter::setMaxSize(qint64 bytes)
+{
+    QMutexLocker locker(&m_mutex);
+    m_maxSize = bytes;
+}
+
+void QXmppLoggerFileWriter::setRotationInterval(int secs)
+{
+    QMutexLocker locker(&m_mutex);
+    m_rotationInterval = secs;
+}
+
+/// Writes the pending messages and stops the thread.
+
+void QXmppLoggerFileWriter::stop()
+{
+    m_mutex.lock();
+    m_stopping = true;
+    m_condition.wakeOne();
+    m_mutex.unlock();
+    wait();
+}
+
+void QXmppLoggerFileWriter::run()
+{
+    QFile file;
+    QDateTime openTime;
+    qint64 rotateSize = 0;
+    QList<QXmppLoggerFileEntry> batch;
+
+    forever {
+        m_mutex.lock();
+        if (m_entries.isEmpty() && !m_droppedPending && !m_stopping)
+            m_condition.wait(&m_mutex, fileFlushInterval);
+        batch = m_entries;
+        m_entries.clear();
+        m_pendingBytes = 0;
+        const int dropped = m_droppedPending;
+        m_droppedPending = 0;
+        const QString path = m_path;
+        const qint64 maxSize = m_maxSize;
+        const int rotationInterval = m_rotationInterval;
+        const bool stopping = m_stopping;
+        m_mutex.unlock();
+
+        if (!batch.isEmpty() || dropped) {
+            const QDateTime now = QDateTime::currentDateTime();
+
+            // open the file, rotating it if needed
+            QString rotateError;
+            if (file.fileName() != path) {
+                file.close();
+                file.setFileName(path);
+            }
+            if (file.isOpen() &&
+                ((maxSize > 0 && file.size() >= qMax(maxSize, rotateSize)) ||
+                 (rotationInterval > 0 && openTime.secsTo(now) >= rotationInterval))) {
+                file.close();
+
+                // the time stamp only has a resolution of one second
+                const QString stamped = path + "." + now.toString("yyyyMMdd-hhmmss");
+                QString target = stamped;
+                for (int i = 1; QFile::exists(target); ++i)
+                    target = stamped + "." + QString::number(i);
+
+                if (QFile::rename(path, target)) {
+                    rotateSize = 0;
+                } else {
+                    // carry on with the current file and retry later
+                    rotateError = QString("Could not rename log file to %1").arg(target);
+                    rotateSize = file.size() + maxSize;
+                }
+            }
+            if (!file.isOpen()) {
+                file.open(QIODevice::WriteOnly | QIODevice::Append);
+                openTime = now;
+            }
+
+            // write the batch
+            QByteArray data;
+            if (!rotateError.isEmpty())
+                data += formatted(now, QXmppLogger::WarningMessage, rotateError).toUtf8() + "\n";
+            if (dropped)
+                data += formatted(now, QXmppLogger::WarningMessage,
+                    QString("%1 log messages were dropped").arg(dropped)).toUtf8() + "\n";
+            foreach (const QXmppLoggerFileEntry &entry, batch)
+                data += formatted(entry.time, entry.type, entry.text).toUtf8() + "\n";
+            file.write(data);
+            file.flush();
+            batch.clear();
+        }
+
+        if (stopping)
+            break;
+    }
+}
+
+// magic bytes at the start of a trace file
+static const char traceMagic[] = "QXMPPTR1";
+static const int traceMagicSize = 8;
+
+// size of a trace record header
+static const int traceHeaderSize = 17;
+
+// amount by which a trace file is grown and mapped at a time
+static const qint64 traceChunkSize = 4 * 1024 * 1024;
+
+/// The QXmppLoggerTraceWriter class appends records to a memory-mapped
+/// binary trace file.
+///
+/// The file starts with the 8 bytes "QXMPPTR1", followed by records made
+/// of a 17 byte little-endian header and a payload:
+///
+///  - payload size (32 bits)
+///  - time in milliseconds since the epoch, UTC (64 bits)
+///  - stream identifier, or 0 for messages not tied to a stream (32 bits)
+///  - QXmppLogger::MessageType (8 bits)
+///  - payload, the UTF-8 encoded message
+///
+/// The file is grown by chunks which are filled with zeroes, so a record
+/// with a zero time marks the end of the trace.
+///
+/// The path and the types of messages to record are copies of the logger's
+/// settings, so that records can be written from any thread.
+
+class QXmppLoggerTraceWriter
+{
+public:
+    QXmppLoggerTraceWriter();
+    ~QXmppLoggerTraceWriter();
+
+    bool isTracing(QXmppLogger::MessageType type) const;
+    void setPath(const QString &path);
+    void setTypes(int types);
+    void write(quint32 streamId, QXmppLogger::MessageType type, const QByteArray &data);
+
+private:
+    bool open(const QString &path);
+    void close();
+    bool reserve(qint64 size);
+
+    QAtomicInt m_types;
+    QMutex m_mutex;
+    QFile m_file;
+    QString m_path;
+    QString m_failedPath;
+    uchar *m_map;
+    qint64 m_mapOffset;
+    qint64 m_mapSize;
+    qint64 m_mapPos;
+};
+
+QXmppLoggerTraceWriter::QXmppLoggerTraceWriter()
+    : m_types(0),
+    m_map(0),
+    m_mapOffset(0),
+    m_mapSize(0),
+    m_mapPos(0)
+{
+}
+
+QXmppLoggerTraceWriter::~QXmppLoggerTraceWriter()
+{
+    close();
+}
+
+/// Opens the trace file, appending to it if it already is a trace.
+///
+/// A non-empty file which does not start with the trace magic is left
+/// untouched and the trace is not written.
+
+bool QXmppLoggerTraceWriter::open(const QString &path)
+{
+    m_file.setFileName(path);
+    if (!m_file.open(QIODevice::ReadWrite))
+        return false;
+
+    // find the end of the existing records
+    qint64 end = 0;
+    const qint64 size = m_file.size();
+    if (size >= traceMagicSize && m_file.read(traceMagicSize) == QByteArray(traceMagic, traceMagicSize)) {
+        end = traceMagicSize;
+        char header[traceHeaderSize];
+        while (end + traceHeaderSize <= size &&
+               m_file.seek(end) &&
+               m_file.read(header, traceHeaderSize) == traceHeaderSize) {
+            const quint32 length = qFromLittleEndian<quint32>(reinterpret_cast<const uchar*>(header));
+            const qint64 stamp = qFromLittleEndian<qint64>(reinterpret_cast<const uchar*>(header + 4));
+            if (!stamp || end + traceHeaderSize + length > size)
+                break;
+            end += traceHeaderSize + length;
+        }
+    } else if (size > 0) {
+        // never overwrite a file which is not a trace
+        qWarning("Not writing a trace to %s as it contains other data",
+                 qPrintable(path));
+        m_file.close();
+        return false;
+    }
+
+    m_mapOffset = end;
+    m_mapSize = 0;
+    m_mapPos = 0;
+    if (!end) {
+        if (!reserve(traceMagicSize))
+            return false;
+        memcpy(m_map, traceMagic, traceMagicSize);
+        m_mapPos = traceMagicSize;
+    }
+    return true;
+}
+
+/// Unmaps the trace file and truncates it to the records written.
+
+void QXmppLoggerTraceWriter::close()
+{
+    if (!m_file.isOpen())
+        return;
+
+    if (m_map)
+        m_file.unmap(m_map);
+    m_map = 0;
+    m_file.resize(m_mapOffset + m_mapPos);
+    m_file.close();
+}
+
+/// Makes sure at least \a size bytes are mapped after the current
+/// position, growing the file if needed.
+
+bool QXmppLoggerTraceWriter::reserve(qint64 size)
+{
+    if (m_map && m_mapPos + size <= m_mapSize)
+        return true;
+
+    if (m_map)
+        m_file.unmap(m_map);
+    m_mapOffset += m_mapPos;
+    m_mapPos = 0;
+    m_mapSize = qMax(size, traceChunkSize);
+    if (!m_file.resize(m_mapOffset + m_mapSize)) {
+        m_map = 0;
+        return false;
+    }
+    m_map = m_file.map(m_mapOffset, m_mapSize);
+    return m_map != 0;
+}
+
+/// Returns true if messages of the given \a type are recorded.
+///
+/// \param type
+
+bool QXmppLoggerTraceWriter::isTracing(QXmppLogger::MessageType type) const
+{
+    return (int(m_types) & type) != 0;
+}
+
+/// Sets the path of the trace file, which is opened by the next write().
+///
+/// \param path
+
+void QXmppLoggerTraceWriter::setPath(const QString &path)
+{
+    QMutexLocker locker(&m_mutex);
+    m_path = path;
+}
+
+/// Sets the types of messages to record, 0 if the trace is disabled.
+///
+/// \param types
+
+void QXmppLoggerTraceWriter::setTypes(int types)
+{
+    m_types = types;
+}
+
+/// Appends a record to the trace file. This method is thread-safe.
+
+void QXmppLoggerTraceWriter::write(quint32 streamId, QXmppLogger::MessageType type, const QByteArray &data)
+{
+    QMutexLocker locker(&m_mutex);
+
+    if (m_file.fileName() != m_path || !m_file.isOpen()) {
+        // do not retry a file which could not be opened for every record
+        if (m_path == m_failedPath)
+            return;
+        close();
+        if (!open(m_path)) {
+            m_failedPath = m_path;
+            return;
+        }
+        m_failedPath.clear();
+    }
+
+    if (!reserve(traceHeaderSize + data.size()))
+        return;
+
+    const QDateTime now = QDateTime::currentDateTime().toUTC();
+    const qint64 stamp = qint64(now.toTime_t()) * 1000 + now.time().msec();
+
+    uchar *ptr = m_map + m_mapPos;
+    qToLittleEndian<quint32>(data.size(), ptr);
+    qToLittleEndian<qint64>(stamp, ptr + 4);
+    qToLittleEndian<quint32>(streamId, ptr + 12);
+    ptr[16] = quint8(type);
+    memcpy(ptr + traceHeaderSize, data.constData(), data.size());
+    m_mapPos += traceHeaderSize + data.size();
+}
+
+/// The QXmppLoggerState class holds the settings of a QXmppLogger which
+/// QXmppLoggable objects read from any thread.
+///
+/// It is reference counted so that it outlives the logger for as long as
+/// a loggable refers to it.
+
+class QXmppLoggerState
+{
+public:
+    QXmppLoggerState()
+        : ref(1),
+        loggedTypes(0)
+    {
+    }
+
+    QAtomicInt ref;
+    QAtomicInt loggedTypes;
+    QXmppLoggerTraceWriter traceWriter;
+};
+
 /// Constructs a new QXmppLoggable.
 ///
 /// \param parent
 
 QXmppLoggable::QXmppLoggable(QObject *parent)
-    : QObject(parent)
+    : QObject(parent),
+    m_loggerConnected(false),
+    m_loggerState(0),
+    m_logReceivers(0),
+    m_relayReceivers(0)
 {
+    static QAtomicInt lastTraceId(0);
+    m_traceId = lastTraceId.fetchAndAddRelaxed(1) + 1;
+
     QXmppLoggable *logParent = qobject_cast<QXmppLoggable*>(parent);
     if (logParent) {
+        m_relayReceivers.ref();
         connect(this, SIGNAL(logMessage(QXmppLogger::MessageType,QString)),
                 logParent, SIGNAL(logMessage(QXmppLogger::MessageType,QString)));
+        setLoggerState(logParent->m_loggerState);
+    }
+}
+
+/// Destroys a QXmppLoggable.
+
+QXmppLoggable::~QXmppLoggable()
+{
+    if (m_loggerState && !m_loggerState->ref.deref())
+        delete m_loggerState;
+}
+
+/// Connects the logMessage() signal to the given \a logger, which then
+/// ultimately receives the messages emitted by this object and its
+/// QXmppLoggable children.
+///
+/// The logger also lets isLogging() know which messages would be
+/// discarded. Messages filtered out by the logger are not emitted at all,
+/// unless something else is connected to logMessage().
+///
+/// This method must be called from the thread the object lives in.
+///
+/// \param logger
+
+void QXmppLoggable::attachLogger(QXmppLogger *logger)
+{
+    if (m_loggerConnected) {
+        if (m_attachedLogger)
+            disconnect(this, SIGNAL(logMessage(QXmppLogger::MessageType,QString)),
+                       m_attachedLogger, SLOT(log(QXmppLogger::MessageType,QString)));
+        m_relayReceivers.deref();
+        m_loggerConnected = false;
+    }
+    if (logger) {
+        m_relayReceivers.ref();
+        connect(this, SIGNAL(logMessage(QXmppLogger::MessageType,QString)),
+                logger, SLOT(log(QXmppLogger::MessageType,QString)));
+        m_loggerConnected = true;
+    }
+    m_attachedLogger = logger;
+    setLoggerState(logger ? logger->m_state : 0);
+}
+
+/// Relays the logMessage() signal of \a source, which is not a child of
+/// this object, as if it were one: the relay is not counted as a receiver
+/// by isLogging() and \a source follows the settings of the logger
+/// attached to this object.
+///
+/// This method must be called from the thread \a source lives in.
+///
+/// \param source
+
+void QXmppLoggable::relayLogMessages(QXmppLoggable *source)
+{
+    source->m_relayReceivers.ref();
+    connect(source, SIGNAL(logMessage(QXmppLogger::MessageType,QString)),
+            this, SIGNAL(logMessage(QXmppLogger::MessageType,QString)));
+    source->setLoggerState(m_loggerState);
+}
+
+/// Sets the settings of the logger which ultimately receives the messages
+/// emitted by this object and its QXmppLoggable children, without
+/// connecting any signals.
+///
+/// \param state
+
+void QXmppLoggable::setLoggerState(QXmppLoggerState *state)
+{
+    if (state)
+        state->ref.ref();
+    if (m_loggerState && !m_loggerState->ref.deref())
+        delete m_loggerState;
+    m_loggerState = state;
+
+    foreach (QObject *object, children()) {
+        QXmppLoggable *child = qobject_cast<QXmppLoggable*>(object);
+        if (child)
+            child->setLoggerState(state);
     }
 }
 
@@ -81,14 +632,91 @@ void QXmppLoggable::childEvent(QChildEvent *event)
         return;
 
     if (event->added()) {
+        child->m_relayReceivers.ref();
         connect(child, SIGNAL(logMessage(QXmppLogger::MessageType,QString)),
                 this, SIGNAL(logMessage(QXmppLogger::MessageType,QString)));
+        child->setLoggerState(m_loggerState);
     } else if (event->removed()) {
         disconnect(child, SIGNAL(logMessage(QXmppLogger::MessageType,QString)),
                 this, SIGNAL(logMessage(QXmppLogger::MessageType,QString)));
+        child->m_relayReceivers.deref();
     }
 }
 
+/// Logs a received packet given as raw UTF-8 data.
+///
+/// If the attached logger records a binary trace, the data is passed on
+/// as-is, otherwise it is only decoded if it is going to be logged.
+///
+/// \param data
+
+void QXmppLoggable::logReceivedData(const QByteArray &data)
+{
+    logData(QXmppLogger::ReceivedMessage, data);
+}
+
+/// Logs a sent packet given as raw UTF-8 data.
+///
+/// \param data
+///
+/// \sa logReceivedData()
+
+void QXmppLoggable::logSentData(const QByteArray &data)
+{
+    logData(QXmppLogger::SentMessage, data);
+}
+
+/// Returns true if messages of the given \a type will be handled,
+/// so that callers can avoid building messages which would be discarded.
+///
+/// Messages are emitted if something other than the parent object or
+/// the attached logger is connected to the logMessage() signal.
+/// Otherwise, if a logger is attached to this object, its settings
+/// decide.
+///
+/// This method only reads atomic values and can be called from any thread.
+///
+/// \param type
+
+bool QXmppLoggable::isLogging(QXmppLogger::MessageType type) const
+{
+    const int receivers = m_logReceivers;
+    if (receivers > int(m_relayReceivers))
+        return true;
+    if (m_loggerState)
+        return (int(m_loggerState->loggedTypes) & type) != 0;
+    return receivers > 0;
+}
+
+void QXmppLoggable::logData(QXmppLogger::MessageType type, const QByteArray &data)
+{
+    if (m_loggerState && m_loggerState->traceWriter.isTracing(type))
+        m_loggerState->traceWriter.write(m_traceId, type, data);
+    else if (isLogging(type))
+        emit logMessage(type, qxmpp_loggable_trace(QString::fromUtf8(data.constData(), data.size())));
+}
+
+static bool isLogMessageSignal(const char *signal)
+{
+    return !qstrcmp(signal, SIGNAL(logMessage(QXmppLogger::MessageType,QString)));
+}
+
+void QXmppLoggable::connectNotify(const char *signal)
+{
+    if (isLogMessageSignal(signal))
+        m_logReceivers.ref();
+}
+
+void QXmppLoggable::disconnectNotify(const char *signal)
+{
+    if (!isLogMessageSignal(signal))
+        return;
+
+    int receivers = m_logReceivers;
+    while (receivers > 0 && !m_logReceivers.testAndSetOrdered(receivers, receivers - 1))
+        receivers = m_logReceivers;
+}
+
 /// Constructs a new QXmppLogger.
 ///
 /// \param parent
@@ -97,10 +725,29 @@ QXmppLogger::QXmppLogger(QObject *parent)
     : QObject(parent),
     m_loggingType(QXmppLogger::NoLogging),
     m_logFilePath("QXmppClientLog.log"),
+    m_logFileMaxSize(0),
+    m_logFileRotationInterval(0),
+    m_fileWriter(0),
+    m_state(new QXmppLoggerState),
     m_messageTypes(QXmppLogger::AnyMessage)
 {
     // make it possible to pass QXmppLogger::MessageType between threads
     qRegisterMetaType< QXmppLogger::MessageType >("QXmppLogger::MessageType");
+
+    m_state->traceWriter.setPath(m_logFilePath);
+}
+
+/// Destroys a QXmppLogger, writing any pending messages to the log file.
+
+QXmppLogger::~QXmppLogger()
+{
+    delete m_fileWriter;
+
+    // loggables which still refer to the state stop logging
+    m_state->loggedTypes = 0;
+    m_state->traceWriter.setTypes(0);
+    if (!m_state->ref.deref())
+        delete m_state;
 }
 
 /// Returns the default logger.
@@ -124,11 +771,21 @@ QXmppLogger::LoggingType QXmppLogger::loggingType()
 
 /// Sets the handler for logging messages.
 ///
+/// Switching away from FileLogging writes the pending messages and stops
+/// the thread writing the log file.
+///
 /// \param type
 
 void QXmppLogger::setLoggingType(QXmppLogger::LoggingType type)
 {
     m_loggingType = type;
+    updateState();
+
+    // write the pending messages and stop the writer thread
+    if (type != QXmppLogger::FileLogging && m_fileWriter) {
+        delete m_fileWriter;
+        m_fileWriter = 0;
+    }
 }
 
 /// Returns the types of messages to log.
@@ -146,6 +803,28 @@ QXmppLogger::MessageTypes QXmppLogger::messageTypes()
 void QXmppLogger::setMessageTypes(QXmppLogger::MessageTypes types)
 {
     m_messageTypes = types;
+    updateState();
+}
+
+/// Returns true if messages of the given \a type are currently
+/// being logged.
+///
+/// This method only reads atomic values and can be called from any thread.
+///
+/// \param type
+
+bool QXmppLogger::isLogging(QXmppLogger::MessageType type) const
+{
+    return (int(m_state->loggedTypes) & type) != 0;
+}
+
+/// Mirrors the logging type and the message types in the state which is
+/// read from other threads.
+
+void QXmppLogger::updateState()
+{
+    m_state->loggedTypes = (m_loggingType != QXmppLogger::NoLogging) ? int(m_messageTypes) : 0;
+    m_state->traceWriter.setTypes((m_loggingType == QXmppLogger::TraceLogging) ? int(m_messageTypes) : 0);
 }
 
 /// Add a logging message.
@@ -162,24 +841,51 @@ void QXmppLogger::log(QXmppLogger::MessageType type, const QString& text)
     switch(m_loggingType)
     {
     case QXmppLogger::FileLogging:
-        {
-            QFile file(m_logFilePath);
-            file.open(QIODevice::Append);
-            QTextStream stream(&file);
-            stream << formatted(type, text) << "\n";
+        if (!m_fileWriter) {
+            m_fileWriter = new QXmppLoggerFileWriter;
+            m_fileWriter->setPath(m_logFilePath);
+            m_fileWriter->setMaxSize(m_logFileMaxSize);
+            m_fileWriter->setRotationInterval(m_logFileRotationInterval);
+            m_fileWriter->start(QThread::LowPriority);
         }
+        m_fileWriter->append(type, text);
         break;
     case QXmppLogger::StdoutLogging:
-        std::cout << qPrintable(formatted(type, text)) << std::endl;
+        std::cout << qPrintable(formatted(QDateTime::currentDateTime(), type, text)) << std::endl;
         break;
     case QXmppLogger::SignalLogging:
         emit message(type, text);
         break;
+    case QXmppLogger::TraceLogging:
+        trace(0, type, text.toUtf8());
+        break;
     default:
         break;
     }
 }
 
+/// Records raw data in the binary trace file, if the logging type is
+/// TraceLogging.
+///
+/// Unlike log(), this method can be called directly from any thread and
+/// does not do any text formatting, which makes it suitable for capturing
+/// all the traffic of a busy server.
+///
+/// If the file at logFilePath() is not empty and is not a trace, it is left
+/// untouched and nothing is recorded until a different path is set.
+///
+/// \param streamId identifier of the stream the data belongs to
+/// \param type
+/// \param data the raw UTF-8 data
+
+void QXmppLogger::trace(quint32 streamId, QXmppLogger::MessageType type, const QByteArray &data)
+{
+    if (!m_state->traceWriter.isTracing(type))
+        return;
+
+    m_state->traceWriter.write(streamId, type, data);
+}
+
 /// Returns the path to which logging messages should be written.
 ///
 /// \sa loggingType()
@@ -198,5 +904,63 @@ QString QXmppLogger::logFilePath()
 void QXmppLogger::setLogFilePath(const QString &path)
 {
     m_logFilePath = path;
+    m_state->traceWriter.setPath(path);
+    if (m_fileWriter)
+        m_fileWriter->setPath(path);
+}
+
+/// Returns the size above which the log file is rotated.
+///
+
+qint64 QXmppLogger::logFileMaxSize() const
+{
+    return m_logFileMaxSize;
+}
+
+/// Sets the size above which the log file is rotated. The current file is
+/// renamed by appending the date and time to its name, followed by a
+/// counter if a file by that name already exists, and a new file is
+/// started. If the file cannot be renamed, a warning is written to it and
+/// rotation is retried once it has grown by the same amount again.
+///
+/// The default value of 0 disables size-based rotation.
+///
+/// \param bytes
+
+void QXmppLogger::setLogFileMaxSize(qint64 bytes)
+{
+    m_logFileMaxSize = bytes;
+    if (m_fileWriter)
+        m_fileWriter->setMaxSize(bytes);
+}
+
+/// Returns the number of seconds after which the log file is rotated.
+///
+
+int QXmppLogger::logFileRotationInterval() const
+{
+    return m_logFileRotationInterval;
+}
+
+/// Sets the number of seconds after which the log file is rotated.
+///
+/// The default value of 0 disables time-based rotation.
+///
+/// \param secs
+
+void QXmppLogger::setLogFileRotationInterval(int secs)
+{
+    m_logFileRotationInterval = secs;
+    if (m_fileWriter)
+        m_fileWriter->setRotationInterval(secs);
+}
+
+/// Returns the number of messages which could not be written to the log
+/// file because they arrived faster than they could be written.
+///
+
+int QXmppLogger::droppedMessages() const
+{
+    return m_fileWriter ? m_fileWriter->dropped() : 0;
 }
 
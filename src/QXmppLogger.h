@@ -25,7 +25,9 @@
 #ifndef QXMPPLOGGER_H
 #define QXMPPLOGGER_H
 
+#include <QAtomicInt>
 #include <QObject>
+#include <QPointer>
 
 #ifdef QXMPP_LOGGABLE_TRACE
 #define qxmpp_loggable_trace(x) QString("%1(0x%2) %3").arg(metaObject()->className(), QString::number(reinterpret_cast<qint64>(this), 16), x)
@@ -33,6 +35,9 @@
 #define qxmpp_loggable_trace(x) (x)
 #endif
 
+class QXmppLoggerFileWriter;
+class QXmppLoggerState;
+
 /// \brief The QXmppLogger class represents a sink for logging messages. 
 ///
 /// \ingroup Core
@@ -49,6 +54,7 @@ public:
         FileLogging = 1,    ///< Log messages are written to a file
         StdoutLogging = 2,  ///< Log messages are written to the standard output
         SignalLogging = 4,  ///< Log messages are emitted as a signal
+        TraceLogging = 8,   ///< Log messages are recorded in a binary trace file
 
         // Deprecated
         /// \cond
@@ -72,6 +78,7 @@ public:
     Q_DECLARE_FLAGS(MessageTypes, MessageType)
 
     QXmppLogger(QObject *parent = 0);
+    ~QXmppLogger();
     static QXmppLogger* getLogger();
 
     QXmppLogger::LoggingType loggingType();
@@ -80,9 +87,21 @@ public:
     QString logFilePath();
     void setLogFilePath(const QString &path);
 
+    qint64 logFileMaxSize() const;
+    void setLogFileMaxSize(qint64 bytes);
+
+    int logFileRotationInterval() const;
+    void setLogFileRotationInterval(int secs);
+
+    int droppedMessages() const;
+
     QXmppLogger::MessageTypes messageTypes();
     void setMessageTypes(QXmppLogger::MessageTypes types);
 
+    bool isLogging(QXmppLogger::MessageType type) const;
+
+    void trace(quint32 streamId, QXmppLogger::MessageType type, const QByteArray &data);
+
 public slots:
     void log(QXmppLogger::MessageType type, const QString& text);
 
@@ -91,10 +110,18 @@ signals:
     void message(QXmppLogger::MessageType type, const QString &text);
 
 private:
+    void updateState();
+
     static QXmppLogger* m_logger;
     QXmppLogger::LoggingType m_loggingType;
     QString m_logFilePath;
+    qint64 m_logFileMaxSize;
+    int m_logFileRotationInterval;
+    QXmppLoggerFileWriter *m_fileWriter;
+    QXmppLoggerState *m_state;
     QXmppLogger::MessageTypes m_messageTypes;
+
+    friend class QXmppLoggable;
 };
 
 /// \brief The QXmppLoggable class represents a source of logging messages. 
@@ -107,19 +134,27 @@ class QXmppLoggable : public QObject
 
 public:
     QXmppLoggable(QObject *parent = 0);
+    ~QXmppLoggable();
 
 protected:
     /// \cond
     virtual void childEvent(QChildEvent *event);
+    virtual void connectNotify(const char *signal);
+    virtual void disconnectNotify(const char *signal);
     /// \endcond
 
+    void attachLogger(QXmppLogger *logger);
+    void relayLogMessages(QXmppLoggable *source);
+    bool isLogging(QXmppLogger::MessageType type) const;
+
     /// Logs a debugging message.
     ///
     /// \param message
 
     void debug(const QString &message)
     {
-        emit logMessage(QXmppLogger::DebugMessage, qxmpp_loggable_trace(message));
+        if (isLogging(QXmppLogger::DebugMessage))
+            emit logMessage(QXmppLogger::DebugMessage, qxmpp_loggable_trace(message));
     }
 
     /// Logs an informational message.
@@ -128,7 +163,8 @@ protected:
 
     void info(const QString &message)
     {
-        emit logMessage(QXmppLogger::InformationMessage, qxmpp_loggable_trace(message));
+        if (isLogging(QXmppLogger::InformationMessage))
+            emit logMessage(QXmppLogger::InformationMessage, qxmpp_loggable_trace(message));
     }
 
     /// Logs a warning message.
@@ -137,7 +173,8 @@ protected:
 
     void warning(const QString &message)
     {
-        emit logMessage(QXmppLogger::WarningMessage, qxmpp_loggable_trace(message));
+        if (isLogging(QXmppLogger::WarningMessage))
+            emit logMessage(QXmppLogger::WarningMessage, qxmpp_loggable_trace(message));
     }
 
     /// Logs a received packet.
@@ -146,7 +183,8 @@ protected:
 
     void logReceived(const QString &message)
     {
-        emit logMessage(QXmppLogger::ReceivedMessage, qxmpp_loggable_trace(message));
+        if (isLogging(QXmppLogger::ReceivedMessage))
+            emit logMessage(QXmppLogger::ReceivedMessage, qxmpp_loggable_trace(message));
     }
 
     /// Logs a sent packet.
@@ -155,12 +193,27 @@ protected:
 
     void logSent(const QString &message)
     {
-        emit logMessage(QXmppLogger::SentMessage, qxmpp_loggable_trace(message));
+        if (isLogging(QXmppLogger::SentMessage))
+            emit logMessage(QXmppLogger::SentMessage, qxmpp_loggable_trace(message));
     }
 
+    void logReceivedData(const QByteArray &data);
+    void logSentData(const QByteArray &data);
+
 signals:
     /// This signal is emitted to send logging messages.
     void logMessage(QXmppLogger::MessageType type, const QString &msg);
+
+private:
+    void logData(QXmppLogger::MessageType type, const QByteArray &data);
+    void setLoggerState(QXmppLoggerState *state);
+
+    QPointer<QXmppLogger> m_attachedLogger;
+    bool m_loggerConnected;
+    QXmppLoggerState *m_loggerState;
+    QAtomicInt m_logReceivers;
+    QAtomicInt m_relayReceivers;
+    quint32 m_traceId;
 };
 
 Q_DECLARE_OPERATORS_FOR_FLAGS(QXmppLogger::MessageTypes)
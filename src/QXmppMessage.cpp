@@ -218,53 +218,82 @@ void QXmppMessage::parse(const QDomElement &element)
     QXmppStanza::parse(element);
 
     setTypeFromStr(element.attribute("type"));
-    m_body = element.firstChildElement("body").text();
-    m_subject = element.firstChildElement("subject").text();
-    m_thread = element.firstChildElement("thread").text();
-
-    // XEP-0184: Message Delivery Receipts
-    m_requestReceipt = element.firstChildElement("request").namespaceURI() == ns_message_receipts;
-
-    // XEP-0224: Attention
-    m_attention = element.firstChildElement("attention").namespaceURI() == ns_attention;
-
-    // chat states
-    for (int i = Active; i <= Paused; i++)
+    m_requestReceipt = false;
+    m_attention = false;
+
+    // walk the children once, the first occurrence of an element wins
+    QDomElement bodyElement, subjectElement, threadElement;
+    QDomElement delayElement, legacyDelayElement;
+    bool requestFound = false;
+    bool attentionFound = false;
+    bool stateFound = false;
+    QXmppElementList extensions;
+    QDomElement childElement = element.firstChildElement();
+    while (!childElement.isNull())
     {
-        QDomElement stateElement = element.firstChildElement(chat_states[i]);
-        if (!stateElement.isNull() &&
-            stateElement.namespaceURI() == ns_chat_states)
-        {
-            m_state = static_cast<QXmppMessage::State>(i);
-            break;
+        const QString tagName = childElement.tagName();
+        if (tagName == QLatin1String("body")) {
+            if (bodyElement.isNull())
+                bodyElement = childElement;
+        } else if (tagName == QLatin1String("subject")) {
+            if (subjectElement.isNull())
+                subjectElement = childElement;
+        } else if (tagName == QLatin1String("thread")) {
+            if (threadElement.isNull())
+                threadElement = childElement;
+        } else if (tagName == QLatin1String("request")) {
+            // XEP-0184: Message Delivery Receipts
+            if (!requestFound)
+                m_requestReceipt = childElement.namespaceURI() == ns_message_receipts;
+            requestFound = true;
+        } else if (tagName == QLatin1String("attention")) {
+            // XEP-0224: Attention
+            if (!attentionFound)
+                m_attention = childElement.namespaceURI() == ns_attention;
+            attentionFound = true;
+        } else if (tagName == QLatin1String("delay")) {
+            // XEP-0203: Delayed Delivery
+            if (delayElement.isNull())
+                delayElement = childElement;
+        } else if (tagName == QLatin1String("x")) {
+            if (childElement.namespaceURI() == ns_legacy_delayed_delivery) {
+                // XEP-0091: Legacy Delayed Delivery
+                legacyDelayElement = childElement;
+            } else {
+                // other extensions
+                extensions << QXmppElement(childElement);
+            }
+        } else if (!stateFound && childElement.namespaceURI() == ns_chat_states) {
+            // chat states
+            for (int i = Active; i <= Paused; i++)
+            {
+                if (tagName == QLatin1String(chat_states[i]))
+                {
+                    m_state = static_cast<QXmppMessage::State>(i);
+                    stateFound = true;
+                    break;
+                }
+            }
         }
+        childElement = childElement.nextSiblingElement();
     }
 
-    // XEP-0203: Delayed Delivery
-    QDomElement delayElement = element.firstChildElement("delay");
+    m_body = bodyElement.text();
+    m_subject = subjectElement.text();
+    m_thread = threadElement.text();
+
     if (!delayElement.isNull() && delayElement.namespaceURI() == ns_delayed_delivery)
     {
         const QString str = delayElement.attribute("stamp");
         m_stamp = datetimeFromString(str);
         m_stampType = QXmppMessage::DelayedDelivery;
     }
-
-    QXmppElementList extensions;
-    QDomElement xElement = element.firstChildElement("x");
-    while (!xElement.isNull())
+    if (!legacyDelayElement.isNull())
     {
-        if (xElement.namespaceURI() == ns_legacy_delayed_delivery)
-        {
-            // XEP-0091: Legacy Delayed Delivery
-            const QString str = xElement.attribute("stamp");
-            m_stamp = QDateTime::fromString(str, "yyyyMMddThh:mm:ss");
-            m_stamp.setTimeSpec(Qt::UTC);
-            m_stampType = QXmppMessage::LegacyDelayedDelivery;
-        } else {
-            // other extensions
-            extensions << QXmppElement(xElement);
-        }
-        xElement = xElement.nextSiblingElement("x");
+        const QString str = legacyDelayElement.attribute("stamp");
+        m_stamp = QDateTime::fromString(str, "yyyyMMddThh:mm:ss");
+        m_stamp.setTimeSpec(Qt::UTC);
+        m_stampType = QXmppMessage::LegacyDelayedDelivery;
     }
     setExtensions(extensions);
 }
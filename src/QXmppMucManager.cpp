@@ -139,6 +139,13 @@ bool QXmppMucManager::handleStanza(const QDomElement &element)
     return false;
 }
 
+QList<QXmppStanzaKey> QXmppMucManager::stanzaKeys() const
+{
+    return QList<QXmppStanzaKey>()
+        << QXmppStanzaKey("iq", "query", ns_muc_admin)
+        << QXmppStanzaKey("iq", "query", ns_muc_owner);
+}
+
 void QXmppMucManager::_q_messageReceived(const QXmppMessage &msg)
 {
     if (msg.type() != QXmppMessage::Normal)
@@ -78,6 +78,10 @@ public:
     QXmppSaslDigestMd5 saslDigest;
     int saslStep;
 
+    // Compression
+    bool compressionFailed;
+    QXmppStreamFeatures compressionFeatures;
+
     // Timers
     QTimer *pingTimer;
     QTimer *timeoutTimer;
@@ -85,7 +89,8 @@ public:
 
 QXmppOutgoingClientPrivate::QXmppOutgoingClientPrivate()
     : sessionAvailable(false),
-    saslStep(0)
+    saslStep(0),
+    compressionFailed(false)
 {
 }
 
@@ -148,6 +153,8 @@ QXmppConfiguration& QXmppOutgoingClient::configuration()
 
 void QXmppOutgoingClient::connectToHost()
 {
+    d->compressionFailed = false;
+
     const QString host = configuration().host();
     const quint16 port = configuration().port();
 
@@ -246,123 +253,138 @@ void QXmppOutgoingClient::handleStream(const QDomElement &streamElement)
     }
 }
 
-void QXmppOutgoingClient::handleStanza(const QDomElement &nodeRecv)
+void QXmppOutgoingClient::handleStreamFeatures(const QXmppStreamFeatures &features)
 {
-    // if we receive any kind of data, stop the timeout timer
-    d->timeoutTimer->stop();
-
-    const QString ns = nodeRecv.namespaceURI();
-
-    // give client opportunity to handle stanza
-    bool handled = false;
-    emit elementReceived(nodeRecv, handled);
-    if (handled)
-        return;
- 
-    if(QXmppStreamFeatures::isStreamFeatures(nodeRecv))
+    if (!socket()->isEncrypted())
     {
-        QXmppStreamFeatures features;
-        features.parse(nodeRecv);
-
-        if (!socket()->isEncrypted())
+        // determine TLS mode to use
+        const QXmppConfiguration::StreamSecurityMode localSecurity = configuration().streamSecurityMode();
+        const QXmppStreamFeatures::Mode remoteSecurity = features.tlsMode();
+        if (!socket()->supportsSsl() &&
+            (localSecurity == QXmppConfiguration::TLSRequired ||
+             remoteSecurity == QXmppStreamFeatures::Required))
         {
-            // determine TLS mode to use
-            const QXmppConfiguration::StreamSecurityMode localSecurity = configuration().streamSecurityMode();
-            const QXmppStreamFeatures::Mode remoteSecurity = features.tlsMode();
-            if (!socket()->supportsSsl() &&
-                (localSecurity == QXmppConfiguration::TLSRequired ||
-                 remoteSecurity == QXmppStreamFeatures::Required))
-            {
-                warning("Disconnecting as TLS is required, but SSL support is not available");
-                disconnectFromHost();
-                return;
-            }
-            if (localSecurity == QXmppConfiguration::TLSRequired &&
-                remoteSecurity == QXmppStreamFeatures::Disabled)
-            {
-                warning("Disconnecting as TLS is required, but not supported by the server");
-                disconnectFromHost();
-                return;
-            }
-
-            if (socket()->supportsSsl() &&
-                localSecurity != QXmppConfiguration::TLSDisabled &&
-                remoteSecurity != QXmppStreamFeatures::Disabled) 
-            {
-                // enable TLS as it is support by both parties
-                sendData("<starttls xmlns='urn:ietf:params:xml:ns:xmpp-tls'/>");
-                return;
-            }
+            warning("Disconnecting as TLS is required, but SSL support is not available");
+            disconnectFromHost();
+            return;
+        }
+        if (localSecurity == QXmppConfiguration::TLSRequired &&
+            remoteSecurity == QXmppStreamFeatures::Disabled)
+        {
+            warning("Disconnecting as TLS is required, but not supported by the server");
+            disconnectFromHost();
+            return;
         }
 
-        if (configuration().ignoreAuth())
+        if (socket()->supportsSsl() &&
+            localSecurity != QXmppConfiguration::TLSDisabled &&
+            remoteSecurity != QXmppStreamFeatures::Disabled) 
         {
-            d->sessionStarted = true;
-            emit connected();
+            // enable TLS as it is support by both parties
+            sendData("<starttls xmlns='urn:ietf:params:xml:ns:xmpp-tls'/>");
             return;
         }
+    }
 
-        // handle authentication
-        const bool nonSaslAvailable = features.nonSaslAuthMode() != QXmppStreamFeatures::Disabled;
-        const bool saslAvailable = !features.authMechanisms().isEmpty();
-        const bool useSasl = configuration().useSASLAuthentication();
-        if((saslAvailable && nonSaslAvailable && !useSasl) ||
-           (!saslAvailable && nonSaslAvailable))
+    if (configuration().ignoreAuth())
+    {
+        d->sessionStarted = true;
+        emit connected();
+        return;
+    }
+
+    // handle authentication
+    const bool nonSaslAvailable = features.nonSaslAuthMode() != QXmppStreamFeatures::Disabled;
+    const bool saslAvailable = !features.authMechanisms().isEmpty();
+    const bool useSasl = configuration().useSASLAuthentication();
+    if((saslAvailable && nonSaslAvailable && !useSasl) ||
+       (!saslAvailable && nonSaslAvailable))
+    {
+        sendNonSASLAuthQuery();
+    }
+    else if(saslAvailable)
+    {
+        // determine SASL Authentication mechanism to use
+        QList<QXmppConfiguration::SASLAuthMechanism> mechanisms = features.authMechanisms();
+        QXmppConfiguration::SASLAuthMechanism mechanism = configuration().sASLAuthMechanism();
+        if (mechanisms.isEmpty())
         {
-            sendNonSASLAuthQuery();
+            warning("No supported SASL Authentication mechanism available");
+            disconnectFromHost();
+            return;
         }
-        else if(saslAvailable)
+        else if (!mechanisms.contains(mechanism))
         {
-            // determine SASL Authentication mechanism to use
-            QList<QXmppConfiguration::SASLAuthMechanism> mechanisms = features.authMechanisms();
-            QXmppConfiguration::SASLAuthMechanism mechanism = configuration().sASLAuthMechanism();
-            if (mechanisms.isEmpty())
-            {
-                warning("No supported SASL Authentication mechanism available");
-                disconnectFromHost();
-                return;
-            }
-            else if (!mechanisms.contains(mechanism))
-            {
-                info("Desired SASL Auth mechanism is not available, selecting first available one");
-                mechanism = mechanisms.first();
-            }
+            info("Desired SASL Auth mechanism is not available, selecting first available one");
+            mechanism = mechanisms.first();
+        }
 
-            // send SASL Authentication request
-            switch(mechanism)
+        // send SASL Authentication request
+        switch(mechanism)
+        {
+        case QXmppConfiguration::SASLPlain:
             {
-            case QXmppConfiguration::SASLPlain:
-                {
-                    QString userPass('\0' + configuration().user() +
-                                     '\0' + configuration().password());
-                    QByteArray data = "<auth xmlns='urn:ietf:params:xml:ns:xmpp-sasl' mechanism='PLAIN'>";
-                    data += userPass.toUtf8().toBase64();
-                    data += "</auth>";
-                    sendData(data);
-                }
-                break;
-            case QXmppConfiguration::SASLDigestMD5:
-                sendData("<auth xmlns='urn:ietf:params:xml:ns:xmpp-sasl' mechanism='DIGEST-MD5'/>");
-                break;
-            case QXmppConfiguration::SASLAnonymous:
-                sendData("<auth xmlns='urn:ietf:params:xml:ns:xmpp-sasl' mechanism='ANONYMOUS'/>");
-                break;
+                QString userPass('\0' + configuration().user() +
+                                 '\0' + configuration().password());
+                QByteArray data = "<auth xmlns='urn:ietf:params:xml:ns:xmpp-sasl' mechanism='PLAIN'>";
+                data += userPass.toUtf8().toBase64();
+                data += "</auth>";
+                sendData(data);
             }
+            break;
+        case QXmppConfiguration::SASLDigestMD5:
+            sendData("<auth xmlns='urn:ietf:params:xml:ns:xmpp-sasl' mechanism='DIGEST-MD5'/>");
+            break;
+        case QXmppConfiguration::SASLAnonymous:
+            sendData("<auth xmlns='urn:ietf:params:xml:ns:xmpp-sasl' mechanism='ANONYMOUS'/>");
+            break;
         }
+    }
 
-        // check whether bind is available
-        if (features.bindMode() != QXmppStreamFeatures::Disabled)
-        {
-            QXmppBindIq bind;
-            bind.setType(QXmppIq::Set);
-            bind.setResource(configuration().resource());
-            d->bindId = bind.id();
-            sendPacket(bind);
-        }
+    // check whether compression is available, once authenticated
+    if (!saslAvailable && !nonSaslAvailable &&
+        configuration().useCompression() &&
+        isCompressionSupported() && !isCompressed() && !d->compressionFailed &&
+        features.compressionMethods().contains(QXmppConfiguration::ZlibCompression))
+    {
+        d->compressionFeatures = features;
+        sendData("<compress xmlns='http://jabber.org/protocol/compress'><method>zlib</method></compress>");
+        return;
+    }
+
+    // check whether bind is available
+    if (features.bindMode() != QXmppStreamFeatures::Disabled)
+    {
+        QXmppBindIq bind;
+        bind.setType(QXmppIq::Set);
+        bind.setResource(configuration().resource());
+        d->bindId = bind.id();
+        sendPacket(bind);
+    }
+
+    // check whether session is available
+    if (features.sessionMode() != QXmppStreamFeatures::Disabled)
+        d->sessionAvailable = true;
+}
+
+void QXmppOutgoingClient::handleStanza(const QDomElement &nodeRecv)
+{
+    // if we receive any kind of data, stop the timeout timer
+    d->timeoutTimer->stop();
+
+    const QString ns = nodeRecv.namespaceURI();
 
-        // check whether session is available
-        if (features.sessionMode() != QXmppStreamFeatures::Disabled)
-            d->sessionAvailable = true;
+    // give client opportunity to handle stanza
+    bool handled = false;
+    emit elementReceived(nodeRecv, handled);
+    if (handled)
+        return;
+ 
+    if(QXmppStreamFeatures::isStreamFeatures(nodeRecv))
+    {
+        QXmppStreamFeatures features;
+        features.parse(nodeRecv);
+        handleStreamFeatures(features);
     }
     else if(ns == ns_stream && nodeRecv.tagName() == "error")
     {
@@ -381,6 +403,27 @@ void QXmppOutgoingClient::handleStanza(const QDomElement &nodeRecv)
             return;
         }
     }
+    else if(ns == ns_compress)
+    {
+        if(nodeRecv.tagName() == "compressed")
+        {
+            debug("Starting compression");
+            if (!startCompression())
+            {
+                warning("Could not start stream compression");
+                disconnectFromHost();
+                return;
+            }
+            handleStart();
+        }
+        else if(nodeRecv.tagName() == "failure")
+        {
+            // carry on without compression
+            warning("Stream compression failed");
+            d->compressionFailed = true;
+            handleStreamFeatures(d->compressionFeatures);
+        }
+    }
     else if(ns == ns_sasl)
     {
         if(nodeRecv.tagName() == "success")
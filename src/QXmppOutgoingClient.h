@@ -38,6 +38,7 @@ class QXmppPresence;
 class QXmppIq;
 class QXmppMessage;
 class QXmppSrvInfo;
+class QXmppStreamFeatures;
 
 class QXmppOutgoingClientPrivate;
 
@@ -96,6 +97,7 @@ private slots:
     void pingTimeout();
 
 private:
+    void handleStreamFeatures(const QXmppStreamFeatures &features);
     void sendAuthDigestMD5ResponseStep1(const QString& challenge);
     void sendAuthDigestMD5ResponseStep2(const QString& challenge);
     void sendNonSASLAuth(bool plaintext);
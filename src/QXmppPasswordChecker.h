@@ -94,6 +94,11 @@ private:
 
 /// \brief The QXmppPasswordChecker class represents an abstract password checker.
 ///
+/// If QXmppServer handles client connections in worker threads, the
+/// methods of the password checker are called from those threads, possibly
+/// at the same time, and the replies they return belong to the calling
+/// thread. Implementations must then be thread-safe.
+///
 
 class QXmppPasswordChecker
 {
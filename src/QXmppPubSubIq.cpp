@@ -27,8 +27,6 @@
 #include "QXmppPubSubIq.h"
 #include "QXmppUtils.h"
 
-static const char *ns_pubsub = "http://jabber.org/protocol/pubsub";
-
 static const char *pubsub_queries[] = {
     "affiliations",
     "default",
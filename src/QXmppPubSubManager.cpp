@@ -24,6 +24,7 @@
 #include <QDomElement>
 
 #include "QXmppClient.h"
+#include "QXmppConstants.h"
 #include "QXmppPubSubIq.h"
 #include "QXmppPubSubManager.h"
 
@@ -75,6 +76,12 @@ bool QXmppPubSubManager::handleStanza(const QDomElement &stanza)
     return false;
 }
 
+QList<QXmppStanzaKey> QXmppPubSubManager::stanzaKeys() const
+{
+    return QList<QXmppStanzaKey>()
+        << QXmppStanzaKey("iq", "pubsub", ns_pubsub);
+}
+
 bool QXmppPubSubManager::requestItems(const QString &jid, const QString &node)
 {
     QXmppPubSubIq iq;
@@ -59,6 +59,7 @@ public:
 
     /// \cond
     bool handleStanza(const QDomElement &stanza);
+    QList<QXmppStanzaKey> stanzaKeys() const;
     /// \endcond
 
 signals:
@@ -25,6 +25,7 @@
 #include <QDomElement>
 
 #include "QXmppClient.h"
+#include "QXmppConstants.h"
 #include "QXmppPresence.h"
 #include "QXmppRosterIq.h"
 #include "QXmppRosterManager.h"
@@ -99,6 +100,12 @@ bool QXmppRosterManager::handleStanza(const QDomElement &element)
     return false;
 }
 
+QList<QXmppStanzaKey> QXmppRosterManager::stanzaKeys() const
+{
+    return QList<QXmppStanzaKey>()
+        << QXmppStanzaKey("iq", "query", ns_roster);
+}
+
 void QXmppRosterManager::presenceReceived(const QXmppPresence& presence)
 {
     const QString jid = presence.from();
@@ -83,6 +83,7 @@ public:
 
     /// \cond
     bool handleStanza(const QDomElement &element);
+    QList<QXmppStanzaKey> stanzaKeys() const;
     /// \endcond
 
     // deprecated in release 0.4.0
@@ -24,12 +24,17 @@
 #include <cmath>
 
 #include <QDataStream>
+#include <QDateTime>
 #include <QMetaType>
+#include <QTime>
 #include <QTimer>
+#include <QVector>
+#include <QtEndian>
 
 #include "QXmppCodec.h"
 #include "QXmppJingleIq.h"
 #include "QXmppRtpChannel.h"
+#include "QXmppRtpChannel_p.h"
 
 #ifndef M_PI
 #define M_PI 3.14159265358979323846264338327950288
@@ -39,6 +44,19 @@
 //#define QXMPP_DEBUG_RTP_BUFFER
 #define SAMPLE_BYTES 2
 
+// maximum number of samples a single RTP packet can decode to
+static const int maxPacketSamples = 8192;
+
+// converts native-endian samples to or from little endian, in place
+static void samplesToLittleEndian(qint16 *samples, int count)
+{
+    if (QSysInfo::ByteOrder == QSysInfo::LittleEndian)
+        return;
+    quint16 *ptr = reinterpret_cast<quint16*>(samples);
+    for (int i = 0; i < count; ++i)
+        ptr[i] = (ptr[i] >> 8) | (ptr[i] << 8);
+}
+
 const quint8 RTP_VERSION = 0x02;
 
 /// Parses an RTP packet.
@@ -47,61 +65,91 @@ const quint8 RTP_VERSION = 0x02;
 
 bool QXmppRtpPacket::decode(const QByteArray &ba)
 {
-    if (ba.isEmpty())
+    const int hlen = decodeHeader(ba);
+    if (hlen < 0)
         return false;
 
+    // the payload owns its data, so it can be kept after the packet is gone
+    payload = ba.mid(hlen);
+    return true;
+}
+
+/// Parses the header of an RTP packet, leaving the payload untouched.
+///
+/// This allows decoding the payload straight from the datagram, without
+/// copying it.
+///
+/// Returns the offset of the payload in \a ba, or -1 if the packet is
+/// not valid.
+///
+/// \param ba
+
+int QXmppRtpPacket::decodeHeader(const QByteArray &ba)
+{
+    if (ba.isEmpty())
+        return -1;
+
     // fixed header
-    quint8 tmp;
-    QDataStream stream(ba);
-    stream >> tmp;
-    version = (tmp >> 6);
-    const quint8 cc = (tmp >> 1) & 0xf;
+    const uchar *data = reinterpret_cast<const uchar*>(ba.constData());
+    version = (data[0] >> 6);
+    const quint8 cc = data[0] & 0x0f;
     const int hlen = 12 + 4 * cc;
     if (version != RTP_VERSION || ba.size() < hlen)
-        return false;
-    stream >> tmp;
-    marker = (tmp >> 7);
-    type = tmp & 0x7f;
-    stream >> sequence;
-    stream >> stamp;
-    stream >> ssrc;
+        return -1;
+    marker = (data[1] >> 7);
+    type = data[1] & 0x7f;
+    sequence = qFromBigEndian<quint16>(data + 2);
+    stamp = qFromBigEndian<quint32>(data + 4);
+    ssrc = qFromBigEndian<quint32>(data + 8);
 
     // contributing source IDs
     csrc.clear();
-    quint32 src;
-    for (int i = 0; i < cc; ++i) {
-        stream >> src;
-        csrc << src;
-    }
+    for (int i = 0; i < cc; ++i)
+        csrc << qFromBigEndian<quint32>(data + 12 + 4 * i);
 
-    // retrieve payload
-    payload = ba.right(ba.size() - hlen);
-    return true;
+    return hlen;
 }
 
 /// Encodes an RTP packet.
 
 QByteArray QXmppRtpPacket::encode() const
+{
+    const int hlen = headerSize();
+    QByteArray ba;
+    ba.resize(hlen + payload.size());
+    writeHeader(ba.data());
+    memcpy(ba.data() + hlen, payload.constData(), payload.size());
+    return ba;
+}
+
+/// Returns the size of the RTP header, in bytes.
+
+int QXmppRtpPacket::headerSize() const
+{
+    return 12 + 4 * csrc.size();
+}
+
+/// Writes the RTP header to \a data, which must hold headerSize() bytes.
+///
+/// This allows encoding a packet's payload directly after some reserved
+/// headroom, then filling in the header, without copying the payload.
+///
+/// \param data
+
+void QXmppRtpPacket::writeHeader(char *data) const
 {
     Q_ASSERT(csrc.size() < 16);
 
-    // fixed header
-    QByteArray ba;
-    ba.resize(payload.size() + 12 + 4 * csrc.size());
-    QDataStream stream(&ba, QIODevice::WriteOnly);
-    stream << quint8(((version & 0x3) << 6) |
-                     ((csrc.size() & 0xf) << 1));
-    stream << quint8((type & 0x7f) | (marker << 7));
-    stream << sequence;
-    stream << stamp;
-    stream << ssrc;
+    uchar *ptr = reinterpret_cast<uchar*>(data);
+    ptr[0] = ((version & 0x3) << 6) | (csrc.size() & 0x0f);
+    ptr[1] = (type & 0x7f) | (marker << 7);
+    qToBigEndian<quint16>(sequence, ptr + 2);
+    qToBigEndian<quint32>(stamp, ptr + 4);
+    qToBigEndian<quint32>(ssrc, ptr + 8);
 
     // contributing source ids
-    foreach (const quint32 &src, csrc)
-        stream << src;
-
-    stream.writeRawData(payload.constData(), payload.size());
-    return ba;
+    for (int i = 0; i < csrc.size(); ++i)
+        qToBigEndian<quint32>(csrc[i], ptr + 12 + 4 * i);
 }
 
 /// Returns a string representation of the RTP header.
@@ -171,6 +219,275 @@ void QXmppRtpChannel::payloadTypesChanged()
 {
 }
 
+// RTCP packet types
+enum RtcpType {
+    RtcpSenderReport = 200,
+    RtcpReceiverReport = 201,
+    RtcpSourceDescription = 202,
+};
+
+// interval between RTCP reports, in milliseconds
+static const int rtcpInterval = 5000;
+
+// offset between the NTP epoch (1900) and the Unix epoch (1970), in seconds
+static const quint32 ntpEpochOffset = 2208988800u;
+
+/// Returns the current time in NTP format.
+
+static quint64 ntpTime()
+{
+    const QDateTime now = QDateTime::currentDateTime().toUTC();
+    const quint64 seconds = quint64(now.toTime_t()) + ntpEpochOffset;
+    const quint64 fraction = (quint64(now.time().msec()) << 32) / 1000;
+    return (seconds << 32) | fraction;
+}
+
+/// Returns the middle 32 bits of an NTP time, as used in RTCP reports.
+
+static quint32 ntpMiddle(quint64 ntp)
+{
+    return quint32(ntp >> 16);
+}
+
+/// Constructs an empty set of RTP statistics.
+
+QXmppRtpStatistics::QXmppRtpStatistics()
+    : packetsSent(0),
+    bytesSent(0),
+    packetsReceived(0),
+    bytesReceived(0),
+    packetsLost(0),
+    packetsMisordered(0),
+    fractionLost(0),
+    jitter(0),
+    remotePacketsLost(0),
+    remoteFractionLost(0),
+    remoteJitter(0),
+    roundTripTime(-1),
+    receiveBitrate(0),
+    sendBitrate(0)
+{
+}
+
+QXmppRtcpReporter::QXmppRtcpReporter()
+    : m_receiving(false),
+    m_remoteSsrc(0),
+    m_baseSequence(0),
+    m_maxSequence(0),
+    m_badSequence(0),
+    m_cycles(0),
+    m_received(0),
+    m_expectedPrior(0),
+    m_receivedPrior(0),
+    m_hasTransit(false),
+    m_transit(0),
+    m_jitter(0),
+    m_lastSenderReport(0),
+    m_reportBytesReceived(0),
+    m_reportBytesSent(0)
+{
+    m_clock.start();
+    m_reportTime.start();
+}
+
+void QXmppRtcpReporter::initSequence(quint16 sequence)
+{
+    m_baseSequence = sequence;
+    m_maxSequence = sequence;
+    m_badSequence = 0x10001;
+    m_cycles = 0;
+    m_received = 0;
+    m_expectedPrior = 0;
+    m_receivedPrior = 0;
+}
+
+qint64 QXmppRtcpReporter::expected() const
+{
+    return qint64(m_cycles) + m_maxSequence - m_baseSequence + 1;
+}
+
+/// Accounts for a received RTP packet, whose payload holds \a payloadSize
+/// bytes.
+
+void QXmppRtcpReporter::packetReceived(const QXmppRtpPacket &packet, int payloadSize, int clockrate)
+{
+    const quint16 maxDropout = 3000;
+    const quint16 maxMisorder = 100;
+
+    if (!m_receiving || packet.ssrc != m_remoteSsrc) {
+        m_receiving = true;
+        m_remoteSsrc = packet.ssrc;
+        m_hasTransit = false;
+        initSequence(packet.sequence);
+    } else {
+        const quint16 delta = packet.sequence - m_maxSequence;
+        if (delta < maxDropout) {
+            // in order, with permissible gap
+            if (packet.sequence < m_maxSequence)
+                m_cycles += 0x10000;
+            m_maxSequence = packet.sequence;
+        } else if (delta <= 0x10000 - maxMisorder) {
+            // a very large jump, the sender may have restarted
+            if (packet.sequence == m_badSequence) {
+                initSequence(packet.sequence);
+            } else {
+                m_badSequence = (packet.sequence + 1) & 0xffff;
+                return;
+            }
+        } else {
+            // duplicate or reordered packet
+            stats.packetsMisordered++;
+        }
+    }
+    m_received++;
+    stats.packetsReceived++;
+    stats.bytesReceived += payloadSize;
+    stats.packetsLost = qint32(qMax(qint64(0), expected() - m_received));
+
+    // interarrival jitter, using wrapping 32-bit differences as in
+    // RFC 3550 appendix A.8
+    if (clockrate > 0) {
+        const quint32 arrival = quint32(qint64(m_clock.elapsed()) * clockrate / 1000);
+        const quint32 transit = arrival - packet.stamp;
+        if (m_hasTransit) {
+            const qint32 delta = qint32(transit - m_transit);
+            m_jitter += (qAbs(delta) - m_jitter) / 16.0;
+        }
+        m_transit = transit;
+        m_hasTransit = true;
+        stats.jitter = m_jitter / clockrate;
+    }
+}
+
+/// Accounts for a sent RTP packet.
+
+void QXmppRtcpReporter::packetSent(const QXmppRtpPacket &packet)
+{
+    stats.packetsSent++;
+    stats.bytesSent += packet.payload.size();
+}
+
+/// Builds a compound RTCP packet with a sender or receiver report and
+/// a source description.
+
+QByteArray QXmppRtcpReporter::report(quint32 localSsrc, quint32 rtpStamp)
+{
+    // update bitrates
+    const int elapsed = m_reportTime.restart();
+    if (elapsed > 0) {
+        stats.receiveBitrate = (stats.bytesReceived - m_reportBytesReceived) * 8000 / elapsed;
+        stats.sendBitrate = (stats.bytesSent - m_reportBytesSent) * 8000 / elapsed;
+    }
+    const bool sending = stats.bytesSent != m_reportBytesSent;
+    m_reportBytesReceived = stats.bytesReceived;
+    m_reportBytesSent = stats.bytesSent;
+
+    QByteArray ba;
+    QDataStream stream(&ba, QIODevice::WriteOnly);
+
+    // sender or receiver report
+    const quint8 blocks = m_receiving ? 1 : 0;
+    const quint8 type = sending ? RtcpSenderReport : RtcpReceiverReport;
+    const quint16 words = (sending ? 6 : 1) + 6 * blocks;
+    stream << quint8((RTP_VERSION << 6) | blocks);
+    stream << type;
+    stream << words;
+    stream << localSsrc;
+    if (sending) {
+        const quint64 ntp = ntpTime();
+        stream << quint32(ntp >> 32);
+        stream << quint32(ntp & 0xffffffff);
+        stream << rtpStamp;
+        stream << stats.packetsSent;
+        stream << quint32(stats.bytesSent);
+    }
+    if (m_receiving) {
+        const qint64 expectedInterval = expected() - m_expectedPrior;
+        const qint64 receivedInterval = m_received - m_receivedPrior;
+        const qint64 lostInterval = expectedInterval - receivedInterval;
+        m_expectedPrior = expected();
+        m_receivedPrior = m_received;
+        stats.fractionLost = (expectedInterval && lostInterval > 0) ? (lostInterval << 8) / expectedInterval : 0;
+
+        quint32 delay = 0;
+        if (m_lastSenderReport)
+            delay = quint32(qint64(m_lastSenderReportTime.elapsed()) * 65536 / 1000);
+
+        stream << m_remoteSsrc;
+        stream << quint32((quint32(stats.fractionLost) << 24) | (quint32(qMin(stats.packetsLost, 0x7fffff)) & 0xffffff));
+        stream << quint32(m_cycles + m_maxSequence);
+        stream << quint32(m_jitter);
+        stream << m_lastSenderReport;
+        stream << delay;
+    }
+
+    // source description with a canonical name
+    const QByteArray cname = QByteArray::number(localSsrc, 16);
+    const int itemsSize = 4 + 2 + cname.size() + 1;
+    const int padding = (4 - itemsSize % 4) % 4;
+    stream << quint8((RTP_VERSION << 6) | 1);
+    stream << quint8(RtcpSourceDescription);
+    stream << quint16((itemsSize + padding) / 4);
+    stream << localSsrc;
+    stream << quint8(1) << quint8(cname.size());
+    stream.writeRawData(cname.constData(), cname.size());
+    for (int i = 0; i < 1 + padding; ++i)
+        stream << quint8(0);
+    return ba;
+}
+
+/// Parses a compound RTCP packet.
+
+void QXmppRtcpReporter::reportReceived(const QByteArray &ba, quint32 localSsrc, int clockrate)
+{
+    QDataStream stream(ba);
+    int pos = 0;
+    while (pos + 4 <= ba.size()) {
+        quint8 tmp, type;
+        quint16 words;
+        stream >> tmp >> type >> words;
+        const int length = 4 * (words + 1);
+        if ((tmp >> 6) != RTP_VERSION || pos + length > ba.size())
+            return;
+        const int count = tmp & 0x1f;
+
+        if (type == RtcpSenderReport || type == RtcpReceiverReport) {
+            quint32 ssrc;
+            stream >> ssrc;
+            int blockSize = 8;
+            if (type == RtcpSenderReport) {
+                quint32 ntpSeconds, ntpFraction, rtpStamp, packets, octets;
+                stream >> ntpSeconds >> ntpFraction >> rtpStamp >> packets >> octets;
+                m_lastSenderReport = ntpMiddle((quint64(ntpSeconds) << 32) | ntpFraction);
+                m_lastSenderReportTime.start();
+                blockSize += 20;
+            }
+            for (int i = 0; i < count && blockSize + 24 <= length; ++i) {
+                quint32 source, lost, highest, jitter, lastReport, delay;
+                stream >> source >> lost >> highest >> jitter >> lastReport >> delay;
+                blockSize += 24;
+                if (source != localSsrc)
+                    continue;
+
+                stats.remoteFractionLost = lost >> 24;
+                stats.remotePacketsLost = lost & 0xffffff;
+                if (stats.remotePacketsLost & 0x800000)
+                    stats.remotePacketsLost -= 0x1000000;
+                stats.remoteJitter = clockrate > 0 ? double(jitter) / clockrate : 0;
+                if (lastReport) {
+                    const qint32 rtt = qint32(ntpMiddle(ntpTime()) - lastReport - delay);
+                    if (rtt >= 0)
+                        stats.roundTripTime = qint64(rtt) * 1000 / 65536;
+                }
+            }
+        }
+
+        // move to the next packet
+        pos += length;
+        stream.device()->seek(pos);
+    }
+}
+
 enum CodecId {
     G711u = 0,
     GSM = 3,
@@ -230,6 +547,180 @@ QByteArray renderTone(QXmppRtpAudioChannel::Tone tone, int clockrate, quint32 cl
     return chunk;
 }
 
+QXmppRtpJitterBuffer::QXmppRtpJitterBuffer()
+    : buffering(true),
+    clockrate(0),
+    frameBytes(0),
+    jitter(0),
+    minimumDelay(0),
+    maximumDelay(0),
+    targetDelay(0),
+    readPos(0),
+    writePos(0),
+    m_mask(0),
+    m_hasStamp(false),
+    m_lastStamp(0),
+    m_hasTransit(false),
+    m_lastTransit(0)
+{
+}
+
+/// Empties the buffer and sets the delays for the given clockrate and
+/// packet size.
+
+void QXmppRtpJitterBuffer::reset(int rate, int bytes)
+{
+    clockrate = rate;
+    frameBytes = bytes;
+    minimumDelay = frameBytes * 2;
+    maximumDelay = frameBytes * 15;
+    targetDelay = frameBytes * 3;
+    jitter = 0;
+    buffering = true;
+    writePos = readPos;
+    m_hasStamp = false;
+    m_hasTransit = false;
+
+    // the ring holds the maximum delay plus the largest packet
+    qint64 capacity = 1;
+    while (capacity < maximumDelay + maxPacketSamples * SAMPLE_BYTES)
+        capacity <<= 1;
+    m_ring = QByteArray(capacity, 0);
+    m_mask = capacity - 1;
+    m_clock.start();
+}
+
+/// Returns the number of bytes buffered ahead of the read head.
+
+qint64 QXmppRtpJitterBuffer::level() const
+{
+    return writePos - readPos;
+}
+
+/// Returns the current time in units of the RTP clock.
+
+qint64 QXmppRtpJitterBuffer::arrivalTime() const
+{
+    return qint64(m_clock.elapsed()) * clockrate / 1000;
+}
+
+/// Extends a 32-bit RTP timestamp to 64 bits by counting its wraparounds,
+/// so that stream positions keep increasing across a wrap.
+///
+/// Timestamps are compared with the most recent one seen, so reordered
+/// packets on either side of a wrap are placed correctly.
+
+qint64 QXmppRtpJitterBuffer::extendStamp(quint32 stamp)
+{
+    if (!m_hasStamp) {
+        // start one cycle in, so that earlier reordered packets stay positive
+        m_hasStamp = true;
+        m_lastStamp = (Q_INT64_C(1) << 32) + stamp;
+        return m_lastStamp;
+    }
+
+    const qint64 extended = m_lastStamp + qint32(stamp - quint32(m_lastStamp));
+    if (extended > m_lastStamp)
+        m_lastStamp = extended;
+    return extended;
+}
+
+/// Updates the jitter estimate and the target delay for a packet with
+/// the given extended RTP timestamp, which arrived at the given time.
+///
+/// \sa arrivalTime(), extendStamp()
+
+void QXmppRtpJitterBuffer::packetArrived(qint64 stamp, qint64 arrival)
+{
+    if (!clockrate)
+        return;
+
+    const qint64 transit = arrival - stamp;
+    if (m_hasTransit) {
+        const qint64 delta = qAbs(transit - m_lastTransit);
+        jitter += (delta - jitter) / 16.0;
+    }
+    m_lastTransit = transit;
+    m_hasTransit = true;
+
+    const qint64 delay = frameBytes + qint64(4 * jitter) * SAMPLE_BYTES;
+    targetDelay = qBound(minimumDelay, delay, maximumDelay);
+}
+
+/// Reads \a size bytes at the read head, padding with silence if the
+/// buffer runs dry.
+
+void QXmppRtpJitterBuffer::read(char *data, qint64 size)
+{
+    const qint64 available = m_ring.isEmpty() ? 0 : qMax(qint64(0), qMin(size, level()));
+    qint64 done = 0;
+    while (done < available) {
+        const qint64 offset = (readPos + done) & m_mask;
+        const qint64 chunk = qMin(available - done, m_ring.size() - offset);
+        memcpy(data + done, m_ring.constData() + offset, chunk);
+        done += chunk;
+    }
+    if (available < size) {
+        memset(data + available, 0, size - available);
+        buffering = true;
+    }
+    readPos += size;
+    if (writePos < readPos)
+        writePos = readPos;
+}
+
+/// Moves the read head, discarding or replaying silence as needed.
+
+void QXmppRtpJitterBuffer::seek(qint64 pos)
+{
+    if (pos < readPos && !m_ring.isEmpty()) {
+        // the data before the read head was played, replace it by silence
+        const qint64 start = qMax(pos, readPos - m_ring.size());
+        QByteArray silence(readPos - start, 0);
+        copy(start, silence.constData(), silence.size());
+        if (writePos - pos > m_ring.size())
+            writePos = pos + m_ring.size();
+    }
+    readPos = pos;
+    if (writePos < readPos)
+        writePos = readPos;
+}
+
+/// Writes \a size bytes at the stream position \a pos, which must not be
+/// before the read head.
+
+void QXmppRtpJitterBuffer::write(qint64 pos, const char *data, qint64 size)
+{
+    if (m_ring.isEmpty())
+        return;
+
+    // make room by dropping the oldest data if needed
+    if (pos + size - readPos > m_ring.size())
+        readPos = pos + size - m_ring.size();
+
+    // fill any gap with silence
+    if (pos > writePos) {
+        const qint64 gap = qMin(pos - writePos, qint64(m_ring.size()));
+        QByteArray silence(gap, 0);
+        copy(pos - gap, silence.constData(), gap);
+    }
+
+    copy(pos, data, size);
+    if (pos + size > writePos)
+        writePos = pos + size;
+}
+
+void QXmppRtpJitterBuffer::copy(qint64 pos, const char *data, qint64 size)
+{
+    qint64 done = 0;
+    while (done < size) {
+        const qint64 offset = (pos + done) & m_mask;
+        const qint64 chunk = qMin(size - done, m_ring.size() - offset);
+        memcpy(m_ring.data() + offset, data + done, chunk);
+        done += chunk;
+    }
+}
+
 class QXmppRtpAudioChannelPrivate
 {
 public:
@@ -244,18 +735,15 @@ public:
     QHostAddress remoteHost;
     quint16 remotePort;
 
-    QByteArray incomingBuffer;
-    bool incomingBuffering;
+    QXmppRtpJitterBuffer incomingBuffer;
     QMap<int, QXmppCodec*> incomingCodecs;
-    int incomingMinimum;
-    int incomingMaximum;
-    // position of the head of the incoming buffer, in bytes
-    qint64 incomingPos;
-    quint16 incomingSequence;
+    QXmppCodec *incomingLastCodec;
+    QVector<qint16> incomingSamples;
 
     QByteArray outgoingBuffer;
     quint16 outgoingChunk;
     QXmppCodec *outgoingCodec;
+    QVector<qint16> outgoingSamples;
     bool outgoingMarker;
     bool outgoingPayloadNumbered;
     quint16 outgoingSequence;
@@ -267,6 +755,10 @@ public:
     quint32 outgoingSsrc;
     QXmppJinglePayloadType payloadType;
 
+    // RTCP
+    QXmppRtcpReporter rtcp;
+    QTimer *rtcpTimer;
+
 private:
     QXmppRtpAudioChannel *q;
 };
@@ -274,11 +766,7 @@ private:
 QXmppRtpAudioChannelPrivate::QXmppRtpAudioChannelPrivate(QXmppRtpAudioChannel *qq)
     : signalsEmitted(false),
     writtenSinceLastEmit(0),
-    incomingBuffering(true),
-    incomingMinimum(0),
-    incomingMaximum(0),
-    incomingPos(0),
-    incomingSequence(0),
+    incomingLastCodec(0),
     outgoingCodec(0),
     outgoingMarker(true),
     outgoingPayloadNumbered(false),
@@ -322,6 +810,9 @@ QXmppRtpAudioChannel::QXmppRtpAudioChannel(QObject *parent)
     }
     d->outgoingTimer = new QTimer(this);
     connect(d->outgoingTimer, SIGNAL(timeout()), this, SLOT(writeDatagram()));
+    d->rtcpTimer = new QTimer(this);
+    d->rtcpTimer->setInterval(rtcpInterval);
+    connect(d->rtcpTimer, SIGNAL(timeout()), this, SLOT(writeControlDatagram()));
 
     // set supported codecs
     QXmppJinglePayloadType payload;
@@ -373,7 +864,7 @@ QXmppRtpAudioChannel::~QXmppRtpAudioChannel()
 
 qint64 QXmppRtpAudioChannel::bytesAvailable() const
 {
-    return d->incomingBuffer.size();
+    return d->incomingBuffer.level();
 }
 
 /// Closes the RTP channel.
@@ -382,6 +873,7 @@ qint64 QXmppRtpAudioChannel::bytesAvailable() const
 void QXmppRtpAudioChannel::close()
 {
     d->outgoingTimer->stop();
+    d->rtcpTimer->stop();
     QIODevice::close();
 }
 
@@ -391,22 +883,20 @@ void QXmppRtpAudioChannel::close()
 
 void QXmppRtpAudioChannel::datagramReceived(const QByteArray &ba)
 {
+    // the payload is decoded right away, so it is not copied
     QXmppRtpPacket packet;
-    if (!packet.decode(ba))
+    const int payloadOffset = packet.decodeHeader(ba);
+    if (payloadOffset < 0)
         return;
+    const uchar *payload = reinterpret_cast<const uchar*>(ba.constData()) + payloadOffset;
+    const int payloadSize = ba.size() - payloadOffset;
 
 #ifdef QXMPP_DEBUG_RTP
     logReceived(packet.toString());
 #endif
 
-    // check sequence number
-#if 0
-    if (d->incomingSequence && packet.sequence != d->incomingSequence + 1)
-        warning(QString("RTP packet seq %1 is out of order, previous was %2")
-                .arg(QString::number(packet.sequence))
-                .arg(QString::number(d->incomingSequence)));
-#endif
-    d->incomingSequence = packet.sequence;
+    // account for the packet
+    d->rtcp.packetReceived(packet, payloadSize, d->payloadType.clockrate());
 
     // get or create codec
     QXmppCodec *codec = 0;
@@ -427,51 +917,64 @@ void QXmppRtpAudioChannel::datagramReceived(const QByteArray &ba)
     if (!codec)
         return;
 
-    // determine packet's position in the buffer (in bytes)
-    qint64 packetOffset = 0;
-    if (!d->incomingBuffer.isEmpty()) {
-        packetOffset = packet.stamp * SAMPLE_BYTES - d->incomingPos;
-        if (packetOffset < 0) {
+    // determine packet's position in the stream (in bytes)
+    QXmppRtpJitterBuffer &buffer = d->incomingBuffer;
+    const qint64 stamp = buffer.extendStamp(packet.stamp);
+    buffer.packetArrived(stamp, buffer.arrivalTime());
+    const qint64 packetPos = stamp * SAMPLE_BYTES;
+    if (buffer.level() > 0 || !buffer.buffering) {
+        if (packetPos < buffer.readPos) {
 #ifdef QXMPP_DEBUG_RTP_BUFFER
             warning(QString("RTP packet stamp %1 is too old, buffer start is %2")
                     .arg(QString::number(packet.stamp))
-                    .arg(QString::number(d->incomingPos)));
+                    .arg(QString::number(buffer.readPos)));
 #endif
             return;
         }
     } else {
-        d->incomingPos = packet.stamp * SAMPLE_BYTES + (d->incomingPos % SAMPLE_BYTES);
+        buffer.seek(packetPos + (buffer.readPos % SAMPLE_BYTES));
     }
 
-    // allocate space for new packet
-    // FIXME: this is wrong, we want the decoded data size!
-    qint64 packetLength = packet.payload.size();
-    if (packetOffset + packetLength > d->incomingBuffer.size())
-        d->incomingBuffer += QByteArray(packetOffset + packetLength - d->incomingBuffer.size(), 0);
-    QDataStream input(packet.payload);
-    QDataStream output(&d->incomingBuffer, QIODevice::WriteOnly);
-    output.device()->seek(packetOffset);
-    output.setByteOrder(QDataStream::LittleEndian);
-    codec->decode(input, output);
+    if (d->incomingSamples.size() < maxPacketSamples)
+        d->incomingSamples.resize(maxPacketSamples);
+
+    // conceal lost packets which have not been played yet
+    if (packetPos > buffer.writePos && d->incomingLastCodec && buffer.level() > 0) {
+        const int lostSamples = qMin(qint64(maxPacketSamples), (packetPos - buffer.writePos) / SAMPLE_BYTES);
+        const int samples = d->incomingLastCodec->concealSamples(d->incomingSamples.data(), lostSamples);
+        if (samples > 0) {
+            samplesToLittleEndian(d->incomingSamples.data(), samples);
+            buffer.write(packetPos - lostSamples * SAMPLE_BYTES,
+                         reinterpret_cast<const char*>(d->incomingSamples.constData()),
+                         samples * SAMPLE_BYTES);
+        }
+    }
+    d->incomingLastCodec = codec;
+
+    // decode packet into the buffer
+    const int samples = codec->decodeSamples(payload, payloadSize,
+        d->incomingSamples.data(), d->incomingSamples.size());
+    samplesToLittleEndian(d->incomingSamples.data(), samples);
+    buffer.write(packetPos, reinterpret_cast<const char*>(d->incomingSamples.constData()),
+                 samples * SAMPLE_BYTES);
 
     // check whether we are running late
-    if (d->incomingBuffer.size() > d->incomingMaximum)
+    const qint64 drift = 3 * buffer.frameBytes;
+    if (buffer.level() > buffer.targetDelay + drift)
     {
-        qint64 droppedSize = d->incomingBuffer.size() - d->incomingMinimum;
-        const int remainder = droppedSize % SAMPLE_BYTES;
-        if (remainder)
-            droppedSize -= remainder;
+        qint64 droppedSize = buffer.level() - buffer.targetDelay;
+        droppedSize -= droppedSize % SAMPLE_BYTES;
 #ifdef QXMPP_DEBUG_RTP_BUFFER
         warning(QString("Incoming RTP buffer is too full, dropping %1 bytes")
                 .arg(QString::number(droppedSize)));
 #endif
-        d->incomingBuffer.remove(0, droppedSize);
-        d->incomingPos += droppedSize;
+        buffer.seek(buffer.readPos + droppedSize);
     }
-    // check whether we have filled the initial buffer
-    if (d->incomingBuffer.size() >= d->incomingMinimum)
-        d->incomingBuffering = false;
-    if (!d->incomingBuffering)
+
+    // check whether we have filled the buffer up to the target delay
+    if (buffer.buffering && buffer.level() >= buffer.targetDelay)
+        buffer.buffering = false;
+    if (!buffer.buffering)
         emit readyRead();
 }
 
@@ -497,42 +1000,57 @@ QIODevice::OpenMode QXmppRtpAudioChannel::openMode() const
 
 qint64 QXmppRtpAudioChannel::readData(char * data, qint64 maxSize)
 {
+    QXmppRtpJitterBuffer &buffer = d->incomingBuffer;
+    const qint64 readPos = buffer.readPos;
+
     // if we are filling the buffer, return empty samples
-    if (d->incomingBuffering)
+    if (buffer.buffering)
     {
-        // FIXME: if we are asked for a non-integer number of samples,
-        // we will return junk on next read as we don't increment d->incomingPos
         memset(data, 0, maxSize);
-        return maxSize;
-    }
-
-    qint64 readSize = qMin(maxSize, qint64(d->incomingBuffer.size()));
-    memcpy(data, d->incomingBuffer.constData(), readSize);
-    d->incomingBuffer.remove(0, readSize);
-    if (readSize < maxSize)
-    {
+    } else {
 #ifdef QXMPP_DEBUG_RTP
-        debug(QString("QXmppRtpAudioChannel::readData missing %1 bytes").arg(QString::number(maxSize - readSize)));
+        if (buffer.level() < maxSize)
+            debug(QString("QXmppRtpAudioChannel::readData missing %1 bytes").arg(QString::number(maxSize - buffer.level())));
 #endif
-        memset(data + readSize, 0, maxSize - readSize);
+        buffer.read(data, maxSize);
     }
 
     // add local DTMF echo
     if (!d->outgoingTones.isEmpty()) {
-        const int headOffset = d->incomingPos % SAMPLE_BYTES;
+        const int headOffset = readPos % SAMPLE_BYTES;
         const int samples = (headOffset + maxSize + SAMPLE_BYTES - 1) / SAMPLE_BYTES;
         const QByteArray chunk = renderTone(
             d->outgoingTones[0].tone,
             d->payloadType.clockrate(),
-            d->incomingPos / SAMPLE_BYTES - d->outgoingTones[0].incomingStart,
+            readPos / SAMPLE_BYTES - d->outgoingTones[0].incomingStart,
             samples);
         memcpy(data, chunk.constData() + headOffset, maxSize);
     }
 
-    d->incomingPos += maxSize;
     return maxSize;
 }
 
+/// Processes an incoming RTCP packet.
+///
+/// \param ba
+
+void QXmppRtpAudioChannel::controlDatagramReceived(const QByteArray &ba)
+{
+    d->rtcp.reportReceived(ba, d->outgoingSsrc, d->payloadType.clockrate());
+}
+
+/// Returns the quality metrics for the channel's RTP streams.
+
+QXmppRtpStatistics QXmppRtpAudioChannel::statistics() const
+{
+    return d->rtcp.stats;
+}
+
+void QXmppRtpAudioChannel::writeControlDatagram()
+{
+    emit sendControlDatagram(d->rtcp.report(d->outgoingSsrc, d->outgoingStamp));
+}
+
 /// Returns the RTP channel's payload type.
 ///
 /// You can use this to determine the QAudioFormat to use with your
@@ -575,8 +1093,8 @@ void QXmppRtpAudioChannel::payloadTypesChanged()
     d->outgoingChunk = SAMPLE_BYTES * d->payloadType.ptime() * d->payloadType.clockrate() / 1000;
     d->outgoingTimer->setInterval(d->payloadType.ptime());
 
-    d->incomingMinimum = d->outgoingChunk * 5;
-    d->incomingMaximum = d->outgoingChunk * 15;
+    d->incomingBuffer.reset(d->payloadType.clockrate(), d->outgoingChunk);
+    d->rtcpTimer->start();
 
     open(QIODevice::ReadWrite | QIODevice::Unbuffered);
 }
@@ -585,7 +1103,7 @@ void QXmppRtpAudioChannel::payloadTypesChanged()
 
 qint64 QXmppRtpAudioChannel::pos() const
 {
-    return d->incomingPos;
+    return d->incomingBuffer.readPos;
 }
 
 /// Seeks in the received audio data.
@@ -597,12 +1115,7 @@ qint64 QXmppRtpAudioChannel::pos() const
 
 bool QXmppRtpAudioChannel::seek(qint64 pos)
 {
-    qint64 delta = pos - d->incomingPos;
-    if (delta < 0)
-        d->incomingBuffer.prepend(QByteArray(-delta, 0));
-    else
-        d->incomingBuffer.remove(0, delta);
-    d->incomingPos = pos;
+    d->incomingBuffer.seek(pos);
     return true;
 }
 
@@ -614,7 +1127,7 @@ void QXmppRtpAudioChannel::startTone(QXmppRtpAudioChannel::Tone tone)
 {
     ToneInfo info;
     info.tone = tone;
-    info.incomingStart = d->incomingPos / SAMPLE_BYTES;
+    info.incomingStart = d->incomingBuffer.readPos / SAMPLE_BYTES;
     info.outgoingStart = d->outgoingStamp;
     info.finished = false;
     d->outgoingTones << info;
@@ -687,6 +1200,7 @@ void QXmppRtpAudioChannel::writeDatagram()
             logSent(packet.toString());
 #endif
             emit sendDatagram(packet.encode());
+            d->rtcp.packetSent(packet);
             d->outgoingSequence++;
             d->outgoingStamp += packetTicks;
 
@@ -717,18 +1231,38 @@ void QXmppRtpAudioChannel::writeDatagram()
         packet.stamp = d->outgoingStamp;
         packet.ssrc = d->outgoingSsrc;
 
-        // encode audio chunk
-        QDataStream input(chunk);
-        input.setByteOrder(QDataStream::LittleEndian);
-        QDataStream output(&packet.payload, QIODevice::WriteOnly);
-        const qint64 packetTicks = d->outgoingCodec->encode(input, output);
+        // encode audio chunk after the space for the RTP header
+        const int samples = chunk.size() / SAMPLE_BYTES;
+        const qint16 *input = reinterpret_cast<const qint16*>(chunk.constData());
+        if (QSysInfo::ByteOrder != QSysInfo::LittleEndian) {
+            d->outgoingSamples.resize(samples);
+            memcpy(d->outgoingSamples.data(), chunk.constData(), samples * SAMPLE_BYTES);
+            samplesToLittleEndian(d->outgoingSamples.data(), samples);
+            input = d->outgoingSamples.constData();
+        }
+        const int headerSize = packet.headerSize();
+        QByteArray datagram;
+        datagram.resize(headerSize + chunk.size());
+        int size = chunk.size();
+        const qint64 packetTicks = d->outgoingCodec->encodeSamples(
+            input, samples, reinterpret_cast<uchar*>(datagram.data() + headerSize), &size);
+        if (!packetTicks) {
+            // the chunk is lost, but the timestamp moves on
+            warning("Could not encode outgoing audio");
+            d->outgoingStamp += samples;
+        } else {
+            datagram.resize(headerSize + size);
+            packet.writeHeader(datagram.data());
+            packet.payload = QByteArray::fromRawData(datagram.constData() + headerSize, size);
 
 #ifdef QXMPP_DEBUG_RTP
-        logSent(packet.toString());
+            logSent(packet.toString());
 #endif
-        emit sendDatagram(packet.encode());
-        d->outgoingSequence++;
-        d->outgoingStamp += packetTicks;
+            emit sendDatagram(datagram);
+            d->rtcp.packetSent(packet);
+            d->outgoingSequence++;
+            d->outgoingStamp += packetTicks;
+        }
     }
 
     // queue signals
@@ -742,7 +1276,8 @@ void QXmppRtpAudioChannel::writeDatagram()
 /** Constructs a null video frame.
  */
 QXmppVideoFrame::QXmppVideoFrame()
-    : m_bytesPerLine(0),
+    : m_bits(0),
+    m_bytesPerLine(0),
     m_height(0),
     m_mappedBytes(0),
     m_pixelFormat(Format_Invalid),
@@ -751,6 +1286,9 @@ QXmppVideoFrame::QXmppVideoFrame()
 }
 
 /** Constructs a video frame of the given pixel format and size in pixels.
+ *
+ * The frame data is explicitly shared: copies of the frame refer to the
+ * same buffer.
  *
  * @param bytes
  * @param size
@@ -765,16 +1303,42 @@ QXmppVideoFrame::QXmppVideoFrame(int bytes, const QSize &size, int bytesPerLine,
     m_width(size.width())
 {
     m_data.resize(bytes);
+    m_bits = (uchar*)m_data.data();
 }
 
+/** Constructs a video frame which wraps existing data without copying it.
+ *
+ * The frame does not take ownership of \a data, which must remain valid
+ * for as long as the frame or any of its copies are in use.
+ *
+ * @param data
+ * @param bytes
+ * @param size
+ * @param bytesPerLine
+ * @param format
+ */
+QXmppVideoFrame::QXmppVideoFrame(uchar *data, int bytes, const QSize &size, int bytesPerLine, PixelFormat format)
+    : m_bits(data),
+    m_bytesPerLine(bytesPerLine),
+    m_height(size.height()),
+    m_mappedBytes(bytes),
+    m_pixelFormat(format),
+    m_width(size.width())
+{
+}
+
+/** Returns a pointer to the start of the frame data buffer.
+ */
 uchar *QXmppVideoFrame::bits()
 {
-    return (uchar*)m_data.data();
+    return m_bits;
 }
 
+/** Returns a pointer to the start of the frame data buffer.
+ */
 const uchar *QXmppVideoFrame::bits() const
 {
-    return (const uchar*)m_data.constData();
+    return m_bits;
 }
 
 /** Returns the number of bytes in a scan line.
@@ -828,6 +1392,61 @@ int QXmppVideoFrame::width() const
     return m_width;
 }
 
+/** Constructs a pool which keeps at most \a maximumFrames buffers.
+ *
+ * @param maximumFrames
+ */
+QXmppVideoFramePool::QXmppVideoFramePool(int maximumFrames)
+    : m_maximumFrames(maximumFrames)
+{
+}
+
+/** Returns a frame of the given pixel format and size in pixels.
+ *
+ * If a pooled buffer with matching properties is no longer referenced by
+ * any other frame it is reused, otherwise a new buffer is allocated.
+ *
+ * @param bytes
+ * @param size
+ * @param bytesPerLine
+ * @param format
+ */
+QXmppVideoFrame QXmppVideoFramePool::frame(int bytes, const QSize &size, int bytesPerLine, QXmppVideoFrame::PixelFormat format)
+{
+    int unused = -1;
+    for (int i = 0; i < m_frames.size(); ++i) {
+        const QXmppVideoFrame &pooled = m_frames.at(i);
+        if (!pooled.m_data.isDetached())
+            continue;
+        if (pooled.m_mappedBytes == bytes &&
+            pooled.m_bytesPerLine == bytesPerLine &&
+            pooled.m_pixelFormat == format &&
+            pooled.size() == size)
+            return pooled;
+        if (unused < 0)
+            unused = i;
+    }
+
+    // evict a buffer of a different format if the pool is full
+    if (m_frames.size() >= m_maximumFrames && unused >= 0)
+        m_frames.removeAt(unused);
+
+    QXmppVideoFrame frame(bytes, size, bytesPerLine, format);
+    if (m_frames.size() < m_maximumFrames)
+        m_frames << frame;
+    return frame;
+}
+
+/** Releases all the buffers held by the pool.
+ */
+void QXmppVideoFramePool::clear()
+{
+    m_frames.clear();
+}
+
+// clockrate of video RTP streams
+static const int videoClockrate = 90000;
+
 class QXmppRtpVideoChannelPrivate
 {
 public:
@@ -842,6 +1461,10 @@ public:
     quint16 outgoingSequence;
     quint32 outgoingStamp;
     quint32 outgoingSsrc;
+
+    // RTCP
+    QXmppRtcpReporter rtcp;
+    QTimer *rtcpTimer;
 };
 
 QXmppRtpVideoChannelPrivate::QXmppRtpVideoChannelPrivate()
@@ -858,6 +1481,9 @@ QXmppRtpVideoChannel::QXmppRtpVideoChannel(QObject *parent)
     : QXmppLoggable(parent)
 {
     d = new QXmppRtpVideoChannelPrivate;
+    d->rtcpTimer = new QTimer(this);
+    d->rtcpTimer->setInterval(rtcpInterval);
+    connect(d->rtcpTimer, SIGNAL(timeout()), this, SLOT(writeControlDatagram()));
     d->outgoingFormat.setFrameRate(15.0);
     d->outgoingFormat.setFrameSize(QSize(320, 240));
     d->outgoingFormat.setPixelFormat(QXmppVideoFrame::Format_YUYV);
@@ -890,6 +1516,7 @@ QXmppRtpVideoChannel::~QXmppRtpVideoChannel()
 
 void QXmppRtpVideoChannel::close()
 {
+    d->rtcpTimer->stop();
 }
 
 /// Processes an incoming RTP video packet.
@@ -905,6 +1532,7 @@ void QXmppRtpVideoChannel::datagramReceived(const QByteArray &ba)
 #ifdef QXMPP_DEBUG_RTP
     logReceived(packet.toString());
 #endif
+    d->rtcp.packetReceived(packet, packet.payload.size(), videoClockrate);
 
     // get codec
     QXmppVideoDecoder *decoder = d->decoders.value(packet.type);
@@ -979,6 +1607,29 @@ void QXmppRtpVideoChannel::payloadTypesChanged()
             break;
         }
     }
+
+    d->rtcpTimer->start();
+}
+
+/// Processes an incoming RTCP packet.
+///
+/// \param ba
+
+void QXmppRtpVideoChannel::controlDatagramReceived(const QByteArray &ba)
+{
+    d->rtcp.reportReceived(ba, d->outgoingSsrc, videoClockrate);
+}
+
+/// Returns the quality metrics for the channel's RTP streams.
+
+QXmppRtpStatistics QXmppRtpVideoChannel::statistics() const
+{
+    return d->rtcp.stats;
+}
+
+void QXmppRtpVideoChannel::writeControlDatagram()
+{
+    emit sendControlDatagram(d->rtcp.report(d->outgoingSsrc, d->outgoingStamp));
 }
 
 QList<QXmppVideoFrame> QXmppRtpVideoChannel::readFrames()
@@ -1008,6 +1659,7 @@ void QXmppRtpVideoChannel::writeFrame(const QXmppVideoFrame &frame)
         logSent(packet.toString());
 #endif
         emit sendDatagram(packet.encode());
+        d->rtcp.packetSent(packet);
     }
     d->outgoingStamp += 1;
 }
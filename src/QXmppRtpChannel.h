@@ -37,14 +37,21 @@ class QXmppRtpVideoChannelPrivate;
 
 /// \brief The QXmppRtpPacket class represents an RTP packet.
 ///
+/// The header fields of a decoded packet are read in place, and its payload
+/// is an independent copy of the end of the datagram, which can safely be
+/// kept or shared once the packet and the datagram are gone.
 
 class QXmppRtpPacket
 {
 public:
     bool decode(const QByteArray &ba);
+    int decodeHeader(const QByteArray &ba);
     QByteArray encode() const;
     QString toString() const;
 
+    int headerSize() const;
+    void writeHeader(char *data) const;
+
     quint8 version;
     bool marker;
     quint8 type;
@@ -55,6 +62,47 @@ public:
     QByteArray payload;
 };
 
+/// \brief The QXmppRtpStatistics class holds quality metrics for the RTP
+/// streams of a channel.
+///
+/// The "remote" values are those reported by the other party in its RTCP
+/// receiver reports, and describe how our stream reaches it.
+
+class QXmppRtpStatistics
+{
+public:
+    QXmppRtpStatistics();
+
+    /// Number of RTP packets sent.
+    quint32 packetsSent;
+    /// Number of payload bytes sent.
+    quint64 bytesSent;
+    /// Number of RTP packets received.
+    quint32 packetsReceived;
+    /// Number of payload bytes received.
+    quint64 bytesReceived;
+    /// Cumulative number of incoming packets lost.
+    qint32 packetsLost;
+    /// Number of incoming packets which were duplicated or out of order.
+    quint32 packetsMisordered;
+    /// Fraction of incoming packets lost during the last report interval, out of 256.
+    quint8 fractionLost;
+    /// Interarrival jitter of the incoming stream, in seconds.
+    double jitter;
+    /// Cumulative number of outgoing packets lost.
+    qint32 remotePacketsLost;
+    /// Fraction of outgoing packets lost during the last report interval, out of 256.
+    quint8 remoteFractionLost;
+    /// Interarrival jitter of the outgoing stream, in seconds.
+    double remoteJitter;
+    /// Round-trip time, in milliseconds, or -1 if unknown.
+    int roundTripTime;
+    /// Incoming bitrate over the last report interval, in bits per second.
+    int receiveBitrate;
+    /// Outgoing bitrate over the last report interval, in bits per second.
+    int sendBitrate;
+};
+
 class QXmppRtpChannel
 {
 public:
@@ -109,6 +157,7 @@ public:
     ~QXmppRtpAudioChannel();
 
     QXmppJinglePayloadType payloadType() const;
+    QXmppRtpStatistics statistics() const;
 
     /// \cond
     qint64 bytesAvailable() const;
@@ -123,10 +172,14 @@ signals:
     /// \brief This signal is emitted when a datagram needs to be sent.
     void sendDatagram(const QByteArray &ba);
 
+    /// \brief This signal is emitted when an RTCP datagram needs to be sent.
+    void sendControlDatagram(const QByteArray &ba);
+
     /// \brief This signal is emitted to send logging messages.
     void logMessage(QXmppLogger::MessageType type, const QString &msg);
 
 public slots:
+    void controlDatagramReceived(const QByteArray &ba);
     void datagramReceived(const QByteArray &ba);
     void startTone(QXmppRtpAudioChannel::Tone tone);
     void stopTone(QXmppRtpAudioChannel::Tone tone);
@@ -160,6 +213,7 @@ protected:
 
 private slots:
     void emitSignals();
+    void writeControlDatagram();
     void writeDatagram();
 
 private:
@@ -182,6 +236,7 @@ public:
 
     QXmppVideoFrame();
     QXmppVideoFrame(int bytes, const QSize &size, int bytesPerLine, PixelFormat format);
+    QXmppVideoFrame(uchar *data, int bytes, const QSize &size, int bytesPerLine, PixelFormat format);
     uchar *bits();
     const uchar *bits() const;
     int bytesPerLine() const;
@@ -193,12 +248,35 @@ public:
     int width() const;
 
 private:
+    uchar *m_bits;
     int m_bytesPerLine;
     QByteArray m_data;
     int m_height;
     int m_mappedBytes;
     PixelFormat m_pixelFormat;
     int m_width;
+    friend class QXmppVideoFramePool;
+};
+
+/// \brief The QXmppVideoFramePool class recycles the buffers of video frames.
+///
+/// A buffer handed out by frame() returns to the pool once the last
+/// QXmppVideoFrame referencing it is destroyed, so that decoding a stream
+/// of frames with constant format and size does not allocate memory.
+///
+/// \note THIS API IS NOT FINALIZED YET
+
+class QXmppVideoFramePool
+{
+public:
+    QXmppVideoFramePool(int maximumFrames = 4);
+
+    QXmppVideoFrame frame(int bytes, const QSize &size, int bytesPerLine, QXmppVideoFrame::PixelFormat format);
+    void clear();
+
+private:
+    QList<QXmppVideoFrame> m_frames;
+    int m_maximumFrames;
 };
 
 class QXmppVideoFormat
@@ -267,16 +345,25 @@ public:
     QIODevice::OpenMode openMode() const;
     void close();
 
+    QXmppRtpStatistics statistics() const;
+
 signals:
     /// \brief This signal is emitted when a datagram needs to be sent.
     void sendDatagram(const QByteArray &ba);
 
+    /// \brief This signal is emitted when an RTCP datagram needs to be sent.
+    void sendControlDatagram(const QByteArray &ba);
+
 public slots:
+    void controlDatagramReceived(const QByteArray &ba);
     void datagramReceived(const QByteArray &ba);
 
 protected:
     void payloadTypesChanged();
 
+private slots:
+    void writeControlDatagram();
+
 private:
     friend class QXmppRtpVideoChannelPrivate;
     QXmppRtpVideoChannelPrivate * d;
@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2008-2011 The QXmpp developers
+ *
+ * Author:
+ *  Jeremy Lainé
+ *
+ * Source:
+ *  http://code.google.com/p/qxmpp
+ *
+ * This file is a part of QXmpp library.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+#ifndef QXMPPRTPCHANNEL_P_H
+#define QXMPPRTPCHANNEL_P_H
+
+#include <QByteArray>
+#include <QTime>
+
+#include "QXmppRtpChannel.h"
+
+/// \brief The QXmppRtcpReporter class keeps track of the packets of an RTP
+/// session, and generates and parses the RTCP sender and receiver reports.
+///
+/// Sequence number and jitter accounting follow RFC 3550, appendix A.
+
+class QXmppRtcpReporter
+{
+public:
+    QXmppRtcpReporter();
+
+    void packetReceived(const QXmppRtpPacket &packet, int payloadSize, int clockrate);
+    void packetSent(const QXmppRtpPacket &packet);
+    QByteArray report(quint32 localSsrc, quint32 rtpStamp);
+    void reportReceived(const QByteArray &ba, quint32 localSsrc, int clockrate);
+
+    QXmppRtpStatistics stats;
+
+private:
+    void initSequence(quint16 sequence);
+    qint64 expected() const;
+
+    // incoming stream
+    bool m_receiving;
+    quint32 m_remoteSsrc;
+    quint16 m_baseSequence;
+    quint16 m_maxSequence;
+    quint32 m_badSequence;
+    quint32 m_cycles;
+    quint32 m_received;
+    qint64 m_expectedPrior;
+    quint32 m_receivedPrior;
+    bool m_hasTransit;
+    quint32 m_transit;
+    double m_jitter;
+    QTime m_clock;
+
+    // last sender report received
+    quint32 m_lastSenderReport;
+    QTime m_lastSenderReportTime;
+
+    // bitrate measurement
+    QTime m_reportTime;
+    quint64 m_reportBytesReceived;
+    quint64 m_reportBytesSent;
+};
+
+/// \brief The QXmppRtpJitterBuffer class holds decoded audio until it is
+/// played.
+///
+/// Audio is stored in a ring indexed by the position in the stream, in
+/// bytes, so that packets are written where their timestamp says they
+/// belong, whatever order they arrive in, and playback never moves memory.
+///
+/// The playback delay follows the interarrival jitter measured as in
+/// RFC 3550, within the minimum and maximum delays.
+
+class QXmppRtpJitterBuffer
+{
+public:
+    QXmppRtpJitterBuffer();
+
+    void reset(int clockrate, int frameBytes);
+    qint64 level() const;
+    qint64 arrivalTime() const;
+    qint64 extendStamp(quint32 stamp);
+    void packetArrived(qint64 stamp, qint64 arrival);
+    void read(char *data, qint64 size);
+    void seek(qint64 pos);
+    void write(qint64 pos, const char *data, qint64 size);
+
+    // whether playback waits for the target delay to be reached
+    bool buffering;
+    int clockrate;
+    // size of a packet, in bytes
+    int frameBytes;
+    // interarrival jitter, in samples
+    double jitter;
+    // playback delays, in bytes
+    qint64 minimumDelay;
+    qint64 maximumDelay;
+    qint64 targetDelay;
+    // stream positions of the read and write heads, in bytes
+    qint64 readPos;
+    qint64 writePos;
+
+private:
+    void copy(qint64 pos, const char *data, qint64 size);
+
+    QByteArray m_ring;
+    qint64 m_mask;
+    QTime m_clock;
+    bool m_hasStamp;
+    qint64 m_lastStamp;
+    bool m_hasTransit;
+    qint64 m_lastTransit;
+};
+
+#endif
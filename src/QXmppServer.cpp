@@ -21,23 +21,32 @@
  *
  */
 
+#include <QDateTime>
 #include <QDomElement>
 #include <QFileInfo>
 #include <QPluginLoader>
 #include <QSslCertificate>
 #include <QSslKey>
 #include <QSslSocket>
+#include <QThread>
+#include <QTimer>
+#if QT_VERSION >= 0x040700
+#include <QElapsedTimer>
+#endif
 
 #include "QXmppConstants.h"
 #include "QXmppDialback.h"
 #include "QXmppIq.h"
 #include "QXmppIncomingClient.h"
 #include "QXmppIncomingServer.h"
+#include "QXmppMessage.h"
 #include "QXmppOutgoingServer.h"
 #include "QXmppPresence.h"
 #include "QXmppServer.h"
 #include "QXmppServerExtension.h"
 #include "QXmppServerPlugin.h"
+#include "QXmppServer_p.h"
+#include "QXmppStanzaKey_p.h"
 #include "QXmppUtils.h"
 
 // Core plugins
@@ -48,13 +57,56 @@ Q_IMPORT_PLUGIN(mod_stats)
 Q_IMPORT_PLUGIN(mod_time)
 Q_IMPORT_PLUGIN(mod_version)
 
+// Time in milliseconds a stream may stay above its high watermark
+static const int slowStreamTimeout = 30000;
+
+/// Returns a time in milliseconds used to expire queued stanzas.
+///
+/// The clock is monotonic if Qt and the platform support it, so that
+/// changes to the system time do not expire queued stanzas early or late.
+
+static qint64 queueClock()
+{
+#if QT_VERSION >= 0x040700
+    QElapsedTimer timer;
+    timer.start();
+    return timer.msecsSinceReference();
+#else
+    return qint64(QDateTime::currentDateTime().toTime_t()) * 1000;
+#endif
+}
+
+/// Stanzas waiting for a stream to become connected.
+
+class QXmppStreamQueue
+{
+public:
+    QXmppStreamQueue() : bytes(0) {}
+
+    QList<QByteArray> stanzas;
+    QList<qint64> stamps;
+    int bytes;
+};
+
 class QXmppServerPrivate
 {
 public:
     QXmppServerPrivate(QXmppServer *qq);
     QXmppOutgoingServer *connectToDomain(const QString &domain);
     QList<QXmppStream*> getStreams(const QString &to);
+    void addClientRoute(QXmppIncomingClient *stream);
+    void removeClientRoute(QXmppIncomingClient *stream);
+    void routeData(const QList<QXmppStream*> &streams, const QByteArray &data);
+    bool sendData(QXmppStream *stream, const QByteArray &data);
+    void sendPacket(QXmppStream *stream, const QXmppPacket &packet);
+    void disconnectStream(QXmppStream *stream);
+    void enqueue(QXmppStream *stream, const QByteArray &data);
+    QList<QByteArray> takeQueue(QXmppStream *stream);
+    void bounce(const QList<QByteArray> &stanzas, QXmppStanza::Error::Condition condition);
+    void bounceElement(const QDomElement &element, QXmppStanza::Error::Condition condition);
+    void broadcastPresence(QXmppStream *stream, const QDomElement &element, const QStringList &recipients);
     void handleStanza(QXmppStream *stream, const QDomElement &element);
+    void addIncomingClient(QXmppIncomingClient *stream);
     void loadExtensions(QXmppServer *server);
     QStringList presenceSubscribers(const QString &jid);
     QStringList presenceSubscriptions(const QString &jid);
@@ -66,20 +118,45 @@ public:
 
     QString domain;
     QList<QXmppServerExtension*> extensions;
+    QXmppStanzaHandlers<QXmppServerExtension> stanzaHandlers;
     QMap<QString, QMap<QString, QXmppPresence> > presences;
     QMap<QString, QSet<QString> > subscribers;
     QXmppLogger *logger;
     QXmppPasswordChecker *passwordChecker;
 
-    // client-to-server
+    // client-to-server, the streams may belong to worker threads so they
+    // are only driven through their proxy, and their JID is the one
+    // reported by the proxy when they were bound
     QXmppSslServer *serverForClients;
-    QList<QXmppIncomingClient*> incomingClients;
+    QHash<QXmppStream*, QXmppIncomingClientProxy*> incomingClients;
+    QHash<QXmppStream*, QString> clientJids;
+
+    // settings for new client streams, copied when listening starts as
+    // the streams may be created by worker threads
+    QString clientDomain;
+    QXmppPasswordChecker *clientPasswordChecker;
 
     // server-to-server
-    QList<QXmppIncomingServer*> incomingServers;
-    QList<QXmppOutgoingServer*> outgoingServers;
+    QSet<QXmppIncomingServer*> incomingServers;
+    QSet<QXmppOutgoingServer*> outgoingServers;
     QXmppSslServer *serverForServers;
-    QMap<QXmppStream*, QList<QByteArray> > queues;
+
+    // queues for streams which are not connected
+    QHash<QXmppStream*, QXmppStreamQueue> queues;
+    int queueLimit;
+    int totalQueueLimit;
+    QXmppServer::OverflowPolicy overflowPolicy;
+    int queueTimeout;
+    QTimer *queueTimer;
+    int queuedBytes;
+    int queueDropped;
+    int queueExpired;
+    int queueRejected;
+
+    // routing table
+    QHash<QString, QXmppIncomingClient*> clientsByJid;
+    QHash<QString, QList<QXmppIncomingClient*> > clientsByBareJid;
+    QHash<QString, QXmppOutgoingServer*> outgoingByDomain;
 
 private:
     bool loaded;
@@ -90,6 +167,16 @@ private:
 QXmppServerPrivate::QXmppServerPrivate(QXmppServer *qq)
     : logger(0),
     passwordChecker(0),
+    clientPasswordChecker(0),
+    queueLimit(1024 * 1024),
+    totalQueueLimit(64 * 1024 * 1024),
+    overflowPolicy(QXmppServer::BounceOverflow),
+    queueTimeout(120),
+    queueTimer(0),
+    queuedBytes(0),
+    queueDropped(0),
+    queueExpired(0),
+    queueRejected(0),
     loaded(false),
     started(false),
     q(qq)
@@ -116,8 +203,11 @@ QXmppOutgoingServer* QXmppServerPrivate::connectToDomain(const QString &toDomain
                              q, SLOT(slotStreamDisconnected()));
     Q_UNUSED(check);
 
+    new QXmppStreamThrottle(stream, slowStreamTimeout);
+
     // add stream
-    outgoingServers.append(stream);
+    outgoingServers.insert(stream);
+    outgoingByDomain.insert(toDomain, stream);
     emit q->streamAdded(stream);
 
     // connect to remote server
@@ -138,8 +228,11 @@ QList<QXmppStream*> QXmppServerPrivate::getStreams(const QString &to)
     const QString toDomain = jidToDomain(to);
     if (toDomain == domain) {
         // look for a client connection
-        foreach (QXmppIncomingClient *conn, incomingClients) {
-            if (conn->jid() == to || jidToBareJid(conn->jid()) == to)
+        QXmppIncomingClient *conn = clientsByJid.value(to);
+        if (conn) {
+            found << conn;
+        } else {
+            foreach (conn, clientsByBareJid.value(to))
                 found << conn;
         }
     } else if (toDomain.endsWith("." + domain)) {
@@ -147,12 +240,9 @@ QList<QXmppStream*> QXmppServerPrivate::getStreams(const QString &to)
         return found;
     } else {
         // look for an outgoing S2S connection
-        foreach (QXmppOutgoingServer *conn, outgoingServers) {
-            if (conn->remoteDomain() == toDomain) {
-                found << conn;
-                break;
-            }
-        }
+        QXmppOutgoingServer *conn = outgoingByDomain.value(toDomain);
+        if (conn)
+            found << conn;
 
         // if we did not find an outgoing server,
         // we need to establish the S2S connection
@@ -162,6 +252,284 @@ QList<QXmppStream*> QXmppServerPrivate::getStreams(const QString &to)
     return found;
 }
 
+/// Makes a bound client stream reachable by its full and bare JIDs.
+///
+/// \param stream
+
+void QXmppServerPrivate::addClientRoute(QXmppIncomingClient *stream)
+{
+    const QString jid = clientJids.value(stream);
+    if (clientsByJid.value(jid) == stream)
+        return;
+    clientsByJid.insert(jid, stream);
+    clientsByBareJid[jidToBareJid(jid)] << stream;
+}
+
+/// Removes a client stream from the routing table.
+///
+/// \param stream
+
+void QXmppServerPrivate::removeClientRoute(QXmppIncomingClient *stream)
+{
+    const QString jid = clientJids.value(stream);
+    if (clientsByJid.value(jid) != stream)
+        return;
+    clientsByJid.remove(jid);
+
+    const QString bareJid = jidToBareJid(jid);
+    QHash<QString, QList<QXmppIncomingClient*> >::iterator it = clientsByBareJid.find(bareJid);
+    if (it != clientsByBareJid.end()) {
+        it.value().removeAll(stream);
+        if (it.value().isEmpty())
+            clientsByBareJid.erase(it);
+    }
+}
+
+/// Sends serialized stanza data to the given streams, queueing it for the
+/// streams which are not connected yet.
+///
+/// \param streams
+/// \param data
+
+void QXmppServerPrivate::routeData(const QList<QXmppStream*> &streams, const QByteArray &data)
+{
+    foreach (QXmppStream *conn, streams) {
+        if (!sendData(conn, data))
+            enqueue(conn, data);
+    }
+}
+
+/// Sends serialized stanza data to the given stream.
+///
+/// Client streams are sent the data through their proxy, from their own
+/// thread. Returns false if the stream is not connected.
+///
+/// \param stream
+/// \param data
+
+bool QXmppServerPrivate::sendData(QXmppStream *stream, const QByteArray &data)
+{
+    QXmppIncomingClientProxy *proxy = incomingClients.value(stream);
+    if (proxy) {
+        if (!clientJids.contains(stream))
+            return false;
+        QMetaObject::invokeMethod(proxy, "sendData", Qt::AutoConnection,
+                                  Q_ARG(QByteArray, data));
+        return true;
+    }
+    return stream->isConnected() && stream->sendData(data);
+}
+
+/// Sends a packet to the given stream.
+///
+/// \param stream
+/// \param packet
+
+void QXmppServerPrivate::sendPacket(QXmppStream *stream, const QXmppPacket &packet)
+{
+    QByteArray data;
+    QXmlStreamWriter xmlStream(&data);
+    packet.toXml(&xmlStream);
+    sendData(stream, data);
+}
+
+/// Closes the given stream.
+///
+/// \param stream
+
+void QXmppServerPrivate::disconnectStream(QXmppStream *stream)
+{
+    QXmppIncomingClientProxy *proxy = incomingClients.value(stream);
+    if (proxy)
+        QMetaObject::invokeMethod(proxy, "disconnectFromHost", Qt::AutoConnection);
+    else
+        stream->disconnectFromHost();
+}
+
+/// Queues serialized stanza data until the given stream is connected.
+///
+/// If the stream's queue or the total size of all queues would exceed
+/// their limits, the overflow policy decides whether the oldest stanzas
+/// queued for the stream are discarded. If there still is not enough
+/// room, the stanza is bounced.
+///
+/// \param stream
+/// \param data
+
+void QXmppServerPrivate::enqueue(QXmppStream *stream, const QByteArray &data)
+{
+    const int size = data.size();
+    QHash<QXmppStream*, QXmppStreamQueue>::iterator it = queues.find(stream);
+    if (it == queues.end())
+        it = queues.insert(stream, QXmppStreamQueue());
+    QXmppStreamQueue &queue = it.value();
+
+    if (overflowPolicy == QXmppServer::DropOldestOverflow) {
+        while (!queue.stanzas.isEmpty() &&
+               (queue.bytes + size > queueLimit || queuedBytes + size > totalQueueLimit)) {
+            const int oldest = queue.stanzas.takeFirst().size();
+            queue.stamps.removeFirst();
+            queue.bytes -= oldest;
+            queuedBytes -= oldest;
+            queueDropped++;
+        }
+    }
+
+    if (queue.bytes + size > queueLimit || queuedBytes + size > totalQueueLimit) {
+        if (queue.stanzas.isEmpty())
+            queues.erase(it);
+        queueRejected++;
+        bounce(QList<QByteArray>() << data, QXmppStanza::Error::ResourceConstraint);
+        return;
+    }
+
+    queue.stanzas << data;
+    queue.stamps << queueClock();
+    queue.bytes += size;
+    queuedBytes += size;
+    if (!queueTimer->isActive())
+        queueTimer->start();
+}
+
+/// Removes the queue for the given stream and returns the stanzas it held.
+///
+/// \param stream
+
+QList<QByteArray> QXmppServerPrivate::takeQueue(QXmppStream *stream)
+{
+    QList<QByteArray> stanzas;
+    QHash<QXmppStream*, QXmppStreamQueue>::iterator it = queues.find(stream);
+    if (it != queues.end()) {
+        stanzas = it.value().stanzas;
+        queuedBytes -= it.value().bytes;
+        queues.erase(it);
+    }
+    return stanzas;
+}
+
+/// Replies to the senders of undeliverable stanzas with an error.
+///
+/// The serialized stanzas are parsed together into a single document.
+///
+/// \param stanzas
+/// \param condition
+
+void QXmppServerPrivate::bounce(const QList<QByteArray> &stanzas, QXmppStanza::Error::Condition condition)
+{
+    if (stanzas.isEmpty())
+        return;
+
+    QByteArray data("<stanzas>");
+    foreach (const QByteArray &stanza, stanzas)
+        data += stanza;
+    data += "</stanzas>";
+
+    QDomDocument doc;
+    if (doc.setContent(data)) {
+        QDomElement element = doc.documentElement().firstChildElement();
+        while (!element.isNull()) {
+            bounceElement(element, condition);
+            element = element.nextSiblingElement();
+        }
+    } else if (stanzas.size() > 1) {
+        // do not let one invalid stanza prevent the others from bouncing
+        foreach (const QByteArray &stanza, stanzas)
+            bounce(QList<QByteArray>() << stanza, condition);
+    }
+}
+
+/// Replies to the sender of an undeliverable stanza with an error.
+///
+/// Only messages and IQ requests are bounced, other stanzas are silently
+/// discarded.
+///
+/// \param element
+/// \param condition
+
+void QXmppServerPrivate::bounceElement(const QDomElement &element, QXmppStanza::Error::Condition condition)
+{
+    if (element.attribute("type") == "error" || element.attribute("from").isEmpty())
+        return;
+
+    const QXmppStanza::Error error(QXmppStanza::Error::Wait, condition);
+    if (element.tagName() == "iq") {
+        QXmppIq request;
+        request.parse(element);
+        if (request.type() != QXmppIq::Get && request.type() != QXmppIq::Set)
+            return;
+
+        QXmppIq response(QXmppIq::Error);
+        response.setId(request.id());
+        response.setFrom(request.to());
+        response.setTo(request.from());
+        response.setError(error);
+        q->sendPacket(response);
+    } else if (element.tagName() == "message") {
+        QXmppMessage message;
+        message.parse(element);
+
+        const QString from = message.from();
+        message.setFrom(message.to());
+        message.setTo(from);
+        message.setType(QXmppMessage::Error);
+        message.setError(error);
+        q->sendPacket(message);
+    }
+}
+
+/// Sends a copy of a presence stanza to each of the given recipients.
+///
+/// The presence is serialized once, and only the "to" attribute is
+/// written for each recipient. The copies are routed directly, they are
+/// not dispatched to the server extensions again.
+///
+/// \param stream
+/// \param element
+/// \param recipients
+
+void QXmppServerPrivate::broadcastPresence(QXmppStream *stream, const QDomElement &element, const QStringList &recipients)
+{
+    if (recipients.isEmpty())
+        return;
+
+    // serialize the presence without its recipient
+    QDomElement copy = element.cloneNode(true).toElement();
+    copy.removeAttribute("to");
+    QByteArray data;
+    QXmlStreamWriter xmlStream(&data);
+    const QStringList omitNamespaces = QStringList() << ns_client << ns_server;
+    helperToXmlAddDomElement(&xmlStream, copy, omitNamespaces);
+
+    static const QByteArray presenceStart("<presence");
+    if (!data.startsWith(presenceStart)) {
+        // this should not happen, fall back to handling each copy
+        foreach (const QString &recipient, recipients) {
+            copy.setAttribute("to", recipient);
+            handleStanza(stream, copy);
+        }
+        return;
+    }
+    const QByteArray head = data.left(presenceStart.size()) + " to=\"";
+    const QByteArray tail = "\"" + data.mid(presenceStart.size());
+
+    const bool available = element.attribute("type").isEmpty();
+    const QString from = element.attribute("from");
+    foreach (const QString &recipient, recipients) {
+        // keep track of the recipients, as for directed presence
+        if (available)
+            subscribers[from].insert(recipient);
+        else
+            subscribers[from].remove(recipient);
+
+        QByteArray value = recipient.toUtf8();
+        value.replace('&', "&amp;");
+        value.replace('<', "&lt;");
+        value.replace('>', "&gt;");
+        value.replace('"', "&quot;");
+        routeData(getStreams(recipient), head + value + tail);
+    }
+}
+
 /// Handles an incoming XML element.
 ///
 /// \param stream
@@ -170,7 +538,7 @@ QList<QXmppStream*> QXmppServerPrivate::getStreams(const QString &to)
 void QXmppServerPrivate::handleStanza(QXmppStream *stream, const QDomElement &element)
 {
     // try extensions
-    foreach (QXmppServerExtension *extension, extensions)
+    foreach (QXmppServerExtension *extension, stanzaHandlers.find(extensions, element))
         if (extension->handleStanza(stream, element))
             return;
 
@@ -195,14 +563,9 @@ void QXmppServerPrivate::handleStanza(QXmppStream *stream, const QDomElement &el
                 }
 
                 // broadcast it to subscribers
-                foreach (const QString &subscriber, presenceSubscribers(from)) {
-                    // avoid loop
-                    if (subscriber == to)
-                        continue;
-                    QDomElement changed(element);
-                    changed.setAttribute("to", subscriber);
-                    handleStanza(stream, changed);
-                }
+                QStringList recipients = presenceSubscribers(from);
+                recipients.removeAll(to);
+                broadcastPresence(stream, element, recipients);
 
                 // get presences from subscriptions
                 if (isInitial) {
@@ -236,7 +599,7 @@ void QXmppServerPrivate::handleStanza(QXmppStream *stream, const QDomElement &el
                 QXmppStanza::Error error(QXmppStanza::Error::Cancel,
                     QXmppStanza::Error::FeatureNotImplemented);
                 response.setError(error);
-                stream->sendPacket(response);
+                sendPacket(stream, response);
             }
         }
 
@@ -266,7 +629,7 @@ void QXmppServerPrivate::handleStanza(QXmppStream *stream, const QDomElement &el
             QXmppStanza::Error error(QXmppStanza::Error::Cancel,
                 QXmppStanza::Error::ServiceUnavailable);
             response.setError(error);
-            stream->sendPacket(response);
+            sendPacket(stream, response);
         }
     }
 }
@@ -370,10 +733,22 @@ void QXmppServerPrivate::stopExtensions()
 QXmppServer::QXmppServer(QObject *parent)
     : QXmppLoggable(parent)
 {
+    qRegisterMetaType<QDomElement>("QDomElement");
+    qRegisterMetaType<QXmppIncomingClientProxy*>("QXmppIncomingClientProxy*");
+
     d = new QXmppServerPrivate(this);
+    d->queueTimer = new QTimer(this);
+    d->queueTimer->setInterval(1000);
+    bool check = connect(d->queueTimer, SIGNAL(timeout()),
+                         this, SLOT(slotExpireQueues()));
+    Q_ASSERT(check);
+
     d->serverForClients = new QXmppSslServer(this);
-    bool check = connect(d->serverForClients, SIGNAL(newConnection(QSslSocket*)),
-                         this, SLOT(slotClientConnection(QSslSocket*)));
+    // client connections may be handed out by worker threads, in which case
+    // the stream is created in the worker thread
+    check = connect(d->serverForClients, SIGNAL(newConnection(QSslSocket*)),
+                    this, SLOT(slotClientConnection(QSslSocket*)),
+                    Qt::DirectConnection);
     Q_ASSERT(check);
 
     d->serverForServers = new QXmppSslServer(this);
@@ -388,6 +763,14 @@ QXmppServer::QXmppServer(QObject *parent)
 QXmppServer::~QXmppServer()
 {
     close();
+
+    // streams belonging to worker threads are deleted by their thread
+    // when it is stopped
+    foreach (QXmppStream *stream, d->incomingClients.keys()) {
+        if (stream->thread() != thread())
+            stream->deleteLater();
+    }
+    d->serverForClients->setThreadCount(0);
     delete d;
 }
 
@@ -403,6 +786,7 @@ void QXmppServer::addExtension(QXmppServerExtension *extension)
     extension->setParent(this);
     extension->setServer(this);
     d->extensions << extension;
+    d->stanzaHandlers.invalidate();
 }
 
 /// Returns the list of loaded extensions.
@@ -450,18 +834,16 @@ QXmppLogger *QXmppServer::logger()
 
 /// Sets the QXmppLogger associated with the server.
 ///
+/// Streams handled by worker threads follow the settings of the logger
+/// which was set when they were created, so the logger should be set
+/// before listening.
+///
 /// \param logger
 
 void QXmppServer::setLogger(QXmppLogger *logger)
 {
-    if (d->logger)
-        QObject::disconnect(this, SIGNAL(logMessage(QXmppLogger::MessageType, QString)),
-                   d->logger, SLOT(log(QXmppLogger::MessageType, QString)));
-    d->logger = logger;
     d->logger = logger;
-    if (d->logger)
-        connect(this, SIGNAL(logMessage(QXmppLogger::MessageType,QString)),
-                d->logger, SLOT(log(QXmppLogger::MessageType,QString)));
+    attachLogger(d->logger);
 }
 
 /// Returns the password checker used to verify client credentials.
@@ -527,6 +909,137 @@ void QXmppServer::setPrivateKey(const QString &path)
     d->serverForServers->setPrivateKey(key);
 }
 
+/// Returns the number of worker threads handling client connections.
+///
+
+int QXmppServer::threadCount() const
+{
+    return d->serverForClients->threadCount();
+}
+
+/// Sets the number of worker threads handling client connections.
+///
+/// By default, client connections are handled in the server's thread. If
+/// \a count is greater than zero, new client connections are distributed
+/// among \a count worker threads, each running its own event loop. The
+/// sockets, TLS encryption and XML parsing of client streams then run in
+/// the worker threads, while stanzas are routed and handled by extensions
+/// in the server's thread.
+///
+/// When using worker threads, the password checker is invoked from the
+/// worker threads and must be thread-safe. Extensions are handed streams
+/// which belong to another thread, so they should reply through
+/// sendPacket() rather than by calling the stream.
+///
+/// You should call this method before listening for connections. The
+/// domain and password checker used for client connections are those set
+/// when listenForClients() is called.
+///
+/// \param count
+
+void QXmppServer::setThreadCount(int count)
+{
+    d->serverForClients->setThreadCount(count);
+}
+
+/// Returns the maximum number of bytes queued for a stream which is not
+/// connected.
+///
+
+int QXmppServer::queueLimit() const
+{
+    return d->queueLimit;
+}
+
+/// Sets the maximum number of bytes queued for a stream which is not
+/// connected, for instance an outgoing server-to-server stream which is
+/// still being established.
+///
+/// The default limit is 1MB.
+///
+/// \param bytes
+
+void QXmppServer::setQueueLimit(int bytes)
+{
+    d->queueLimit = bytes;
+}
+
+/// Returns the maximum number of bytes queued for all streams.
+///
+
+int QXmppServer::totalQueueLimit() const
+{
+    return d->totalQueueLimit;
+}
+
+/// Sets the maximum number of bytes queued for all streams.
+///
+/// The default limit is 64MB.
+///
+/// \param bytes
+
+void QXmppServer::setTotalQueueLimit(int bytes)
+{
+    d->totalQueueLimit = bytes;
+}
+
+/// Returns what happens to stanzas which do not fit in a queue.
+///
+
+QXmppServer::OverflowPolicy QXmppServer::overflowPolicy() const
+{
+    return d->overflowPolicy;
+}
+
+/// Sets what happens to stanzas which do not fit in a queue.
+///
+/// \param policy
+
+void QXmppServer::setOverflowPolicy(QXmppServer::OverflowPolicy policy)
+{
+    d->overflowPolicy = policy;
+}
+
+/// Returns the number of seconds after which queued stanzas expire.
+///
+
+int QXmppServer::queueTimeout() const
+{
+    return d->queueTimeout;
+}
+
+/// Sets the number of seconds after which queued stanzas expire. Expired
+/// stanzas are bounced.
+///
+/// The default timeout is 120 seconds.
+///
+/// \param secs
+
+void QXmppServer::setQueueTimeout(int secs)
+{
+    d->queueTimeout = secs;
+}
+
+/// Returns statistics about the stanzas queued for streams which are not
+/// connected.
+///
+
+QVariantMap QXmppServer::queueStatistics() const
+{
+    int stanzas = 0;
+    foreach (const QXmppStreamQueue &queue, d->queues)
+        stanzas += queue.stanzas.size();
+
+    QVariantMap stats;
+    stats["queued-streams"] = d->queues.size();
+    stats["queued-stanzas"] = stanzas;
+    stats["queued-bytes"] = d->queuedBytes;
+    stats["queue-dropped"] = d->queueDropped;
+    stats["queue-expired"] = d->queueExpired;
+    stats["queue-rejected"] = d->queueRejected;
+    return stats;
+}
+
 /// Listen for incoming XMPP client connections.
 ///
 /// \param address
@@ -534,6 +1047,8 @@ void QXmppServer::setPrivateKey(const QString &path)
 
 bool QXmppServer::listenForClients(const QHostAddress &address, quint16 port)
 {
+    d->clientDomain = d->domain;
+    d->clientPasswordChecker = d->passwordChecker;
     if (!d->serverForClients->listen(address, port))
     {
         d->warning(QString("Could not start listening for C2S on port %1").arg(QString::number(port)));
@@ -559,8 +1074,8 @@ void QXmppServer::close()
     d->stopExtensions();
 
     // close XMPP streams
-    foreach (QXmppIncomingClient *stream, d->incomingClients)
-       stream->disconnectFromHost();
+    foreach (QXmppStream *stream, d->incomingClients.keys())
+       d->disconnectStream(stream);
     foreach (QXmppIncomingServer *stream, d->incomingServers)
        stream->disconnectFromHost();
     foreach (QXmppOutgoingServer *stream, d->outgoingServers)
@@ -592,22 +1107,18 @@ bool QXmppServer::listenForServers(const QHostAddress &address, quint16 port)
 
 bool QXmppServer::sendElement(const QDomElement &element)
 {
-    bool sent = false;
-    const QString to = element.attribute("to");
-    foreach (QXmppStream *conn, d->getStreams(to)) {
-        if (conn->isConnected() && conn->sendElement(element)) {
-            sent = true;
-        } else {
-            // queue packet
-            QByteArray data;
-            QXmlStreamWriter xmlStream(&data);
-            const QStringList omitNamespaces = QStringList() << ns_client << ns_server;
-            helperToXmlAddDomElement(&xmlStream, element, omitNamespaces);
-            d->queues[conn] << data;
-            sent = true;
-        }
-    }
-    return sent;
+    const QList<QXmppStream*> streams = d->getStreams(element.attribute("to"));
+    if (streams.isEmpty())
+        return false;
+
+    // serialize the stanza once for all the recipient streams
+    QByteArray data;
+    QXmlStreamWriter xmlStream(&data);
+    const QStringList omitNamespaces = QStringList() << ns_client << ns_server;
+    helperToXmlAddDomElement(&xmlStream, element, omitNamespaces);
+
+    d->routeData(streams, data);
+    return true;
 }
 
 /// Route an XMPP packet.
@@ -616,20 +1127,17 @@ bool QXmppServer::sendElement(const QDomElement &element)
 
 bool QXmppServer::sendPacket(const QXmppStanza &packet)
 {
-    bool sent = false;
-    foreach (QXmppStream *conn, d->getStreams(packet.to())) {
-        if (conn->isConnected() && conn->sendPacket(packet)) {
-            sent = true;
-        } else {
-            // queue packet
-            QByteArray data;
-            QXmlStreamWriter xmlStream(&data);
-            packet.toXml(&xmlStream);
-            d->queues[conn] << data;
-            sent = true;
-        }
-    }
-    return sent;
+    const QList<QXmppStream*> streams = d->getStreams(packet.to());
+    if (streams.isEmpty())
+        return false;
+
+    // serialize the packet once for all the recipient streams
+    QByteArray data;
+    QXmlStreamWriter xmlStream(&data);
+    packet.toXml(&xmlStream);
+
+    d->routeData(streams, data);
+    return true;
 }
 
 /// Add a new incoming client stream.
@@ -639,34 +1147,72 @@ bool QXmppServer::sendPacket(const QXmppStanza &packet)
 void QXmppServer::addIncomingClient(QXmppIncomingClient *stream)
 {
     stream->setPasswordChecker(d->passwordChecker);
+    d->addIncomingClient(stream);
+}
 
-    bool check = connect(stream, SIGNAL(connected()),
-                         this, SLOT(slotStreamConnected()));
+/// Connects a new incoming client stream to the server, from the stream's
+/// thread.
+///
+/// \param stream
+
+void QXmppServerPrivate::addIncomingClient(QXmppIncomingClient *stream)
+{
+    QXmppIncomingClientProxy *proxy = new QXmppIncomingClientProxy(stream);
+    new QXmppStreamThrottle(stream, slowStreamTimeout);
+
+    bool check = QObject::connect(proxy, SIGNAL(connected(QString)),
+                                  q, SLOT(slotClientConnected(QString)));
     Q_ASSERT(check);
 
-    check = connect(stream, SIGNAL(disconnected()),
-                    this, SLOT(slotStreamDisconnected()));
+    check = QObject::connect(proxy, SIGNAL(disconnected()),
+                             q, SLOT(slotClientDisconnected()));
     Q_ASSERT(check);
 
-    check = connect(stream, SIGNAL(elementReceived(QDomElement)),
-                    this, SLOT(slotElementReceived(QDomElement)));
+    check = QObject::connect(proxy, SIGNAL(sendFailed(QByteArray)),
+                             q, SLOT(slotClientSendFailed(QByteArray)));
     Q_ASSERT(check);
 
-    // add stream
-    d->incomingClients.append(stream);
+    check = QObject::connect(stream, SIGNAL(elementReceived(QDomElement)),
+                             q, SLOT(slotElementReceived(QDomElement)));
+    Q_ASSERT(check);
+
+    Q_UNUSED(check);
+
+    // relay the log messages of streams which are not our children
+    if (!stream->parent())
+        q->relayLogMessages(stream);
+
+    // add stream, from our thread if it belongs to a worker thread
+    QMetaObject::invokeMethod(q, "slotClientAdded", Qt::AutoConnection,
+                              Q_ARG(QXmppIncomingClientProxy*, proxy));
+}
+
+/// Registers a new incoming client stream.
+///
+/// \param proxy
+
+void QXmppServer::slotClientAdded(QXmppIncomingClientProxy *proxy)
+{
+    QXmppIncomingClient *stream = proxy->stream();
+    d->incomingClients.insert(stream, proxy);
     emit streamAdded(stream);
 }
 
 /// Handle a new incoming TCP connection from a client.
 ///
+/// If the socket was created by a worker thread, we are running in that
+/// thread, so only the settings copied when listening started are used.
+///
 /// \param socket
 
 void QXmppServer::slotClientConnection(QSslSocket *socket)
 {
-    QXmppIncomingClient *stream = new QXmppIncomingClient(socket, d->domain, this);
+    QObject *parent = (socket->thread() == thread()) ? this : 0;
+    QXmppIncomingClient *stream = new QXmppIncomingClient(socket, d->clientDomain, parent);
     stream->setInactivityTimeout(120);
+    stream->setPasswordChecker(d->clientPasswordChecker);
     socket->setParent(stream);
-    addIncomingClient(stream);
+    d->addIncomingClient(stream);
 }
 
 void QXmppServer::slotDialbackRequestReceived(const QXmppDialback &dialback)
@@ -678,11 +1224,9 @@ void QXmppServer::slotDialbackRequestReceived(const QXmppDialback &dialback)
     if (dialback.command() == QXmppDialback::Verify)
     {
         // handle a verify request
-        foreach (QXmppOutgoingServer *out, d->outgoingServers)
+        QXmppOutgoingServer *out = d->outgoingByDomain.value(dialback.from());
+        if (out)
         {
-            if (out->remoteDomain() != dialback.from())
-                continue;
-
             bool isValid = dialback.key() == out->localStreamKey();
             QXmppDialback verify;
             verify.setCommand(QXmppDialback::Verify);
@@ -691,7 +1235,6 @@ void QXmppServer::slotDialbackRequestReceived(const QXmppDialback &dialback)
             verify.setFrom(d->domain);
             verify.setType(isValid ? "valid" : "invalid");
             stream->sendPacket(verify);
-            return;
         }
     }
 }
@@ -731,8 +1274,10 @@ void QXmppServer::slotServerConnection(QSslSocket *socket)
                     this, SLOT(slotElementReceived(QDomElement)));
     Q_ASSERT(check);
 
+    new QXmppStreamThrottle(stream, slowStreamTimeout);
+
     // add stream
-    d->incomingServers.append(stream);
+    d->incomingServers.insert(stream);
     emit streamAdded(stream);
 }
 
@@ -745,80 +1290,148 @@ void QXmppServer::slotStreamConnected()
     if (!stream)
         return;
 
-    // handle incoming clients
-    QXmppIncomingClient *client = qobject_cast<QXmppIncomingClient *>(stream);
-    if (client)
+    // flush queue
+    foreach (const QByteArray &data, d->takeQueue(stream))
+        stream->sendData(data);
+
+    // emit signal
+    emit streamConnected(stream);
+}
+
+/// Handle a client stream being bound to a JID.
+///
+/// \param jid
+
+void QXmppServer::slotClientConnected(const QString &jid)
+{
+    QXmppIncomingClientProxy *proxy = qobject_cast<QXmppIncomingClientProxy*>(sender());
+    if (!proxy || d->incomingClients.value(proxy->stream()) != proxy)
+        return;
+    QXmppIncomingClient *client = proxy->stream();
+
+    // check whether the connection conflicts with another one
+    QXmppIncomingClient *conn = d->clientsByJid.value(jid);
+    if (conn && conn != client)
     {
-        // check whether the connection conflicts with another one
-        foreach (QXmppIncomingClient *conn, d->incomingClients)
-        {
-            if (conn != client && conn->jid() == client->jid())
-            {
-                conn->sendData("<stream:error><conflict xmlns='urn:ietf:params:xml:ns:xmpp-streams'/><text xmlns='urn:ietf:params:xml:ns:xmpp-streams'>Replaced by new connection</text></stream:error>");
-                conn->disconnectFromHost();
-            }
-        }
+        d->removeClientRoute(conn);
+        d->sendData(conn, "<stream:error><conflict xmlns='urn:ietf:params:xml:ns:xmpp-streams'/><text xmlns='urn:ietf:params:xml:ns:xmpp-streams'>Replaced by new connection</text></stream:error>");
+        d->disconnectStream(conn);
     }
 
+    // make the client reachable
+    d->clientJids.insert(client, jid);
+    d->addClientRoute(client);
+
     // flush queue
-    if (d->queues.contains(stream))
-    {
-        foreach (const QByteArray &data, d->queues[stream])
-            stream->sendData(data);
-        d->queues.remove(stream);
-    }
+    foreach (const QByteArray &data, d->takeQueue(client))
+        d->sendData(client, data);
 
     // emit signal
-    emit streamConnected(stream);
+    emit streamConnected(client);
 }
 
-/// Handle a stream disconnection.
+/// Bounces the stanzas which could not be sent to a client stream.
 ///
+/// \param data
 
-void QXmppServer::slotStreamDisconnected()
+void QXmppServer::slotClientSendFailed(const QByteArray &data)
 {
-    // handle clients
-    QXmppIncomingClient *stream = qobject_cast<QXmppIncomingClient *>(sender());
-    if (stream && d->incomingClients.contains(stream))
-    {
-        const QString jid = stream->jid();
-
-        // check the user exited cleanly
-        if (!jid.isEmpty()) {
-            QDomDocument doc;
-            QDomElement presence = doc.createElement("presence");
-            presence.setAttribute("from", stream->jid());
-            presence.setAttribute("type", "unavailable");
-
-            if (d->presences.value(jidToBareJid(jid)).contains(jid)) {
-                // the client had sent an initial available presence but did
-                // not sent an unavailable presence, synthesize it
-                presence.setAttribute("to", d->domain);
-                d->handleStanza(stream, presence);
-            } else {
-                // synthesize unavailable presence to directed presence receivers
-                const QSet<QString> recipients = d->subscribers.value(jid);
-                foreach (const QString &recipient, recipients) {
-                    presence.setAttribute("to", recipient);
-                    d->handleStanza(stream, presence);
-                }
-            }
+    d->bounce(data, QXmppStanza::Error::RecipientUnavailable);
+}
+
+/// Bounces the queued stanzas which have expired.
+///
+
+void QXmppServer::slotExpireQueues()
+{
+    const qint64 now = queueClock();
+    const qint64 timeout = qint64(d->queueTimeout) * 1000;
+    QList<QPair<QXmppStanza::Error::Condition, QList<QByteArray> > > expired;
+
+    QHash<QXmppStream*, QXmppStreamQueue>::iterator it = d->queues.begin();
+    while (it != d->queues.end()) {
+        QXmppStreamQueue &queue = it.value();
+        QList<QByteArray> stanzas;
+        while (!queue.stamps.isEmpty() && now - queue.stamps.first() >= timeout) {
+            const QByteArray data = queue.stanzas.takeFirst();
+            queue.stamps.removeFirst();
+            queue.bytes -= data.size();
+            d->queuedBytes -= data.size();
+            d->queueExpired++;
+            stanzas << data;
+        }
+        if (!stanzas.isEmpty()) {
+            const QXmppStanza::Error::Condition condition = qobject_cast<QXmppOutgoingServer*>(it.key()) ?
+                QXmppStanza::Error::RemoteServerTimeout : QXmppStanza::Error::RecipientUnavailable;
+            expired << qMakePair(condition, stanzas);
         }
+        if (queue.stanzas.isEmpty())
+            it = d->queues.erase(it);
+        else
+            ++it;
+    }
+    if (d->queues.isEmpty())
+        d->queueTimer->stop();
+
+    // bouncing may queue new stanzas, so do it once the queues are updated
+    for (int i = 0; i < expired.size(); ++i)
+        d->bounce(expired[i].second, expired[i].first);
+}
 
-        // remove stream
-        d->incomingClients.removeAll(stream);
-        d->queues.remove(stream);
-        emit streamRemoved(stream);
-        stream->deleteLater();
+/// Handle a client stream disconnection.
+///
+
+void QXmppServer::slotClientDisconnected()
+{
+    QXmppIncomingClientProxy *proxy = qobject_cast<QXmppIncomingClientProxy*>(sender());
+    if (!proxy || d->incomingClients.value(proxy->stream()) != proxy)
         return;
+    QXmppIncomingClient *stream = proxy->stream();
+
+    const QString jid = d->clientJids.value(stream);
+    d->removeClientRoute(stream);
+    d->clientJids.remove(stream);
+
+    // check the user exited cleanly
+    if (!jid.isEmpty()) {
+        QDomDocument doc;
+        QDomElement presence = doc.createElement("presence");
+        presence.setAttribute("from", jid);
+        presence.setAttribute("type", "unavailable");
+
+        if (d->presences.value(jidToBareJid(jid)).contains(jid)) {
+            // the client had sent an initial available presence but did
+            // not sent an unavailable presence, synthesize it
+            presence.setAttribute("to", d->domain);
+            d->handleStanza(stream, presence);
+        } else {
+            // synthesize unavailable presence to directed presence receivers
+            const QSet<QString> recipients = d->subscribers.value(jid);
+            foreach (const QString &recipient, recipients) {
+                presence.setAttribute("to", recipient);
+                d->handleStanza(stream, presence);
+            }
+        }
     }
 
+    // remove stream
+    d->incomingClients.remove(stream);
+    d->bounce(d->takeQueue(stream), QXmppStanza::Error::RecipientUnavailable);
+    emit streamRemoved(stream);
+    stream->deleteLater();
+}
+
+/// Handle a stream disconnection.
+///
+
+void QXmppServer::slotStreamDisconnected()
+{
     // handle incoming streams
     QXmppIncomingServer *incoming = qobject_cast<QXmppIncomingServer *>(sender());
     if (incoming && d->incomingServers.contains(incoming))
     {
-        d->incomingServers.removeAll(incoming);
-        d->queues.remove(incoming);
+        d->incomingServers.remove(incoming);
+        d->bounce(d->takeQueue(incoming), QXmppStanza::Error::RemoteServerNotFound);
         emit streamRemoved(incoming);
         incoming->deleteLater();
         return;
@@ -828,22 +1441,181 @@ void QXmppServer::slotStreamDisconnected()
     QXmppOutgoingServer *outgoing = qobject_cast<QXmppOutgoingServer *>(sender());
     if (outgoing && d->outgoingServers.contains(outgoing))
     {
-        d->outgoingServers.removeAll(outgoing);
-        d->queues.remove(outgoing);
+        if (d->outgoingByDomain.value(outgoing->remoteDomain()) == outgoing)
+            d->outgoingByDomain.remove(outgoing->remoteDomain());
+        d->outgoingServers.remove(outgoing);
+        d->bounce(d->takeQueue(outgoing), QXmppStanza::Error::RemoteServerNotFound);
         emit streamRemoved(outgoing);
         outgoing->deleteLater();
         return;
     }
 }
 
+/// Constructs a proxy for the given client stream.
+///
+/// \param stream
+
+QXmppIncomingClientProxy::QXmppIncomingClientProxy(QXmppIncomingClient *stream)
+    : QObject(stream),
+    m_stream(stream)
+{
+    bool check = connect(stream, SIGNAL(connected()),
+                         this, SLOT(slotConnected()));
+    Q_ASSERT(check);
+
+    check = connect(stream, SIGNAL(disconnected()),
+                    this, SIGNAL(disconnected()));
+    Q_ASSERT(check);
+    Q_UNUSED(check);
+}
+
+/// Returns the client stream.
+///
+
+QXmppIncomingClient *QXmppIncomingClientProxy::stream() const
+{
+    return m_stream;
+}
+
+/// Closes the stream.
+
+void QXmppIncomingClientProxy::disconnectFromHost()
+{
+    m_stream->disconnectFromHost();
+}
+
+/// Sends raw data to the stream, the sendFailed() signal is emitted if
+/// the stream is no longer connected.
+///
+/// \param data
+
+void QXmppIncomingClientProxy::sendData(const QByteArray &data)
+{
+    if (!m_stream->sendData(data))
+        emit sendFailed(data);
+}
+
+void QXmppIncomingClientProxy::slotConnected()
+{
+    emit connected(m_stream->jid());
+}
+
+/// Constructs a throttle for the given stream.
+///
+/// \param stream
+/// \param timeout The time in milliseconds the stream may stay above its high watermark.
+
+QXmppStreamThrottle::QXmppStreamThrottle(QXmppStream *stream, int timeout)
+    : QXmppLoggable(stream),
+    m_stream(stream)
+{
+    m_timer = new QTimer(this);
+    m_timer->setInterval(timeout);
+    m_timer->setSingleShot(true);
+
+    bool check = connect(m_timer, SIGNAL(timeout()),
+                         this, SLOT(slotTimeout()));
+    Q_ASSERT(check);
+
+    check = connect(stream, SIGNAL(highWatermarkReached()),
+                    this, SLOT(slotHighWatermark()));
+    Q_ASSERT(check);
+
+    check = connect(stream, SIGNAL(lowWatermarkReached()),
+                    this, SLOT(slotLowWatermark()));
+    Q_ASSERT(check);
+
+    check = connect(stream, SIGNAL(disconnected()),
+                    this, SLOT(slotLowWatermark()));
+    Q_ASSERT(check);
+    Q_UNUSED(check);
+}
+
+void QXmppStreamThrottle::slotHighWatermark()
+{
+    m_stream->setReadingPaused(true);
+    m_timer->start();
+}
+
+void QXmppStreamThrottle::slotLowWatermark()
+{
+    m_timer->stop();
+    m_stream->setReadingPaused(false);
+}
+
+void QXmppStreamThrottle::slotTimeout()
+{
+    warning(QString("Closing stream which did not read %1 bytes").arg(
+        QString::number(m_stream->bytesToWrite())));
+    m_stream->disconnectFromHost();
+}
+
 class QXmppSslServerPrivate
 {
 public:
+    QXmppSslServerPrivate();
+    QSslSocket *createSocket(int socketDescriptor);
+    void stopThreads();
+
     QList<QSslCertificate> caCertificates;
     QSslCertificate localCertificate;
     QSslKey privateKey;
+
+    // worker threads
+    QList<QThread*> threads;
+    QList<QXmppSslServerWorker*> workers;
+    int nextWorker;
 };
 
+QXmppSslServerPrivate::QXmppSslServerPrivate()
+    : nextWorker(0)
+{
+}
+
+/// Creates an SSL socket for the given descriptor in the current thread.
+///
+/// \param socketDescriptor
+
+QSslSocket *QXmppSslServerPrivate::createSocket(int socketDescriptor)
+{
+    QSslSocket *socket = new QSslSocket;
+    socket->setSocketDescriptor(socketDescriptor);
+    if (!localCertificate.isNull() && !privateKey.isNull())
+    {
+        socket->setProtocol(QSsl::AnyProtocol);
+        socket->addCaCertificates(caCertificates);
+        socket->setLocalCertificate(localCertificate);
+        socket->setPrivateKey(privateKey);
+    }
+    return socket;
+}
+
+/// Stops the worker threads and waits for them to finish.
+
+void QXmppSslServerPrivate::stopThreads()
+{
+    foreach (QXmppSslServerWorker *worker, workers)
+        worker->deleteLater();
+    workers.clear();
+
+    foreach (QThread *thread, threads) {
+        thread->quit();
+        thread->wait();
+        delete thread;
+    }
+    threads.clear();
+    nextWorker = 0;
+}
+
+/// Creates a socket for an incoming connection in the worker's thread.
+///
+/// \param socketDescriptor
+
+void QXmppSslServerWorker::addConnection(int socketDescriptor)
+{
+    emit newConnection(serverPrivate->createSocket(socketDescriptor));
+}
+
 /// Constructs a new SSL server instance.
 ///
 /// \param parent
@@ -859,21 +1631,22 @@ QXmppSslServer::QXmppSslServer(QObject *parent)
 
 QXmppSslServer::~QXmppSslServer()
 {
+    d->stopThreads();
     delete d;
 }
 
 void QXmppSslServer::incomingConnection(int socketDescriptor)
 {
-    QSslSocket *socket = new QSslSocket;
-    socket->setSocketDescriptor(socketDescriptor);
-    if (!d->localCertificate.isNull() && !d->privateKey.isNull())
-    {
-        socket->setProtocol(QSsl::AnyProtocol);
-        socket->addCaCertificates(d->caCertificates);
-        socket->setLocalCertificate(d->localCertificate);
-        socket->setPrivateKey(d->privateKey);
+    if (!d->workers.isEmpty()) {
+        // hand the connection over to the next worker thread
+        QXmppSslServerWorker *worker = d->workers.at(d->nextWorker);
+        d->nextWorker = (d->nextWorker + 1) % d->workers.size();
+        QMetaObject::invokeMethod(worker, "addConnection", Qt::QueuedConnection,
+                                  Q_ARG(int, socketDescriptor));
+        return;
     }
-    emit newConnection(socket);
+
+    emit newConnection(d->createSocket(socketDescriptor));
 }
 
 /// Adds the given certificates to the CA certificate database to be used
@@ -904,3 +1677,37 @@ void QXmppSslServer::setPrivateKey(const QSslKey &key)
     d->privateKey = key;
 }
 
+/// Returns the number of worker threads handling incoming connections.
+///
+
+int QXmppSslServer::threadCount() const
+{
+    return d->threads.size();
+}
+
+/// Sets the number of worker threads handling incoming connections.
+///
+/// If \a count is greater than zero, the sockets for incoming connections
+/// are created in the worker threads in a round-robin fashion, and the
+/// newConnection() signal is emitted from the worker thread.
+///
+/// \param count
+
+void QXmppSslServer::setThreadCount(int count)
+{
+    d->stopThreads();
+    for (int i = 0; i < count; ++i) {
+        QXmppSslServerWorker *worker = new QXmppSslServerWorker(d);
+        QThread *thread = new QThread(this);
+        worker->moveToThread(thread);
+        bool check = connect(worker, SIGNAL(newConnection(QSslSocket*)),
+                             this, SIGNAL(newConnection(QSslSocket*)),
+                             Qt::DirectConnection);
+        Q_ASSERT(check);
+        Q_UNUSED(check);
+        thread->start();
+
+        d->threads << thread;
+        d->workers << worker;
+    }
+}
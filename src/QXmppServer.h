@@ -25,6 +25,7 @@
 #define QXMPPSERVER_H
 
 #include <QTcpServer>
+#include <QVariant>
 
 #include "QXmppLogger.h"
 
@@ -35,6 +36,7 @@ class QSslSocket;
 
 class QXmppDialback;
 class QXmppIncomingClient;
+class QXmppIncomingClientProxy;
 class QXmppOutgoingServer;
 class QXmppPasswordChecker;
 class QXmppPresence;
@@ -60,6 +62,14 @@ class QXmppServer : public QXmppLoggable
     Q_OBJECT
 
 public:
+    /// This enum describes what happens to a stanza which does not fit in
+    /// the queue of a stream which is not connected.
+    enum OverflowPolicy
+    {
+        BounceOverflow = 0,     ///< The new stanza is bounced with an error
+        DropOldestOverflow = 1, ///< The oldest stanzas queued for the stream are discarded
+    };
+
     QXmppServer(QObject *parent = 0);
     ~QXmppServer();
 
@@ -79,6 +89,23 @@ public:
     void setLocalCertificate(const QString &path);
     void setPrivateKey(const QString &path);
 
+    int threadCount() const;
+    void setThreadCount(int count);
+
+    int queueLimit() const;
+    void setQueueLimit(int bytes);
+
+    int totalQueueLimit() const;
+    void setTotalQueueLimit(int bytes);
+
+    QXmppServer::OverflowPolicy overflowPolicy() const;
+    void setOverflowPolicy(QXmppServer::OverflowPolicy policy);
+
+    int queueTimeout() const;
+    void setQueueTimeout(int secs);
+
+    QVariantMap queueStatistics() const;
+
     void close();
     bool listenForClients(const QHostAddress &address = QHostAddress::Any, quint16 port = 5222);
     bool listenForServers(const QHostAddress &address = QHostAddress::Any, quint16 port = 5269);
@@ -100,9 +127,14 @@ signals:
     void streamRemoved(QXmppStream *stream);
 
 private slots:
+    void slotClientAdded(QXmppIncomingClientProxy *proxy);
+    void slotClientConnected(const QString &jid);
     void slotClientConnection(QSslSocket *socket);
+    void slotClientDisconnected();
+    void slotClientSendFailed(const QByteArray &data);
     void slotDialbackRequestReceived(const QXmppDialback &dialback);
     void slotElementReceived(const QDomElement &element);
+    void slotExpireQueues();
     void slotServerConnection(QSslSocket *socket);
     void slotStreamConnected();
     void slotStreamDisconnected();
@@ -129,6 +161,9 @@ public:
     void setLocalCertificate(const QSslCertificate &certificate);
     void setPrivateKey(const QSslKey &key);
 
+    int threadCount() const;
+    void setThreadCount(int count);
+
 signals:
     /// This signal is emitted when a new connection is established.
     void newConnection(QSslSocket *socket);
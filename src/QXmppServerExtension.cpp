@@ -88,6 +88,17 @@ bool QXmppServerExtension::handleStanza(QXmppStream *stream, const QDomElement &
     return false;
 }
 
+/// Returns the keys of the stanzas handled by this extension.
+///
+/// handleStanza() will only be called for stanzas which have a child
+/// element matching one of the keys. The default implementation returns
+/// an empty list, which means handleStanza() is called for every stanza.
+
+QList<QXmppStanzaKey> QXmppServerExtension::stanzaKeys() const
+{
+    return QList<QXmppStanzaKey>();
+}
+
 /// Returns the list of subscribers for the given JID.
 ///
 /// \param jid
@@ -27,6 +27,7 @@
 #include <QVariant>
 
 #include "QXmppLogger.h"
+#include "QXmppStanzaKey.h"
 
 class QDomElement;
 class QStringList;
@@ -57,6 +58,7 @@ public:
     virtual QStringList discoveryFeatures() const;
     virtual QStringList discoveryItems() const;
     virtual bool handleStanza(QXmppStream *stream, const QDomElement &stanza);
+    virtual QList<QXmppStanzaKey> stanzaKeys() const;
     virtual QStringList presenceSubscribers(const QString &jid);
     virtual QStringList presenceSubscriptions(const QString &jid);
 
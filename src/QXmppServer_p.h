@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2008-2011 The QXmpp developers
+ *
+ * Author:
+ *  Jeremy Lainé
+ *
+ * Source:
+ *  http://code.google.com/p/qxmpp
+ *
+ * This file is a part of QXmpp library.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+
+#ifndef QXMPPSERVER_P_H
+#define QXMPPSERVER_P_H
+
+#include "QXmppLogger.h"
+
+class QSslSocket;
+class QTimer;
+class QXmppIncomingClient;
+class QXmppSslServerPrivate;
+class QXmppStream;
+
+/// \brief The QXmppIncomingClientProxy class lets the server drive a client
+/// stream which may belong to a worker thread.
+///
+/// The proxy lives in the stream's thread. It reports the stream's state
+/// to the server through signals and performs the server's requests from
+/// the stream's thread, so that the server never calls the stream directly.
+
+class QXmppIncomingClientProxy : public QObject
+{
+    Q_OBJECT
+
+public:
+    QXmppIncomingClientProxy(QXmppIncomingClient *stream);
+    QXmppIncomingClient *stream() const;
+
+signals:
+    /// This signal is emitted when the stream is bound to \a jid.
+    void connected(const QString &jid);
+
+    /// This signal is emitted when the stream is disconnected.
+    void disconnected();
+
+    /// This signal is emitted when \a data could not be sent.
+    void sendFailed(const QByteArray &data);
+
+public slots:
+    void disconnectFromHost();
+    void sendData(const QByteArray &data);
+
+private slots:
+    void slotConnected();
+
+private:
+    QXmppIncomingClient *m_stream;
+};
+
+/// \brief The QXmppStreamThrottle class applies flow control to a stream
+/// whose peer does not read the data we send it.
+///
+/// Once the stream's high watermark is reached, no more data is read from
+/// the peer so that its requests stop producing output. If the stream does
+/// not drain to its low watermark within the grace period, it is closed.
+///
+/// The throttle is a child of the stream and lives in the stream's thread.
+
+class QXmppStreamThrottle : public QXmppLoggable
+{
+    Q_OBJECT
+
+public:
+    QXmppStreamThrottle(QXmppStream *stream, int timeout);
+
+private slots:
+    void slotHighWatermark();
+    void slotLowWatermark();
+    void slotTimeout();
+
+private:
+    QXmppStream *m_stream;
+    QTimer *m_timer;
+};
+
+class QXmppSslServerWorker : public QObject
+{
+    Q_OBJECT
+
+public:
+    QXmppSslServerWorker(QXmppSslServerPrivate *server)
+        : serverPrivate(server)
+    { }
+
+signals:
+    void newConnection(QSslSocket *socket);
+
+public slots:
+    void addConnection(int socketDescriptor);
+
+private:
+    QXmppSslServerPrivate *serverPrivate;
+};
+
+#endif
@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2008-2011 The QXmpp developers
+ *
+ * Author:
+ *  Jeremy Lainé
+ *
+ * Source:
+ *  http://code.google.com/p/qxmpp
+ *
+ * This file is a part of QXmpp library.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+#include "QXmppStanzaKey.h"
+
+/// Constructs a new stanza key.
+///
+/// \param stanzaName
+/// \param elementName
+/// \param namespaceURI
+
+QXmppStanzaKey::QXmppStanzaKey(const QString &stanzaName, const QString &elementName, const QString &namespaceURI)
+    : m_stanzaName(stanzaName),
+    m_elementName(elementName),
+    m_namespaceURI(namespaceURI)
+{
+}
+
+/// Returns the name of the stanza, for instance "iq".
+///
+
+QString QXmppStanzaKey::stanzaName() const
+{
+    return m_stanzaName;
+}
+
+/// Returns the name of the stanza's child element.
+///
+
+QString QXmppStanzaKey::elementName() const
+{
+    return m_elementName;
+}
+
+/// Returns the namespace of the stanza's child element.
+///
+
+QString QXmppStanzaKey::namespaceURI() const
+{
+    return m_namespaceURI;
+}
+
+/// Returns true if the two keys are identical.
+///
+/// \param other
+
+bool QXmppStanzaKey::operator==(const QXmppStanzaKey &other) const
+{
+    return m_namespaceURI == other.m_namespaceURI &&
+           m_elementName == other.m_elementName &&
+           m_stanzaName == other.m_stanzaName;
+}
+
+uint qHash(const QXmppStanzaKey &key)
+{
+    return (qHash(key.namespaceURI()) * 31 + qHash(key.elementName())) * 31 + qHash(key.stanzaName());
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2008-2011 The QXmpp developers
+ *
+ * Author:
+ *  Jeremy Lainé
+ *
+ * Source:
+ *  http://code.google.com/p/qxmpp
+ *
+ * This file is a part of QXmpp library.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+#ifndef QXMPPSTANZAKEY_H
+#define QXMPPSTANZAKEY_H
+
+#include <QHash>
+#include <QString>
+
+/// \brief The QXmppStanzaKey class identifies a kind of stanza payload.
+///
+/// A key is made of the name of the stanza (for instance "iq" or
+/// "message"), and the name and namespace of one of its child elements.
+/// Extensions declare the keys they handle so that stanzas can be
+/// dispatched to them with a single hash lookup.
+///
+/// \ingroup Core
+
+class QXmppStanzaKey
+{
+public:
+    QXmppStanzaKey(const QString &stanzaName = QString(),
+                   const QString &elementName = QString(),
+                   const QString &namespaceURI = QString());
+
+    QString stanzaName() const;
+    QString elementName() const;
+    QString namespaceURI() const;
+
+    bool operator==(const QXmppStanzaKey &other) const;
+
+private:
+    QString m_stanzaName;
+    QString m_elementName;
+    QString m_namespaceURI;
+};
+
+uint qHash(const QXmppStanzaKey &key);
+
+#endif
@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2008-2011 The QXmpp developers
+ *
+ * Author:
+ *  Jeremy Lainé
+ *
+ * Source:
+ *  http://code.google.com/p/qxmpp
+ *
+ * This file is a part of QXmpp library.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+#ifndef QXMPPSTANZAKEY_P_H
+#define QXMPPSTANZAKEY_P_H
+
+#include <QDomElement>
+#include <QList>
+#include <QSet>
+
+#include "QXmppStanzaKey.h"
+
+/// \brief The QXmppStanzaHandlers class is the dispatch table used by the
+/// client and the server to find the extensions to offer a stanza to.
+///
+/// The table is built from the keys declared by the extensions the first
+/// time a stanza is dispatched after invalidate() was called.
+
+template <class T>
+class QXmppStanzaHandlers
+{
+public:
+    QXmppStanzaHandlers()
+        : m_dirty(true)
+    {
+    }
+
+    /// Marks the table for rebuilding, call this when the extensions change.
+    void invalidate()
+    {
+        m_dirty = true;
+    }
+
+    /// Returns the extensions which should be offered the given stanza,
+    /// in the order in which they were registered.
+    ///
+    /// \param extensions
+    /// \param element
+    QList<T*> find(const QList<T*> &extensions, const QDomElement &element)
+    {
+        if (m_dirty)
+            build(extensions);
+
+        // look up the stanza's child elements
+        QList<T*> found;
+        bool matched = false;
+        const QString stanzaName = element.tagName();
+        QDomElement child = element.firstChildElement();
+        while (!child.isNull())
+        {
+            typename QHash<QXmppStanzaKey, QList<T*> >::const_iterator it =
+                m_keyedHandlers.constFind(QXmppStanzaKey(stanzaName, child.tagName(), child.namespaceURI()));
+            if (it != m_keyedHandlers.constEnd())
+            {
+                if (!matched) {
+                    found = it.value();
+                    matched = true;
+                } else if (found != it.value()) {
+                    // merge the handlers, preserving registration order
+                    QList<T*> merged;
+                    foreach (T *extension, extensions)
+                        if (found.contains(extension) || it.value().contains(extension))
+                            merged << extension;
+                    found = merged;
+                }
+            }
+            child = child.nextSiblingElement();
+        }
+        return matched ? found : m_defaultHandlers;
+    }
+
+private:
+    void build(const QList<T*> &extensions)
+    {
+        // extensions which do not declare keys are offered every stanza
+        QHash<T*, QList<QXmppStanzaKey> > extensionKeys;
+        QSet<QXmppStanzaKey> keys;
+        m_defaultHandlers.clear();
+        foreach (T *extension, extensions)
+        {
+            const QList<QXmppStanzaKey> declared = extension->stanzaKeys();
+            if (declared.isEmpty())
+                m_defaultHandlers << extension;
+            else
+                extensionKeys.insert(extension, declared);
+            foreach (const QXmppStanzaKey &key, declared)
+                keys.insert(key);
+        }
+
+        m_keyedHandlers.clear();
+        foreach (const QXmppStanzaKey &key, keys)
+        {
+            QList<T*> &handlers = m_keyedHandlers[key];
+            foreach (T *extension, extensions)
+                if (!extensionKeys.contains(extension) || extensionKeys.value(extension).contains(key))
+                    handlers << extension;
+        }
+        m_dirty = false;
+    }
+
+    bool m_dirty;
+    QHash<QXmppStanzaKey, QList<T*> > m_keyedHandlers;
+    QList<T*> m_defaultHandlers;
+};
+
+#endif
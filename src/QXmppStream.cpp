@@ -27,35 +27,425 @@
 #include "QXmppLogger.h"
 #include "QXmppPacket.h"
 #include "QXmppStream.h"
+#include "QXmppStream_p.h"
 #include "QXmppUtils.h"
 
 #include <QBuffer>
 #include <QDomDocument>
 #include <QHostAddress>
-#include <QRegExp>
 #include <QSslSocket>
 #include <QStringList>
 #include <QTime>
 #include <QXmlStreamWriter>
 
+#ifdef QXMPP_USE_ZLIB
+#include <zlib.h>
+#endif
+
 static bool randomSeeded = false;
 static const QByteArray streamRootElementEnd = "</stream:stream>";
 
+// Outgoing stanzas larger than this do not keep their memory allocated
+// once they have been sent.
+static const int maxWriteBufferSize = 65536;
+
+QXmppStreamParser::QXmppStreamParser()
+{
+    reset();
+}
+
+/// Returns the buffer holding the received data, to which new data
+/// is appended.
+
+QByteArray &QXmppStreamParser::buffer()
+{
+    return m_buffer;
+}
+
+/// Returns the received data which has not been handed out as an item yet.
+
+QByteArray QXmppStreamParser::pendingData() const
+{
+    return m_buffer.mid(m_itemStart);
+}
+
+/// Drops the data which has already been handed out, so that the buffer
+/// only holds the item currently being received.
+
+void QXmppStreamParser::compact()
+{
+    if (m_itemStart > 0)
+    {
+        m_buffer.remove(0, m_itemStart);
+        m_position -= m_itemStart;
+        m_itemStart = 0;
+    }
+}
+
+/// Returns true if the start tag of the current item is a
+/// <stream:stream> element, which happens when the stream is restarted.
+
+bool QXmppStreamParser::isStreamElement() const
+{
+    static const char streamTag[] = "stream:stream";
+    static const int streamTagLength = sizeof(streamTag) - 1;
+
+    if (m_position - m_itemStart < streamTagLength + 2)
+        return false;
+    const char *data = m_buffer.constData() + m_itemStart + 1;
+    if (qstrncmp(data, streamTag, streamTagLength))
+        return false;
+    const char next = data[streamTagLength];
+    return next == ' ' || next == '\t' || next == '\r' || next == '\n' ||
+           next == '>' || next == '/';
+}
+
+/// Resets the incremental parser, for instance when the underlying
+/// transport is (re)started.
+
+void QXmppStreamParser::reset()
+{
+    m_buffer.clear();
+    m_state = TextState;
+    m_depth = 0;
+    m_position = 0;
+    m_itemStart = 0;
+    m_quote = 0;
+    m_lastChar = 0;
+}
+
+/// Advances the parser past the given terminator.
+///
+/// Returns false if the terminator has not been received yet.
+
+bool QXmppStreamParser::skipUntil(const char *terminator)
+{
+    const int length = qstrlen(terminator);
+    const int found = m_buffer.indexOf(terminator, m_position);
+    if (found < 0)
+    {
+        // keep a possibly truncated terminator for the next read
+        m_position = qMax(m_position, m_buffer.size() - length + 1);
+        return false;
+    }
+    m_position = found + length;
+    m_state = TextState;
+
+    // comments and processing instructions between stanzas are discarded
+    if (m_depth <= 1)
+        m_itemStart = m_position;
+    return true;
+}
+
+QXmppStreamParser::ItemType QXmppStreamParser::takeItem(QByteArray &item, ItemType type)
+{
+    item = m_buffer.mid(m_itemStart, m_position - m_itemStart);
+    m_itemStart = m_position;
+    return type;
+}
+
+/// Scans the received data for the next complete top-level item.
+///
+/// Scanning resumes where the previous call stopped, so every byte is
+/// only looked at once no matter how a stanza is split across reads.
+///
+/// \param item
+
+QXmppStreamParser::ItemType QXmppStreamParser::nextItem(QByteArray &item)
+{
+    const char *data = m_buffer.constData();
+    const int size = m_buffer.size();
+
+    while (m_position < size)
+    {
+        switch (m_state)
+        {
+        case TextState:
+        {
+            const int pos = m_buffer.indexOf('<', m_position);
+            if (pos < 0)
+            {
+                // whitespace between stanzas is discarded
+                m_position = size;
+                if (m_depth <= 1)
+                    m_itemStart = size;
+                return NoItem;
+            }
+            if (m_depth <= 1)
+                m_itemStart = pos;
+            m_position = pos;
+
+            // we need to look ahead to determine the type of markup
+            if (pos + 1 >= size)
+                return NoItem;
+            const char next = data[pos + 1];
+            if (next == '/') {
+                m_state = EndTagState;
+                m_position = pos + 2;
+            } else if (next == '?') {
+                m_state = ProcessingState;
+                m_position = pos + 2;
+            } else if (next == '!') {
+                static const char commentStart[] = "<!--";
+                static const char cdataStart[] = "<![CDATA[";
+                const int available = size - pos;
+                if (available >= 4 && !qstrncmp(data + pos, commentStart, 4)) {
+                    m_state = CommentState;
+                    m_position = pos + 4;
+                } else if (available >= 9 && !qstrncmp(data + pos, cdataStart, 9)) {
+                    m_state = CDataState;
+                    m_position = pos + 9;
+                } else if (available < 9 && !qstrncmp(data + pos, cdataStart, available)) {
+                    return NoItem;
+                } else if (available < 4 && !qstrncmp(data + pos, commentStart, available)) {
+                    return NoItem;
+                } else {
+                    m_state = DeclarationState;
+                    m_position = pos + 2;
+                }
+            } else {
+                m_state = StartTagState;
+                m_quote = 0;
+                m_lastChar = 0;
+                m_position = pos + 1;
+            }
+            break;
+        }
+        case StartTagState:
+        {
+            for ( ; m_position < size; ++m_position)
+            {
+                const char c = data[m_position];
+                if (m_quote) {
+                    if (c == m_quote)
+                        m_quote = 0;
+                } else if (c == '>') {
+                    break;
+                } else if (c == '"' || c == '\'') {
+                    m_quote = c;
+                }
+                m_lastChar = c;
+            }
+            if (m_position >= size)
+                return NoItem;
+            m_position++;
+            m_state = TextState;
+
+            if (m_depth == 0 || (m_depth == 1 && isStreamElement())) {
+                m_depth = 1;
+                return takeItem(item, StreamStart);
+            } else if (m_lastChar != '/') {
+                m_depth++;
+            } else if (m_depth == 1) {
+                return takeItem(item, Stanza);
+            }
+            break;
+        }
+        case EndTagState:
+        {
+            const int pos = m_buffer.indexOf('>', m_position);
+            if (pos < 0)
+            {
+                m_position = size;
+                return NoItem;
+            }
+            m_position = pos + 1;
+            m_state = TextState;
+
+            m_depth--;
+            if (m_depth == 1) {
+                return takeItem(item, Stanza);
+            } else if (m_depth <= 0) {
+                m_depth = 0;
+                return takeItem(item, StreamEnd);
+            }
+            break;
+        }
+        case CommentState:
+            if (!skipUntil("-->"))
+                return NoItem;
+            break;
+        case CDataState:
+            if (!skipUntil("]]>"))
+                return NoItem;
+            break;
+        case ProcessingState:
+            if (!skipUntil("?>"))
+                return NoItem;
+            break;
+        case DeclarationState:
+            if (!skipUntil(">"))
+                return NoItem;
+            break;
+        }
+    }
+    return NoItem;
+}
+
 class QXmppStreamPrivate
 {
 public:
     QXmppStreamPrivate();
 
-    QByteArray dataBuffer;
+    QXmlStreamWriter *startWrite();
+    QByteArray writtenData() const;
+    void finishWrite();
+
+    bool deflateData(const QByteArray &data);
+    bool inflateData(const QByteArray &data);
+    void stopCompression();
+
+    QXmppStreamParser parser;
     QSslSocket* socket;
 
+    // output serialization, the buffer and writer are reused for every
+    // outgoing stanza
+    QBuffer writeBuffer;
+    QXmlStreamWriter writer;
+    bool writing;
+
+    // data sent during the current event loop pass, written in one go
+    QByteArray outputBuffer;
+    bool flushScheduled;
+    qint64 highWatermark;
+    qint64 lowWatermark;
+    bool aboveHighWatermark;
+    bool readingPaused;
+
+    // stream compression, the zlib state is kept for the whole stream
+    bool compressed;
+    QByteArray compressBuffer;
+#ifdef QXMPP_USE_ZLIB
+    z_stream deflater;
+    z_stream inflater;
+#endif
+
     // stream state
     QByteArray streamStart;
 };
 
 QXmppStreamPrivate::QXmppStreamPrivate()
-    : socket(0)
+    : socket(0),
+    writer(&writeBuffer),
+    writing(false),
+    flushScheduled(false),
+    highWatermark(1024 * 1024),
+    lowWatermark(256 * 1024),
+    aboveHighWatermark(false),
+    readingPaused(false),
+    compressed(false)
+{
+    writeBuffer.open(QIODevice::WriteOnly);
+}
+
+/// Returns the writer for the reusable output buffer, positioned at the
+/// start of the buffer.
+///
+/// Returns 0 if the buffer is already in use, for instance if a stanza is
+/// sent from a slot invoked while sending another stanza.
+
+QXmlStreamWriter *QXmppStreamPrivate::startWrite()
 {
+    if (writing)
+        return 0;
+    writing = true;
+    writeBuffer.seek(0);
+    return &writer;
+}
+
+/// Returns the data written since startWrite() was called.
+///
+/// The returned array does not copy the data, it is only valid until
+/// finishWrite() is called.
+
+QByteArray QXmppStreamPrivate::writtenData() const
+{
+    return QByteArray::fromRawData(writeBuffer.data().constData(), writeBuffer.pos());
+}
+
+/// Compresses outgoing data into compressBuffer, flushing the compressor
+/// so that the peer can decompress everything which was sent so far.
+///
+/// \param data
+
+bool QXmppStreamPrivate::deflateData(const QByteArray &data)
+{
+#ifdef QXMPP_USE_ZLIB
+    const int chunkSize = 4096;
+    int size = 0;
+    deflater.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.constData()));
+    deflater.avail_in = data.size();
+    do {
+        compressBuffer.resize(size + chunkSize);
+        deflater.next_out = reinterpret_cast<Bytef*>(compressBuffer.data() + size);
+        deflater.avail_out = chunkSize;
+        if (deflate(&deflater, Z_SYNC_FLUSH) == Z_STREAM_ERROR)
+            return false;
+        size += chunkSize - deflater.avail_out;
+    } while (deflater.avail_out == 0);
+    compressBuffer.resize(size);
+    return true;
+#else
+    Q_UNUSED(data);
+    return false;
+#endif
+}
+
+/// Decompresses incoming data and appends it to the parser's buffer.
+///
+/// \param data
+
+bool QXmppStreamPrivate::inflateData(const QByteArray &data)
+{
+#ifdef QXMPP_USE_ZLIB
+    const int chunkSize = 4096;
+    QByteArray &buffer = parser.buffer();
+    int size = buffer.size();
+    inflater.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.constData()));
+    inflater.avail_in = data.size();
+    do {
+        buffer.resize(size + chunkSize);
+        inflater.next_out = reinterpret_cast<Bytef*>(buffer.data() + size);
+        inflater.avail_out = chunkSize;
+        const int ret = inflate(&inflater, Z_SYNC_FLUSH);
+        size += chunkSize - inflater.avail_out;
+        if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            buffer.resize(size);
+            return false;
+        }
+    } while (inflater.avail_out == 0);
+    buffer.resize(size);
+    return true;
+#else
+    Q_UNUSED(data);
+    return false;
+#endif
+}
+
+/// Releases the compression state.
+
+void QXmppStreamPrivate::stopCompression()
+{
+    if (!compressed)
+        return;
+#ifdef QXMPP_USE_ZLIB
+    deflateEnd(&deflater);
+    inflateEnd(&inflater);
+#endif
+    compressed = false;
+    compressBuffer.clear();
+}
+
+/// Releases the output buffer.
+
+void QXmppStreamPrivate::finishWrite()
+{
+    writing = false;
+    if (writeBuffer.size() > maxWriteBufferSize) {
+        writeBuffer.close();
+        writeBuffer.setData(QByteArray());
+        writeBuffer.open(QIODevice::WriteOnly);
+    }
 }
 
 /// Constructs a base XMPP stream.
@@ -78,6 +468,7 @@ QXmppStream::QXmppStream(QObject *parent)
 
 QXmppStream::~QXmppStream()
 {
+    d->stopCompression();
     delete d;
 }
 
@@ -87,6 +478,7 @@ QXmppStream::~QXmppStream()
 void QXmppStream::disconnectFromHost()
 {
     sendData(streamRootElementEnd);
+    flush();
     if (d->socket)
     {
         d->socket->flush();
@@ -112,14 +504,141 @@ bool QXmppStream::isConnected() const
 
 /// Sends raw data to the peer.
 ///
+/// The data is not referenced once this method returns, so callers may
+/// pass a QByteArray which does not own its contents.
+///
+/// The data sent during one pass of the event loop is buffered and written
+/// to the socket at once when control returns to the event loop, or when
+/// flush() is called.
+///
 /// \param data
 
 bool QXmppStream::sendData(const QByteArray &data)
 {
-    logSent(QString::fromUtf8(data));
+    logSentData(data);
     if (!d->socket || d->socket->state() != QAbstractSocket::ConnectedState)
         return false;
-    return d->socket->write(data) == data.size();
+
+    d->outputBuffer.append(data);
+    if (!d->flushScheduled) {
+        d->flushScheduled = true;
+        QMetaObject::invokeMethod(this, "flush", Qt::QueuedConnection);
+    }
+    return true;
+}
+
+/// Writes the data buffered by sendData() to the socket immediately.
+///
+/// You need to call this before changing the transport, for instance
+/// before starting encryption.
+
+void QXmppStream::flush()
+{
+    d->flushScheduled = false;
+    if (d->outputBuffer.isEmpty())
+        return;
+
+    if (d->socket && d->socket->state() == QAbstractSocket::ConnectedState) {
+        if (!d->compressed) {
+            d->socket->write(d->outputBuffer);
+        } else if (d->deflateData(d->outputBuffer)) {
+            d->socket->write(d->compressBuffer);
+        } else {
+            warning("Could not compress outgoing data");
+            d->socket->disconnectFromHost();
+        }
+    }
+    d->outputBuffer.clear();
+
+    if (!d->aboveHighWatermark && d->highWatermark > 0 &&
+        bytesToWrite() > d->highWatermark) {
+        d->aboveHighWatermark = true;
+        emit highWatermarkReached();
+    }
+}
+
+/// Returns the number of bytes which are waiting to be written.
+///
+
+qint64 QXmppStream::bytesToWrite() const
+{
+    qint64 bytes = d->outputBuffer.size();
+    if (d->socket)
+        bytes += d->socket->bytesToWrite() + d->socket->encryptedBytesToWrite();
+    return bytes;
+}
+
+/// Returns the number of bytes waiting to be written above which the
+/// highWatermarkReached() signal is emitted.
+///
+
+qint64 QXmppStream::highWatermark() const
+{
+    return d->highWatermark;
+}
+
+/// Sets the number of bytes waiting to be written above which the
+/// highWatermarkReached() signal is emitted, for instance to stop
+/// reading from the peer producing the data or to disconnect a peer
+/// which does not read its data.
+///
+/// The default value is 1MB, a value of 0 disables the signal.
+///
+/// \param bytes
+
+void QXmppStream::setHighWatermark(qint64 bytes)
+{
+    d->highWatermark = bytes;
+}
+
+/// Returns the number of bytes waiting to be written at which the
+/// lowWatermarkReached() signal is emitted.
+///
+
+qint64 QXmppStream::lowWatermark() const
+{
+    return d->lowWatermark;
+}
+
+/// Sets the number of bytes waiting to be written at which the
+/// lowWatermarkReached() signal is emitted, once the high watermark
+/// was reached.
+///
+/// The default value is 256kB.
+///
+/// \param bytes
+
+void QXmppStream::setLowWatermark(qint64 bytes)
+{
+    d->lowWatermark = bytes;
+}
+
+/// Returns true if incoming data is not being processed.
+///
+
+bool QXmppStream::isReadingPaused() const
+{
+    return d->readingPaused;
+}
+
+/// Stops or resumes processing incoming data.
+///
+/// While reading is paused, incoming data is left in the socket, whose
+/// read buffer is bounded so that the peer is eventually throttled.
+///
+/// \param paused
+
+void QXmppStream::setReadingPaused(bool paused)
+{
+    if (paused == d->readingPaused)
+        return;
+    d->readingPaused = paused;
+    if (d->socket)
+        d->socket->setReadBufferSize(paused ? 65536 : 0);
+
+    // process the data which arrived in the meantime
+    if (!paused)
+        QMetaObject::invokeMethod(this, "socketReadyRead", Qt::QueuedConnection);
 }
 
 /// Sends an XML element to the peer.
@@ -128,14 +647,22 @@ bool QXmppStream::sendData(const QByteArray &data)
 
 bool QXmppStream::sendElement(const QDomElement &element)
 {
-    // prepare packet
-    QByteArray data;
-    QXmlStreamWriter xmlStream(&data);
     const QStringList omitNamespaces = QStringList() << ns_client << ns_server;
-    helperToXmlAddDomElement(&xmlStream, element, omitNamespaces);
+
+    // serialize into the reusable output buffer
+    QXmlStreamWriter *writer = d->startWrite();
+    if (!writer) {
+        QByteArray data;
+        QXmlStreamWriter xmlStream(&data);
+        helperToXmlAddDomElement(&xmlStream, element, omitNamespaces);
+        return sendData(data);
+    }
+    helperToXmlAddDomElement(writer, element, omitNamespaces);
 
     // send packet
-    return sendData(data);
+    const bool sent = sendData(d->writtenData());
+    d->finishWrite();
+    return sent;
 }
 
 /// Sends an XMPP packet to the peer.
@@ -144,13 +671,80 @@ bool QXmppStream::sendElement(const QDomElement &element)
 
 bool QXmppStream::sendPacket(const QXmppPacket &packet)
 {
-    // prepare packet
-    QByteArray data;
-    QXmlStreamWriter xmlStream(&data);
-    packet.toXml(&xmlStream);
+    // serialize into the reusable output buffer
+    QXmlStreamWriter *writer = d->startWrite();
+    if (!writer) {
+        QByteArray data;
+        QXmlStreamWriter xmlStream(&data);
+        packet.toXml(&xmlStream);
+        return sendData(data);
+    }
+    packet.toXml(writer);
 
     // send packet
-    return sendData(data);
+    const bool sent = sendData(d->writtenData());
+    d->finishWrite();
+    return sent;
+}
+
+/// Returns true if stream compression is active.
+///
+
+bool QXmppStream::isCompressed() const
+{
+    return d->compressed;
+}
+
+/// Returns true if QXmpp was built with support for zlib stream
+/// compression.
+///
+
+bool QXmppStream::isCompressionSupported()
+{
+#ifdef QXMPP_USE_ZLIB
+    return true;
+#else
+    return false;
+#endif
+}
+
+/// Starts zlib compression of the stream in both directions.
+///
+/// The data which was already sent is flushed uncompressed, and any
+/// data received after the element currently being handled is considered
+/// to be compressed. The compression state is kept until the socket
+/// is disconnected.
+///
+/// Returns false if compression could not be started.
+
+bool QXmppStream::startCompression()
+{
+#ifdef QXMPP_USE_ZLIB
+    if (d->compressed)
+        return false;
+    flush();
+
+    memset(&d->deflater, 0, sizeof(d->deflater));
+    if (deflateInit(&d->deflater, Z_DEFAULT_COMPRESSION) != Z_OK)
+        return false;
+    memset(&d->inflater, 0, sizeof(d->inflater));
+    if (inflateInit(&d->inflater) != Z_OK) {
+        deflateEnd(&d->deflater);
+        return false;
+    }
+    d->compressed = true;
+
+    // the data which has not been parsed yet is compressed
+    const QByteArray pending = d->parser.pendingData();
+    d->parser.reset();
+    if (!pending.isEmpty() && !d->inflateData(pending)) {
+        warning("Received invalid compressed data");
+        d->socket->disconnectFromHost();
+    }
+    return true;
+#else
+    return false;
+#endif
 }
 
 /// Returns the QSslSocket used for this stream.
@@ -187,84 +781,117 @@ void QXmppStream::setSocket(QSslSocket *socket)
                     this, SLOT(socketReadyRead()));
     Q_ASSERT(check);
 
+    check = connect(socket, SIGNAL(bytesWritten(qint64)),
+                    this, SLOT(socketBytesWritten()));
+    Q_ASSERT(check);
+
+    check = connect(socket, SIGNAL(encryptedBytesWritten(qint64)),
+                    this, SLOT(socketBytesWritten()));
+    Q_ASSERT(check);
+
     // relay signals
     check = connect(socket, SIGNAL(disconnected()),
                     this, SIGNAL(disconnected()));
     Q_ASSERT(check);
 }
 
+void QXmppStream::socketBytesWritten()
+{
+    if (d->aboveHighWatermark && bytesToWrite() <= d->lowWatermark) {
+        d->aboveHighWatermark = false;
+        emit lowWatermarkReached();
+    }
+}
+
 void QXmppStream::socketConnected()
 {
     info(QString("Socket connected to %1 %2").arg(
         d->socket->peerAddress().toString(),
         QString::number(d->socket->peerPort())));
-    d->dataBuffer.clear();
+    d->parser.reset();
     handleStart();
 }
 
 void QXmppStream::socketDisconnected()
 {
     info("Socket disconnected");
-    d->dataBuffer.clear();
+    d->parser.reset();
+    d->stopCompression();
+    d->outputBuffer.clear();
+    d->aboveHighWatermark = false;
 }
 
 void QXmppStream::socketEncrypted()
 {
     debug("Socket encrypted");
-    d->dataBuffer.clear();
+    d->parser.reset();
     handleStart();
 }
 
 void QXmppStream::socketReadyRead()
 {
-    const QByteArray data = d->socket->readAll();
-    //debug("SERVER [COULD BE PARTIAL DATA]:" + data.left(20));
-
-    d->dataBuffer.append(data);
-
-    // FIXME : maybe these QRegExps could be static?
-    QRegExp startStreamRegex("^(<\\?xml.*\\?>)?\\s*<stream:stream.*>");
-    startStreamRegex.setMinimal(true);
-    QRegExp endStreamRegex("</stream:stream>$");
-    endStreamRegex.setMinimal(true);
-
-    // check whether we need to add stream start / end elements
-    QByteArray completeXml = d->dataBuffer;
-    const QString strData = QString::fromUtf8(d->dataBuffer);
-    bool streamStart = false;
-    if(strData.contains(startStreamRegex))
-    {
-        streamStart = true;
-        d->streamStart = startStreamRegex.cap(0).toUtf8();
-    }
-    else
-        completeXml.prepend(d->streamStart);
-    if(!strData.contains(endStreamRegex))
-        completeXml.append(streamRootElementEnd);
-
-    // check whether we have a valid XML document
-    QDomDocument doc;
-    if(!doc.setContent(completeXml, true))
+    if (d->readingPaused || !d->socket ||
+        d->socket->state() != QAbstractSocket::ConnectedState)
         return;
 
-    // remove data from buffer
-    logReceived(strData);
-    d->dataBuffer.clear();
-
-    // process stream start
-    QDomElement nodeRecv = doc.documentElement().firstChildElement();
-    if (streamStart)
-    {
-        QDomElement streamElement = doc.documentElement();
-        handleStream(streamElement);
+    if (!d->compressed) {
+        d->parser.buffer().append(d->socket->readAll());
+    } else if (!d->inflateData(d->socket->readAll())) {
+        warning("Received invalid compressed data");
+        d->socket->disconnectFromHost();
+        return;
     }
 
-    // process stanzas
-    while(!nodeRecv.isNull())
+    // process each complete top-level item exactly once
+    QByteArray item;
+    QXmppStreamParser::ItemType type;
+    while ((type = d->parser.nextItem(item)) != QXmppStreamParser::NoItem)
     {
-        handleStanza(nodeRecv);
-        nodeRecv = nodeRecv.nextSiblingElement();
+        logReceivedData(item);
+
+        if (type == QXmppStreamParser::StreamStart)
+        {
+            // process stream start
+            d->streamStart = item;
+            QDomDocument doc;
+            if (!doc.setContent(item + streamRootElementEnd, true))
+            {
+                warning("Received an invalid stream start");
+                sendNotWellFormed();
+                return;
+            }
+            handleStream(doc.documentElement());
+        }
+        else if (type == QXmppStreamParser::Stanza)
+        {
+            // process stanza, using the stream start for namespaces
+            QDomDocument doc;
+            if (!doc.setContent(d->streamStart + item + streamRootElementEnd, true))
+            {
+                warning("Received an invalid stanza");
+                sendNotWellFormed();
+                return;
+            }
+            handleStanza(doc.documentElement().firstChildElement());
+        }
+        else if (type == QXmppStreamParser::StreamEnd)
+        {
+            // the peer closed the stream, close ours too
+            disconnectFromHost();
+            return;
+        }
+
+        // a handler may have closed the stream
+        if (!d->socket || d->socket->state() != QAbstractSocket::ConnectedState)
+            return;
     }
+    d->parser.compact();
 }
 
+/// Sends a <not-well-formed/> stream error and closes the stream.
 
+void QXmppStream::sendNotWellFormed()
+{
+    sendData("<stream:error><not-well-formed xmlns='urn:ietf:params:xml:ns:xmpp-streams'/></stream:error>");
+    disconnectFromHost();
+}
@@ -52,6 +52,23 @@ public:
     bool sendElement(const QDomElement&);
     bool sendPacket(const QXmppPacket&);
 
+    qint64 bytesToWrite() const;
+
+    qint64 highWatermark() const;
+    void setHighWatermark(qint64 bytes);
+
+    qint64 lowWatermark() const;
+    void setLowWatermark(qint64 bytes);
+
+    bool isReadingPaused() const;
+    void setReadingPaused(bool paused);
+
+    bool isCompressed() const;
+    static bool isCompressionSupported();
+
+public slots:
+    void flush();
+
 signals:
     /// This signal is emitted when the stream is connected.
     void connected();
@@ -59,10 +76,20 @@ signals:
     /// This signal is emitted when the stream is disconnected.
     void disconnected();
 
+    /// This signal is emitted when the number of bytes waiting to be
+    /// written exceeds the high watermark.
+    void highWatermarkReached();
+
+    /// This signal is emitted when the number of bytes waiting to be
+    /// written falls to the low watermark, after the high watermark
+    /// was reached.
+    void lowWatermarkReached();
+
 protected:
     // Access to underlying socket
     QSslSocket *socket();
     void setSocket(QSslSocket *socket);
+    bool startCompression();
 
     // Overridable methods
     virtual void handleStart();
@@ -78,12 +105,15 @@ protected:
     virtual void handleStream(const QDomElement &element) = 0;
 
 private slots:
+    void socketBytesWritten();
     void socketConnected();
     void socketDisconnected();
     void socketEncrypted();
     void socketReadyRead();
 
 private:
+    void sendNotWellFormed();
+
     QXmppStreamPrivate * const d;
 };
 
@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2008-2011 The QXmpp developers
+ *
+ * Author:
+ *  Jeremy Lainé
+ *
+ * Source:
+ *  http://code.google.com/p/qxmpp
+ *
+ * This file is a part of QXmpp library.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+#ifndef QXMPPSTREAM_P_H
+#define QXMPPSTREAM_P_H
+
+#include <QByteArray>
+
+/// \brief The QXmppStreamParser class splits the data received on an XMPP
+/// stream into its top-level items.
+///
+/// The parser only tracks the nesting of the markup, the items it returns
+/// still need to be parsed as XML.
+
+class QXmppStreamParser
+{
+public:
+    /// Type of a complete top-level item found in the incoming data.
+    enum ItemType
+    {
+        NoItem = 0,
+        StreamStart,
+        StreamEnd,
+        Stanza
+    };
+
+    QXmppStreamParser();
+
+    QByteArray &buffer();
+    void compact();
+    ItemType nextItem(QByteArray &item);
+    QByteArray pendingData() const;
+    void reset();
+
+private:
+    /// State of the incremental parser between two reads.
+    enum ParserState
+    {
+        TextState,
+        StartTagState,
+        EndTagState,
+        CommentState,
+        CDataState,
+        ProcessingState,
+        DeclarationState
+    };
+
+    bool isStreamElement() const;
+    bool skipUntil(const char *terminator);
+    ItemType takeItem(QByteArray &item, ItemType type);
+
+    QByteArray m_buffer;
+    ParserState m_state;
+    int m_depth;
+    int m_position;
+    int m_itemStart;
+    char m_quote;
+    char m_lastChar;
+};
+
+#endif
@@ -23,19 +23,41 @@
 
 #define QXMPP_DEBUG_STUN
 
+#include <QCoreApplication>
 #include <QCryptographicHash>
+#include <QHash>
 #include <QHostInfo>
 #include <QNetworkInterface>
+#include <QPointer>
+#include <QtEndian>
+#include <QThreadStorage>
 #include <QUdpSocket>
 #include <QTimer>
+#include <QVector>
 
 #include "QXmppStun.h"
+#include "QXmppStun_p.h"
 #include "QXmppUtils.h"
 
+#include <cstring>
+
+// batched datagram I/O, recvmmsg appeared in glibc 2.12 and sendmmsg in 2.14
+#if defined(Q_OS_LINUX) && defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 14))
+#define QXMPP_USE_MMSG
+#include <errno.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#endif
+
 #define ID_SIZE 12
 #define STUN_RTO_INTERVAL 500
 #define STUN_RTO_MAX      7
 
+// pacing of ICE connectivity checks and their minimum retransmission
+// timeout, see RFC 5245 - 16.1. RTP Media Streams
+#define ICE_PACING_INTERVAL 20
+#define ICE_RTO_MIN         100
+
 static const quint32 STUN_MAGIC = 0x2112A442;
 static const quint16 STUN_HEADER = 20;
 static const quint8 STUN_IPV4 = 0x01;
@@ -214,6 +236,352 @@ static void setBodyLength(QByteArray &buffer, qint16 length)
     stream << length;
 }
 
+QXmppSha1::QXmppSha1()
+    : m_length(0)
+{
+    m_state[0] = 0x67452301;
+    m_state[1] = 0xefcdab89;
+    m_state[2] = 0x98badcfe;
+    m_state[3] = 0x10325476;
+    m_state[4] = 0xc3d2e1f0;
+}
+
+static inline quint32 rotateLeft(quint32 value, int bits)
+{
+    return (value << bits) | (value >> (32 - bits));
+}
+
+void QXmppSha1::transform(const uchar *block)
+{
+    quint32 w[80];
+    for (int i = 0; i < 16; ++i)
+        w[i] = qFromBigEndian<quint32>(block + 4 * i);
+    for (int i = 16; i < 80; ++i)
+        w[i] = rotateLeft(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+    quint32 a = m_state[0], b = m_state[1], c = m_state[2], d = m_state[3], e = m_state[4];
+    for (int i = 0; i < 80; ++i) {
+        quint32 f, k;
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5a827999;
+        } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ed9eba1;
+        } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8f1bbcdc;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xca62c1d6;
+        }
+        const quint32 temp = rotateLeft(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = rotateLeft(b, 30);
+        b = a;
+        a = temp;
+    }
+    m_state[0] += a;
+    m_state[1] += b;
+    m_state[2] += c;
+    m_state[3] += d;
+    m_state[4] += e;
+}
+
+/// Adds \a size bytes of \a data to the digest.
+
+void QXmppSha1::addData(const char *data, int size)
+{
+    const uchar *input = reinterpret_cast<const uchar*>(data);
+    int used = m_length % 64;
+    m_length += size;
+
+    // complete a partial block
+    if (used) {
+        const int chunk = qMin(64 - used, size);
+        memcpy(m_buffer + used, input, chunk);
+        input += chunk;
+        size -= chunk;
+        used += chunk;
+        if (used < 64)
+            return;
+        transform(m_buffer);
+    }
+
+    for (; size >= 64; size -= 64, input += 64)
+        transform(input);
+    memcpy(m_buffer, input, size);
+}
+
+/// Finishes the digest and stores it in \a digest.
+
+void QXmppSha1::result(uchar digest[20])
+{
+    uchar trailer[72];
+    const int used = m_length % 64;
+    const int padding = (used < 56 ? 56 : 120) - used;
+    const quint64 bits = m_length * 8;
+    memset(trailer, 0, padding);
+    trailer[0] = 0x80;
+    qToBigEndian(bits, trailer + padding);
+    addData(reinterpret_cast<const char*>(trailer), padding + 8);
+
+    for (int i = 0; i < 5; ++i)
+        qToBigEndian(m_state[i], digest + 4 * i);
+}
+
+QXmppHmacSha1::QXmppHmacSha1(const QByteArray &key)
+{
+    setKey(key);
+}
+
+/// Returns true if no key is set.
+
+bool QXmppHmacSha1::isNull() const
+{
+    return m_null;
+}
+
+/// Sets the key and computes the key pads.
+///
+/// \param key
+
+void QXmppHmacSha1::setKey(const QByteArray &key)
+{
+    const int B = 64;
+    uchar kpad[B];
+    memset(kpad, 0, B);
+    if (key.size() > B) {
+        QXmppSha1 hash;
+        hash.addData(key.constData(), key.size());
+        hash.result(kpad);
+    } else {
+        memcpy(kpad, key.constData(), key.size());
+    }
+
+    char pad[B];
+    for (int i = 0; i < B; ++i)
+        pad[i] = kpad[i] ^ 0x36;
+    m_inner = QXmppSha1();
+    m_inner.addData(pad, B);
+    for (int i = 0; i < B; ++i)
+        pad[i] = kpad[i] ^ 0x5c;
+    m_outer = QXmppSha1();
+    m_outer.addData(pad, B);
+    m_null = key.isEmpty();
+}
+
+/// Returns a digest to which the message must be added.
+
+QXmppSha1 QXmppHmacSha1::start() const
+{
+    return m_inner;
+}
+
+/// Completes the message authentication code for the \a inner digest
+/// returned by start().
+
+void QXmppHmacSha1::finish(QXmppSha1 &inner, uchar mac[20]) const
+{
+    uchar digest[20];
+    inner.result(digest);
+    QXmppSha1 outer = m_outer;
+    outer.addData(reinterpret_cast<const char*>(digest), sizeof(digest));
+    outer.result(mac);
+}
+
+// Checks the MESSAGE-INTEGRITY attribute found at \a offset in the \a size
+// bytes of \a data. The HMAC covers the message up to that attribute, with
+// the length in the header adjusted as if the attribute ended the message.
+static bool checkMessageIntegrity(const QXmppHmacSha1 &hmac, const char *data, int size, int offset)
+{
+    if (offset < STUN_HEADER || offset + 24 > size)
+        return false;
+
+    uchar length[2];
+    qToBigEndian(quint16(offset - STUN_HEADER + 24), length);
+
+    QXmppSha1 hash = hmac.start();
+    hash.addData(data, 2);
+    hash.addData(reinterpret_cast<const char*>(length), sizeof(length));
+    hash.addData(data + 4, offset - 4);
+    uchar mac[20];
+    hmac.finish(hash, mac);
+    return !memcmp(mac, data + offset + 4, sizeof(mac));
+}
+
+QXmppStunParser::QXmppStunParser()
+    : m_data(0),
+    m_size(0),
+    m_fingerprint(-1),
+    m_integrity(-1),
+    m_priority(0),
+    m_useCandidate(false),
+    m_username(-1),
+    m_xorMappedAddress(-1)
+{
+}
+
+/// Returns true if the \a buffer has a valid STUN header, as opposed to
+/// media data.
+
+bool QXmppStunParser::isStun(const QByteArray &buffer)
+{
+    if (buffer.size() < STUN_HEADER)
+        return false;
+
+    // the two most significant bits of a STUN message are zero
+    const uchar *data = reinterpret_cast<const uchar*>(buffer.constData());
+    const quint16 length = qFromBigEndian<quint16>(data + 2);
+    return !(data[0] & 0xc0) &&
+           qFromBigEndian<quint32>(data + 4) == STUN_MAGIC &&
+           length == buffer.size() - STUN_HEADER &&
+           !(length % 4);
+}
+
+/// Walks the attributes of the STUN message in \a buffer, which must pass
+/// isStun() and remain valid as long as the parser is used.
+///
+/// Returns false if the message is malformed.
+
+bool QXmppStunParser::parse(const QByteArray &buffer)
+{
+    m_data = buffer.constData();
+    m_size = buffer.size();
+
+    const uchar *data = reinterpret_cast<const uchar*>(m_data);
+    int pos = STUN_HEADER;
+    while (pos < m_size) {
+        if (pos + 4 > m_size)
+            return false;
+        const quint16 a_type = qFromBigEndian<quint16>(data + pos);
+        const quint16 a_length = qFromBigEndian<quint16>(data + pos + 2);
+        const int next = pos + 4 + 4 * ((a_length + 3) / 4);
+        if (next > m_size)
+            return false;
+
+        // FINGERPRINT must be the last attribute, and only FINGERPRINT
+        // is taken into account after MESSAGE-INTEGRITY
+        if (m_fingerprint >= 0)
+            return false;
+        if (m_integrity >= 0 && a_type != Fingerprint) {
+            pos = next;
+            continue;
+        }
+
+        switch (a_type) {
+        case Priority:
+            if (a_length != 4)
+                return false;
+            m_priority = qFromBigEndian<quint32>(data + pos + 4);
+            break;
+        case UseCandidate:
+            if (a_length != 0)
+                return false;
+            m_useCandidate = true;
+            break;
+        case Username:
+            m_username = pos;
+            break;
+        case XorMappedAddress:
+            m_xorMappedAddress = pos;
+            break;
+        case MessageIntegrity:
+            if (a_length != 20)
+                return false;
+            m_integrity = pos;
+            break;
+        case Fingerprint:
+            if (a_length != 4)
+                return false;
+            m_fingerprint = pos;
+            break;
+        default:
+            break;
+        }
+        pos = next;
+    }
+    return true;
+}
+
+/// Returns false if the message has a FINGERPRINT attribute which does
+/// not match its contents.
+
+bool QXmppStunParser::checkFingerprint() const
+{
+    if (m_fingerprint < 0)
+        return true;
+
+    // FINGERPRINT is last, so the length in the header needs no adjustment
+    const quint32 expected = generateCrc32(m_data, m_fingerprint) ^ 0x5354554eL;
+    return qFromBigEndian<quint32>(reinterpret_cast<const uchar*>(m_data + m_fingerprint + 4)) == expected;
+}
+
+/// Returns false if the message has a MESSAGE-INTEGRITY attribute which
+/// does not match its contents.
+
+bool QXmppStunParser::checkIntegrity(const QXmppHmacSha1 &hmac) const
+{
+    if (m_integrity < 0)
+        return true;
+    return checkMessageIntegrity(hmac, m_data, m_size, m_integrity);
+}
+
+/// Returns true if the message has the given transaction \a id.
+
+bool QXmppStunParser::hasId(const QByteArray &id) const
+{
+    return id.size() == ID_SIZE && !memcmp(m_data + 8, id.constData(), ID_SIZE);
+}
+
+QByteArray QXmppStunParser::id() const
+{
+    return QByteArray(m_data + 8, ID_SIZE);
+}
+
+quint16 QXmppStunParser::type() const
+{
+    return qFromBigEndian<quint16>(reinterpret_cast<const uchar*>(m_data));
+}
+
+QString QXmppStunParser::username() const
+{
+    if (m_username < 0)
+        return QString();
+    const quint16 length = qFromBigEndian<quint16>(reinterpret_cast<const uchar*>(m_data + m_username + 2));
+    return QString::fromUtf8(m_data + m_username + 4, length);
+}
+
+/// Decodes the XOR-MAPPED-ADDRESS attribute.
+///
+/// Returns false if there is no such attribute or it is invalid.
+
+bool QXmppStunParser::xorMappedAddress(QHostAddress &host, quint16 &port) const
+{
+    if (m_xorMappedAddress < 0)
+        return false;
+
+    const uchar *data = reinterpret_cast<const uchar*>(m_data);
+    const uchar *value = data + m_xorMappedAddress + 4;
+    const quint16 length = qFromBigEndian<quint16>(data + m_xorMappedAddress + 2);
+    if (length == 8 && value[1] == STUN_IPV4) {
+        port = qFromBigEndian<quint16>(value + 2) ^ (STUN_MAGIC >> 16);
+        host = QHostAddress(qFromBigEndian<quint32>(value + 4) ^ STUN_MAGIC);
+        return true;
+    } else if (length == 20 && value[1] == STUN_IPV6) {
+        // the address is XOR'd with the magic cookie and transaction id,
+        // which follow each other in the header
+        Q_IPV6ADDR addr;
+        for (int i = 0; i < 16; ++i)
+            addr[i] = value[4 + i] ^ data[4 + i];
+        port = qFromBigEndian<quint16>(value + 2) ^ (STUN_MAGIC >> 16);
+        host = QHostAddress(addr);
+        return true;
+    }
+    return false;
+}
+
 /// Constructs a new QXmppStunMessage.
 
 QXmppStunMessage::QXmppStunMessage()
@@ -709,9 +1077,7 @@ bool QXmppStunMessage::decode(const QByteArray &buffer, const QByteArray &key, Q
             // check HMAC-SHA1
             if (!key.isEmpty())
             {
-                QByteArray copy = buffer.left(STUN_HEADER + done);
-                setBodyLength(copy, done + 24);
-                if (integrity != generateHmacSha1(key, copy))
+                if (!checkMessageIntegrity(QXmppHmacSha1(key), buffer.constData(), buffer.size(), STUN_HEADER + done))
                 {
                     *errors << QLatin1String("Bad message integrity");
                     return false;
@@ -932,10 +1298,14 @@ QByteArray QXmppStunMessage::encode(const QByteArray &key, bool addFingerprint)
     if (!key.isEmpty())
     {
         setBodyLength(buffer, buffer.size() - STUN_HEADER + 24);
-        QByteArray integrity = generateHmacSha1(key, buffer);
+        const QXmppHmacSha1 hmac(key);
+        QXmppSha1 hash = hmac.start();
+        hash.addData(buffer.constData(), buffer.size());
+        uchar integrity[20];
+        hmac.finish(hash, integrity);
         stream << quint16(MessageIntegrity);
-        stream << quint16(integrity.size());
-        stream.writeRawData(integrity.data(), integrity.size());
+        stream << quint16(sizeof(integrity));
+        stream.writeRawData(reinterpret_cast<const char*>(integrity), sizeof(integrity));
     }
 
     // FINGERPRINT
@@ -964,19 +1334,14 @@ quint16 QXmppStunMessage::peekType(const QByteArray &buffer, quint32 &cookie, QB
         return 0;
 
     // parse STUN header
-    QDataStream stream(buffer);
-    quint16 type;
-    quint16 length;
-    stream >> type;
-    stream >> length;
-    stream >> cookie;
-
+    const uchar *data = reinterpret_cast<const uchar*>(buffer.constData());
+    const quint16 length = qFromBigEndian<quint16>(data + 2);
     if (length != buffer.size() - STUN_HEADER)
         return 0;
 
-    id.resize(ID_SIZE);
-    stream.readRawData(id.data(), id.size());
-    return type;
+    cookie = qFromBigEndian<quint32>(data + 4);
+    id = buffer.mid(8, ID_SIZE);
+    return qFromBigEndian<quint16>(data);
 }
  
 QString QXmppStunMessage::toString() const
@@ -1134,6 +1499,359 @@ void QXmppStunTransaction::retry()
     m_retryTimer->start(2 * m_retryTimer->interval());
 }
 
+// Maximum number of datagrams moved by a single system call.
+static const int datagramBatchSize = 32;
+
+// Size of a receive slot, enough for the largest UDP datagram. The slab is
+// allocated once per thread and only the pages datagrams land in get used.
+static const int datagramSlotSize = 65536;
+
+#ifdef QXMPP_USE_MMSG
+// Cleared if the kernel turns out not to implement recvmmsg / sendmmsg.
+// Every thread's reader and writer may clear it.
+static QAtomicInt mmsgAvailable(1);
+
+static socklen_t hostToSockaddr(const QHostAddress &host, quint16 port, sockaddr_storage *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    if (host.protocol() == QAbstractSocket::IPv4Protocol) {
+        sockaddr_in *sin = reinterpret_cast<sockaddr_in*>(addr);
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(port);
+        sin->sin_addr.s_addr = htonl(host.toIPv4Address());
+        return sizeof(sockaddr_in);
+    } else if (host.protocol() == QAbstractSocket::IPv6Protocol && host.scopeId().isEmpty()) {
+        sockaddr_in6 *sin6 = reinterpret_cast<sockaddr_in6*>(addr);
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(port);
+        const Q_IPV6ADDR ip = host.toIPv6Address();
+        memcpy(&sin6->sin6_addr, &ip, sizeof(ip));
+        return sizeof(sockaddr_in6);
+    }
+
+    // let QUdpSocket handle anything else, such as scoped addresses
+    return 0;
+}
+#endif
+
+/// \internal
+///
+/// The QXmppDatagramReader class drains the datagrams pending on a
+/// QUdpSocket.
+///
+/// On Linux, datagrams are received in batches using recvmmsg() into a
+/// preallocated slab. Once the socket is drained, the last read goes
+/// through QUdpSocket so that it re-enables its read notifications.
+/// A single reader is shared by all the sockets of a thread.
+
+class QXmppDatagramReader
+{
+public:
+    QXmppDatagramReader();
+    bool read(QUdpSocket *socket, QByteArray &buffer, QHostAddress &host, quint16 &port);
+
+private:
+    bool readSocket(QUdpSocket *socket, QByteArray &buffer, QHostAddress &host, quint16 &port);
+
+#ifdef QXMPP_USE_MMSG
+    bool m_batching;
+    int m_count;
+    int m_index;
+    QPointer<QUdpSocket> m_socket;
+
+    mmsghdr m_messages[datagramBatchSize];
+    iovec m_vectors[datagramBatchSize];
+    sockaddr_storage m_addresses[datagramBatchSize];
+    char m_slab[datagramBatchSize][datagramSlotSize];
+
+    // most datagrams come from the same peer, avoid rebuilding its address
+    sockaddr_storage m_lastAddress;
+    socklen_t m_lastAddressLength;
+    QHostAddress m_lastHost;
+    quint16 m_lastPort;
+#endif
+};
+
+QXmppDatagramReader::QXmppDatagramReader()
+#ifdef QXMPP_USE_MMSG
+    : m_batching(true),
+    m_count(0),
+    m_index(0),
+    m_lastAddressLength(0),
+    m_lastPort(0)
+#endif
+{
+#ifdef QXMPP_USE_MMSG
+    memset(m_messages, 0, sizeof(m_messages));
+    for (int i = 0; i < datagramBatchSize; ++i) {
+        m_vectors[i].iov_base = m_slab[i];
+        m_vectors[i].iov_len = datagramSlotSize;
+        m_messages[i].msg_hdr.msg_iov = &m_vectors[i];
+        m_messages[i].msg_hdr.msg_iovlen = 1;
+        m_messages[i].msg_hdr.msg_name = &m_addresses[i];
+    }
+#endif
+}
+
+/// Reads the next pending datagram from \a socket.
+///
+/// Returns false once the socket has no more pending datagrams.
+
+bool QXmppDatagramReader::read(QUdpSocket *socket, QByteArray &buffer, QHostAddress &host, quint16 &port)
+{
+#ifdef QXMPP_USE_MMSG
+    if (m_index < m_count && m_socket != socket) {
+        if (m_socket) {
+            // the slab holds datagrams for another socket, this is a nested read
+            return readSocket(socket, buffer, host, port);
+        }
+        // the socket the slab was filled from is gone
+        m_index = m_count = 0;
+    }
+
+    forever {
+        if (m_index >= m_count) {
+            m_index = m_count = 0;
+            if (!m_batching || !mmsgAvailable)
+                break;
+
+            for (int i = 0; i < datagramBatchSize; ++i)
+                m_messages[i].msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+            const int count = recvmmsg(socket->socketDescriptor(), m_messages, datagramBatchSize, MSG_DONTWAIT, 0);
+            if (count <= 0) {
+                if (count < 0 && errno == ENOSYS)
+                    mmsgAvailable = 0;
+                break;
+            }
+            m_count = count;
+            m_socket = socket;
+            m_batching = (count == datagramBatchSize);
+        }
+
+        const mmsghdr &message = m_messages[m_index];
+        const int slot = m_index++;
+        if (message.msg_hdr.msg_flags & MSG_TRUNC) {
+            qWarning("Discarding truncated UDP datagram");
+            continue;
+        }
+
+        // decode sender
+        const socklen_t length = message.msg_hdr.msg_namelen;
+        if (length != m_lastAddressLength || memcmp(&m_addresses[slot], &m_lastAddress, length)) {
+            const sockaddr *addr = reinterpret_cast<const sockaddr*>(&m_addresses[slot]);
+            if (addr->sa_family == AF_INET)
+                m_lastPort = ntohs(reinterpret_cast<const sockaddr_in*>(addr)->sin_port);
+            else if (addr->sa_family == AF_INET6)
+                m_lastPort = ntohs(reinterpret_cast<const sockaddr_in6*>(addr)->sin6_port);
+            else
+                continue;
+            m_lastHost = QHostAddress(addr);
+            memcpy(&m_lastAddress, &m_addresses[slot], length);
+            m_lastAddressLength = length;
+        }
+        host = m_lastHost;
+        port = m_lastPort;
+
+        buffer.resize(message.msg_len);
+        memcpy(buffer.data(), m_slab[slot], message.msg_len);
+        return true;
+    }
+
+    // The socket is drained. QUdpSocket only re-enables its read
+    // notifications when readDatagram() is called, so finish with it.
+    m_batching = true;
+    if (socket->pendingDatagramSize() <= datagramSlotSize) {
+        const qint64 size = socket->readDatagram(m_slab[0], datagramSlotSize, &host, &port);
+        if (size < 0)
+            return false;
+        buffer.resize(size);
+        memcpy(buffer.data(), m_slab[0], size);
+        return true;
+    }
+#endif
+    return readSocket(socket, buffer, host, port);
+}
+
+bool QXmppDatagramReader::readSocket(QUdpSocket *socket, QByteArray &buffer, QHostAddress &host, quint16 &port)
+{
+    if (!socket->hasPendingDatagrams())
+        return false;
+
+    const qint64 size = socket->pendingDatagramSize();
+    buffer.resize(size);
+    socket->readDatagram(buffer.data(), buffer.size(), &host, &port);
+    return true;
+}
+
+static QThreadStorage<QXmppDatagramReader*> datagramReaders;
+
+static QXmppDatagramReader *datagramReader()
+{
+    if (!datagramReaders.hasLocalData())
+        datagramReaders.setLocalData(new QXmppDatagramReader);
+    return datagramReaders.localData();
+}
+
+/// \internal
+///
+/// The QXmppDatagramWriter class queues outgoing datagrams so that they
+/// can be sent in batches using sendmmsg() on Linux.
+///
+/// Like the reader, a single writer is shared by all the sockets of a
+/// thread. The queue is flushed once control returns to the event loop,
+/// so the datagrams written by all the components go out together.
+///
+/// Queued datagrams hold plain socket pointers, so the queue must be
+/// flushed before a socket it refers to is deleted.
+
+class QXmppDatagramWriter : public QObject
+{
+public:
+    QXmppDatagramWriter();
+
+    qint64 write(QUdpSocket *socket, const QByteArray &data, const QHostAddress &host, quint16 port);
+    void flush();
+
+protected:
+    bool event(QEvent *event);
+
+#ifdef QXMPP_USE_MMSG
+private:
+    struct Datagram
+    {
+        QUdpSocket *socket;
+        QByteArray data;
+        QHostAddress host;
+        quint16 port;
+        sockaddr_storage address;
+        socklen_t addressLength;
+    };
+    QVector<Datagram> m_queue;
+    int m_size;
+    bool m_flushPending;
+#endif
+};
+
+// Posted to the writer to flush its queue from the event loop.
+static const QEvent::Type datagramFlushEvent = QEvent::Type(QEvent::User + 1);
+
+QXmppDatagramWriter::QXmppDatagramWriter()
+#ifdef QXMPP_USE_MMSG
+    : m_size(0),
+    m_flushPending(false)
+#endif
+{
+}
+
+bool QXmppDatagramWriter::event(QEvent *event)
+{
+    if (event->type() == datagramFlushEvent) {
+        flush();
+        return true;
+    }
+    return QObject::event(event);
+}
+
+/// Queues a datagram, or sends it immediately if batching is unavailable.
+///
+/// Queued datagrams are sent once control returns to the event loop, or
+/// when flush() is called. For those, the size of the datagram is returned
+/// as it is queued, and a failure to send it is only reported by the
+/// socket's error() once the queue is flushed.
+
+qint64 QXmppDatagramWriter::write(QUdpSocket *socket, const QByteArray &data, const QHostAddress &host, quint16 port)
+{
+#ifdef QXMPP_USE_MMSG
+    if (mmsgAvailable) {
+        if (m_size == m_queue.size())
+            m_queue.resize(m_size + 1);
+        Datagram &datagram = m_queue[m_size];
+        datagram.addressLength = hostToSockaddr(host, port, &datagram.address);
+        if (datagram.addressLength) {
+            datagram.socket = socket;
+            datagram.data = data;
+            datagram.host = host;
+            datagram.port = port;
+            m_size++;
+            if (!m_flushPending) {
+                m_flushPending = true;
+                QCoreApplication::postEvent(this, new QEvent(datagramFlushEvent));
+            }
+            return data.size();
+        }
+    }
+#endif
+    return socket->writeDatagram(data, host, port);
+}
+
+/// Sends all queued datagrams.
+
+void QXmppDatagramWriter::flush()
+{
+#ifdef QXMPP_USE_MMSG
+    mmsghdr messages[datagramBatchSize];
+    iovec vectors[datagramBatchSize];
+    memset(messages, 0, sizeof(messages));
+
+    int i = 0;
+    while (i < m_size) {
+        // collect consecutive datagrams for the same socket
+        QUdpSocket *socket = m_queue[i].socket;
+        int count = 0;
+        while (i + count < m_size && count < datagramBatchSize && m_queue[i + count].socket == socket) {
+            Datagram &datagram = m_queue[i + count];
+            vectors[count].iov_base = const_cast<char*>(datagram.data.constData());
+            vectors[count].iov_len = datagram.data.size();
+            messages[count].msg_hdr.msg_iov = &vectors[count];
+            messages[count].msg_hdr.msg_iovlen = 1;
+            messages[count].msg_hdr.msg_name = &datagram.address;
+            messages[count].msg_hdr.msg_namelen = datagram.addressLength;
+            count++;
+        }
+
+        int sent = -1;
+        if (socket->state() == QAbstractSocket::BoundState && mmsgAvailable) {
+            sent = sendmmsg(socket->socketDescriptor(), messages, count, MSG_DONTWAIT);
+            if (sent < 0 && errno == ENOSYS)
+                mmsgAvailable = 0;
+        }
+        if (sent < 0)
+            sent = 0;
+        i += sent;
+
+        // hand the datagram which could not be sent to QUdpSocket, which
+        // reports the error
+        if (sent < count) {
+            const Datagram &datagram = m_queue[i];
+            socket->writeDatagram(datagram.data, datagram.host, datagram.port);
+            i++;
+        }
+    }
+
+    for (i = 0; i < m_size; ++i) {
+        m_queue[i].socket = 0;
+        m_queue[i].data = QByteArray();
+    }
+    m_size = 0;
+    m_flushPending = false;
+#endif
+}
+
+static QThreadStorage<QXmppDatagramWriter*> datagramWriters;
+
+static QXmppDatagramWriter *datagramWriter()
+{
+    if (!datagramWriters.hasLocalData())
+        datagramWriters.setLocalData(new QXmppDatagramWriter);
+    return datagramWriters.localData();
+}
+
+// Channel bindings last 10 minutes and are refreshed every 500 seconds if
+// they carried data. Once a binding expires, its number may not be bound
+// to another peer for 5 more minutes, so an idle number is kept for three
+// refresh intervals.
+static const int turnChannelIdleIntervals = 3;
+
 /// Constructs a new QXmppTurnAllocation.
 ///
 /// \param parent
@@ -1211,6 +1929,9 @@ void QXmppTurnAllocation::disconnectFromHost()
 
     // clear channels and any outstanding transactions
     m_channels.clear();
+    m_boundChannels.clear();
+    m_idleChannels.clear();
+    m_usedChannels.clear();
     foreach (QXmppStunTransaction *transaction, m_transactions)
         delete transaction;
     m_transactions.clear();
@@ -1232,30 +1953,50 @@ void QXmppTurnAllocation::disconnectFromHost()
     }
 }
 
+/// Sends a ChannelBind request for the given \a channel, which creates or
+/// refreshes the binding to its peer.
+
+void QXmppTurnAllocation::bindChannel(quint16 channel)
+{
+    const Address addr = m_boundChannels.value(channel);
+
+    QXmppStunMessage request;
+    request.setType(QXmppStunMessage::ChannelBind | QXmppStunMessage::Request);
+    request.setId(generateRandomBytes(12));
+    request.setNonce(m_nonce);
+    request.setRealm(m_realm);
+    request.setUsername(m_username);
+    request.setChannelNumber(channel);
+    request.xorPeerHost = addr.first;
+    request.xorPeerPort = addr.second;
+    m_transactions << new QXmppStunTransaction(request, this);
+
+    // schedule refresh
+    if (!m_channelTimer->isActive())
+        m_channelTimer->start();
+}
+
 void QXmppTurnAllocation::readyRead()
 {
+    QXmppDatagramReader *reader = datagramReader();
     QByteArray buffer;
     QHostAddress remoteHost;
     quint16 remotePort;
-    while (socket->hasPendingDatagrams()) {
-        const qint64 size = socket->pendingDatagramSize();
-        buffer.resize(size);
-        socket->readDatagram(buffer.data(), buffer.size(), &remoteHost, &remotePort);
+    while (reader->read(socket, buffer, remoteHost, remotePort))
         handleDatagram(buffer, remoteHost, remotePort);
-    }
 }
 
 void QXmppTurnAllocation::handleDatagram(const QByteArray &buffer, const QHostAddress &remoteHost, quint16 remotePort)
 {
     // demultiplex channel data
     if (buffer.size() >= 4 && (buffer[0] & 0xc0) == 0x40) {
-        QDataStream stream(buffer);
-        quint16 channel, length;
-        stream >> channel;
-        stream >> length;
-        if (m_state == ConnectedState && m_channels.contains(channel) && length <= buffer.size() - 4) {
-            emit datagramReceived(buffer.mid(4, length), m_channels[channel].first,
-                m_channels[channel].second);
+        const uchar *data = reinterpret_cast<const uchar*>(buffer.constData());
+        const quint16 channel = qFromBigEndian<quint16>(data);
+        const quint16 length = qFromBigEndian<quint16>(data + 2);
+        QMap<quint16, Address>::const_iterator it = m_channels.constFind(channel);
+        if (m_state == ConnectedState && it != m_channels.constEnd() && length <= buffer.size() - 4) {
+            m_usedChannels.insert(channel);
+            emit datagramReceived(buffer.mid(4, length), it.value().first, it.value().second);
         }
         return;
     }
@@ -1299,22 +2040,28 @@ void QXmppTurnAllocation::refresh()
     m_transactions << new QXmppStunTransaction(request, this);
 }
 
-/// Refresh channel bindings.
+/// Refresh channel bindings which carried data since the last refresh,
+/// the others are left to expire.
+///
+/// The number of an expired channel is kept for its peer until it may be
+/// bound to another peer, so that traffic which resumes in the meantime
+/// rebinds the same number.
 
 void QXmppTurnAllocation::refreshChannels()
 {
-    foreach (quint16 channel, m_channels.keys()) {
-        QXmppStunMessage request;
-        request.setType(QXmppStunMessage::ChannelBind | QXmppStunMessage::Request);
-        request.setId(generateRandomBytes(12));
-        request.setNonce(m_nonce);
-        request.setRealm(m_realm);
-        request.setUsername(m_username);
-        request.setChannelNumber(channel);
-        request.xorPeerHost = m_channels[channel].first;
-        request.xorPeerPort = m_channels[channel].second;
-        m_transactions << new QXmppStunTransaction(request, this);
+    foreach (quint16 channel, m_boundChannels.keys()) {
+        if (m_usedChannels.contains(channel)) {
+            m_idleChannels.remove(channel);
+            bindChannel(channel);
+        } else if (++m_idleChannels[channel] >= turnChannelIdleIntervals) {
+            m_channels.remove(channel);
+            m_boundChannels.remove(channel);
+            m_idleChannels.remove(channel);
+        }
     }
+    m_usedChannels.clear();
+    if (m_boundChannels.isEmpty())
+        m_channelTimer->stop();
 }
 
 /// Returns the relayed host address, i.e. the address on the server
@@ -1390,11 +2137,13 @@ void QXmppTurnAllocation::transactionFinished()
         return;
     transaction->deleteLater();
 
-    // handle authentication
+    // handle authentication, including nonces which went stale while
+    // the allocation was kept for reuse
     const QXmppStunMessage reply = transaction->response();
     if (reply.messageClass() == QXmppStunMessage::Error &&
-        reply.errorCode == 401 &&
-        (reply.nonce() != m_nonce && reply.realm() != m_realm))
+        ((reply.errorCode == 401 && reply.realm() != m_realm) ||
+         (reply.errorCode == 438 && !reply.nonce().isEmpty())) &&
+        reply.nonce() != m_nonce)
     {
         // update long-term credentials
         m_nonce = reply.nonce();
@@ -1447,8 +2196,12 @@ void QXmppTurnAllocation::transactionFinished()
                 QString::number(reply.errorCode), reply.errorPhrase));
 
             // remove channel
-            m_channels.remove(transaction->request().channelNumber());
-            if (m_channels.isEmpty())
+            const quint16 channel = transaction->request().channelNumber();
+            m_channels.remove(channel);
+            m_boundChannels.remove(channel);
+            m_idleChannels.remove(channel);
+            m_usedChannels.remove(channel);
+            if (m_boundChannels.isEmpty())
                 m_channelTimer->stop();
             return;
         }
@@ -1483,34 +2236,42 @@ qint64 QXmppTurnAllocation::writeDatagram(const QByteArray &data, const QHostAdd
     quint16 channel = m_channels.key(addr);
 
     if (!channel) {
-        channel = m_channelNumber++;
+        // reuse the number which is still reserved for this peer, if any
+        channel = m_boundChannels.key(addr);
+        if (!channel) {
+            // channel numbers range from 0x4000 to 0x7FFF, skip the
+            // numbers which are still reserved for other peers
+            if (m_boundChannels.size() > 0x7fff - 0x4000) {
+                warning("No TURN channel number is available");
+                return -1;
+            }
+            do {
+                channel = m_channelNumber++;
+                if (m_channelNumber > 0x7fff)
+                    m_channelNumber = 0x4000;
+            } while (m_boundChannels.contains(channel));
+            m_boundChannels.insert(channel, addr);
+            bindChannel(channel);
+        }
         m_channels.insert(channel, addr);
+    }
 
-        // bind channel
-        QXmppStunMessage request;
-        request.setType(QXmppStunMessage::ChannelBind | QXmppStunMessage::Request);
-        request.setId(generateRandomBytes(12));
-        request.setNonce(m_nonce);
-        request.setRealm(m_realm);
-        request.setUsername(m_username);
-        request.setChannelNumber(channel);
-        request.xorPeerHost = host;
-        request.xorPeerPort = port;
-        m_transactions << new QXmppStunTransaction(request, this);
-
-        // schedule refresh
-        if (!m_channelTimer->isActive())
-            m_channelTimer->start();
-    }
-
-    // send data
-    QByteArray channelData;
-    channelData.reserve(4 + data.size());
-    QDataStream stream(&channelData, QIODevice::WriteOnly);
-    stream << channel;
-    stream << quint16(data.size());
-    stream.writeRawData(data.data(), data.size());
-    if (socket->writeDatagram(channelData, m_turnHost, m_turnPort) == channelData.size())
+    // the binding may have expired while the channel was idle
+    if (m_idleChannels.remove(channel))
+        bindChannel(channel);
+
+    m_usedChannels.insert(channel);
+
+    // frame the data in a buffer which is kept from one datagram to the
+    // next, so that it only grows to the largest datagram
+    const int size = 4 + data.size();
+    if (m_channelData.size() < size)
+        m_channelData.resize(size);
+    uchar *frame = reinterpret_cast<uchar*>(m_channelData.data());
+    qToBigEndian(channel, frame);
+    qToBigEndian(quint16(data.size()), frame + 2);
+    memcpy(frame + 4, data.constData(), data.size());
+    if (socket->writeDatagram(m_channelData.constData(), size, m_turnHost, m_turnPort) == size)
         return data.size();
     else
         return -1;
@@ -1527,9 +2288,118 @@ void QXmppTurnAllocation::writeStun(const QXmppStunMessage &message)
 #endif
 }
 
+// Number of expiry intervals during which a released allocation is kept.
+static const int turnPoolIntervals = 5;
+
+static QThreadStorage<QXmppTurnAllocationPool*> turnPools;
+
+QXmppTurnAllocationPool::QXmppTurnAllocationPool()
+{
+    m_timer = new QTimer(this);
+    m_timer->setInterval(60 * 1000);
+    bool check = connect(m_timer, SIGNAL(timeout()),
+                         this, SLOT(expire()));
+    Q_ASSERT(check);
+    Q_UNUSED(check);
+}
+
+/// Returns the pool for the current thread.
+
+QXmppTurnAllocationPool *QXmppTurnAllocationPool::instance()
+{
+    if (!turnPools.hasLocalData())
+        turnPools.setLocalData(new QXmppTurnAllocationPool);
+    return turnPools.localData();
+}
+
+/// Returns an allocation on the given TURN server for the given
+/// credentials, which is connected if it was reused.
+///
+/// \param host The address of the TURN server.
+/// \param port The port of the TURN server.
+/// \param user The user for authentication with the TURN server.
+/// \param password The password for authentication with the TURN server.
+/// \param parent The new parent of the allocation.
+
+QXmppTurnAllocation *QXmppTurnAllocationPool::take(const QHostAddress &host, quint16 port, const QString &user, const QString &password, QObject *parent)
+{
+    for (int i = 0; i < m_allocations.size(); ++i) {
+        QXmppTurnAllocation *allocation = m_allocations[i].first;
+        if (allocation->m_turnHost == host &&
+            allocation->m_turnPort == port &&
+            allocation->m_username == user &&
+            allocation->m_password == password &&
+            allocation->state() == QXmppTurnAllocation::ConnectedState) {
+            m_allocations.removeAt(i);
+            if (m_allocations.isEmpty())
+                m_timer->stop();
+            allocation->setParent(parent);
+            return allocation;
+        }
+    }
+
+    QXmppTurnAllocation *allocation = new QXmppTurnAllocation(parent);
+    allocation->setServer(host, port);
+    allocation->setUser(user);
+    allocation->setPassword(password);
+    return allocation;
+}
+
+/// Takes ownership of an \a allocation which is no longer used. If it is
+/// connected it is kept for reuse, otherwise it is discarded.
+///
+/// \param allocation
+
+void QXmppTurnAllocationPool::release(QXmppTurnAllocation *allocation)
+{
+    // the next owner only receives data on the channels it binds, the
+    // numbers stay reserved for their peers until the bindings expire
+    allocation->m_channels.clear();
+    allocation->m_usedChannels.clear();
+
+    allocation->setParent(this);
+    if (allocation->state() != QXmppTurnAllocation::ConnectedState) {
+        allocation->disconnectFromHost();
+        allocation->deleteLater();
+        return;
+    }
+
+    m_allocations << qMakePair(allocation, 0);
+    if (!m_timer->isActive())
+        m_timer->start();
+}
+
+void QXmppTurnAllocationPool::expire()
+{
+    for (int i = m_allocations.size() - 1; i >= 0; --i) {
+        QXmppTurnAllocation *allocation = m_allocations[i].first;
+        if (allocation->state() == QXmppTurnAllocation::ConnectedState &&
+            ++m_allocations[i].second < turnPoolIntervals)
+            continue;
+
+        // release the allocation on the server, then delete it
+        m_allocations.removeAt(i);
+        if (allocation->state() == QXmppTurnAllocation::ConnectedState) {
+            bool check = connect(allocation, SIGNAL(disconnected()),
+                                 allocation, SLOT(deleteLater()));
+            Q_ASSERT(check);
+            Q_UNUSED(check);
+            allocation->disconnectFromHost();
+        } else {
+            allocation->deleteLater();
+        }
+    }
+    if (m_allocations.isEmpty())
+        m_timer->stop();
+}
+
 QXmppIceComponent::Pair::Pair(int component, bool controlling)
     : checked(QIODevice::NotOpen),
     socket(0),
+    state(FrozenState),
+    tries(0),
+    rto(0),
+    timeout(0),
     m_component(component),
     m_controlling(controlling)
 {
@@ -1572,17 +2442,23 @@ QXmppIceComponent::QXmppIceComponent(QObject *parent)
     m_activePair(0),
     m_fallbackPair(0),
     m_iceControlling(false),
+    m_checking(false),
     m_peerReflexivePriority(0),
+    m_multiplexer(0),
     m_stunPort(0),
     m_stunTries(0),
-    m_turnConfigured(false)
+    m_turnAllocation(0),
+    m_turnConfigured(false),
+    m_turnPort(0)
 {
     bool check;
     m_localUser = generateStanzaHash(4);
     m_localPassword = generateStanzaHash(22);
+    m_localHmac = new QXmppHmacSha1(m_localPassword.toUtf8());
+    m_remoteHmac = new QXmppHmacSha1;
 
     m_timer = new QTimer(this);
-    m_timer->setInterval(500);
+    m_timer->setInterval(ICE_PACING_INTERVAL);
     check = connect(m_timer, SIGNAL(timeout()),
                     this, SLOT(checkCandidates()));
     Q_ASSERT(check);
@@ -1592,22 +2468,20 @@ QXmppIceComponent::QXmppIceComponent(QObject *parent)
     check = connect(m_stunTimer, SIGNAL(timeout()),
                     this, SLOT(checkStun()));
     Q_ASSERT(check);
-
-    m_turnAllocation = new QXmppTurnAllocation(this);
-    check = connect(m_turnAllocation, SIGNAL(connected()),
-                    this, SLOT(turnConnected()));
-    Q_ASSERT(check);
-    check = connect(m_turnAllocation, SIGNAL(datagramReceived(QByteArray,QHostAddress,quint16)),
-                    this, SLOT(handleDatagram(QByteArray,QHostAddress,quint16)));
-    Q_ASSERT(check);
 }
 
 /// Destroys the QXmppIceComponent.
 
 QXmppIceComponent::~QXmppIceComponent()
 {
+    releaseTurnAllocation();
+    if (m_multiplexer)
+        m_multiplexer->removeComponent(this);
     foreach (Pair *pair, m_pairs)
         delete pair;
+    datagramWriter()->flush();
+    delete m_localHmac;
+    delete m_remoteHmac;
 }
 
 /// Returns the component id for the current socket, e.g. 1 for RTP
@@ -1639,28 +2513,51 @@ void QXmppIceComponent::setComponent(int component)
 
 void QXmppIceComponent::checkCandidates()
 {
-    debug("Checking remote candidates");
+    if (m_remoteUser.isEmpty())
+        return;
+
+    // retransmit checks which timed out
+    bool inProgress = false;
     foreach (Pair *pair, m_pairs)
     {
-        if (m_remoteUser.isEmpty())
+        if (pair->state != Pair::InProgressState)
             continue;
 
-        // send a binding request
-        QXmppStunMessage message;
-        message.setId(pair->transaction);
-        message.setType(QXmppStunMessage::Binding | QXmppStunMessage::Request);
-        message.setPriority(m_peerReflexivePriority);
-        message.setUsername(QString("%1:%2").arg(m_remoteUser, m_localUser));
-        if (m_iceControlling)
-        {
-            message.iceControlling = QByteArray(8, 0);
-            message.useCandidate = true;
+        pair->timeout -= m_timer->interval();
+        if (pair->timeout > 0) {
+            inProgress = true;
+        } else if (pair->tries >= STUN_RTO_MAX) {
+            debug(QString("ICE check failed %1").arg(pair->toString()));
+            pair->state = Pair::FailedState;
         } else {
-            message.iceControlled = QByteArray(8, 0);
+            sendCheck(pair);
+            inProgress = true;
         }
-        writeStun(message, pair);
     }
 
+    // start one new check per interval, triggered checks first, then the
+    // highest priority waiting pair, then the highest priority frozen pair
+    // see RFC 5245 - 5.8. Scheduling Checks
+    Pair *next = 0;
+    if (!m_triggeredPairs.isEmpty()) {
+        next = m_triggeredPairs.takeFirst();
+    } else {
+        foreach (Pair *pair, m_pairs) {
+            if (m_activePair && pair->priority() <= m_activePair->priority())
+                break;
+            if (pair->state == Pair::WaitingState) {
+                next = pair;
+                break;
+            } else if (pair->state == Pair::FrozenState && !next) {
+                next = pair;
+            }
+        }
+    }
+
+    if (next)
+        sendCheck(next);
+    else if (!inProgress)
+        m_timer->stop();
 }
 
 void QXmppIceComponent::checkStun()
@@ -1689,9 +2586,18 @@ void QXmppIceComponent::checkStun()
 
 void QXmppIceComponent::close()
 {
-    foreach (QUdpSocket *socket, m_sockets)
-        socket->close();
-    m_turnAllocation->disconnectFromHost();
+    // send the media which is still queued before the sockets close
+    datagramWriter()->flush();
+    if (m_multiplexer) {
+        // shared sockets stay open, stop receiving from them
+        m_multiplexer->removeComponent(this);
+    } else {
+        foreach (QUdpSocket *socket, m_sockets)
+            socket->close();
+    }
+    releaseTurnAllocation();
+    m_checking = false;
+    m_triggeredPairs.clear();
     m_timer->stop();
     m_stunTimer->stop();
     m_activePair = 0;
@@ -1704,6 +2610,7 @@ void QXmppIceComponent::connectToHost()
     if (m_activePair)
         return;
 
+    m_checking = true;
     checkCandidates();
     m_timer->start();
 }
@@ -1720,6 +2627,15 @@ void QXmppIceComponent::setIceControlling(bool controlling)
     m_iceControlling = controlling;
 }
 
+/// Sets the pacing interval between connectivity checks, also known as Ta.
+///
+/// \param msecs
+
+void QXmppIceComponent::setCheckInterval(int msecs)
+{
+    m_timer->setInterval(qMax(msecs, 1));
+}
+
 /// Returns the list of local candidates.
 
 QList<QXmppJingleCandidate> QXmppIceComponent::localCandidates() const
@@ -1734,6 +2650,8 @@ QList<QXmppJingleCandidate> QXmppIceComponent::localCandidates() const
 void QXmppIceComponent::setLocalUser(const QString &user)
 {
     m_localUser = user;
+    if (m_multiplexer)
+        m_multiplexer->addComponent(this);
 }
 
 /// Sets the local password.
@@ -1743,6 +2661,7 @@ void QXmppIceComponent::setLocalUser(const QString &user)
 void QXmppIceComponent::setLocalPassword(const QString &password)
 {
     m_localPassword = password;
+    m_localHmac->setKey(password.toUtf8());
 }
 
 /// Adds a remote STUN candidate.
@@ -1779,7 +2698,7 @@ bool QXmppIceComponent::addRemoteCandidate(const QXmppJingleCandidate &candidate
             pair->remote.setHost(remoteHost);
         }
         pair->socket = socket;
-        m_pairs << pair;
+        insertPair(pair);
 
         if (!m_fallbackPair)
             m_fallbackPair = pair;
@@ -1790,8 +2709,12 @@ bool QXmppIceComponent::addRemoteCandidate(const QXmppJingleCandidate &candidate
         Pair *pair = new Pair(m_component, m_iceControlling);
         pair->remote = candidate;
         pair->socket = 0;
-        m_pairs << pair;
+        insertPair(pair);
     }
+
+    // resume checks if they had run out of pairs
+    if (m_checking && !m_activePair && !m_timer->isActive())
+        m_timer->start();
     return true;
 }
 
@@ -1817,12 +2740,99 @@ QXmppIceComponent::Pair *QXmppIceComponent::addRemoteCandidate(QUdpSocket *socke
     Pair *pair = new Pair(m_component, m_iceControlling);
     pair->remote = candidate;
     pair->socket = socket;
-    m_pairs << pair;
+    insertPair(pair);
 
     debug(QString("Added candidate %1").arg(pair->toString()));
     return pair;
 }
 
+/// Adds a \a pair to the check list, which is ordered by decreasing
+/// priority.
+///
+/// The pair starts in the waiting state, unless another pair with the same
+/// foundation is still waiting for or undergoing a check.
+
+void QXmppIceComponent::insertPair(Pair *pair)
+{
+    const int local = m_sockets.indexOf(pair->socket);
+    pair->foundation = QString("%1:%2").arg(
+        local < 0 ? QString("relay") : QString::number(local),
+        QString::number(pair->remote.foundation()));
+
+    pair->state = Pair::WaitingState;
+    foreach (Pair *other, m_pairs) {
+        if (other->foundation == pair->foundation &&
+            other->state <= Pair::InProgressState) {
+            pair->state = Pair::FrozenState;
+            break;
+        }
+    }
+
+    const quint64 priority = pair->priority();
+    int i = 0;
+    while (i < m_pairs.size() && m_pairs[i]->priority() >= priority)
+        ++i;
+    m_pairs.insert(i, pair);
+
+    if (m_multiplexer && pair->socket) {
+        m_multiplexer->addRoute(this, pair->socket, pair->remote.host(), pair->remote.port());
+        m_multiplexer->addTransaction(this, pair->transaction);
+    }
+}
+
+/// Sends a connectivity check for the given \a pair, or retransmits it if
+/// the check is already in progress.
+
+void QXmppIceComponent::sendCheck(Pair *pair)
+{
+    if (pair->state == Pair::InProgressState) {
+        pair->tries++;
+        pair->timeout = pair->rto << (pair->tries - 1);
+    } else {
+        // see RFC 5245 - 16.1. RTP Media Streams
+        int active = 0;
+        foreach (Pair *other, m_pairs)
+            if (other->state == Pair::WaitingState || other->state == Pair::InProgressState)
+                active++;
+        pair->state = Pair::InProgressState;
+        pair->tries = 1;
+        pair->rto = qMax(ICE_RTO_MIN, m_timer->interval() * active);
+        pair->timeout = pair->rto;
+    }
+
+    // send a binding request, nominating the pair straight away if we are
+    // the controlling agent
+    QXmppStunMessage message;
+    message.setId(pair->transaction);
+    message.setType(QXmppStunMessage::Binding | QXmppStunMessage::Request);
+    message.setPriority(m_peerReflexivePriority);
+    message.setUsername(QString("%1:%2").arg(m_remoteUser, m_localUser));
+    if (m_iceControlling)
+    {
+        message.iceControlling = QByteArray(8, 0);
+        message.useCandidate = true;
+    } else {
+        message.iceControlled = QByteArray(8, 0);
+    }
+    writeStun(message, pair);
+}
+
+/// Queues a triggered check for the given \a pair, which is sent ahead of
+/// ordinary checks.
+
+void QXmppIceComponent::triggerCheck(Pair *pair)
+{
+    if (pair->state == Pair::InProgressState ||
+        pair->state == Pair::SucceededState ||
+        m_triggeredPairs.contains(pair))
+        return;
+
+    pair->state = Pair::WaitingState;
+    m_triggeredPairs << pair;
+    if (!m_timer->isActive())
+        m_timer->start();
+}
+
 /// Sets the remote user fragment.
 ///
 /// \param user
@@ -1839,26 +2849,41 @@ void QXmppIceComponent::setRemoteUser(const QString &user)
 void QXmppIceComponent::setRemotePassword(const QString &password)
 {
     m_remotePassword = password;
+    m_remoteHmac->setKey(password.toUtf8());
 }
 
 /// Sets the list of sockets to use for this component.
 ///
+/// If a \a multiplexer is given, the sockets belong to it and may be
+/// shared with other components, otherwise the component takes ownership
+/// of them.
+///
 /// \param sockets
+/// \param multiplexer
 
-void QXmppIceComponent::setSockets(QList<QUdpSocket*> sockets)
+void QXmppIceComponent::setSockets(QList<QUdpSocket*> sockets, QXmppIceMultiplexer *multiplexer)
 {
     // clear previous candidates and sockets
     m_localCandidates.clear();
-    foreach (QUdpSocket *socket, m_sockets)
-        delete socket;
+    if (m_multiplexer) {
+        m_multiplexer->removeComponent(this);
+    } else {
+        // send the media which is still queued before the sockets go away
+        datagramWriter()->flush();
+        foreach (QUdpSocket *socket, m_sockets)
+            delete socket;
+    }
     m_sockets.clear();
+    m_multiplexer = multiplexer;
 
     // store candidates
     int foundation = 0;
     foreach (QUdpSocket *socket, sockets)
     {
-        socket->setParent(this);
-        connect(socket, SIGNAL(readyRead()), this, SLOT(readyRead()));
+        if (!m_multiplexer) {
+            socket->setParent(this);
+            connect(socket, SIGNAL(readyRead()), this, SLOT(readyRead()));
+        }
 
         QXmppJingleCandidate candidate;
         candidate.setComponent(m_component);
@@ -1879,6 +2904,8 @@ void QXmppIceComponent::setSockets(QList<QUdpSocket*> sockets)
         m_sockets << socket;
         m_localCandidates << candidate;
     }
+    if (m_multiplexer)
+        m_multiplexer->addComponent(this);
 
     // start STUN checks
     if (!m_stunHost.isNull() && m_stunPort) {
@@ -1887,9 +2914,36 @@ void QXmppIceComponent::setSockets(QList<QUdpSocket*> sockets)
         m_stunTimer->start();
     }
 
-    // connect to TURN server
-    if (m_turnConfigured)
-        m_turnAllocation->connectToHost();
+    // connect to TURN server, reusing an allocation if possible
+    releaseTurnAllocation();
+    if (m_turnConfigured) {
+        m_turnAllocation = QXmppTurnAllocationPool::instance()->take(
+            m_turnHost, m_turnPort, m_turnUser, m_turnPassword, this);
+        bool check = connect(m_turnAllocation, SIGNAL(connected()),
+                             this, SLOT(turnConnected()));
+        Q_ASSERT(check);
+        check = connect(m_turnAllocation, SIGNAL(datagramReceived(QByteArray,QHostAddress,quint16)),
+                        this, SLOT(handleDatagram(QByteArray,QHostAddress,quint16)));
+        Q_ASSERT(check);
+        Q_UNUSED(check);
+
+        if (m_turnAllocation->state() == QXmppTurnAllocation::ConnectedState)
+            QMetaObject::invokeMethod(this, "turnConnected", Qt::QueuedConnection);
+        else
+            m_turnAllocation->connectToHost();
+    }
+}
+
+/// Hands the TURN allocation over to the pool, so that it can be reused
+/// by another component.
+
+void QXmppIceComponent::releaseTurnAllocation()
+{
+    if (m_turnAllocation) {
+        m_turnAllocation->disconnect(this);
+        QXmppTurnAllocationPool::instance()->release(m_turnAllocation);
+        m_turnAllocation = 0;
+    }
 }
 
 /// Sets the STUN server to use to determine server-reflexive addresses
@@ -1903,6 +2957,8 @@ void QXmppIceComponent::setStunServer(const QHostAddress &host, quint16 port)
     m_stunHost = host;
     m_stunPort = port;
     m_stunId = generateRandomBytes(ID_SIZE);
+    if (m_multiplexer)
+        m_multiplexer->addComponent(this);
 }
 
 /// Sets the TURN server to use to relay packets in double-NAT configurations.
@@ -1912,7 +2968,8 @@ void QXmppIceComponent::setStunServer(const QHostAddress &host, quint16 port)
 
 void QXmppIceComponent::setTurnServer(const QHostAddress &host, quint16 port)
 {
-    m_turnAllocation->setServer(host, port);
+    m_turnHost = host;
+    m_turnPort = port;
     m_turnConfigured = !host.isNull() && port;
 }
 
@@ -1922,7 +2979,7 @@ void QXmppIceComponent::setTurnServer(const QHostAddress &host, quint16 port)
 
 void QXmppIceComponent::setTurnUser(const QString &user)
 {
-    m_turnAllocation->setUser(user);
+    m_turnUser = user;
 }
 
 /// Sets the \a password used for authentication with the TURN server.
@@ -1931,7 +2988,7 @@ void QXmppIceComponent::setTurnUser(const QString &user)
 
 void QXmppIceComponent::setTurnPassword(const QString &password)
 {
-    m_turnAllocation->setPassword(password);
+    m_turnPassword = password;
 }
 
 void QXmppIceComponent::readyRead()
@@ -1940,24 +2997,18 @@ void QXmppIceComponent::readyRead()
     if (!socket)
         return;
 
+    QXmppDatagramReader *reader = datagramReader();
     QByteArray buffer;
     QHostAddress remoteHost;
     quint16 remotePort;
-    while (socket->hasPendingDatagrams()) {
-        const qint64 size = socket->pendingDatagramSize();
-        buffer.resize(size);
-        socket->readDatagram(buffer.data(), buffer.size(), &remoteHost, &remotePort);
+    while (reader->read(socket, buffer, remoteHost, remotePort))
         handleDatagram(buffer, remoteHost, remotePort, socket);
-    }
 }
 
 void QXmppIceComponent::handleDatagram(const QByteArray &buffer, const QHostAddress &remoteHost, quint16 remotePort, QUdpSocket *socket)
 {
     // if this is not a STUN message, emit it
-    quint32 messageCookie;
-    QByteArray messageId;
-    quint16 messageType = QXmppStunMessage::peekType(buffer, messageCookie, messageId);
-    if (!messageType || messageCookie != STUN_MAGIC)
+    if (!QXmppStunParser::isStun(buffer))
     {
         // use this as an opportunity to flag a potential pair
         foreach (Pair *pair, m_pairs) {
@@ -1971,34 +3022,32 @@ void QXmppIceComponent::handleDatagram(const QByteArray &buffer, const QHostAddr
         return;
     }
 
-    // determine password to use
-    QString messagePassword;
-    if (messageId != m_stunId)
+    QXmppStunParser parser;
+    if (!parser.parse(buffer))
     {
-        messagePassword = (messageType & 0xFF00) ? m_remotePassword : m_localPassword;
-        if (messagePassword.isEmpty())
-            return;
+        warning("Received an invalid STUN packet");
+        return;
     }
 
-    // parse STUN message
-    QXmppStunMessage message;
-    QStringList errors;
-    if (!message.decode(buffer, messagePassword.toUtf8(), &errors))
+    // check how to handle message
+    if (parser.hasId(m_stunId))
     {
-        foreach (const QString &error, errors)
-            warning(error);
-        return;
-    }
+        // responses from the STUN server are rare, decode them fully
+        QXmppStunMessage message;
+        QStringList errors;
+        if (!message.decode(buffer, QByteArray(), &errors))
+        {
+            foreach (const QString &error, errors)
+                warning(error);
+            return;
+        }
 #ifdef QXMPP_DEBUG_STUN
-    logReceived(QString("STUN packet from %1 port %2\n%3").arg(
-            remoteHost.toString(),
-            QString::number(remotePort),
-            message.toString()));
+        logReceived(QString("STUN packet from %1 port %2\n%3").arg(
+                remoteHost.toString(),
+                QString::number(remotePort),
+                message.toString()));
 #endif
 
-    // check how to handle message
-    if (message.id() == m_stunId)
-    {
         m_stunTimer->stop();
 
         // determine server-reflexive address
@@ -2043,47 +3092,67 @@ void QXmppIceComponent::handleDatagram(const QByteArray &buffer, const QHostAddr
         return;
     }
 
+    // connectivity checks are validated in place, using the key pads
+    // precomputed for the relevant password
+    const quint16 messageType = parser.type();
+    const QXmppHmacSha1 *hmac = (messageType & 0xFF00) ? m_remoteHmac : m_localHmac;
+    if (hmac->isNull())
+        return;
+    if (!parser.checkIntegrity(*hmac))
+    {
+        warning("Bad message integrity");
+        return;
+    }
+    if (!parser.checkFingerprint())
+    {
+        warning("Bad fingerprint");
+        return;
+    }
+#ifdef QXMPP_DEBUG_STUN
+    if (isLogging(QXmppLogger::ReceivedMessage))
+    {
+        QXmppStunMessage message;
+        message.decode(buffer);
+        logReceived(QString("STUN packet from %1 port %2\n%3").arg(
+                remoteHost.toString(),
+                QString::number(remotePort),
+                message.toString()));
+    }
+#endif
+
     // process message from peer
     Pair *pair = 0;
-    if (message.type() == (QXmppStunMessage::Binding | QXmppStunMessage::Request))
+    if (messageType == (QXmppStunMessage::Binding | QXmppStunMessage::Request))
     {
         // add remote candidate
-        pair = addRemoteCandidate(socket, remoteHost, remotePort, message.priority());
+        pair = addRemoteCandidate(socket, remoteHost, remotePort, parser.priority());
 
         // send a binding response
         QXmppStunMessage response;
-        response.setId(message.id());
+        response.setId(parser.id());
         response.setType(QXmppStunMessage::Binding | QXmppStunMessage::Response);
-        response.setUsername(message.username());
+        response.setUsername(parser.username());
         response.xorMappedHost = pair->remote.host();
         response.xorMappedPort = pair->remote.port();
         writeStun(response, pair);
 
         // update state
-        if (m_iceControlling || message.useCandidate)
+        if (m_iceControlling || parser.useCandidate())
         {
             debug(QString("ICE reverse check complete %1").arg(pair->toString()));
             pair->checked |= QIODevice::ReadOnly;
         }
 
-        if (!m_iceControlling && !m_activePair && !m_remoteUser.isEmpty())
-        {
-            // send a triggered connectivity test
-            QXmppStunMessage message;
-            message.setId(pair->transaction);
-            message.setType(QXmppStunMessage::Binding | QXmppStunMessage::Request);
-            message.setPriority(m_peerReflexivePriority);
-            message.setUsername(QString("%1:%2").arg(m_remoteUser, m_localUser));
-            message.iceControlled = QByteArray(8, 0);
-            writeStun(message, pair);
-        }
+        // schedule a triggered connectivity test
+        if (!m_activePair && !m_remoteUser.isEmpty())
+            triggerCheck(pair);
 
-    } else if (message.type() == (QXmppStunMessage::Binding | QXmppStunMessage::Response)) {
+    } else if (messageType == (QXmppStunMessage::Binding | QXmppStunMessage::Response)) {
 
         // find the pair for this transaction
         foreach (Pair *ptr, m_pairs)
         {
-            if (ptr->transaction == message.id())
+            if (parser.hasId(ptr->transaction))
             {
                 pair = ptr;
                 break;
@@ -2091,12 +3160,15 @@ void QXmppIceComponent::handleDatagram(const QByteArray &buffer, const QHostAddr
         }
         if (!pair)
         {
-            debug(QString("Unknown transaction %1").arg(QString::fromAscii(message.id().toHex())));
+            debug(QString("Unknown transaction %1").arg(QString::fromAscii(parser.id().toHex())));
             return;
         }
         // store peer-reflexive address
-        pair->reflexive.setHost(message.xorMappedHost);
-        pair->reflexive.setPort(message.xorMappedPort);
+        QHostAddress reflexiveHost;
+        quint16 reflexivePort = 0;
+        parser.xorMappedAddress(reflexiveHost, reflexivePort);
+        pair->reflexive.setHost(reflexiveHost);
+        pair->reflexive.setPort(reflexivePort);
 
 #if 0
         // send a binding indication
@@ -2109,17 +3181,34 @@ void QXmppIceComponent::handleDatagram(const QByteArray &buffer, const QHostAddr
         // outgoing media can flow
         debug(QString("ICE forward check complete %1").arg(pair->toString()));
         pair->checked |= QIODevice::WriteOnly;
+        pair->state = Pair::SucceededState;
+
+        // unfreeze the pairs which share its foundation
+        foreach (Pair *other, m_pairs)
+            if (other->state == Pair::FrozenState && other->foundation == pair->foundation)
+                other->state = Pair::WaitingState;
     }
 
     // signal completion
     if (pair && pair->checked == QIODevice::ReadWrite)
     { 
-        m_timer->stop();
         if (!m_activePair || pair->priority() > m_activePair->priority()) {
             info(QString("ICE pair selected %1 (priority: %2)").arg(
                 pair->toString(), QString::number(pair->priority())));
             const bool wasConnected = (m_activePair != 0);
             m_activePair = pair;
+
+            // only checks which may yield a better pair remain useful
+            // see RFC 5245 - 8.1.2. Updating States
+            const quint64 priority = pair->priority();
+            m_triggeredPairs.clear();
+            foreach (Pair *other, m_pairs) {
+                if (other->state == Pair::FrozenState ||
+                    other->state == Pair::WaitingState ||
+                    (other->state == Pair::InProgressState && other->priority() < priority))
+                    other->state = Pair::FailedState;
+            }
+
             if (!wasConnected)
                 emit connected();
         }
@@ -2128,6 +3217,19 @@ void QXmppIceComponent::handleDatagram(const QByteArray &buffer, const QHostAddr
 
 void QXmppIceComponent::turnConnected()
 {
+    // the allocation may have been released since it was taken from the pool
+    if (!m_turnAllocation || m_turnAllocation->state() != QXmppTurnAllocation::ConnectedState)
+        return;
+
+    // check whether this candidate is already known
+    foreach (const QXmppJingleCandidate &candidate, m_localCandidates)
+    {
+        if (candidate.host() == m_turnAllocation->relayedHost() &&
+            candidate.port() == m_turnAllocation->relayedPort() &&
+            candidate.type() == QXmppJingleCandidate::RelayedType)
+            return;
+    }
+
     // add the new local candidate
     debug(QString("Adding relayed candidate %1 port %2").arg(
         m_turnAllocation->relayedHost().toString(),
@@ -2250,6 +3352,13 @@ QList<QUdpSocket*> QXmppIceComponent::reservePorts(const QList<QHostAddress> &ad
 
 /// Sends a data packet to the remote party.
 ///
+/// Media sent over a local socket is queued and sent once control returns
+/// to the event loop. The size of the datagram is then returned as soon as
+/// it is queued, and failures are only reported by the socket.
+///
+/// Returns the number of bytes sent or queued, or -1 if there is no pair
+/// to send the data on.
+///
 /// \param datagram
 
 qint64 QXmppIceComponent::sendDatagram(const QByteArray &datagram)
@@ -2257,9 +3366,10 @@ qint64 QXmppIceComponent::sendDatagram(const QByteArray &datagram)
     Pair *pair = m_activePair ? m_activePair : m_fallbackPair;
     if (!pair)
         return -1;
-    if (pair->socket)
-        return pair->socket->writeDatagram(datagram, pair->remote.host(), pair->remote.port());
-    else if (m_turnAllocation->state() == QXmppTurnAllocation::ConnectedState)
+    if (pair->socket) {
+        // media is sent in batches once control returns to the event loop
+        return datagramWriter()->write(pair->socket, datagram, pair->remote.host(), pair->remote.port());
+    } else if (m_turnAllocation && m_turnAllocation->state() == QXmppTurnAllocation::ConnectedState)
         return m_turnAllocation->writeDatagram(datagram, pair->remote.host(), pair->remote.port());
     else
         return -1;
@@ -2276,7 +3386,7 @@ qint64 QXmppIceComponent::writeStun(const QXmppStunMessage &message, QXmppIceCom
             message.encode(messagePassword.toUtf8()),
             pair->remote.host(),
             pair->remote.port());
-    else if (m_turnAllocation->state() == QXmppTurnAllocation::ConnectedState)
+    else if (m_turnAllocation && m_turnAllocation->state() == QXmppTurnAllocation::ConnectedState)
         ret = m_turnAllocation->writeDatagram(
             message.encode(messagePassword.toUtf8()),
             pair->remote.host(),
@@ -2289,6 +3399,277 @@ qint64 QXmppIceComponent::writeStun(const QXmppStunMessage &message, QXmppIceCom
     return ret;
 }
 
+// Remote transport address as seen on one of the sockets of a multiplexer.
+class QXmppIceRoute
+{
+public:
+    QXmppIceRoute(QUdpSocket *socket, const QHostAddress &host, quint16 port);
+    bool operator==(const QXmppIceRoute &other) const;
+
+    QUdpSocket *socket;
+    quint16 port;
+    uchar address[16];
+};
+
+QXmppIceRoute::QXmppIceRoute(QUdpSocket *socket, const QHostAddress &host, quint16 port)
+    : socket(socket),
+    port(port)
+{
+    // store IPv4 addresses in their IPv4-mapped IPv6 form
+    if (host.protocol() == QAbstractSocket::IPv4Protocol) {
+        memset(address, 0, 10);
+        address[10] = address[11] = 0xff;
+        qToBigEndian(host.toIPv4Address(), address + 12);
+    } else {
+        const Q_IPV6ADDR addr = host.toIPv6Address();
+        memcpy(address, addr.c, sizeof(address));
+    }
+}
+
+bool QXmppIceRoute::operator==(const QXmppIceRoute &other) const
+{
+    return socket == other.socket &&
+           port == other.port &&
+           !memcmp(address, other.address, sizeof(address));
+}
+
+static uint qHash(const QXmppIceRoute &route)
+{
+    uint h = qHash(route.socket) ^ route.port;
+    for (int i = 0; i < 16; i += 4)
+        h = 31 * h + qFromBigEndian<quint32>(route.address + i);
+    return h;
+}
+
+class QXmppIceMultiplexerPrivate
+{
+public:
+    struct Registration {
+        QList<QUdpSocket*> sockets;
+        QString user;
+        QByteArray stunId;
+    };
+
+    QXmppIceMultiplexerPrivate();
+    void unregister(QXmppIceComponent *component);
+
+    int groupSize;
+    QList<QUdpSocket*> sockets;
+    QHash<QXmppIceComponent*, Registration> registrations;
+    QHash<QXmppIceRoute, QList<QXmppIceComponent*> > routes;
+    QHash<QByteArray, QXmppIceComponent*> transactions;
+    QHash<QPair<QUdpSocket*, QString>, QXmppIceComponent*> users;
+};
+
+QXmppIceMultiplexerPrivate::QXmppIceMultiplexerPrivate()
+    : groupSize(0)
+{
+}
+
+void QXmppIceMultiplexerPrivate::unregister(QXmppIceComponent *component)
+{
+    if (!registrations.contains(component))
+        return;
+
+    const Registration registration = registrations.take(component);
+    foreach (QUdpSocket *socket, registration.sockets) {
+        const QPair<QUdpSocket*, QString> key(socket, registration.user);
+        if (users.value(key) == component)
+            users.remove(key);
+    }
+    if (transactions.value(registration.stunId) == component)
+        transactions.remove(registration.stunId);
+}
+
+/// Constructs a new QXmppIceMultiplexer.
+///
+/// \param parent
+
+QXmppIceMultiplexer::QXmppIceMultiplexer(QObject *parent)
+    : QXmppLoggable(parent),
+    d(new QXmppIceMultiplexerPrivate)
+{
+}
+
+/// Destroys the QXmppIceMultiplexer.
+
+QXmppIceMultiplexer::~QXmppIceMultiplexer()
+{
+    // send the media which is still queued before the sockets go away
+    datagramWriter()->flush();
+    delete d;
+}
+
+/// Binds the shared sockets on each of the given \a addresses, with one
+/// socket per address for each of the given number of \a components.
+///
+/// \param addresses The network addresses on which to listen.
+/// \param components The number of components in each connection, for
+/// instance 2 for RTP and RTCP.
+
+bool QXmppIceMultiplexer::bind(const QList<QHostAddress> &addresses, int components)
+{
+    if (!d->sockets.isEmpty()) {
+        warning("Multiplexer is already bound");
+        return false;
+    }
+
+    const QList<QUdpSocket*> sockets = QXmppIceComponent::reservePorts(addresses, components, this);
+    if (sockets.isEmpty() && !addresses.isEmpty())
+        return false;
+
+    foreach (QUdpSocket *socket, sockets) {
+        bool check = connect(socket, SIGNAL(readyRead()),
+                             this, SLOT(readyRead()));
+        Q_ASSERT(check);
+        Q_UNUSED(check);
+    }
+    d->groupSize = addresses.size();
+    d->sockets = sockets;
+    return true;
+}
+
+/// Returns the sockets to use for the component at the given \a index,
+/// starting from 0.
+///
+/// \param index
+
+QList<QUdpSocket*> QXmppIceMultiplexer::sockets(int index) const
+{
+    if (index < 0 || !d->groupSize)
+        return QList<QUdpSocket*>();
+    return d->sockets.mid(index * d->groupSize, d->groupSize);
+}
+
+/// Registers the user fragment and STUN transaction of a \a component,
+/// replacing any previous registration.
+
+void QXmppIceMultiplexer::addComponent(QXmppIceComponent *component)
+{
+    d->unregister(component);
+
+    QXmppIceMultiplexerPrivate::Registration registration;
+    registration.sockets = component->m_sockets;
+    registration.user = component->m_localUser;
+    registration.stunId = component->m_stunId;
+    foreach (QUdpSocket *socket, registration.sockets) {
+        const QPair<QUdpSocket*, QString> key(socket, registration.user);
+        QXmppIceComponent *other = d->users.value(key);
+        if (other && other != component) {
+            warning(QString("User fragment %1 is already in use").arg(registration.user));
+            continue;
+        }
+        d->users.insert(key, component);
+    }
+    if (!registration.stunId.isEmpty())
+        d->transactions.insert(registration.stunId, component);
+    d->registrations.insert(component, registration);
+}
+
+/// Routes datagrams from the given remote transport address to a
+/// \a component.
+///
+/// If several components expect datagrams from the same address, the
+/// address no longer identifies a component and only the STUN messages
+/// from it, which are dispatched by their USERNAME, are delivered.
+
+void QXmppIceMultiplexer::addRoute(QXmppIceComponent *component, QUdpSocket *socket, const QHostAddress &host, quint16 port)
+{
+    QList<QXmppIceComponent*> &components = d->routes[QXmppIceRoute(socket, host, port)];
+    if (components.contains(component))
+        return;
+    components << component;
+    if (components.size() == 2)
+        warning(QString("Several components expect datagrams from %1 port %2").arg(host.toString(), QString::number(port)));
+}
+
+/// Routes STUN responses carrying the given \a transaction id to a
+/// \a component, as responses to connectivity checks need not carry a
+/// USERNAME.
+
+void QXmppIceMultiplexer::addTransaction(QXmppIceComponent *component, const QByteArray &transaction)
+{
+    d->transactions.insert(transaction, component);
+}
+
+/// Returns true if a component which does not belong to \a owner uses
+/// the given \a user fragment.
+
+bool QXmppIceMultiplexer::hasUser(const QString &user, const QObject *owner) const
+{
+    QHash<QXmppIceComponent*, QXmppIceMultiplexerPrivate::Registration>::const_iterator it;
+    for (it = d->registrations.constBegin(); it != d->registrations.constEnd(); ++it) {
+        if (it.value().user == user && it.key()->parent() != owner)
+            return true;
+    }
+    return false;
+}
+
+/// Stops routing datagrams to a \a component.
+
+void QXmppIceMultiplexer::removeComponent(QXmppIceComponent *component)
+{
+    d->unregister(component);
+
+    foreach (QXmppIceComponent::Pair *pair, component->m_pairs) {
+        if (d->transactions.value(pair->transaction) == component)
+            d->transactions.remove(pair->transaction);
+        if (!pair->socket)
+            continue;
+        QHash<QXmppIceRoute, QList<QXmppIceComponent*> >::iterator it =
+            d->routes.find(QXmppIceRoute(pair->socket, pair->remote.host(), pair->remote.port()));
+        if (it == d->routes.end())
+            continue;
+        it.value().removeAll(component);
+        if (it.value().isEmpty())
+            d->routes.erase(it);
+    }
+}
+
+void QXmppIceMultiplexer::readyRead()
+{
+    QUdpSocket *socket = qobject_cast<QUdpSocket*>(sender());
+    if (!socket)
+        return;
+
+    QXmppDatagramReader *reader = datagramReader();
+    QByteArray buffer;
+    QHostAddress remoteHost;
+    quint16 remotePort;
+    while (reader->read(socket, buffer, remoteHost, remotePort)) {
+        QXmppIceComponent *component = 0;
+
+        // responses carry the transaction of our request, and requests
+        // carry our user fragment, which tells components sharing a remote
+        // address apart
+        if (QXmppStunParser::isStun(buffer)) {
+            QXmppStunParser parser;
+            if (parser.parse(buffer)) {
+                component = d->transactions.value(parser.id());
+
+                // responses which echo the USERNAME of our request have
+                // our user fragment second
+                const QString username = parser.username();
+                if (!component && !username.isEmpty()) {
+                    const int field = (parser.type() & 0xFF00) ? 1 : 0;
+                    component = d->users.value(qMakePair(socket, username.section(QLatin1Char(':'), field, field)));
+                }
+            }
+        }
+
+        // media is routed by its remote address, unless it is ambiguous
+        if (!component) {
+            QHash<QXmppIceRoute, QList<QXmppIceComponent*> >::const_iterator it =
+                d->routes.constFind(QXmppIceRoute(socket, remoteHost, remotePort));
+            if (it != d->routes.constEnd() && it.value().size() == 1)
+                component = it.value().first();
+        }
+
+        if (component)
+            component->handleDatagram(buffer, remoteHost, remotePort, socket);
+    }
+}
+
 /// Constructs a new ICE connection.
 ///
 /// \param controlling
@@ -2296,6 +3677,7 @@ qint64 QXmppIceComponent::writeStun(const QXmppStunMessage &message, QXmppIceCom
 
 QXmppIceConnection::QXmppIceConnection(QObject *parent)
     : QXmppLoggable(parent),
+    m_checkInterval(ICE_PACING_INTERVAL),
     m_iceControlling(false),
     m_stunPort(0)
 {
@@ -2339,6 +3721,7 @@ void QXmppIceConnection::addComponent(int component)
     QXmppIceComponent *socket = new QXmppIceComponent(this);
     socket->setComponent(component);
     socket->setIceControlling(m_iceControlling);
+    socket->setCheckInterval(m_checkInterval);
     socket->setLocalUser(m_localUser);
     socket->setLocalPassword(m_localPassword);
     socket->setStunServer(m_stunHost, m_stunPort);
@@ -2396,6 +3779,31 @@ bool QXmppIceConnection::bind(const QList<QHostAddress> &addresses)
     return true;
 }
 
+/// Binds the local sockets to those of the given \a multiplexer, which
+/// are shared with other connections.
+///
+/// \param multiplexer
+
+bool QXmppIceConnection::bind(QXmppIceMultiplexer *multiplexer)
+{
+    QList<int> keys = m_components.keys();
+    qSort(keys);
+    for (int i = 0; i < keys.size(); ++i) {
+        if (multiplexer->sockets(i).isEmpty()) {
+            warning("Multiplexer does not have sockets for every component");
+            return false;
+        }
+    }
+
+    // the user fragment identifies the connection on the shared sockets
+    while (multiplexer->hasUser(m_localUser, this))
+        setLocalUser(generateStanzaHash(4));
+
+    for (int i = 0; i < keys.size(); ++i)
+        m_components[keys[i]]->setSockets(multiplexer->sockets(i), multiplexer);
+    return true;
+}
+
 /// Closes the ICE connection.
 
 void QXmppIceConnection::close()
@@ -2506,6 +3914,18 @@ void QXmppIceConnection::setRemotePassword(const QString &password)
         socket->setRemotePassword(password);
 }
 
+/// Sets the pacing interval between connectivity checks for each
+/// component, in milliseconds. The default is 20 ms.
+///
+/// \param msecs
+
+void QXmppIceConnection::setCheckInterval(int msecs)
+{
+    m_checkInterval = msecs;
+    foreach (QXmppIceComponent *socket, m_components.values())
+        socket->setCheckInterval(msecs);
+}
+
 /// Sets the STUN server to use to determine server-reflexive addresses
 /// and ports.
 ///
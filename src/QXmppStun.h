@@ -25,6 +25,7 @@
 #define QXMPPSTUN_H
 
 #include <QObject>
+#include <QSet>
 
 #include "QXmppLogger.h"
 #include "QXmppJingleIq.h"
@@ -32,6 +33,9 @@
 class QDataStream;
 class QUdpSocket;
 class QTimer;
+class QXmppHmacSha1;
+class QXmppIceMultiplexer;
+class QXmppIceMultiplexerPrivate;
 
 /// \internal
 ///
@@ -239,6 +243,7 @@ private slots:
     void writeStun(const QXmppStunMessage &message);
 
 private:
+    void bindChannel(quint16 channel);
     void handleDatagram(const QByteArray &datagram, const QHostAddress &host, quint16 port);
     void setState(AllocationState state);
 
@@ -252,10 +257,14 @@ private:
     QHostAddress m_turnHost;
     quint16 m_turnPort;
 
-    // channels
+    // channels, the bound channels include those of previous owners
     typedef QPair<QHostAddress, quint16> Address;
     quint16 m_channelNumber;
     QMap<quint16, Address> m_channels;
+    QMap<quint16, Address> m_boundChannels;
+    QMap<quint16, int> m_idleChannels;
+    QSet<quint16> m_usedChannels;
+    QByteArray m_channelData;
 
     // state
     quint32 m_lifetime;
@@ -264,6 +273,35 @@ private:
     QByteArray m_nonce;
     AllocationState m_state;
     QList<QXmppStunTransaction*> m_transactions;
+
+    friend class QXmppTurnAllocationPool;
+};
+
+/// \internal
+///
+/// The QXmppTurnAllocationPool class keeps the TURN allocations released
+/// by ICE components for a while, so that later components using the same
+/// server and credentials can reuse them without allocating again.
+///
+
+class QXmppTurnAllocationPool : public QObject
+{
+    Q_OBJECT
+
+public:
+    static QXmppTurnAllocationPool *instance();
+
+    QXmppTurnAllocation *take(const QHostAddress &host, quint16 port, const QString &user, const QString &password, QObject *parent);
+    void release(QXmppTurnAllocation *allocation);
+
+private slots:
+    void expire();
+
+private:
+    QXmppTurnAllocationPool();
+
+    QList<QPair<QXmppTurnAllocation*, int> > m_allocations;
+    QTimer *m_timer;
 };
 
 /// \brief The QXmppIceComponent class represents a piece of a media stream
@@ -278,6 +316,7 @@ public:
     QXmppIceComponent(QObject *parent=0);
     ~QXmppIceComponent();
     void setIceControlling(bool controlling);
+    void setCheckInterval(int msecs);
     void setStunServer(const QHostAddress &host, quint16 port);
     void setTurnServer(const QHostAddress &host, quint16 port);
     void setTurnUser(const QString &user);
@@ -295,7 +334,7 @@ public:
     void setRemotePassword(const QString &password);
 
     bool isConnected() const;
-    void setSockets(QList<QUdpSocket*> sockets);
+    void setSockets(QList<QUdpSocket*> sockets, QXmppIceMultiplexer *multiplexer = 0);
 
     static QList<QHostAddress> discoverAddresses();
     static QList<QUdpSocket*> reservePorts(const QList<QHostAddress> &addresses, int count, QObject *parent = 0);
@@ -325,6 +364,14 @@ signals:
 private:
     class Pair {
     public:
+        enum State {
+            FrozenState = 0,
+            WaitingState,
+            InProgressState,
+            SucceededState,
+            FailedState,
+        };
+
         Pair(int component, bool controlling);
         quint64 priority() const;
         QString toString() const;
@@ -334,6 +381,11 @@ private:
         QXmppJingleCandidate reflexive;
         QByteArray transaction;
         QUdpSocket *socket;
+        QString foundation;
+        State state;
+        int tries;
+        int rto;
+        int timeout;
 
     private:
         int m_component;
@@ -341,6 +393,10 @@ private:
     };
 
     Pair *addRemoteCandidate(QUdpSocket *socket, const QHostAddress &host, quint16 port, quint32 priority);
+    void insertPair(Pair *pair);
+    void releaseTurnAllocation();
+    void sendCheck(Pair *pair);
+    void triggerCheck(Pair *pair);
     qint64 writeStun(const QXmppStunMessage &message, QXmppIceComponent::Pair *pair);
 
     int m_component;
@@ -348,16 +404,21 @@ private:
     QList<QXmppJingleCandidate> m_localCandidates;
     QString m_localUser;
     QString m_localPassword;
+    QXmppHmacSha1 *m_localHmac;
 
     Pair *m_activePair;
     Pair *m_fallbackPair;
     bool m_iceControlling;
     QList<Pair*> m_pairs;
+    QList<Pair*> m_triggeredPairs;
+    bool m_checking;
     quint32 m_peerReflexivePriority;
     QString m_remoteUser;
     QString m_remotePassword;
+    QXmppHmacSha1 *m_remoteHmac;
 
     QList<QUdpSocket*> m_sockets;
+    QXmppIceMultiplexer *m_multiplexer;
     QTimer *m_timer;
 
     // STUN server
@@ -370,6 +431,49 @@ private:
     // TURN server
     QXmppTurnAllocation *m_turnAllocation;
     bool m_turnConfigured;
+    QHostAddress m_turnHost;
+    quint16 m_turnPort;
+    QString m_turnUser;
+    QString m_turnPassword;
+
+    friend class QXmppIceMultiplexer;
+};
+
+/// \brief The QXmppIceMultiplexer class holds a set of UDP sockets which
+/// are shared by many ICE connections.
+///
+/// Instead of binding new ports for every call, connections are bound to
+/// the multiplexer using QXmppIceConnection::bind(QXmppIceMultiplexer*).
+/// Incoming datagrams are dispatched according to their remote transport
+/// address, or the USERNAME of the first STUN request from an unknown
+/// address.
+///
+/// The multiplexer must outlive the connections bound to it.
+
+class QXmppIceMultiplexer : public QXmppLoggable
+{
+    Q_OBJECT
+
+public:
+    QXmppIceMultiplexer(QObject *parent = 0);
+    ~QXmppIceMultiplexer();
+
+    bool bind(const QList<QHostAddress> &addresses, int components = 2);
+    QList<QUdpSocket*> sockets(int index) const;
+
+private slots:
+    void readyRead();
+
+private:
+    void addComponent(QXmppIceComponent *component);
+    void addRoute(QXmppIceComponent *component, QUdpSocket *socket, const QHostAddress &host, quint16 port);
+    void addTransaction(QXmppIceComponent *component, const QByteArray &transaction);
+    bool hasUser(const QString &user, const QObject *owner) const;
+    void removeComponent(QXmppIceComponent *component);
+
+    QXmppIceMultiplexerPrivate *d;
+    friend class QXmppIceComponent;
+    friend class QXmppIceConnection;
 };
 
 /// \brief The QXmppIceConnection class represents a set of UDP sockets
@@ -397,12 +501,14 @@ public:
     void setRemoteUser(const QString &user);
     void setRemotePassword(const QString &password);
 
+    void setCheckInterval(int msecs);
     void setStunServer(const QHostAddress &host, quint16 port = 3478);
     void setTurnServer(const QHostAddress &host, quint16 port = 3478);
     void setTurnUser(const QString &user);
     void setTurnPassword(const QString &password);
 
     bool bind(const QList<QHostAddress> &addresses);
+    bool bind(QXmppIceMultiplexer *multiplexer);
     bool isConnected() const;
 
 signals:
@@ -424,6 +530,7 @@ private slots:
     void slotTimeout();
 
 private:
+    int m_checkInterval;
     QTimer *m_connectTimer;
     bool m_iceControlling;
     QMap<int, QXmppIceComponent*> m_components;
@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2008-2011 The QXmpp developers
+ *
+ * Author:
+ *  Jeremy Lainé
+ *
+ * Source:
+ *  http://code.google.com/p/qxmpp
+ *
+ * This file is a part of QXmpp library.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+#ifndef QXMPPSTUN_P_H
+#define QXMPPSTUN_P_H
+
+#include <QByteArray>
+#include <QHostAddress>
+#include <QString>
+
+/// \internal
+///
+/// The QXmppSha1 class computes SHA-1 digests incrementally without
+/// allocating memory. Copying an instance copies its intermediate state.
+
+class QXmppSha1
+{
+public:
+    QXmppSha1();
+    void addData(const char *data, int size);
+    void result(uchar digest[20]);
+
+private:
+    void transform(const uchar *block);
+
+    quint32 m_state[5];
+    quint64 m_length;
+    uchar m_buffer[64];
+};
+
+/// \internal
+///
+/// The QXmppHmacSha1 class computes HMAC-SHA1 message authentication
+/// codes for a given key. The hash states after absorbing the inner and
+/// outer key pads are computed once, when the key is set.
+
+class QXmppHmacSha1
+{
+public:
+    QXmppHmacSha1(const QByteArray &key = QByteArray());
+
+    bool isNull() const;
+    void setKey(const QByteArray &key);
+
+    QXmppSha1 start() const;
+    void finish(QXmppSha1 &inner, uchar mac[20]) const;
+
+private:
+    QXmppSha1 m_inner;
+    QXmppSha1 m_outer;
+    bool m_null;
+};
+
+/// \internal
+///
+/// The QXmppStunParser class validates a STUN message in place and gives
+/// access to the attributes used by ICE connectivity checks, without
+/// copying the message.
+
+class QXmppStunParser
+{
+public:
+    QXmppStunParser();
+
+    static bool isStun(const QByteArray &buffer);
+    bool parse(const QByteArray &buffer);
+    bool checkFingerprint() const;
+    bool checkIntegrity(const QXmppHmacSha1 &hmac) const;
+
+    bool hasId(const QByteArray &id) const;
+    QByteArray id() const;
+    quint16 type() const;
+    quint32 priority() const { return m_priority; }
+    bool useCandidate() const { return m_useCandidate; }
+    QString username() const;
+    bool xorMappedAddress(QHostAddress &host, quint16 &port) const;
+
+private:
+    const char *m_data;
+    int m_size;
+    int m_fingerprint;
+    int m_integrity;
+    quint32 m_priority;
+    bool m_useCandidate;
+    int m_username;
+    int m_xorMappedAddress;
+};
+
+#endif
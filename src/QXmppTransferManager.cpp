@@ -728,6 +728,16 @@ bool QXmppTransferManager::handleStanza(const QDomElement &element)
 
     return false;
 }
+
+QList<QXmppStanzaKey> QXmppTransferManager::stanzaKeys() const
+{
+    return QList<QXmppStanzaKey>()
+        << QXmppStanzaKey("iq", "open", ns_ibb)
+        << QXmppStanzaKey("iq", "data", ns_ibb)
+        << QXmppStanzaKey("iq", "close", ns_ibb)
+        << QXmppStanzaKey("iq", "query", ns_bytestreams)
+        << QXmppStanzaKey("iq", "si", ns_stream_initiation);
+}
  
 QXmppTransferJob* QXmppTransferManager::getJobByRequestId(QXmppTransferJob::Direction direction, const QString &jid, const QString &id)
 {
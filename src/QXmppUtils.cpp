@@ -213,10 +213,15 @@ QString jidToBareJid(const QString& jid)
 }
 
 quint32 generateCrc32(const QByteArray &in)
+{
+    return generateCrc32(in.constData(), in.size());
+}
+
+quint32 generateCrc32(const char *data, int size)
 {
     quint32 result = 0xffffffff;
-    for(int n = 0; n < in.size(); ++n)
-        result = (result >> 8) ^ (crctable[(result & 0xff) ^ (quint8)in[n]]);
+    for(int n = 0; n < size; ++n)
+        result = (result >> 8) ^ (crctable[(result & 0xff) ^ (quint8)data[n]]);
     return result ^= 0xffffffff;
 }
 
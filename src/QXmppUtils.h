@@ -50,6 +50,7 @@ QString jidToUser(const QString& jid);
 QString jidToBareJid(const QString& jid);
 
 quint32 generateCrc32(const QByteArray &input);
+quint32 generateCrc32(const char *data, int size);
 QByteArray generateHmacMd5(const QByteArray &key, const QByteArray &text);
 QByteArray generateHmacSha1(const QByteArray &key, const QByteArray &text);
 int generateRandomInteger(int N);
@@ -65,6 +65,12 @@ bool QXmppVCardManager::handleStanza(const QDomElement &element)
     return false;
 }
 
+QList<QXmppStanzaKey> QXmppVCardManager::stanzaKeys() const
+{
+    return QList<QXmppStanzaKey>()
+        << QXmppStanzaKey("iq", "vCard", ns_vcard);
+}
+
 /// This function requests the server for vCard of the specified jid.
 /// Once received the signal vCardReceived() is emitted.
 ///
@@ -86,6 +86,12 @@ bool QXmppVersionManager::handleStanza(const QDomElement &element)
     return false;
 }
 
+QList<QXmppStanzaKey> QXmppVersionManager::stanzaKeys() const
+{
+    return QList<QXmppStanzaKey>()
+        << QXmppStanzaKey("iq", "query", ns_version);
+}
+
 /// Request version information from the specified XMPP entity.
 ///
 /// \param jid
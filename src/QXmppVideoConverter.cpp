@@ -0,0 +1,398 @@
+/*
+ * Copyright (C) 2008-2011 The QXmpp developers
+ *
+ * Author:
+ *  Jeremy Lainé
+ *
+ * Source:
+ *  http://code.google.com/p/qxmpp
+ *
+ * This file is a part of QXmpp library.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+#include "QXmppVideoConverter_p.h"
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define QXMPP_VIDEO_X86
+#define QXMPP_VIDEO_TARGET(x) __attribute__((target(x)))
+#include <immintrin.h>
+// AVX2 intrinsics in a function with a target attribute and CPU detection
+// need GCC 4.9 or a clang which has both, older compilers only get the SSE2
+// kernels
+#if defined(__clang__)
+#if defined(__has_attribute) && defined(__has_builtin)
+#if __has_attribute(target) && __has_builtin(__builtin_cpu_supports)
+#define QXMPP_VIDEO_AVX2
+#endif
+#endif
+#elif (__GNUC__ * 100 + __GNUC_MINOR__) >= 409
+#define QXMPP_VIDEO_AVX2
+#endif
+#elif defined(_MSC_VER) && defined(_M_X64)
+#define QXMPP_VIDEO_X86
+#define QXMPP_VIDEO_TARGET(x)
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#define QXMPP_VIDEO_NEON
+#include <arm_neon.h>
+#endif
+
+typedef void (*QXmppPackRow)(const uchar *y, const uchar *cb, const uchar *cr, uchar *output, int width);
+typedef void (*QXmppUnpackRow)(const uchar *input, uchar *y, uchar *cb, uchar *cr, int width);
+
+// Generic kernels, which also handle the pixels left over by the
+// vectorised kernels.
+
+static void packRowGeneric(const uchar *y, const uchar *cb, const uchar *cr, uchar *output, int width)
+{
+    for (int x = 0; x < width; x += 2) {
+        *(output++) = *(y++);
+        *(output++) = *(cb++);
+        *(output++) = *(y++);
+        *(output++) = *(cr++);
+    }
+}
+
+static void unpackRowGeneric(const uchar *input, uchar *y, uchar *cb, uchar *cr, int width)
+{
+    for (int x = 0; x < width; x += 2) {
+        *(y++) = *(input++);
+        *(cb++) = *(input++);
+        *(y++) = *(input++);
+        *(cr++) = *(input++);
+    }
+}
+
+#ifdef QXMPP_VIDEO_X86
+
+// SSE2 kernels, 32 pixels per iteration.
+
+QXMPP_VIDEO_TARGET("sse2")
+static void packRowSSE2(const uchar *y, const uchar *cb, const uchar *cr, uchar *output, int width)
+{
+    int x = 0;
+    for (; x + 32 <= width; x += 32) {
+        const __m128i y0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(y + x));
+        const __m128i y1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(y + x + 16));
+        const __m128i u = _mm_loadu_si128(reinterpret_cast<const __m128i*>(cb + x / 2));
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(cr + x / 2));
+        const __m128i uv0 = _mm_unpacklo_epi8(u, v);
+        const __m128i uv1 = _mm_unpackhi_epi8(u, v);
+        __m128i *out = reinterpret_cast<__m128i*>(output + 2 * x);
+        _mm_storeu_si128(out, _mm_unpacklo_epi8(y0, uv0));
+        _mm_storeu_si128(out + 1, _mm_unpackhi_epi8(y0, uv0));
+        _mm_storeu_si128(out + 2, _mm_unpacklo_epi8(y1, uv1));
+        _mm_storeu_si128(out + 3, _mm_unpackhi_epi8(y1, uv1));
+    }
+    packRowGeneric(y + x, cb + x / 2, cr + x / 2, output + 2 * x, width - x);
+}
+
+QXMPP_VIDEO_TARGET("sse2")
+static void unpackRowSSE2(const uchar *input, uchar *y, uchar *cb, uchar *cr, int width)
+{
+    const __m128i mask = _mm_set1_epi16(0x00ff);
+    int x = 0;
+    for (; x + 32 <= width; x += 32) {
+        const __m128i *in = reinterpret_cast<const __m128i*>(input + 2 * x);
+        const __m128i p0 = _mm_loadu_si128(in);
+        const __m128i p1 = _mm_loadu_si128(in + 1);
+        const __m128i p2 = _mm_loadu_si128(in + 2);
+        const __m128i p3 = _mm_loadu_si128(in + 3);
+
+        // luma is in the even bytes, interleaved chroma in the odd bytes
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(y + x),
+            _mm_packus_epi16(_mm_and_si128(p0, mask), _mm_and_si128(p1, mask)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(y + x + 16),
+            _mm_packus_epi16(_mm_and_si128(p2, mask), _mm_and_si128(p3, mask)));
+        const __m128i uv0 = _mm_packus_epi16(_mm_srli_epi16(p0, 8), _mm_srli_epi16(p1, 8));
+        const __m128i uv1 = _mm_packus_epi16(_mm_srli_epi16(p2, 8), _mm_srli_epi16(p3, 8));
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(cb + x / 2),
+            _mm_packus_epi16(_mm_and_si128(uv0, mask), _mm_and_si128(uv1, mask)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(cr + x / 2),
+            _mm_packus_epi16(_mm_srli_epi16(uv0, 8), _mm_srli_epi16(uv1, 8)));
+    }
+    unpackRowGeneric(input + 2 * x, y + x, cb + x / 2, cr + x / 2, width - x);
+}
+
+#endif
+
+#ifdef QXMPP_VIDEO_AVX2
+
+// AVX2 kernels, 64 pixels per iteration. The byte unpacking and packing
+// instructions operate within 128-bit lanes, hence the lane permutations.
+
+QXMPP_VIDEO_TARGET("avx2")
+static void packRowAVX2(const uchar *y, const uchar *cb, const uchar *cr, uchar *output, int width)
+{
+    int x = 0;
+    for (; x + 64 <= width; x += 64) {
+        const __m256i y0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(y + x));
+        const __m256i y1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(y + x + 32));
+        const __m256i u = _mm256_permute4x64_epi64(
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(cb + x / 2)), 0xd8);
+        const __m256i v = _mm256_permute4x64_epi64(
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(cr + x / 2)), 0xd8);
+
+        // uv0 holds chroma pairs 0-7 | 8-15, uv1 holds 16-23 | 24-31
+        const __m256i uv0 = _mm256_unpacklo_epi8(u, v);
+        const __m256i uv1 = _mm256_unpackhi_epi8(u, v);
+
+        const __m256i lo0 = _mm256_unpacklo_epi8(y0, uv0);
+        const __m256i hi0 = _mm256_unpackhi_epi8(y0, uv0);
+        const __m256i lo1 = _mm256_unpacklo_epi8(y1, uv1);
+        const __m256i hi1 = _mm256_unpackhi_epi8(y1, uv1);
+
+        __m256i *out = reinterpret_cast<__m256i*>(output + 2 * x);
+        _mm256_storeu_si256(out, _mm256_permute2x128_si256(lo0, hi0, 0x20));
+        _mm256_storeu_si256(out + 1, _mm256_permute2x128_si256(lo0, hi0, 0x31));
+        _mm256_storeu_si256(out + 2, _mm256_permute2x128_si256(lo1, hi1, 0x20));
+        _mm256_storeu_si256(out + 3, _mm256_permute2x128_si256(lo1, hi1, 0x31));
+    }
+    packRowSSE2(y + x, cb + x / 2, cr + x / 2, output + 2 * x, width - x);
+}
+
+QXMPP_VIDEO_TARGET("avx2")
+static void unpackRowAVX2(const uchar *input, uchar *y, uchar *cb, uchar *cr, int width)
+{
+    const __m256i mask = _mm256_set1_epi16(0x00ff);
+    int x = 0;
+    for (; x + 64 <= width; x += 64) {
+        const __m256i *in = reinterpret_cast<const __m256i*>(input + 2 * x);
+        const __m256i p0 = _mm256_loadu_si256(in);
+        const __m256i p1 = _mm256_loadu_si256(in + 1);
+        const __m256i p2 = _mm256_loadu_si256(in + 2);
+        const __m256i p3 = _mm256_loadu_si256(in + 3);
+
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(y + x), _mm256_permute4x64_epi64(
+            _mm256_packus_epi16(_mm256_and_si256(p0, mask), _mm256_and_si256(p1, mask)), 0xd8));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(y + x + 32), _mm256_permute4x64_epi64(
+            _mm256_packus_epi16(_mm256_and_si256(p2, mask), _mm256_and_si256(p3, mask)), 0xd8));
+
+        // chroma stays lane-swizzled until the final pack
+        const __m256i uv0 = _mm256_packus_epi16(_mm256_srli_epi16(p0, 8), _mm256_srli_epi16(p1, 8));
+        const __m256i uv1 = _mm256_packus_epi16(_mm256_srli_epi16(p2, 8), _mm256_srli_epi16(p3, 8));
+        const __m256i u = _mm256_packus_epi16(_mm256_and_si256(uv0, mask), _mm256_and_si256(uv1, mask));
+        const __m256i v = _mm256_packus_epi16(_mm256_srli_epi16(uv0, 8), _mm256_srli_epi16(uv1, 8));
+
+        const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(cb + x / 2), _mm256_permutevar8x32_epi32(u, order));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(cr + x / 2), _mm256_permutevar8x32_epi32(v, order));
+    }
+    unpackRowSSE2(input + 2 * x, y + x, cb + x / 2, cr + x / 2, width - x);
+}
+
+#endif
+
+#ifdef QXMPP_VIDEO_NEON
+
+// NEON kernels, 16 pixels per iteration.
+
+static void packRowNEON(const uchar *y, const uchar *cb, const uchar *cr, uchar *output, int width)
+{
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        const uint8x8x2_t luma = vld2_u8(y + x);
+        uint8x8x4_t pixels;
+        pixels.val[0] = luma.val[0];
+        pixels.val[1] = vld1_u8(cb + x / 2);
+        pixels.val[2] = luma.val[1];
+        pixels.val[3] = vld1_u8(cr + x / 2);
+        vst4_u8(output + 2 * x, pixels);
+    }
+    packRowGeneric(y + x, cb + x / 2, cr + x / 2, output + 2 * x, width - x);
+}
+
+static void unpackRowNEON(const uchar *input, uchar *y, uchar *cb, uchar *cr, int width)
+{
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        const uint8x8x4_t pixels = vld4_u8(input + 2 * x);
+        uint8x8x2_t luma;
+        luma.val[0] = pixels.val[0];
+        luma.val[1] = pixels.val[2];
+        vst2_u8(y + x, luma);
+        vst1_u8(cb + x / 2, pixels.val[1]);
+        vst1_u8(cr + x / 2, pixels.val[3]);
+    }
+    unpackRowGeneric(input + 2 * x, y + x, cb + x / 2, cr + x / 2, width - x);
+}
+
+#endif
+
+static bool kernelSupported(QXmppVideoConverter::Kernel kernel)
+{
+    switch (kernel) {
+    case QXmppVideoConverter::GenericKernel:
+        return true;
+#ifdef QXMPP_VIDEO_AVX2
+    case QXmppVideoConverter::SSE2Kernel:
+        return __builtin_cpu_supports("sse2");
+    case QXmppVideoConverter::AVX2Kernel:
+        return __builtin_cpu_supports("avx2");
+#elif defined(QXMPP_VIDEO_X86)
+    case QXmppVideoConverter::SSE2Kernel:
+        return true;
+#endif
+#ifdef QXMPP_VIDEO_NEON
+    case QXmppVideoConverter::NEONKernel:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+class QXmppVideoKernels
+{
+public:
+    QXmppVideoKernels();
+    void select(QXmppVideoConverter::Kernel kernel);
+
+    QXmppVideoConverter::Kernel kernel;
+    QXmppPackRow packRow;
+    QXmppUnpackRow unpackRow;
+};
+
+QXmppVideoKernels::QXmppVideoKernels()
+{
+    const QXmppVideoConverter::Kernel preferred[] = {
+        QXmppVideoConverter::AVX2Kernel,
+        QXmppVideoConverter::SSE2Kernel,
+        QXmppVideoConverter::NEONKernel,
+    };
+
+    select(QXmppVideoConverter::GenericKernel);
+    for (unsigned int i = 0; i < sizeof(preferred) / sizeof(preferred[0]); ++i) {
+        if (kernelSupported(preferred[i])) {
+            select(preferred[i]);
+            break;
+        }
+    }
+}
+
+void QXmppVideoKernels::select(QXmppVideoConverter::Kernel kernel)
+{
+    this->kernel = kernel;
+    switch (kernel) {
+#ifdef QXMPP_VIDEO_X86
+    case QXmppVideoConverter::SSE2Kernel:
+        packRow = packRowSSE2;
+        unpackRow = unpackRowSSE2;
+        break;
+#endif
+#ifdef QXMPP_VIDEO_AVX2
+    case QXmppVideoConverter::AVX2Kernel:
+        packRow = packRowAVX2;
+        unpackRow = unpackRowAVX2;
+        break;
+#endif
+#ifdef QXMPP_VIDEO_NEON
+    case QXmppVideoConverter::NEONKernel:
+        packRow = packRowNEON;
+        unpackRow = unpackRowNEON;
+        break;
+#endif
+    default:
+        this->kernel = QXmppVideoConverter::GenericKernel;
+        packRow = packRowGeneric;
+        unpackRow = unpackRowGeneric;
+        break;
+    }
+}
+
+Q_GLOBAL_STATIC(QXmppVideoKernels, videoKernels)
+
+/// Returns the kernel used for conversions.
+
+QXmppVideoConverter::Kernel QXmppVideoConverter::kernel()
+{
+    return videoKernels()->kernel;
+}
+
+/// Selects the kernel used for conversions, for instance to compare
+/// kernels in tests.
+///
+/// Returns false if the kernel is not supported by the CPU, in which
+/// case the current kernel is kept.
+///
+/// \param kernel
+
+bool QXmppVideoConverter::setKernel(Kernel kernel)
+{
+    if (!kernelSupported(kernel))
+        return false;
+    videoKernels()->select(kernel);
+    return true;
+}
+
+/// Packs planar Y'CbCr data with horizontally subsampled chroma into YUYV.
+///
+/// \param width frame width in pixels, which should be even
+/// \param height frame height in pixels
+/// \param y luma plane
+/// \param yStride bytes per luma row
+/// \param cb blue-difference chroma plane
+/// \param cr red-difference chroma plane
+/// \param cStride bytes per chroma row
+/// \param cShift vertical chroma subsampling, 0 for 4:2:2 and 1 for 4:2:0
+/// \param output YUYV data
+/// \param outputStride bytes per YUYV row
+
+void QXmppVideoConverter::planarToYuyv(int width, int height,
+                                       const uchar *y, int yStride,
+                                       const uchar *cb, const uchar *cr, int cStride, int cShift,
+                                       uchar *output, int outputStride)
+{
+    const QXmppPackRow packRow = videoKernels()->packRow;
+    for (int row = 0; row < height; ++row) {
+        const int c = (row >> cShift) * cStride;
+        packRow(y, cb + c, cr + c, output, width);
+        y += yStride;
+        output += outputStride;
+    }
+}
+
+/// Unpacks YUYV data into planar Y'CbCr data with horizontally subsampled
+/// chroma.
+///
+/// When chroma is also subsampled vertically, each chroma row is taken from
+/// the last of the YUYV rows it covers.
+///
+/// \param width frame width in pixels, which should be even
+/// \param height frame height in pixels
+/// \param input YUYV data
+/// \param inputStride bytes per YUYV row
+/// \param y luma plane
+/// \param yStride bytes per luma row
+/// \param cb blue-difference chroma plane
+/// \param cr red-difference chroma plane
+/// \param cStride bytes per chroma row
+/// \param cShift vertical chroma subsampling, 0 for 4:2:2 and 1 for 4:2:0
+
+void QXmppVideoConverter::yuyvToPlanar(int width, int height,
+                                       const uchar *input, int inputStride,
+                                       uchar *y, int yStride,
+                                       uchar *cb, uchar *cr, int cStride, int cShift)
+{
+    const QXmppUnpackRow unpackRow = videoKernels()->unpackRow;
+    for (int row = 0; row < height; ++row) {
+        const int c = (row >> cShift) * cStride;
+        unpackRow(input, y, cb + c, cr + c, width);
+        input += inputStride;
+        y += yStride;
+    }
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2008-2011 The QXmpp developers
+ *
+ * Author:
+ *  Jeremy Lainé
+ *
+ * Source:
+ *  http://code.google.com/p/qxmpp
+ *
+ * This file is a part of QXmpp library.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+#ifndef QXMPPVIDEOCONVERTER_P_H
+#define QXMPPVIDEOCONVERTER_P_H
+
+#include <QtGlobal>
+
+/// \brief The QXmppVideoConverter class converts between packed YUYV and
+/// planar Y'CbCr pixel data.
+///
+/// The conversion kernels are selected at runtime according to the
+/// instruction sets supported by the CPU. All kernels produce the same
+/// output as the generic one.
+
+class QXmppVideoConverter
+{
+public:
+    enum Kernel {
+        GenericKernel = 0,
+        SSE2Kernel,
+        AVX2Kernel,
+        NEONKernel,
+    };
+
+    static Kernel kernel();
+    static bool setKernel(Kernel kernel);
+
+    static void planarToYuyv(int width, int height,
+                             const uchar *y, int yStride,
+                             const uchar *cb, const uchar *cr, int cStride, int cShift,
+                             uchar *output, int outputStride);
+    static void yuyvToPlanar(int width, int height,
+                             const uchar *input, int inputStride,
+                             uchar *y, int yStride,
+                             uchar *cb, uchar *cr, int cStride, int cShift);
+};
+
+#endif
@@ -108,6 +108,13 @@ bool QXmppServerDiscovery::handleStanza(QXmppStream *stream, const QDomElement &
     return false;
 }
 
+QList<QXmppStanzaKey> QXmppServerDiscovery::stanzaKeys() const
+{
+    return QList<QXmppStanzaKey>()
+        << QXmppStanzaKey("iq", "query", ns_disco_info)
+        << QXmppStanzaKey("iq", "query", ns_disco_items);
+}
+
 // PLUGIN
 
 class QXmppServerDiscoveryPlugin : public QXmppServerPlugin
@@ -45,6 +45,7 @@ public:
     QStringList discoveryFeatures() const;
     QStringList discoveryItems() const;
     bool handleStanza(QXmppStream *stream, const QDomElement &element);
+    QList<QXmppStanzaKey> stanzaKeys() const;
     /// \endcond
 
 private:
@@ -60,6 +60,12 @@ bool QXmppServerPing::handleStanza(QXmppStream *stream, const QDomElement &eleme
     return false;
 }
 
+QList<QXmppStanzaKey> QXmppServerPing::stanzaKeys() const
+{
+    return QList<QXmppStanzaKey>()
+        << QXmppStanzaKey("iq", "ping", ns_ping);
+}
+
 // PLUGIN
 
 class QXmppServerPingPlugin : public QXmppServerPlugin
@@ -376,6 +376,14 @@ bool QXmppServerProxy65::handleStanza(QXmppStream *stream, const QDomElement &el
     return false;
 }
 
+QList<QXmppStanzaKey> QXmppServerProxy65::stanzaKeys() const
+{
+    return QList<QXmppStanzaKey>()
+        << QXmppStanzaKey("iq", "query", ns_disco_info)
+        << QXmppStanzaKey("iq", "query", ns_disco_items)
+        << QXmppStanzaKey("iq", "query", ns_bytestreams);
+}
+
 bool QXmppServerProxy65::start()
 {
     // determine allowed domains
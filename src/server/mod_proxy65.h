@@ -90,6 +90,7 @@ public:
     /// \cond
     QStringList discoveryItems() const;
     bool handleStanza(QXmppStream *stream, const QDomElement &element);
+    QList<QXmppStanzaKey> stanzaKeys() const;
     bool start();
     void stop();
     QVariantMap statistics() const;
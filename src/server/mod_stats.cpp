@@ -180,6 +180,10 @@ QVariantMap QXmppServerStats::statistics() const
     stats["incoming-clients"] = d->incomingClients;
     stats["incoming-servers"] = d->incomingServers;
     stats["outgoing-servers"] = d->outgoingServers;
+
+    const QVariantMap queueStats = server()->queueStatistics();
+    foreach (const QString &key, queueStats.keys())
+        stats[key] = queueStats.value(key);
     return stats;
 }
 
@@ -278,6 +282,13 @@ bool QXmppServerStats::handleStanza(QXmppStream *stream, const QDomElement &elem
     return false;
 }
 
+QList<QXmppStanzaKey> QXmppServerStats::stanzaKeys() const
+{
+    return QList<QXmppStanzaKey>()
+        << QXmppStanzaKey("iq", "query", ns_disco_info)
+        << QXmppStanzaKey("iq", "query", ns_disco_items);
+}
+
 bool QXmppServerStats::start()
 {
     // determine jid
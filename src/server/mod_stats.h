@@ -52,6 +52,7 @@ public:
     /// cond
     QStringList discoveryItems() const;
     bool handleStanza(QXmppStream *stream, const QDomElement &element);
+    QList<QXmppStanzaKey> stanzaKeys() const;
     QVariantMap statistics() const;
     bool start();
     void stop();
@@ -72,6 +72,12 @@ bool QXmppServerTime::handleStanza(QXmppStream *stream, const QDomElement &eleme
     return false;
 }
 
+QList<QXmppStanzaKey> QXmppServerTime::stanzaKeys() const
+{
+    return QList<QXmppStanzaKey>()
+        << QXmppStanzaKey("iq", "time", ns_entity_time);
+}
+
 // PLUGIN
 
 class QXmppServerTimePlugin : public QXmppServerPlugin
@@ -66,6 +66,12 @@ bool QXmppServerVersion::handleStanza(QXmppStream *stream, const QDomElement &el
     return false;
 }
 
+QList<QXmppStanzaKey> QXmppServerVersion::stanzaKeys() const
+{
+    return QList<QXmppStanzaKey>()
+        << QXmppStanzaKey("iq", "query", ns_version);
+}
+
 // PLUGIN
 
 class QXmppServerVersionPlugin : public QXmppServerPlugin
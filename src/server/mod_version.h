@@ -37,6 +37,7 @@ class QXmppServerVersion : public QXmppServerExtension
 public:
     QStringList discoveryFeatures() const;
     bool handleStanza(QXmppStream *stream, const QDomElement &element);
+    QList<QXmppStanzaKey> stanzaKeys() const;
 };
 
 #endif
@@ -16,6 +16,10 @@ LIBS += $$QXMPP_INTERNAL_LIBS
 # DEFINES += QXMPP_USE_THEORA
 # LIBS += -ltheoradec -ltheoraenc
 
+# To enable support for zlib stream compression, uncomment the following:
+# DEFINES += QXMPP_USE_ZLIB
+# LIBS += -lz
+
 # Target definition
 TARGET = $$QXMPP_LIBRARY_NAME
 VERSION = $$QXMPP_VERSION
@@ -75,6 +79,7 @@ INSTALL_HEADERS = QXmppUtils.h \
     QXmppSessionIq.h \
     QXmppSocks.h \
     QXmppStanza.h \
+    QXmppStanzaKey.h \
     QXmppStream.h \
     QXmppStreamFeatures.h \
     QXmppStreamInitiationIq.h \
@@ -98,7 +103,13 @@ INSTALL_HEADERS = QXmppUtils.h \
 
 
 HEADERS += $$INSTALL_HEADERS
-HEADERS += QXmppSrvInfo_p.h
+HEADERS += QXmppRtpChannel_p.h \
+    QXmppServer_p.h \
+    QXmppSrvInfo_p.h \
+    QXmppStanzaKey_p.h \
+    QXmppStream_p.h \
+    QXmppStun_p.h \
+    QXmppVideoConverter_p.h
 
 # Source files
 SOURCES += QXmppUtils.cpp \
@@ -153,6 +164,7 @@ SOURCES += QXmppUtils.cpp \
     QXmppSessionIq.cpp \
     QXmppSocks.cpp \
     QXmppStanza.cpp \
+    QXmppStanzaKey.cpp \
     QXmppStream.cpp \
     QXmppStreamFeatures.cpp \
     QXmppStreamInitiationIq.cpp \
@@ -162,6 +174,7 @@ SOURCES += QXmppUtils.cpp \
     QXmppVCardIq.cpp \
     QXmppVersionIq.cpp \
     QXmppVersionManager.cpp \
+    QXmppVideoConverter.cpp \
 	QXmppBookmarkManager.cpp \
 	QXmppBookmarkSet.cpp \
     QXmppActivityItem.cpp \
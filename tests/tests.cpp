@@ -27,6 +27,7 @@
 #include <QCoreApplication>
 #include <QDomDocument>
 #include <QEventLoop>
+#include <QUdpSocket>
 #include <QVariant>
 #include <QtTest/QtTest>
 
@@ -34,6 +35,8 @@
 #include "QXmppBindIq.h"
 #include "QXmppClient.h"
 #include "QXmppCodec.h"
+#include "QXmppElement.h"
+#include "QXmppIncomingClient.h"
 #include "QXmppJingleIq.h"
 #include "QXmppMessage.h"
 #include "QXmppNonSASLAuth.h"
@@ -42,20 +45,28 @@
 #include "QXmppPubSubIq.h"
 #include "QXmppRpcIq.h"
 #include "QXmppRtpChannel.h"
+#include "QXmppRtpChannel_p.h"
 #include "QXmppSaslAuth.h"
 #include "QXmppSessionIq.h"
 #include "QXmppServer.h"
+#include "QXmppServer_p.h"
+#include "QXmppStream.h"
 #include "QXmppStreamFeatures.h"
+#include "QXmppStream_p.h"
 #include "QXmppStun.h"
+#include "QXmppStun_p.h"
 #include "QXmppUtils.h"
 #include "QXmppVCardIq.h"
 #include "QXmppVersionIq.h"
+#include "QXmppVideoConverter_p.h"
 #include "QXmppGlobal.h"
 #include "QXmppEntityTimeIq.h"
 #include "QXmppActivityItem.h"
 #include "QXmppBobIq.h"
 #include "tests.h"
 
+Q_DECLARE_METATYPE(QList<QByteArray>)
+
 QString getImageType(const QByteArray &contents);
 
 void TestUtils::testCrc32()
@@ -310,6 +321,64 @@ void TestPackets::testBindResult()
     serializePacket(bind, xml);
 }
 
+static QByteArray elementToXml(const QXmppElement &element)
+{
+    QBuffer buffer;
+    buffer.open(QIODevice::ReadWrite);
+    QXmlStreamWriter writer(&buffer);
+    element.toXml(&writer);
+    return buffer.data();
+}
+
+static void loadElement(const QXmppElement &element)
+{
+    element.attributeNames();
+    QXmppElement child = element.firstChildElement();
+    while (!child.isNull()) {
+        loadElement(child);
+        child = child.nextSiblingElement();
+    }
+}
+
+void TestPackets::testElement()
+{
+    const QByteArray xml(
+        "<message xmlns=\"jabber:client\">"
+        "<x xmlns=\"jabber:x:foo\" b=\"2\" a=\"1&amp;\">text"
+        "<y>inner</y>"
+        "<z xmlns=\"urn:z\" c=\"3\"/>"
+        "tail</x>"
+        "</message>");
+    const QByteArray expected(
+        "<x xmlns=\"jabber:x:foo\" a=\"1&amp;\" b=\"2\">texttail"
+        "<y>inner</y>"
+        "<z xmlns=\"urn:z\" c=\"3\"/>"
+        "</x>");
+
+    QDomDocument doc;
+    QCOMPARE(doc.setContent(xml, true), true);
+    const QDomElement source = doc.documentElement().firstChildElement();
+
+    // unconverted element, written straight from the DOM
+    QXmppElement unconverted(source);
+    QCOMPARE(elementToXml(unconverted), expected);
+
+    // only the top-level element is converted
+    QXmppElement partial(source);
+    QCOMPARE(partial.attribute("a"), QString("1&"));
+    QCOMPARE(elementToXml(partial), expected);
+
+    // the whole tree is converted
+    QXmppElement converted(source);
+    loadElement(converted);
+    QCOMPARE(elementToXml(converted), expected);
+
+    // copies share the conversion
+    QXmppElement copy(unconverted);
+    QCOMPARE(copy.firstChildElement("y").value(), QString("inner"));
+    QCOMPARE(elementToXml(unconverted), expected);
+}
+
 void TestPackets::testMessage()
 {
     const QByteArray xml(
@@ -698,6 +767,164 @@ void TestPackets::testEntityTimeResult()
     serializePacket(entityTime, xml);
 }
 
+/// Codec which only implements the stream API, writing each sample as a
+/// 16-bit word in the output stream's byte order.
+
+class TestStreamCodec : public QXmppCodec
+{
+public:
+    qint64 encode(QDataStream &input, QDataStream &output)
+    {
+        qint64 samples = 0;
+        qint16 sample;
+        while (!input.atEnd()) {
+            input >> sample;
+            output << sample;
+            samples++;
+        }
+        return samples;
+    }
+
+    qint64 decode(QDataStream &input, QDataStream &output)
+    {
+        Q_UNUSED(input);
+        Q_UNUSED(output);
+        return 0;
+    }
+};
+
+void TestCodec::testEncodeSamples()
+{
+    TestStreamCodec codec;
+    const qint16 samples[2] = { 0x0102, 0x0304 };
+    uchar output[4];
+
+    // the encoded data fits
+    int size = 4;
+    QCOMPARE(codec.encodeSamples(samples, 2, output, &size), 2);
+    QCOMPARE(size, 4);
+    QCOMPARE(QByteArray(reinterpret_cast<char*>(output), size), QByteArray("\x01\x02\x03\x04"));
+
+    // the encoded data does not fit, nothing is written
+    memset(output, 0, sizeof(output));
+    size = 3;
+    QCOMPARE(codec.encodeSamples(samples, 2, output, &size), 0);
+    QCOMPARE(size, 0);
+    QCOMPARE(QByteArray(reinterpret_cast<char*>(output), 4), QByteArray(4, '\0'));
+}
+
+void TestCodec::testG711a_data()
+{
+    QTest::addColumn<int>("pcm");
+    QTest::addColumn<int>("g711");
+    QTest::addColumn<int>("decoded");
+
+    QTest::newRow("zero") << 0 << 0xd5 << 8;
+    QTest::newRow("positive") << 1000 << 0xfa << 1008;
+    QTest::newRow("negative") << -1000 << 0x7a << -1008;
+}
+
+void TestCodec::testG711a()
+{
+    QFETCH(int, pcm);
+    QFETCH(int, g711);
+    QFETCH(int, decoded);
+
+    QXmppG711aCodec codec(8000);
+
+    // buffer API
+    const qint16 sample = pcm;
+    uchar code;
+    int size = 1;
+    QCOMPARE(codec.encodeSamples(&sample, 1, &code, &size), 1);
+    QCOMPARE(size, 1);
+    QCOMPARE(int(code), g711);
+
+    qint16 result;
+    QCOMPARE(codec.decodeSamples(&code, 1, &result, 1), 1);
+    QCOMPARE(int(result), decoded);
+
+    // stream API
+    QByteArray samples;
+    QDataStream sampleStream(&samples, QIODevice::WriteOnly);
+    sampleStream.setByteOrder(QDataStream::LittleEndian);
+    sampleStream << qint16(pcm) << qint16(pcm);
+
+    QByteArray encoded;
+    QDataStream input(samples);
+    input.setByteOrder(QDataStream::LittleEndian);
+    QDataStream output(&encoded, QIODevice::WriteOnly);
+    QCOMPARE(codec.encode(input, output), qint64(2));
+    QCOMPARE(encoded, QByteArray(2, char(g711)));
+
+    QByteArray decodedSamples;
+    QDataStream encodedInput(encoded);
+    QDataStream decodedOutput(&decodedSamples, QIODevice::WriteOnly);
+    decodedOutput.setByteOrder(QDataStream::LittleEndian);
+    QCOMPARE(codec.decode(encodedInput, decodedOutput), qint64(2));
+    QCOMPARE(decodedSamples.size(), 4);
+    QDataStream decodedInput(decodedSamples);
+    decodedInput.setByteOrder(QDataStream::LittleEndian);
+    decodedInput >> result;
+    QCOMPARE(int(result), decoded);
+}
+
+void TestCodec::testG711u_data()
+{
+    QTest::addColumn<int>("pcm");
+    QTest::addColumn<int>("g711");
+    QTest::addColumn<int>("decoded");
+
+    QTest::newRow("zero") << 0 << 0xff << 0;
+    QTest::newRow("positive") << 1000 << 0xce << 988;
+    QTest::newRow("negative") << -1000 << 0x4e << -988;
+}
+
+void TestCodec::testG711u()
+{
+    QFETCH(int, pcm);
+    QFETCH(int, g711);
+    QFETCH(int, decoded);
+
+    QXmppG711uCodec codec(8000);
+
+    // buffer API
+    const qint16 sample = pcm;
+    uchar code;
+    int size = 1;
+    QCOMPARE(codec.encodeSamples(&sample, 1, &code, &size), 1);
+    QCOMPARE(size, 1);
+    QCOMPARE(int(code), g711);
+
+    qint16 result;
+    QCOMPARE(codec.decodeSamples(&code, 1, &result, 1), 1);
+    QCOMPARE(int(result), decoded);
+
+    // stream API
+    QByteArray samples;
+    QDataStream sampleStream(&samples, QIODevice::WriteOnly);
+    sampleStream.setByteOrder(QDataStream::LittleEndian);
+    sampleStream << qint16(pcm) << qint16(pcm);
+
+    QByteArray encoded;
+    QDataStream input(samples);
+    input.setByteOrder(QDataStream::LittleEndian);
+    QDataStream output(&encoded, QIODevice::WriteOnly);
+    QCOMPARE(codec.encode(input, output), qint64(2));
+    QCOMPARE(encoded, QByteArray(2, char(g711)));
+
+    QByteArray decodedSamples;
+    QDataStream encodedInput(encoded);
+    QDataStream decodedOutput(&decodedSamples, QIODevice::WriteOnly);
+    decodedOutput.setByteOrder(QDataStream::LittleEndian);
+    QCOMPARE(codec.decode(encodedInput, decodedOutput), qint64(2));
+    QCOMPARE(decodedSamples.size(), 4);
+    QDataStream decodedInput(decodedSamples);
+    decodedInput.setByteOrder(QDataStream::LittleEndian);
+    decodedInput >> result;
+    QCOMPARE(int(result), decoded);
+}
+
 void TestCodec::testTheoraDecoder()
 {
 #ifdef QXMPP_USE_THEORA
@@ -730,6 +957,100 @@ void TestCodec::testTheoraEncoder()
 #endif
 }
 
+void TestCodec::testVideoFramePool()
+{
+    const QSize size(320, 240);
+    const int bytes = size.width() * size.height() * 2;
+    QXmppVideoFramePool pool;
+
+    const uchar *bits;
+    {
+        QXmppVideoFrame frame = pool.frame(bytes, size, size.width() * 2, QXmppVideoFrame::Format_YUYV);
+        QCOMPARE(frame.isValid(), true);
+        QCOMPARE(frame.mappedBytes(), bytes);
+        bits = frame.bits();
+    }
+
+    // released buffer is reused
+    QXmppVideoFrame first = pool.frame(bytes, size, size.width() * 2, QXmppVideoFrame::Format_YUYV);
+    QVERIFY(first.bits() == bits);
+
+    // buffer in use is not handed out again
+    QXmppVideoFrame second = pool.frame(bytes, size, size.width() * 2, QXmppVideoFrame::Format_YUYV);
+    QVERIFY(second.bits() != first.bits());
+
+    // copies share the frame data
+    QXmppVideoFrame copy = first;
+    QVERIFY(copy.bits() == first.bits());
+}
+
+void TestCodec::testYuyvConversion_data()
+{
+    QTest::addColumn<int>("kernel");
+    QTest::addColumn<int>("width");
+
+    const int widths[] = { 2, 30, 64, 66, 130, 320 };
+    const char *names[] = { "generic", "sse2", "avx2", "neon" };
+    for (int k = QXmppVideoConverter::GenericKernel; k <= QXmppVideoConverter::NEONKernel; ++k) {
+        for (unsigned int i = 0; i < sizeof(widths) / sizeof(widths[0]); ++i) {
+            const QByteArray name = QByteArray(names[k]) + "-" + QByteArray::number(widths[i]);
+            QTest::newRow(name.constData()) << k << widths[i];
+        }
+    }
+}
+
+void TestCodec::testYuyvConversion()
+{
+    QFETCH(int, kernel);
+    QFETCH(int, width);
+
+    const QXmppVideoConverter::Kernel defaultKernel = QXmppVideoConverter::kernel();
+    if (!QXmppVideoConverter::setKernel(QXmppVideoConverter::Kernel(kernel)))
+        QSKIP("Kernel is not supported by this CPU", SkipSingle);
+
+    // planar 4:2:2 with padded rows
+    const int height = 3;
+    const int yStride = width + 3;
+    const int cStride = width / 2 + 5;
+    QByteArray y(yStride * height, 0);
+    QByteArray cb(cStride * height, 0);
+    QByteArray cr(cStride * height, 0);
+    for (int i = 0; i < y.size(); ++i)
+        y[i] = char(i * 7);
+    for (int i = 0; i < cb.size(); ++i) {
+        cb[i] = char(i * 11 + 1);
+        cr[i] = char(i * 13 + 2);
+    }
+
+    QByteArray yuyv(width * 2 * height, 0);
+    QXmppVideoConverter::planarToYuyv(width, height,
+        (const uchar*)y.constData(), yStride,
+        (const uchar*)cb.constData(), (const uchar*)cr.constData(), cStride, 0,
+        (uchar*)yuyv.data(), width * 2);
+
+    QByteArray y2(y.size(), 0);
+    QByteArray cb2(cb.size(), 0);
+    QByteArray cr2(cr.size(), 0);
+    QXmppVideoConverter::yuyvToPlanar(width, height,
+        (const uchar*)yuyv.constData(), width * 2,
+        (uchar*)y2.data(), yStride,
+        (uchar*)cb2.data(), (uchar*)cr2.data(), cStride, 0);
+    QXmppVideoConverter::setKernel(defaultKernel);
+
+    for (int row = 0; row < height; ++row) {
+        const char *in = yuyv.constData() + row * width * 2;
+        for (int x = 0; x < width; x += 2) {
+            QCOMPARE(in[2 * x], y.at(row * yStride + x));
+            QCOMPARE(in[2 * x + 1], cb.at(row * cStride + x / 2));
+            QCOMPARE(in[2 * x + 2], y.at(row * yStride + x + 1));
+            QCOMPARE(in[2 * x + 3], cr.at(row * cStride + x / 2));
+        }
+        QCOMPARE(y2.mid(row * yStride, width), y.mid(row * yStride, width));
+        QCOMPARE(cb2.mid(row * cStride, width / 2), cb.mid(row * cStride, width / 2));
+        QCOMPARE(cr2.mid(row * cStride, width / 2), cr.mid(row * cStride, width / 2));
+    }
+}
+
 void TestJingle::testSession()
 {
     const QByteArray xml(
@@ -1054,6 +1375,85 @@ private:
     QString m_password;
 };
 
+/// Returns an RTP packet carrying 20ms of G.711 u-law audio.
+
+static QByteArray audioPacket(quint16 sequence, quint32 stamp, char code)
+{
+    QXmppRtpPacket packet;
+    packet.version = 2;
+    packet.marker = false;
+    packet.type = 0;
+    packet.ssrc = 0x12345678;
+    packet.sequence = sequence;
+    packet.stamp = stamp;
+    packet.payload = QByteArray(160, code);
+    return packet.encode();
+}
+
+/// Returns the little-endian samples an audio packet decodes to.
+
+static QByteArray audioSamples(char code, int count = 160)
+{
+    QXmppG711uCodec codec(8000);
+    const uchar input = code;
+    qint16 sample;
+    codec.decodeSamples(&input, 1, &sample, 1);
+
+    QByteArray data;
+    for (int i = 0; i < count; ++i) {
+        data.append(char(sample & 0xff));
+        data.append(char((sample >> 8) & 0xff));
+    }
+    return data;
+}
+
+static void setupAudioChannel(QXmppRtpAudioChannel &channel)
+{
+    QXmppJinglePayloadType payload;
+    payload.setId(0);
+    payload.setChannels(1);
+    payload.setName("PCMU");
+    payload.setClockrate(8000);
+    channel.setRemotePayloadTypes(QList<QXmppJinglePayloadType>() << payload);
+}
+
+void TestRtp::testAudioReorder()
+{
+    QXmppRtpAudioChannel channel;
+    setupAudioChannel(channel);
+
+    // the second packet is lost, the last two arrive out of order
+    const quint32 stamp = 1000;
+    channel.datagramReceived(audioPacket(1, stamp, 0x10));
+    channel.datagramReceived(audioPacket(4, stamp + 480, 0x30));
+    channel.datagramReceived(audioPacket(3, stamp + 320, 0x20));
+    QCOMPARE(channel.bytesAvailable(), qint64(1280));
+
+    // G.711 does not conceal losses, so the gap is silent
+    const QByteArray expected = audioSamples(0x10)
+        + QByteArray(320, '\0')
+        + audioSamples(0x20)
+        + audioSamples(0x30);
+    QCOMPARE(channel.read(1280), expected);
+}
+
+void TestRtp::testAudioWrap()
+{
+    QXmppRtpAudioChannel channel;
+    setupAudioChannel(channel);
+
+    // the RTP timestamp wraps around between the first two packets
+    channel.datagramReceived(audioPacket(1, 0xffffff60, 0x10));
+    channel.datagramReceived(audioPacket(2, 0, 0x20));
+    channel.datagramReceived(audioPacket(3, 160, 0x30));
+    QCOMPARE(channel.bytesAvailable(), qint64(960));
+
+    const QByteArray expected = audioSamples(0x10)
+        + audioSamples(0x20)
+        + audioSamples(0x30);
+    QCOMPARE(channel.read(960), expected);
+}
+
 void TestRtp::testBad()
 {
     QXmppRtpPacket packet;
@@ -1067,6 +1467,205 @@ void TestRtp::testBad()
     QCOMPARE(packet.decode(QByteArray("\x40\x00\x3e\xd2\x00\x00\x00\x90\x5f\xbd\x16\x9e", 12)), false);
 }
 
+void TestRtp::testHeader()
+{
+    const QByteArray data("\x80\x00\x3e\xd2\x00\x00\x00\x90\x5f\xbd\x16\x9e\x12\x34\x56", 15);
+
+    // the payload outlives the datagram it was decoded from
+    QXmppRtpPacket packet;
+    {
+        QByteArray datagram(data.constData(), data.size());
+        QCOMPARE(packet.decode(datagram), true);
+        datagram.fill('\0');
+    }
+    QCOMPARE(packet.payload, QByteArray("\x12\x34\x56", 3));
+
+    // a copy of the payload outlives the packet
+    QByteArray payload;
+    {
+        QByteArray datagram(data.constData(), data.size());
+        QXmppRtpPacket other;
+        QCOMPARE(other.decode(datagram), true);
+        payload = other.payload;
+    }
+    QCOMPARE(payload, QByteArray("\x12\x34\x56", 3));
+
+    // the header can be parsed without copying the payload
+    QXmppRtpPacket header;
+    QCOMPARE(header.decodeHeader(data), 12);
+    QCOMPARE(header.sequence, quint16(16082));
+    QCOMPARE(header.payload, QByteArray());
+    QCOMPARE(header.decodeHeader(data.left(11)), -1);
+
+    // write the header in front of the payload
+    QCOMPARE(packet.headerSize(), 12);
+    QByteArray encoded(packet.headerSize(), '\0');
+    encoded += packet.payload;
+    packet.writeHeader(encoded.data());
+    QCOMPARE(encoded, data);
+}
+
+void TestRtp::testJitterBuffer()
+{
+    QXmppRtpJitterBuffer buffer;
+    buffer.reset(8000, 320);
+    QCOMPARE(buffer.targetDelay, qint64(960));
+
+    // timestamps are extended across a wrap, in either order
+    const qint64 start = buffer.extendStamp(0xfffffff0);
+    QCOMPARE(buffer.extendStamp(0x10), start + 0x20);
+    QCOMPARE(buffer.extendStamp(0xffffffe0), start - 0x10);
+    QCOMPARE(buffer.extendStamp(0x20), start + 0x30);
+
+    // packets arriving irregularly raise the target delay
+    qint64 stamp = start;
+    for (int i = 0; i < 50; ++i) {
+        buffer.packetArrived(stamp, stamp + ((i % 2) ? 400 : 0));
+        stamp += 160;
+    }
+    QVERIFY(buffer.targetDelay > qint64(960));
+    QVERIFY(buffer.targetDelay <= buffer.maximumDelay);
+
+    // packets arriving regularly bring it back down
+    for (int i = 0; i < 200; ++i) {
+        buffer.packetArrived(stamp, stamp);
+        stamp += 160;
+    }
+    QCOMPARE(buffer.targetDelay, buffer.minimumDelay);
+}
+
+/// Returns the RTCP source description a reporter appends to its reports.
+
+static QByteArray sourceDescription(quint32 ssrc)
+{
+    QByteArray data;
+    QDataStream stream(&data, QIODevice::WriteOnly);
+    stream << quint8(0x81) << quint8(202) << quint16(4) << ssrc;
+    stream << quint8(1) << quint8(8);
+    stream.writeRawData(QByteArray::number(ssrc, 16).constData(), 8);
+    stream << quint8(0) << quint8(0);
+    return data;
+}
+
+void TestRtp::testReceiverReport()
+{
+    const quint32 localSsrc = 0x55667788;
+    const quint32 remoteSsrc = 0x11223344;
+
+    // receive ten packets across a timestamp wrap, the fifth is lost
+    QXmppRtcpReporter receiver;
+    QXmppRtpPacket packet;
+    packet.version = 2;
+    packet.marker = false;
+    packet.type = 0;
+    packet.ssrc = remoteSsrc;
+    packet.payload = QByteArray(160, '\0');
+    for (int i = 0; i < 10; ++i) {
+        if (i == 4)
+            continue;
+        packet.sequence = 100 + i;
+        packet.stamp = 0xfffffd00 + 160 * i;
+        receiver.packetReceived(packet, packet.payload.size(), 8000);
+    }
+    QCOMPARE(receiver.stats.packetsReceived, quint32(9));
+    QCOMPARE(receiver.stats.packetsLost, qint32(1));
+    QVERIFY(receiver.stats.jitter * 8000 < 160);
+
+    // nothing was sent, so this is a receiver report
+    const QByteArray report = receiver.report(localSsrc, 0);
+    QCOMPARE(report.size(), 52);
+    QCOMPARE(receiver.stats.fractionLost, quint8(25));
+
+    QByteArray expected;
+    QDataStream stream(&expected, QIODevice::WriteOnly);
+    stream << quint8(0x81) << quint8(201) << quint16(7) << localSsrc;
+    stream << remoteSsrc << quint32((25 << 24) | 1) << quint32(109);
+    stream << quint32(0) << quint32(0) << quint32(0);
+    expected += sourceDescription(localSsrc);
+
+    // the jitter depends on the arrival times
+    expected.replace(20, 4, report.mid(20, 4));
+    QCOMPARE(report, expected);
+
+    // the sender learns how its stream is received
+    QXmppRtcpReporter sender;
+    sender.reportReceived(report, remoteSsrc, 8000);
+    QCOMPARE(sender.stats.remotePacketsLost, qint32(1));
+    QCOMPARE(sender.stats.remoteFractionLost, quint8(25));
+    QCOMPARE(sender.stats.roundTripTime, -1);
+}
+
+void TestRtp::testSenderReport()
+{
+    const quint32 localSsrc = 0x55667788;
+    const quint32 remoteSsrc = 0x11223344;
+
+    QXmppRtcpReporter sender;
+    QXmppRtpPacket packet;
+    packet.version = 2;
+    packet.marker = false;
+    packet.type = 0;
+    packet.ssrc = remoteSsrc;
+    packet.payload = QByteArray(160, '\0');
+    for (int i = 0; i < 3; ++i) {
+        packet.sequence = 100 + i;
+        packet.stamp = 160 * i;
+        sender.packetSent(packet);
+    }
+
+    // something was sent, so this is a sender report
+    const QByteArray report = sender.report(remoteSsrc, 480);
+    QCOMPARE(report.size(), 48);
+    QCOMPARE(report.left(8), QByteArray("\x80\xc8\x00\x06\x11\x22\x33\x44", 8));
+    QCOMPARE(report.mid(16, 12), QByteArray("\x00\x00\x01\xe0\x00\x00\x00\x03\x00\x00\x01\xe0", 12));
+    QCOMPARE(report.mid(28), sourceDescription(remoteSsrc));
+
+    // the receiver echoes the middle of the NTP time in its next report
+    QXmppRtcpReporter receiver;
+    packet.ssrc = remoteSsrc;
+    receiver.packetReceived(packet, packet.payload.size(), 8000);
+    receiver.reportReceived(report, localSsrc, 8000);
+    const QByteArray reply = receiver.report(localSsrc, 0);
+    QCOMPARE(reply.mid(24, 4), report.mid(10, 4));
+}
+
+void TestRtp::testRoundTripTime()
+{
+    QXmppRtpAudioChannel alice;
+    setupAudioChannel(alice);
+    QXmppRtpAudioChannel bob;
+    setupAudioChannel(bob);
+
+    // exchange some audio
+    connect(&alice, SIGNAL(sendDatagram(QByteArray)),
+            &bob, SLOT(datagramReceived(QByteArray)));
+    connect(&bob, SIGNAL(sendDatagram(QByteArray)),
+            &alice, SLOT(datagramReceived(QByteArray)));
+    alice.write(QByteArray(1600, '\0'));
+    bob.write(QByteArray(1600, '\0'));
+    QTest::qWait(300);
+    QVERIFY(alice.statistics().packetsReceived > 0);
+    QVERIFY(bob.statistics().packetsReceived > 0);
+    QCOMPARE(alice.statistics().roundTripTime, -1);
+
+    // deliver the sender report after 100ms
+    QSignalSpy aliceSpy(&alice, SIGNAL(sendControlDatagram(QByteArray)));
+    QMetaObject::invokeMethod(&alice, "writeControlDatagram");
+    QCOMPARE(aliceSpy.size(), 1);
+    QTest::qWait(100);
+    bob.controlDatagramReceived(aliceSpy.at(0).at(0).toByteArray());
+
+    // deliver the reply after 100ms
+    QSignalSpy bobSpy(&bob, SIGNAL(sendControlDatagram(QByteArray)));
+    QMetaObject::invokeMethod(&bob, "writeControlDatagram");
+    QCOMPARE(bobSpy.size(), 1);
+    QTest::qWait(100);
+    alice.controlDatagramReceived(bobSpy.at(0).at(0).toByteArray());
+
+    const int rtt = alice.statistics().roundTripTime;
+    QVERIFY2(rtt >= 150 && rtt < 1000, qPrintable(QString::number(rtt)));
+}
+
 void TestRtp::testSimple()
 {
     QByteArray data("\x80\x00\x3e\xd2\x00\x00\x00\x90\x5f\xbd\x16\x9e\x12\x34\x56", 15);
@@ -1085,7 +1684,7 @@ void TestRtp::testSimple()
 
 void TestRtp::testWithCsrc()
 {
-    QByteArray data("\x84\x00\x3e\xd2\x00\x00\x00\x90\x5f\xbd\x16\x9e\xab\xcd\xef\x01\xde\xad\xbe\xef\x12\x34\x56", 23);
+    QByteArray data("\x82\x00\x3e\xd2\x00\x00\x00\x90\x5f\xbd\x16\x9e\xab\xcd\xef\x01\xde\xad\xbe\xef\x12\x34\x56", 23);
     QXmppRtpPacket packet;
     QCOMPARE(packet.decode(data), true);
     QCOMPARE(packet.version, quint8(2));
@@ -1101,8 +1700,74 @@ void TestRtp::testWithCsrc()
 }
 
 
+void TestServer::testCompression()
+{
+    if (!QXmppStream::isCompressionSupported())
+        QSKIP("Stream compression is not supported", SkipSingle);
+
+    const QString testDomain("localhost");
+    const QString testPassword("testpwd");
+    const QString testUser("testuser");
+    const QHostAddress testHost(QHostAddress::LocalHost);
+    const quint16 testPort = 12347;
+
+    // prepare server
+    TestPasswordChecker passwordChecker(testUser, testPassword);
+
+    QXmppServer server;
+    server.setDomain(testDomain);
+    server.setPasswordChecker(&passwordChecker);
+    QVERIFY(server.listenForClients(testHost, testPort));
+
+    // prepare client
+    QXmppClient client;
+
+    QEventLoop loop;
+    connect(&client, SIGNAL(connected()),
+            &loop, SLOT(quit()));
+    connect(&client, SIGNAL(disconnected()),
+            &loop, SLOT(quit()));
+    connect(&client, SIGNAL(messageReceived(QXmppMessage)),
+            &loop, SLOT(quit()));
+
+    QXmppConfiguration config;
+    config.setDomain(testDomain);
+    config.setHost(testHost.toString());
+    config.setUser(testUser);
+    config.setPassword(testPassword);
+    config.setPort(testPort);
+    config.setUseCompression(true);
+
+    // check the stream is compressed once authenticated
+    client.connectToServer(config);
+    loop.exec();
+    QCOMPARE(client.isConnected(), true);
+
+    QList<QXmppIncomingClient*> streams = server.findChildren<QXmppIncomingClient*>();
+    QCOMPARE(streams.size(), 1);
+    QCOMPARE(streams.first()->isCompressed(), true);
+
+    // check a stanza makes it through both directions
+    QXmppMessage message;
+    message.setTo(config.jid());
+    message.setBody("compressed");
+    QCOMPARE(client.sendPacket(message), true);
+    loop.exec();
+    QCOMPARE(client.isConnected(), true);
+}
+
+void TestServer::testConnect_data()
+{
+    QTest::addColumn<int>("threads");
+
+    QTest::newRow("single thread") << 0;
+    QTest::newRow("worker threads") << 2;
+}
+
 void TestServer::testConnect()
 {
+    QFETCH(int, threads);
+
     const QString testDomain("localhost");
     const QString testPassword("testpwd");
     const QString testUser("testuser");
@@ -1119,6 +1784,7 @@ void TestServer::testConnect()
     server.setDomain(testDomain);
     server.setLogger(&logger);
     server.setPasswordChecker(&passwordChecker);
+    server.setThreadCount(threads);
     server.listenForClients(testHost, testPort);
 
     // prepare client
@@ -1150,6 +1816,271 @@ void TestServer::testConnect()
     QCOMPARE(client.isConnected(), true);
 }
 
+/// Records the types of the stanzas logged by the server's streams.
+
+void TestServerLog::log(QXmppLogger::MessageType type, const QString &text)
+{
+    Q_UNUSED(text);
+    if (type == QXmppLogger::ReceivedMessage || type == QXmppLogger::SentMessage)
+        types << type;
+}
+
+void TestServer::testLogging()
+{
+    const QString testDomain("localhost");
+    const QString testPassword("testpwd");
+    const QString testUser("testuser");
+    const QHostAddress testHost(QHostAddress::LocalHost);
+    const quint16 testPort = 12348;
+
+    QXmppLogger logger;
+    logger.setLoggingType(QXmppLogger::NoLogging);
+
+    // prepare server with streams in worker threads
+    TestPasswordChecker passwordChecker(testUser, testPassword);
+
+    QXmppServer server;
+    server.setDomain(testDomain);
+    server.setLogger(&logger);
+    server.setPasswordChecker(&passwordChecker);
+    server.setThreadCount(2);
+    QVERIFY(server.listenForClients(testHost, testPort));
+
+    TestServerLog log;
+    connect(&server, SIGNAL(logMessage(QXmppLogger::MessageType,QString)),
+            &log, SLOT(log(QXmppLogger::MessageType,QString)));
+
+    // prepare client
+    QXmppClient client;
+
+    QEventLoop loop;
+    connect(&client, SIGNAL(connected()),
+            &loop, SLOT(quit()));
+    connect(&client, SIGNAL(disconnected()),
+            &loop, SLOT(quit()));
+    connect(&client, SIGNAL(messageReceived(QXmppMessage)),
+            &loop, SLOT(quit()));
+
+    QXmppConfiguration config;
+    config.setDomain(testDomain);
+    config.setHost(testHost.toString());
+    config.setUser(testUser);
+    config.setPassword(testPassword);
+    config.setPort(testPort);
+
+    // the stream does not emit anything while the logger discards it
+    client.connectToServer(config);
+    loop.exec();
+    QCOMPARE(client.isConnected(), true);
+    QCOMPARE(log.types.size(), 0);
+
+    QXmppMessage message;
+    message.setTo(config.jid());
+    message.setBody("not logged");
+    QCOMPARE(client.sendPacket(message), true);
+    loop.exec();
+    QCOMPARE(log.types.size(), 0);
+
+    // the stream follows changes to the logger's settings
+    logger.setLoggingType(QXmppLogger::SignalLogging);
+    logger.setMessageTypes(QXmppLogger::ReceivedMessage);
+    message.setBody("logged");
+    QCOMPARE(client.sendPacket(message), true);
+    loop.exec();
+    QVERIFY(log.types.contains(QXmppLogger::ReceivedMessage));
+    QVERIFY(!log.types.contains(QXmppLogger::SentMessage));
+}
+
+void TestServer::testQueue()
+{
+    const QString testDomain("localhost");
+    const QHostAddress testHost(QHostAddress::LocalHost);
+    const quint16 testPort = 12346;
+
+    QXmppServer server;
+    server.setDomain(testDomain);
+    QVERIFY(server.listenForServers(testHost, testPort));
+
+    // stanzas for a remote domain are queued while the server-to-server
+    // stream is being established
+    QXmppMessage message;
+    message.setFrom("alice@localhost/QXmpp");
+    message.setTo("bob@remote.invalid");
+    message.setBody("hello");
+    QCOMPARE(server.sendPacket(message), true);
+
+    QVariantMap stats = server.queueStatistics();
+    QCOMPARE(stats.value("queued-streams").toInt(), 1);
+    QCOMPARE(stats.value("queued-stanzas").toInt(), 1);
+    const int size = stats.value("queued-bytes").toInt();
+    QVERIFY(size > 0);
+
+    // a stanza which does not fit is bounced
+    server.setQueueLimit(size + size / 2);
+    QCOMPARE(server.sendPacket(message), true);
+    stats = server.queueStatistics();
+    QCOMPARE(stats.value("queued-stanzas").toInt(), 1);
+    QCOMPARE(stats.value("queued-bytes").toInt(), size);
+    QCOMPARE(stats.value("queue-rejected").toInt(), 1);
+    QCOMPARE(stats.value("queue-dropped").toInt(), 0);
+
+    // or replaces the oldest stanzas
+    server.setOverflowPolicy(QXmppServer::DropOldestOverflow);
+    QCOMPARE(server.sendPacket(message), true);
+    stats = server.queueStatistics();
+    QCOMPARE(stats.value("queued-stanzas").toInt(), 1);
+    QCOMPARE(stats.value("queued-bytes").toInt(), size);
+    QCOMPARE(stats.value("queue-rejected").toInt(), 1);
+    QCOMPARE(stats.value("queue-dropped").toInt(), 1);
+
+    // the total limit applies to all queues
+    server.setQueueLimit(1024 * 1024);
+    server.setTotalQueueLimit(size + size / 2);
+    server.setOverflowPolicy(QXmppServer::BounceOverflow);
+    message.setTo("carol@other.invalid");
+    QCOMPARE(server.sendPacket(message), true);
+    stats = server.queueStatistics();
+    QCOMPARE(stats.value("queued-streams").toInt(), 1);
+    QCOMPARE(stats.value("queue-rejected").toInt(), 2);
+
+    // queued stanzas expire
+    server.setQueueTimeout(0);
+    QTest::qWait(1500);
+    stats = server.queueStatistics();
+    QCOMPARE(stats.value("queued-streams").toInt(), 0);
+    QCOMPARE(stats.value("queued-stanzas").toInt(), 0);
+    QCOMPARE(stats.value("queued-bytes").toInt(), 0);
+    QCOMPARE(stats.value("queue-expired").toInt(), 1);
+}
+
+/// Stream which lets the test drive its watermark signals.
+
+class TestWatermarkStream : public QXmppStream
+{
+public:
+    TestWatermarkStream() : QXmppStream(0), disconnects(0) {}
+
+    void disconnectFromHost() { disconnects++; }
+    void reachHighWatermark() { emit highWatermarkReached(); }
+    void reachLowWatermark() { emit lowWatermarkReached(); }
+
+    int disconnects;
+
+protected:
+    void handleStanza(const QDomElement &) {}
+    void handleStream(const QDomElement &) {}
+};
+
+void TestServer::testThrottle()
+{
+    TestWatermarkStream stream;
+    new QXmppStreamThrottle(&stream, 100);
+    QCOMPARE(stream.isReadingPaused(), false);
+
+    // reading is paused while the peer does not read
+    stream.reachHighWatermark();
+    QCOMPARE(stream.isReadingPaused(), true);
+
+    // and resumed once it catches up
+    stream.reachLowWatermark();
+    QCOMPARE(stream.isReadingPaused(), false);
+    QTest::qWait(200);
+    QCOMPARE(stream.disconnects, 0);
+
+    // a peer which stays above the high watermark is disconnected
+    stream.reachHighWatermark();
+    QCOMPARE(stream.isReadingPaused(), true);
+    QTest::qWait(200);
+    QCOMPARE(stream.disconnects, 1);
+}
+
+static QList<QByteArray> parseItems(QXmppStreamParser &parser)
+{
+    QList<QByteArray> items;
+    QByteArray item;
+    QXmppStreamParser::ItemType type;
+    while ((type = parser.nextItem(item)) != QXmppStreamParser::NoItem)
+        items << QByteArray::number(type) + ":" + item;
+    parser.compact();
+    return items;
+}
+
+void TestStream::testParser_data()
+{
+    const QByteArray streamStart("<stream:stream xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams' to='example.com' version='1.0'>");
+    const QByteArray start = QByteArray::number(QXmppStreamParser::StreamStart) + ":";
+    const QByteArray end = QByteArray::number(QXmppStreamParser::StreamEnd) + ":";
+    const QByteArray stanza = QByteArray::number(QXmppStreamParser::Stanza) + ":";
+
+    QTest::addColumn<QByteArray>("data");
+    QTest::addColumn<QList<QByteArray> >("items");
+
+    QTest::newRow("simple")
+        << QByteArray("<?xml version='1.0'?>" + streamStart + "<presence/>\n<message to='a@b'><body>hi</body></message></stream:stream>")
+        << (QList<QByteArray>()
+            << start + streamStart
+            << stanza + "<presence/>"
+            << stanza + "<message to='a@b'><body>hi</body></message>"
+            << end + "</stream:stream>");
+
+    QTest::newRow("cdata")
+        << QByteArray(streamStart + "<message><body><![CDATA[</body></message><x/>]]></body></message>")
+        << (QList<QByteArray>()
+            << start + streamStart
+            << stanza + "<message><body><![CDATA[</body></message><x/>]]></body></message>");
+
+    QTest::newRow("comments")
+        << QByteArray(streamStart + "<!-- <iq> --><iq type='get'><!-- </iq> --><ping/></iq><!---->")
+        << (QList<QByteArray>()
+            << start + streamStart
+            << stanza + "<iq type='get'><!-- </iq> --><ping/></iq>");
+
+    QTest::newRow("attributes")
+        << QByteArray(streamStart + "<message a='x>y' b=\"/>\" c='\"'><body>1 &gt; 0</body></message><presence to='a/>'/>")
+        << (QList<QByteArray>()
+            << start + streamStart
+            << stanza + "<message a='x>y' b=\"/>\" c='\"'><body>1 &gt; 0</body></message>"
+            << stanza + "<presence to='a/>'/>");
+
+    QTest::newRow("restart")
+        << QByteArray(streamStart + "<proceed/>" + streamStart + "<iq/>")
+        << (QList<QByteArray>()
+            << start + streamStart
+            << stanza + "<proceed/>"
+            << start + streamStart
+            << stanza + "<iq/>");
+}
+
+void TestStream::testParser()
+{
+    QFETCH(QByteArray, data);
+    QFETCH(QList<QByteArray>, items);
+
+    // whole data
+    QXmppStreamParser parser;
+    parser.buffer().append(data);
+    QCOMPARE(parseItems(parser), items);
+
+    // data split in two at every possible position
+    for (int i = 1; i < data.size(); ++i) {
+        parser.reset();
+        parser.buffer().append(data.left(i));
+        QList<QByteArray> received = parseItems(parser);
+        parser.buffer().append(data.mid(i));
+        received += parseItems(parser);
+        QCOMPARE(received, items);
+    }
+
+    // data received one byte at a time
+    parser.reset();
+    QList<QByteArray> received;
+    for (int i = 0; i < data.size(); ++i) {
+        parser.buffer().append(data.at(i));
+        received += parseItems(parser);
+    }
+    QCOMPARE(received, items);
+}
+
 void TestStun::testFingerprint()
 {
     // without fingerprint
@@ -1163,12 +2094,276 @@ void TestStun::testFingerprint()
              QByteArray("\x00\x01\x00\x08\x21\x12\xA4\x42\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x80\x28\x00\x04\xB2\xAA\xF9\xF6", 28));
 }
 
+TestIceChecks::TestIceChecks()
+{
+    m_time.start();
+}
+
+/// Records the first connectivity check sent to each remote port.
+
+void TestIceChecks::log(QXmppLogger::MessageType type, const QString &text)
+{
+    QRegExp regex("Sent to \\S+ port (\\d+)");
+    if (type != QXmppLogger::SentMessage ||
+        !text.contains("type Binding Request") ||
+        regex.indexIn(text) < 0)
+        return;
+
+    const quint16 port = regex.cap(1).toUShort();
+    if (!ports.contains(port)) {
+        ports << port;
+        times << m_time.elapsed();
+    }
+}
+
+void TestStun::testIceConnection()
+{
+    const int interval = 50;
+    const QList<QHostAddress> addresses = QList<QHostAddress>() << QHostAddress::LocalHost;
+
+    QXmppIceConnection controlling;
+    controlling.setIceControlling(true);
+    controlling.setCheckInterval(interval);
+    controlling.addComponent(1);
+    QVERIFY(controlling.bind(addresses));
+
+    QXmppIceConnection controlled;
+    controlled.setIceControlling(false);
+    controlled.addComponent(1);
+    QVERIFY(controlled.bind(addresses));
+
+    controlling.setRemoteUser(controlled.localUser());
+    controlling.setRemotePassword(controlled.localPassword());
+    controlled.setRemoteUser(controlling.localUser());
+    controlled.setRemotePassword(controlling.localPassword());
+
+    // decoys which never answer, with a higher priority than the peer
+    QUdpSocket decoyHigh, decoyLow;
+    QVERIFY(decoyHigh.bind(QHostAddress::LocalHost, 0));
+    QVERIFY(decoyLow.bind(QHostAddress::LocalHost, 0));
+
+    QCOMPARE(controlled.localCandidates().size(), 1);
+    QXmppJingleCandidate peer = controlled.localCandidates().first();
+    peer.setFoundation(1);
+    peer.setPriority(1000);
+
+    QXmppJingleCandidate high = peer;
+    high.setFoundation(2);
+    high.setPort(decoyHigh.localPort());
+    high.setPriority(3000);
+
+    QXmppJingleCandidate low = peer;
+    low.setFoundation(3);
+    low.setPort(decoyLow.localPort());
+    low.setPriority(2000);
+
+    // add candidates out of order, the check list sorts them
+    controlling.addRemoteCandidate(peer);
+    controlling.addRemoteCandidate(low);
+    controlling.addRemoteCandidate(high);
+
+    TestIceChecks checks;
+    QVERIFY(connect(&controlling, SIGNAL(logMessage(QXmppLogger::MessageType,QString)),
+                    &checks, SLOT(log(QXmppLogger::MessageType,QString))));
+
+    // the controlled agent learns its peer from the incoming checks
+    controlled.connectToHost();
+    controlling.connectToHost();
+    for (int i = 0; i < 100 && !(controlling.isConnected() && controlled.isConnected()); ++i)
+        QTest::qWait(50);
+    QVERIFY(controlling.isConnected());
+    QVERIFY(controlled.isConnected());
+
+    // checks are sent by decreasing priority, one per interval
+    QVERIFY(checks.ports.size() >= 3);
+    QCOMPARE(checks.ports[0], decoyHigh.localPort());
+    QCOMPARE(checks.ports[1], decoyLow.localPort());
+    QCOMPARE(checks.ports[2], peer.port());
+    QVERIFY(checks.times[1] - checks.times[0] >= interval - 10);
+    QVERIFY(checks.times[2] - checks.times[1] >= interval - 10);
+
+    // media flows over the nominated pair
+    QSignalSpy received(controlled.component(1), SIGNAL(datagramReceived(QByteArray)));
+    QCOMPARE(controlling.component(1)->sendDatagram(QByteArray("hello")), qint64(5));
+    for (int i = 0; i < 20 && received.isEmpty(); ++i)
+        QTest::qWait(50);
+    QCOMPARE(received.size(), 1);
+    QCOMPARE(received.first().first().toByteArray(), QByteArray("hello"));
+}
+
+void TestStun::testIceMultiplexer()
+{
+    QXmppIceMultiplexer multiplexer;
+    QVERIFY(multiplexer.bind(QList<QHostAddress>() << QHostAddress::LocalHost, 2));
+    QCOMPARE(multiplexer.sockets(0).size(), 1);
+    QCOMPARE(multiplexer.sockets(1).size(), 1);
+    QVERIFY(multiplexer.sockets(2).isEmpty());
+    const quint16 port = multiplexer.sockets(0).first()->localPort();
+    QCOMPARE(multiplexer.sockets(1).first()->localPort(), quint16(port + 1));
+
+    // connections share the same ports
+    for (int i = 0; i < 2; ++i) {
+        QXmppIceConnection connection;
+        connection.addComponent(1);
+        connection.addComponent(2);
+        QVERIFY(connection.bind(&multiplexer));
+        QCOMPARE(connection.component(1)->localCandidates().size(), 1);
+        QCOMPARE(connection.component(1)->localCandidates().first().port(), port);
+        QCOMPARE(connection.component(2)->localCandidates().first().port(), quint16(port + 1));
+    }
+
+    // not enough sockets
+    QXmppIceConnection connection;
+    connection.addComponent(1);
+    connection.addComponent(2);
+    connection.addComponent(3);
+    QVERIFY(!connection.bind(&multiplexer));
+}
+
+static QByteArray waitForDatagram(QUdpSocket *socket)
+{
+    for (int i = 0; i < 40 && !socket->hasPendingDatagrams(); ++i)
+        QTest::qWait(50);
+    if (!socket->hasPendingDatagrams())
+        return QByteArray();
+    QByteArray datagram(socket->pendingDatagramSize(), 0);
+    socket->readDatagram(datagram.data(), datagram.size());
+    return datagram;
+}
+
+static QByteArray bindingRequest(const QString &username, const QString &password)
+{
+    QXmppStunMessage request;
+    request.setType(QXmppStunMessage::Binding | QXmppStunMessage::Request);
+    request.setId(QByteArray("0123456789ab"));
+    request.setUsername(username);
+    return request.encode(password.toUtf8());
+}
+
+void TestStun::testIceMultiplexerRouting()
+{
+    QXmppIceMultiplexer multiplexer;
+    QVERIFY(multiplexer.bind(QList<QHostAddress>() << QHostAddress::LocalHost, 1));
+    const quint16 sharedPort = multiplexer.sockets(0).first()->localPort();
+
+    QUdpSocket peer;
+    QVERIFY(peer.bind(QHostAddress::LocalHost, 0));
+    QUdpSocket stunServer;
+    QVERIFY(stunServer.bind(QHostAddress::LocalHost, 0));
+
+    QXmppIceConnection first;
+    first.addComponent(1);
+    first.setStunServer(QHostAddress::LocalHost, stunServer.localPort());
+    QVERIFY(first.bind(&multiplexer));
+
+    // a colliding user fragment is replaced
+    QXmppIceConnection second;
+    second.addComponent(1);
+    second.setLocalUser(first.localUser());
+    QVERIFY(second.bind(&multiplexer));
+    QVERIFY(second.localUser() != first.localUser());
+
+    QSignalSpy firstReceived(first.component(1), SIGNAL(datagramReceived(QByteArray)));
+    QSignalSpy secondReceived(second.component(1), SIGNAL(datagramReceived(QByteArray)));
+
+    // by STUN transaction
+    QXmppStunMessage request;
+    QVERIFY(request.decode(waitForDatagram(&stunServer)));
+    QXmppStunMessage response;
+    response.setType(QXmppStunMessage::Binding | QXmppStunMessage::Response);
+    response.setId(request.id());
+    response.xorMappedHost = QHostAddress::LocalHost;
+    response.xorMappedPort = 4242;
+    stunServer.writeDatagram(response.encode(), QHostAddress::LocalHost, sharedPort);
+    for (int i = 0; i < 40 && first.localCandidates().size() < 2; ++i)
+        QTest::qWait(50);
+    QCOMPARE(first.localCandidates().size(), 2);
+    QCOMPARE(first.localCandidates().last().type(), QXmppJingleCandidate::ServerReflexiveType);
+    QCOMPARE(first.localCandidates().last().port(), quint16(4242));
+    QCOMPARE(second.localCandidates().size(), 1);
+
+    // by address
+    QXmppJingleCandidate candidate;
+    candidate.setComponent(1);
+    candidate.setHost(QHostAddress::LocalHost);
+    candidate.setPort(peer.localPort());
+    candidate.setProtocol("udp");
+    candidate.setType(QXmppJingleCandidate::HostType);
+    first.setRemoteUser("peer");
+    first.setRemotePassword("peerpassword");
+    first.addRemoteCandidate(candidate);
+
+    peer.writeDatagram(QByteArray("media"), QHostAddress::LocalHost, sharedPort);
+    for (int i = 0; i < 40 && firstReceived.isEmpty(); ++i)
+        QTest::qWait(50);
+    QCOMPARE(firstReceived.size(), 1);
+    QCOMPARE(secondReceived.size(), 0);
+
+    // by USERNAME, the second connection now also knows the peer
+    peer.writeDatagram(bindingRequest(second.localUser() + ":peer", second.localPassword()), QHostAddress::LocalHost, sharedPort);
+    QXmppStunMessage secondResponse;
+    QVERIFY(secondResponse.decode(waitForDatagram(&peer), second.localPassword().toUtf8()));
+    QCOMPARE(secondResponse.type(), quint16(QXmppStunMessage::Binding | QXmppStunMessage::Response));
+
+    // the address is ambiguous, but STUN requests still carry the user
+    peer.writeDatagram(bindingRequest(first.localUser() + ":peer", first.localPassword()), QHostAddress::LocalHost, sharedPort);
+    QXmppStunMessage firstResponse;
+    QVERIFY(firstResponse.decode(waitForDatagram(&peer), first.localPassword().toUtf8()));
+    QCOMPARE(firstResponse.username(), first.localUser() + ":peer");
+
+    // media from the ambiguous address reaches neither connection
+    peer.writeDatagram(QByteArray("media"), QHostAddress::LocalHost, sharedPort);
+    QTest::qWait(200);
+    QCOMPARE(firstReceived.size(), 1);
+    QCOMPARE(secondReceived.size(), 0);
+
+    // responses to our checks need not carry a USERNAME, they are routed
+    // by their transaction
+    first.setIceControlling(true);
+    first.connectToHost();
+    QXmppStunMessage check;
+    for (int i = 0; i < 10; ++i) {
+        const QByteArray datagram = waitForDatagram(&peer);
+        if (check.decode(datagram) &&
+            check.type() == (QXmppStunMessage::Binding | QXmppStunMessage::Request))
+            break;
+        check = QXmppStunMessage();
+    }
+    QCOMPARE(check.username(), QString("peer:") + first.localUser());
+
+    peer.writeDatagram(bindingRequest(first.localUser() + ":peer", first.localPassword()), QHostAddress::LocalHost, sharedPort);
+    QXmppStunMessage checkResponse;
+    checkResponse.setType(QXmppStunMessage::Binding | QXmppStunMessage::Response);
+    checkResponse.setId(check.id());
+    checkResponse.xorMappedHost = QHostAddress::LocalHost;
+    checkResponse.xorMappedPort = sharedPort;
+    peer.writeDatagram(checkResponse.encode(QByteArray("peerpassword")), QHostAddress::LocalHost, sharedPort);
+    for (int i = 0; i < 40 && !first.isConnected(); ++i)
+        QTest::qWait(50);
+    QCOMPARE(first.isConnected(), true);
+    QCOMPARE(second.isConnected(), false);
+}
+
 void TestStun::testIntegrity()
 {
     QXmppStunMessage msg;
     msg.setType(0x0001);
     QCOMPARE(msg.encode(QByteArray("somesecret"), false),
              QByteArray("\x00\x01\x00\x18\x21\x12\xA4\x42\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x08\x00\x14\x96\x4B\x40\xD1\x84\x67\x6A\xFD\xB5\xE0\x7C\xC5\x1F\xFB\xBD\xA2\x61\xAF\xB1\x26", 44));
+
+    // sample request from RFC 5769
+    const QByteArray packet = QByteArray::fromHex(
+        "000100582112a442b7e7a701bc34d686fa87dfae802200105354554e207465737420"
+        "636c69656e74002400046e0001ff80290008932ff9b151263b360006000965767467"
+        "3a68367659202020000800149aeaa70cbfd8cb56781ef2b5b2d3f249c1b571a28028"
+        "0004e57a3bcf");
+    QXmppStunMessage msg2;
+    QVERIFY(msg2.decode(packet, QByteArray("VOkJxbRl1RmTxUk/WvJxBt")));
+    QCOMPARE(msg2.priority(), quint32(0x6e0001ff));
+    QCOMPARE(msg2.username(), QString("evtj:h6vY"));
+
+    QXmppStunMessage msg3;
+    QVERIFY(!msg3.decode(packet, QByteArray("wrongsecret")));
 }
 
 void TestStun::testIPv4Address()
@@ -1207,6 +2402,303 @@ void TestStun::testIPv6Address()
     QCOMPARE(msg2.mappedPort, quint16(12345));
 }
 
+void TestStun::testSha1()
+{
+    uchar digest[20];
+
+    // sample from FIPS 180-1
+    QXmppSha1 hash;
+    hash.addData("abc", 3);
+    hash.result(digest);
+    QCOMPARE(QByteArray(reinterpret_cast<char*>(digest), 20).toHex(),
+             QByteArray("a9993e364706816aba3e25717850c26c9cd0d89d"));
+
+    // data spanning several blocks, added in uneven chunks
+    QByteArray data;
+    for (int i = 0; i < 1000; ++i)
+        data.append(char(i * 7));
+    QXmppSha1 chunked;
+    for (int pos = 0; pos < data.size(); pos += 13)
+        chunked.addData(data.constData() + pos, qMin(13, data.size() - pos));
+    chunked.result(digest);
+    QCOMPARE(QByteArray(reinterpret_cast<char*>(digest), 20),
+             QCryptographicHash::hash(data, QCryptographicHash::Sha1));
+
+    // samples from RFC 2202, including a key longer than a block
+    QXmppHmacSha1 hmac(QByteArray(20, '\x0b'));
+    QXmppSha1 inner = hmac.start();
+    inner.addData("Hi There", 8);
+    hmac.finish(inner, digest);
+    QCOMPARE(QByteArray(reinterpret_cast<char*>(digest), 20).toHex(),
+             QByteArray("b617318655057264e28bc0b6fb378c8ef146be00"));
+
+    hmac.setKey(QByteArray(80, '\xaa'));
+    const QByteArray message("Test Using Larger Than Block-Size Key - Hash Key First");
+    inner = hmac.start();
+    inner.addData(message.constData(), message.size());
+    hmac.finish(inner, digest);
+    QCOMPARE(QByteArray(reinterpret_cast<char*>(digest), 20).toHex(),
+             QByteArray("aa4ae5e15272d00e95705637ce8a3b55ed402112"));
+}
+
+void TestStun::testStunParser()
+{
+    // sample request from RFC 5769
+    const QByteArray packet = QByteArray::fromHex(
+        "000100582112a442b7e7a701bc34d686fa87dfae802200105354554e207465737420"
+        "636c69656e74002400046e0001ff80290008932ff9b151263b360006000965767467"
+        "3a68367659202020000800149aeaa70cbfd8cb56781ef2b5b2d3f249c1b571a28028"
+        "0004e57a3bcf");
+    QVERIFY(QXmppStunParser::isStun(packet));
+    QXmppStunParser parser;
+    QVERIFY(parser.parse(packet));
+    QCOMPARE(parser.type(), quint16(0x0001));
+    QVERIFY(parser.hasId(QByteArray::fromHex("b7e7a701bc34d686fa87dfae")));
+    QCOMPARE(parser.priority(), quint32(0x6e0001ff));
+    QCOMPARE(parser.username(), QString("evtj:h6vY"));
+    QVERIFY(!parser.useCandidate());
+    QVERIFY(parser.checkFingerprint());
+    QVERIFY(parser.checkIntegrity(QXmppHmacSha1("VOkJxbRl1RmTxUk/WvJxBt")));
+    QVERIFY(!parser.checkIntegrity(QXmppHmacSha1("wrongsecret")));
+
+    // a message produced by QXmppStunMessage
+    QXmppStunMessage msg;
+    msg.setType(0x0001);
+    msg.setId(QByteArray("0123456789ab"));
+    msg.setPriority(1234);
+    msg.setUsername("foo:bar");
+    msg.useCandidate = true;
+    const QByteArray encoded = msg.encode(QByteArray("somesecret"));
+    QVERIFY(QXmppStunParser::isStun(encoded));
+    QXmppStunParser parser2;
+    QVERIFY(parser2.parse(encoded));
+    QVERIFY(parser2.hasId(QByteArray("0123456789ab")));
+    QCOMPARE(parser2.id(), QByteArray("0123456789ab"));
+    QCOMPARE(parser2.priority(), quint32(1234));
+    QCOMPARE(parser2.username(), QString("foo:bar"));
+    QVERIFY(parser2.useCandidate());
+    QVERIFY(parser2.checkFingerprint());
+    QVERIFY(parser2.checkIntegrity(QXmppHmacSha1("somesecret")));
+
+    // corrupted data
+    QByteArray corrupted = encoded;
+    corrupted[corrupted.size() - 1] = corrupted.at(corrupted.size() - 1) ^ 1;
+    QXmppStunParser parser3;
+    QVERIFY(parser3.parse(corrupted));
+    QVERIFY(!parser3.checkFingerprint());
+
+    // media is not STUN
+    QVERIFY(!QXmppStunParser::isStun(QByteArray("\x80\x00\x00\x01\x21\x12\xa4\x42\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00", 20)));
+    QVERIFY(!QXmppStunParser::isStun(encoded.left(encoded.size() - 4)));
+
+    // MESSAGE-INTEGRITY running past the end of the message
+    const QByteArray truncated("\x00\x01\x00\x04\x21\x12\xA4\x42\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x08\x00\x14", 24);
+    QVERIFY(QXmppStunParser::isStun(truncated));
+    QXmppStunParser parser4;
+    QVERIFY(!parser4.parse(truncated));
+    QXmppStunMessage msg2;
+    QVERIFY(!msg2.decode(truncated, QByteArray("somesecret")));
+}
+
+/// Answers the requests of a TURN allocation and records the channel
+/// bindings and channel data it sends.
+
+class TestTurnServer
+{
+public:
+    TestTurnServer();
+    void process(int msecs = 200);
+    void send(const QByteArray &datagram);
+
+    QUdpSocket socket;
+    QList<QXmppStunMessage> channelBinds;
+    QList<QByteArray> channelData;
+
+private:
+    QSet<QByteArray> m_ids;
+    QHostAddress m_clientHost;
+    quint16 m_clientPort;
+};
+
+TestTurnServer::TestTurnServer()
+    : m_clientPort(0)
+{
+    socket.bind(QHostAddress::LocalHost, 0);
+}
+
+void TestTurnServer::process(int msecs)
+{
+    QTest::qWait(msecs);
+    while (socket.hasPendingDatagrams()) {
+        QByteArray datagram(socket.pendingDatagramSize(), 0);
+        socket.readDatagram(datagram.data(), datagram.size(), &m_clientHost, &m_clientPort);
+        if ((datagram[0] & 0xc0) == 0x40) {
+            channelData << datagram;
+            continue;
+        }
+
+        QXmppStunMessage request;
+        if (!request.decode(datagram) || m_ids.contains(request.id()))
+            continue;
+        m_ids.insert(request.id());
+
+        QXmppStunMessage response;
+        response.setId(request.id());
+        response.setType(request.messageMethod() | QXmppStunMessage::Response);
+        if (request.messageMethod() == QXmppStunMessage::Allocate) {
+            response.xorRelayedHost = QHostAddress("192.0.2.1");
+            response.xorRelayedPort = 5000;
+            response.setLifetime(600);
+        } else if (request.messageMethod() == QXmppStunMessage::ChannelBind) {
+            channelBinds << request;
+        } else if (request.messageMethod() == QXmppStunMessage::Refresh) {
+            response.setLifetime(request.lifetime());
+        }
+        send(response.encode());
+    }
+}
+
+void TestTurnServer::send(const QByteArray &datagram)
+{
+    socket.writeDatagram(datagram, m_clientHost, m_clientPort);
+}
+
+void TestTurnReceiver::datagramReceived(const QByteArray &data, const QHostAddress &host, quint16 port)
+{
+    Q_UNUSED(host);
+    datagrams << data;
+    ports << port;
+}
+
+void TestStun::testTurnChannelData()
+{
+    TestTurnServer server;
+    QXmppTurnAllocation allocation;
+    allocation.setServer(QHostAddress::LocalHost, server.socket.localPort());
+    allocation.setUser("user");
+    allocation.setPassword("password");
+
+    TestTurnReceiver receiver;
+    QVERIFY(connect(&allocation, SIGNAL(datagramReceived(QByteArray,QHostAddress,quint16)),
+                    &receiver, SLOT(datagramReceived(QByteArray,QHostAddress,quint16))));
+
+    allocation.connectToHost();
+    server.process();
+    QCOMPARE(allocation.state(), QXmppTurnAllocation::ConnectedState);
+    QCOMPARE(allocation.relayedHost(), QHostAddress("192.0.2.1"));
+    QCOMPARE(allocation.relayedPort(), quint16(5000));
+
+    // outgoing data is framed with its channel number and length
+    const QHostAddress peer("192.0.2.2");
+    QCOMPARE(allocation.writeDatagram(QByteArray("hello"), peer, 1234), qint64(5));
+    QCOMPARE(allocation.writeDatagram(QByteArray("hi"), peer, 1234), qint64(2));
+    QCOMPARE(allocation.writeDatagram(QByteArray("world"), peer, 1235), qint64(5));
+    server.process();
+    QCOMPARE(server.channelBinds.size(), 2);
+    QCOMPARE(server.channelBinds[0].channelNumber(), quint16(0x4000));
+    QCOMPARE(server.channelBinds[0].xorPeerHost, peer);
+    QCOMPARE(server.channelBinds[0].xorPeerPort, quint16(1234));
+    QCOMPARE(server.channelBinds[1].channelNumber(), quint16(0x4001));
+    QCOMPARE(server.channelBinds[1].xorPeerPort, quint16(1235));
+    QCOMPARE(server.channelData, QList<QByteArray>()
+             << QByteArray("\x40\x00\x00\x05" "hello", 9)
+             << QByteArray("\x40\x00\x00\x02" "hi", 6)
+             << QByteArray("\x40\x01\x00\x05" "world", 9));
+
+    // incoming data may be padded, unknown channels and truncated data
+    // are dropped
+    server.send(QByteArray("\x40\x01\x00\x03" "abc" "\x00", 8));
+    server.send(QByteArray("\x40\x05\x00\x03" "abc", 7));
+    server.send(QByteArray("\x40\x00\x00\x09" "abc", 7));
+    server.process();
+    QCOMPARE(receiver.datagrams, QList<QByteArray>() << QByteArray("abc"));
+    QCOMPARE(receiver.ports, QList<quint16>() << 1235);
+}
+
+void TestStun::testTurnPool()
+{
+    TestTurnServer server;
+    const quint16 port = server.socket.localPort();
+    const QHostAddress peer("192.0.2.2");
+    QXmppTurnAllocationPool *pool = QXmppTurnAllocationPool::instance();
+
+    QObject firstOwner;
+    QXmppTurnAllocation *allocation = pool->take(QHostAddress::LocalHost, port, "user", "password", &firstOwner);
+    QCOMPARE(allocation->parent(), &firstOwner);
+    allocation->connectToHost();
+    server.process();
+    QCOMPARE(allocation->state(), QXmppTurnAllocation::ConnectedState);
+    allocation->writeDatagram(QByteArray("hello"), peer, 1234);
+    server.process();
+    QCOMPARE(server.channelBinds.size(), 1);
+    QCOMPARE(server.channelBinds[0].channelNumber(), quint16(0x4000));
+
+    // a released allocation is only reused with the same credentials
+    pool->release(allocation);
+    QCOMPARE(allocation->parent(), static_cast<QObject*>(pool));
+    QObject secondOwner;
+    QXmppTurnAllocation *other = pool->take(QHostAddress::LocalHost, port, "user", "otherpassword", &secondOwner);
+    QVERIFY(other != allocation);
+    QCOMPARE(other->state(), QXmppTurnAllocation::UnconnectedState);
+    delete other;
+    QCOMPARE(pool->take(QHostAddress::LocalHost, port, "user", "password", &secondOwner), allocation);
+    QCOMPARE(allocation->parent(), &secondOwner);
+    QCOMPARE(allocation->state(), QXmppTurnAllocation::ConnectedState);
+
+    TestTurnReceiver receiver;
+    QVERIFY(connect(allocation, SIGNAL(datagramReceived(QByteArray,QHostAddress,quint16)),
+                    &receiver, SLOT(datagramReceived(QByteArray,QHostAddress,quint16))));
+
+    // data on the channels of the previous owner is dropped
+    server.send(QByteArray("\x40\x00\x00\x03" "abc", 7));
+    server.process();
+    QVERIFY(receiver.datagrams.isEmpty());
+
+    // the number reserved for the first peer is skipped for another peer,
+    // and reused without a new binding for the first peer
+    server.channelBinds.clear();
+    server.channelData.clear();
+    allocation->writeDatagram(QByteArray("world"), peer, 1235);
+    allocation->writeDatagram(QByteArray("again"), peer, 1234);
+    server.process();
+    QCOMPARE(server.channelBinds.size(), 1);
+    QCOMPARE(server.channelBinds[0].channelNumber(), quint16(0x4001));
+    QCOMPARE(server.channelData, QList<QByteArray>()
+             << QByteArray("\x40\x01\x00\x05" "world", 9)
+             << QByteArray("\x40\x00\x00\x05" "again", 9));
+    server.send(QByteArray("\x40\x00\x00\x03" "abc", 7));
+    server.process();
+    QCOMPARE(receiver.datagrams, QList<QByteArray>() << QByteArray("abc"));
+    QCOMPARE(receiver.ports, QList<quint16>() << 1234);
+
+    // channels which carried data are refreshed with the same number
+    server.channelBinds.clear();
+    QVERIFY(QMetaObject::invokeMethod(allocation, "refreshChannels"));
+    server.process();
+    QCOMPARE(server.channelBinds.size(), 2);
+    QCOMPARE(server.channelBinds[0].channelNumber(), quint16(0x4000));
+    QCOMPARE(server.channelBinds[1].channelNumber(), quint16(0x4001));
+
+    // an idle channel is bound again with the same number when data resumes
+    server.channelBinds.clear();
+    QVERIFY(QMetaObject::invokeMethod(allocation, "refreshChannels"));
+    allocation->writeDatagram(QByteArray("hello"), peer, 1234);
+    server.process();
+    QCOMPARE(server.channelBinds.size(), 1);
+    QCOMPARE(server.channelBinds[0].channelNumber(), quint16(0x4000));
+    QCOMPARE(server.channelBinds[0].xorPeerPort, quint16(1234));
+
+    // once the numbers may be reused, the mapping is forgotten
+    for (int i = 0; i < 4; ++i)
+        QVERIFY(QMetaObject::invokeMethod(allocation, "refreshChannels"));
+    server.process();
+    server.channelBinds.clear();
+    allocation->writeDatagram(QByteArray("hello"), peer, 1234);
+    server.process();
+    QCOMPARE(server.channelBinds.size(), 1);
+    QCOMPARE(server.channelBinds[0].channelNumber(), quint16(0x4002));
+}
+
 void TestStun::testXorIPv4Address()
 {
     // encode
@@ -1657,6 +3149,9 @@ int main(int argc, char *argv[])
     TestServer testServer;
     errors += QTest::qExec(&testServer);
 
+    TestStream testStream;
+    errors += QTest::qExec(&testStream);
+
     TestStun testStun;
     errors += QTest::qExec(&testStun);
 
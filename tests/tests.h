@@ -22,7 +22,11 @@
  *
  */
 
+#include <QHostAddress>
 #include <QObject>
+#include <QTime>
+
+#include "QXmppLogger.h"
 
 class TestUtils : public QObject
 {
@@ -49,6 +53,7 @@ private slots:
     void testBindNoResource();
     void testBindResource();
     void testBindResult();
+    void testElement();
     void testMessage();
     void testMessageFull();
     void testMessageDelay();
@@ -73,8 +78,16 @@ class TestCodec : public QObject
     Q_OBJECT
 
 private slots:
+    void testEncodeSamples();
+    void testG711a_data();
+    void testG711a();
+    void testG711u_data();
+    void testG711u();
     void testTheoraDecoder();
     void testTheoraEncoder();
+    void testVideoFramePool();
+    void testYuyvConversion_data();
+    void testYuyvConversion();
 };
 
 class TestJingle : public QObject
@@ -107,7 +120,14 @@ class TestRtp : public QObject
     Q_OBJECT
 
 private slots:
+    void testAudioReorder();
+    void testAudioWrap();
     void testBad();
+    void testHeader();
+    void testJitterBuffer();
+    void testReceiverReport();
+    void testRoundTripTime();
+    void testSenderReport();
     void testSimple();
     void testWithCsrc();
 };
@@ -117,7 +137,61 @@ class TestServer : public QObject
     Q_OBJECT
 
 private slots:
+    void testCompression();
+    void testConnect_data();
     void testConnect();
+    void testLogging();
+    void testQueue();
+    void testThrottle();
+};
+
+class TestServerLog : public QObject
+{
+    Q_OBJECT
+
+public:
+    QList<QXmppLogger::MessageType> types;
+
+public slots:
+    void log(QXmppLogger::MessageType type, const QString &text);
+};
+
+class TestStream : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void testParser_data();
+    void testParser();
+};
+
+class TestIceChecks : public QObject
+{
+    Q_OBJECT
+
+public:
+    TestIceChecks();
+
+    QList<quint16> ports;
+    QList<int> times;
+
+public slots:
+    void log(QXmppLogger::MessageType type, const QString &text);
+
+private:
+    QTime m_time;
+};
+
+class TestTurnReceiver : public QObject
+{
+    Q_OBJECT
+
+public:
+    QList<QByteArray> datagrams;
+    QList<quint16> ports;
+
+public slots:
+    void datagramReceived(const QByteArray &data, const QHostAddress &host, quint16 port);
 };
 
 class TestStun : public QObject
@@ -126,9 +200,16 @@ class TestStun : public QObject
 
 private slots:
     void testFingerprint();
+    void testIceConnection();
+    void testIceMultiplexer();
+    void testIceMultiplexerRouting();
     void testIntegrity();
     void testIPv4Address();
     void testIPv6Address();
+    void testSha1();
+    void testStunParser();
+    void testTurnChannelData();
+    void testTurnPool();
     void testXorIPv4Address();
     void testXorIPv6Address();
 };